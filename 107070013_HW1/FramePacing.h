@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+// FramePacing.h
+// =============
+// Render on demand. The frame loop draws only when requestFrame() was called
+// since the last frame (input, animation, loading, a resize), and otherwise
+// sleeps in glfwWaitEventsTimeout() until the next event. The continuous
+// mode draws every iteration, as the loops did before, for benchmarks.
+//
+// FramePacer counts the frames drawn, the wakeups that did not need one and
+// the time spent waiting, and reads the CPU time of the process, so the
+// cost of an idle window can be compared between the modes.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FRAME_PACING_H_DEF
+#define FRAME_PACING_H_DEF
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+const double FRAME_WAIT_TIMEOUT = 0.5;	// seconds, longest sleep between two loop iterations
+
+// user + kernel time of all threads of the process, in seconds
+inline double ProcessCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME creation, exitTime, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user))
+		return 0;
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (double)(k.QuadPart + u.QuadPart) * 1e-7;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+struct FramePacingReport
+{
+	double seconds;			// wall time of the period
+	unsigned long long frames;
+	unsigned long long idleWakeups;	// waits which ended without a frame to draw
+	double waitSeconds;		// spent in glfwWaitEventsTimeout()
+	double skippedFrames;	// frames the continuous mode would have drawn at the refresh rate
+	double cpuPercent;		// of one core
+};
+
+class FramePacer
+{
+public:
+	FramePacer() : continuous(false), pending(true), refreshRate(60), frames(0), idleWakeups(0), waitSeconds(0), startTime(0), startCpu(0) {}
+
+	void setContinuous(bool on)
+	{
+		continuous = on;
+		pending = true;
+	}
+	bool isContinuous() const { return continuous; }
+
+	// refresh rate of the monitor, for the skipped frame count
+	void setRefreshRate(int hz) { refreshRate = (hz > 0) ? hz : 60; }
+
+	// something the next frame shows has changed
+	void requestFrame() { pending = true; }
+
+	// draw now, otherwise wait for events
+	bool shouldDraw() const { return continuous || pending; }
+
+	void frameDrawn()
+	{
+		pending = false;
+		frames++;
+	}
+
+	// seconds spent in glfwWaitEventsTimeout(), needFrame: the wait ended with work to do
+	void waited(double seconds, bool needFrame)
+	{
+		waitSeconds += seconds;
+		idleWakeups += needFrame ? 0 : 1;
+	}
+
+	// start counting at now (glfwGetTime())
+	void startPeriod(double now)
+	{
+		frames = idleWakeups = 0;
+		waitSeconds = 0;
+		startTime = now;
+		startCpu = ProcessCpuSeconds();
+	}
+
+	FramePacingReport report(double now) const
+	{
+		FramePacingReport r;
+		r.seconds = now - startTime;
+		r.frames = frames;
+		r.idleWakeups = idleWakeups;
+		r.waitSeconds = waitSeconds;
+		r.skippedFrames = waitSeconds * refreshRate;
+		r.cpuPercent = (r.seconds > 0) ? (ProcessCpuSeconds() - startCpu) / r.seconds * 100.0 : 0;
+		return r;
+	}
+
+private:
+	bool continuous;
+	bool pending;
+	int refreshRate;
+	unsigned long long frames, idleWakeups;
+	double waitSeconds;
+	double startTime, startCpu;
+};
+
+#endif
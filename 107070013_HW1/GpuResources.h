@@ -0,0 +1,352 @@
+///////////////////////////////////////////////////////////////////////////////
+// GpuResources.h
+// ==============
+// Ownership and accounting of GL objects.
+//
+// GpuHandle owns one buffer, vertex array, texture or program and deletes it
+// when it is destroyed or reset. It can be moved but not copied, so every GL
+// object has exactly one owner. GpuResources counts the objects and bytes of
+// every category; the byte counts are what the app asked for (buffer sizes,
+// texels with their mip chain), not what the driver allocated.
+//
+// Handles belong to a group, usually a model. With a budget set,
+// enforceBudget() evicts the least recently used groups not touched in the
+// current frame until the total fits again, through a callback of the app,
+// which resets the handles of the group and uploads them again on its next
+// use. Handles of GPU_UNGROUPED are never evicted.
+//
+// Create, reset and evict on the thread owning the context; report() may be
+// called from any thread. After closeContext() handles only forget their
+// objects, for the ones destroyed after the window.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GPU_RESOURCES_H_DEF
+#define GPU_RESOURCES_H_DEF
+
+#include <mutex>
+#include <vector>
+
+enum GpuCategory
+{
+	GPU_GEOMETRY = 0,		// vertex and index buffers
+	GPU_STREAM = 1,			// buffers refilled while drawing
+	GPU_VERTEX_ARRAY = 2,
+	GPU_TEXTURE = 3,
+	GPU_PROGRAM = 4,
+	GPU_CATEGORIES = 5,
+};
+
+const int GPU_UNGROUPED = -1;
+
+class GpuResources;
+
+class GpuHandle
+{
+public:
+	GpuHandle() : resources(NULL), category(GPU_GEOMETRY), group(GPU_UNGROUPED), name(0), bytes(0) {}
+	GpuHandle(GpuHandle&& other) : resources(NULL), category(GPU_GEOMETRY), group(GPU_UNGROUPED), name(0), bytes(0) { take(other); }
+	GpuHandle& operator=(GpuHandle&& other)
+	{
+		if (this != &other)
+		{
+			reset();
+			take(other);
+		}
+		return *this;
+	}
+	GpuHandle(const GpuHandle&) = delete;
+	GpuHandle& operator=(const GpuHandle&) = delete;
+	~GpuHandle() { reset(); }
+
+	GLuint get() const { return name; }
+	bool valid() const { return name != 0; }
+	size_t getBytes() const { return bytes; }
+
+	// size of the storage after glBufferData / glTexImage2D
+	inline void setBytes(size_t size);
+
+	// delete the object
+	inline void reset();
+
+private:
+	friend class GpuResources;
+
+	void take(GpuHandle& other)
+	{
+		resources = other.resources;
+		category = other.category;
+		group = other.group;
+		name = other.name;
+		bytes = other.bytes;
+		other.resources = NULL;
+		other.name = 0;
+		other.bytes = 0;
+	}
+
+	GpuResources* resources;
+	GpuCategory category;
+	int group;
+	GLuint name;
+	size_t bytes;
+};
+
+struct GpuResourceReport
+{
+	size_t count[GPU_CATEGORIES];
+	size_t bytes[GPU_CATEGORIES];
+	size_t totalBytes, peakBytes;
+	size_t budget;					// 0 = none
+	size_t residentGroups, evictedGroups;
+	unsigned long long evictions, restores;
+	size_t evictedBytes;			// in total
+	double restoreMs;				// in total
+	unsigned long long overBudgetFrames;	// everything left was in use
+};
+
+class GpuResources
+{
+public:
+	GpuResources() : frame(0), totalBytes(0), peakBytes(0), budget(0), evictions(0), restores(0), evictedBytes(0),
+		restoreMs(0), overBudgetFrames(0), contextOpen(true)
+	{
+		for (int i = 0; i < GPU_CATEGORIES; i++)
+			count[i] = bytes[i] = 0;
+	}
+
+	GpuHandle createBuffer(GpuCategory category, int group = GPU_UNGROUPED)
+	{
+		GLuint name = 0;
+		glGenBuffers(1, &name);
+		return track(category, group, name);
+	}
+
+	GpuHandle createVertexArray(int group = GPU_UNGROUPED)
+	{
+		GLuint name = 0;
+		glGenVertexArrays(1, &name);
+		return track(GPU_VERTEX_ARRAY, group, name);
+	}
+
+	GpuHandle createTexture(int group = GPU_UNGROUPED)
+	{
+		GLuint name = 0;
+		glGenTextures(1, &name);
+		return track(GPU_TEXTURE, group, name);
+	}
+
+	// a linked program from glCreateProgram()
+	GpuHandle adoptProgram(GLuint program)
+	{
+		return track(GPU_PROGRAM, GPU_UNGROUPED, program);
+	}
+
+	// the bytes of width * height texels and, with mipmaps, of the levels below
+	static size_t textureBytes(int width, int height, size_t texelBytes, bool mipmaps)
+	{
+		size_t total = 0;
+		for (;;)
+		{
+			total += (size_t)width * height * texelBytes;
+			if (!mipmaps || (width <= 1 && height <= 1))
+				return total;
+			width = width > 1 ? width / 2 : 1;
+			height = height > 1 ? height / 2 : 1;
+		}
+	}
+
+	// bytes over all categories, 0 = no limit
+	void setBudget(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		budget = bytes;
+	}
+	size_t getBudget() const { return budget; }
+
+	// once per frame, before the groups drawn are touched
+	void beginFrame() { frame++; }
+
+	// the group is drawn this frame
+	void touch(int group)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		groupInfo(group).lastUsed = frame;
+	}
+
+	// the app uploaded an evicted group again, taking ms
+	void restored(int group, double ms)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		groupInfo(group).evicted = false;
+		restores++;
+		restoreMs += ms;
+	}
+
+	// evict(group) resets the handles of the least recently used groups not touched
+	// this frame while the total is over the budget
+	template <typename Evict>
+	void enforceBudget(const Evict& evict)
+	{
+		while (budget > 0 && totalBytes > budget)
+		{
+			int victim = -1;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (size_t g = 0; g < groups.size(); g++)
+				{
+					const Group& info = groups[g];
+					if (info.bytes > 0 && info.lastUsed < frame && (victim < 0 || info.lastUsed < groups[victim].lastUsed))
+						victim = (int)g;
+				}
+				if (victim < 0)
+				{
+					overBudgetFrames++;
+					return;
+				}
+			}
+			size_t before = groups[victim].bytes;
+			evict(victim);
+			std::lock_guard<std::mutex> lock(mutex);
+			groups[victim].evicted = true;
+			evictions++;
+			evictedBytes += before - groups[victim].bytes;
+			if (groups[victim].bytes >= before)
+				return;		// the callback freed nothing
+		}
+	}
+
+	// the context is about to go away, handles left over only forget their objects
+	void closeContext() { contextOpen = false; }
+
+	GpuResourceReport report()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		GpuResourceReport r;
+		for (int i = 0; i < GPU_CATEGORIES; i++)
+		{
+			r.count[i] = count[i];
+			r.bytes[i] = bytes[i];
+		}
+		r.totalBytes = totalBytes;
+		r.peakBytes = peakBytes;
+		r.budget = budget;
+		r.residentGroups = r.evictedGroups = 0;
+		for (size_t g = 0; g < groups.size(); g++)
+		{
+			if (groups[g].evicted)
+				r.evictedGroups++;
+			else if (groups[g].bytes > 0)
+				r.residentGroups++;
+		}
+		r.evictions = evictions;
+		r.restores = restores;
+		r.evictedBytes = evictedBytes;
+		r.restoreMs = restoreMs;
+		r.overBudgetFrames = overBudgetFrames;
+		return r;
+	}
+
+	static const char* categoryName(int category)
+	{
+		static const char* names[GPU_CATEGORIES] = { "geometry", "stream", "vertex arrays", "textures", "programs" };
+		return names[category];
+	}
+
+private:
+	friend class GpuHandle;
+
+	struct Group
+	{
+		Group() : bytes(0), lastUsed(0), evicted(false) {}
+		size_t bytes;
+		unsigned long long lastUsed;	// frame
+		bool evicted;
+	};
+
+	Group& groupInfo(int group)
+	{
+		if (group >= (int)groups.size())
+			groups.resize(group + 1);
+		return groups[group];
+	}
+
+	GpuHandle track(GpuCategory category, int group, GLuint name)
+	{
+		GpuHandle handle;
+		handle.resources = this;
+		handle.category = category;
+		handle.group = group;
+		handle.name = name;
+		std::lock_guard<std::mutex> lock(mutex);
+		count[category]++;
+		if (group != GPU_UNGROUPED)
+			groupInfo(group);
+		return handle;
+	}
+
+	void resize(GpuHandle& handle, size_t size)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bytes[handle.category] += size - handle.bytes;
+		totalBytes += size - handle.bytes;
+		if (handle.group != GPU_UNGROUPED)
+			groups[handle.group].bytes += size - handle.bytes;
+		peakBytes = totalBytes > peakBytes ? totalBytes : peakBytes;
+		handle.bytes = size;
+	}
+
+	void release(GpuHandle& handle)
+	{
+		resize(handle, 0);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			count[handle.category]--;
+		}
+		if (!contextOpen)
+			return;
+		switch (handle.category)
+		{
+		case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &handle.name); break;
+		case GPU_TEXTURE: glDeleteTextures(1, &handle.name); break;
+		case GPU_PROGRAM: glDeleteProgram(handle.name); break;
+		default: glDeleteBuffers(1, &handle.name); break;
+		}
+	}
+
+	std::mutex mutex;
+	unsigned long long frame;
+	size_t count[GPU_CATEGORIES];
+	size_t bytes[GPU_CATEGORIES];
+	size_t totalBytes, peakBytes;
+	size_t budget;
+	std::vector<Group> groups;		// by group id
+	unsigned long long evictions, restores;
+	size_t evictedBytes;
+	double restoreMs;
+	unsigned long long overBudgetFrames;
+	bool contextOpen;
+};
+
+inline void GpuHandle::setBytes(size_t size)
+{
+	if (resources)
+		resources->resize(*this, size);
+}
+
+inline void GpuHandle::reset()
+{
+	if (resources && name)
+		resources->release(*this);
+	resources = NULL;
+	name = 0;
+	bytes = 0;
+}
+
+// glBufferData into buffer, bound to target, with its size recorded
+inline void GpuBufferData(GLenum target, GpuHandle& buffer, size_t size, const void* data, GLenum usage)
+{
+	glBindBuffer(target, buffer.get());
+	glBufferData(target, (GLsizeiptr)size, data, usage);
+	buffer.setBytes(size);
+}
+
+#endif
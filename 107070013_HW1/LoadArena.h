@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+// LoadArena.h
+// ===========
+// Monotonic arena for the temporaries of one model load (flattened vertex
+// arrays, per material splits, ...). Allocation is a pointer bump in a
+// block, deallocation does nothing, and reset() drops everything at once
+// after the load. The largest block is kept, so the next load usually does
+// not touch the heap at all.
+//
+// ArenaAllocator / LoadArenaVector let std::vector allocate from the arena.
+// Reserve the final size where it is known: a growing vector leaves its old
+// buffers in the arena until the next reset().
+//
+// Not thread safe, use one arena per thread.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LOAD_ARENA_H_DEF
+#define LOAD_ARENA_H_DEF
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+struct LoadArenaStats
+{
+	size_t allocations;		// allocate() calls since the last reset
+	size_t bytes;			// bytes handed out since the last reset, i.e. the peak of the load
+	size_t heapBlocks;		// blocks taken from the heap since the last reset
+	size_t reservedBytes;	// size of all blocks currently owned by the arena
+};
+
+class LoadArena
+{
+public:
+	explicit LoadArena(size_t blockSize = 1 << 20) : minBlockSize(blockSize), current(NULL), used(0), capacity(0)
+	{
+		stats.allocations = stats.bytes = stats.heapBlocks = stats.reservedBytes = 0;
+	}
+
+	~LoadArena()
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+			free(blocks[i].data);
+	}
+
+	void* allocate(size_t bytes, size_t alignment)
+	{
+		size_t offset = (used + alignment - 1) & ~(alignment - 1);
+		if (!current || offset + bytes > capacity)
+		{
+			addBlock(bytes + alignment);
+			offset = (used + alignment - 1) & ~(alignment - 1);
+		}
+		used = offset + bytes;
+		stats.allocations++;
+		stats.bytes += bytes;
+		return current + offset;
+	}
+
+	// free everything allocated since the last reset, keeping the largest block
+	void reset()
+	{
+		size_t largest = 0;
+		for (size_t i = 1; i < blocks.size(); i++)
+		{
+			if (blocks[i].size > blocks[largest].size)
+				largest = i;
+		}
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			if (i != largest)
+				free(blocks[i].data);
+		}
+		if (!blocks.empty())
+		{
+			Block keep = blocks[largest];
+			blocks.assign(1, keep);
+			current = keep.data;
+			capacity = keep.size;
+		}
+		used = 0;
+		stats.allocations = stats.bytes = stats.heapBlocks = 0;
+		stats.reservedBytes = capacity;
+	}
+
+	const LoadArenaStats& getStats() const { return stats; }
+
+private:
+	struct Block
+	{
+		char* data;
+		size_t size;
+	};
+
+	void addBlock(size_t minBytes)
+	{
+		// grow geometrically so large models need only a few blocks
+		size_t size = (capacity > minBlockSize) ? capacity * 2 : minBlockSize;
+		if (size < minBytes)
+			size = minBytes;
+		char* data = (char*)malloc(size);
+		if (!data)
+			throw std::bad_alloc();
+		Block block = { data, size };
+		blocks.push_back(block);
+		current = data;
+		used = 0;
+		capacity = size;
+		stats.heapBlocks++;
+		stats.reservedBytes += size;
+	}
+
+	LoadArena(const LoadArena&);
+	LoadArena& operator=(const LoadArena&);
+
+	size_t minBlockSize;
+	std::vector<Block> blocks;
+	char* current;
+	size_t used;
+	size_t capacity;
+	LoadArenaStats stats;
+};
+
+// std allocator on top of a LoadArena
+template <typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+
+	LoadArena* arena;
+
+	ArenaAllocator(LoadArena* arena) : arena(arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T*, size_t) {}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using LoadArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
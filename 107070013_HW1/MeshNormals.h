@@ -0,0 +1,401 @@
+///////////////////////////////////////////////////////////////////////////////
+// MeshNormals.h
+// =============
+// Smooth normals for the corners of an ObjMesh which have none in the file,
+// and on request tangents for meshes with texcoords, on several threads.
+//
+// 1. faces: unit normal, area and the angle of every corner.
+// 2. adjacency: the corners of every vertex, by a counting sort of the
+//    corners on their vertex index (CSR, corner lists in corner order).
+// 3. normals: every vertex sums the face normals of its corners weighted by
+//    area * angle. Each thread only writes the vertices it owns, so nothing
+//    is scattered and no atomics are needed, and the sums are added in the
+//    same order for any thread count. The normals are appended to
+//    mesh->normals and the corners without one point at them.
+// 4. tangents: MikkTSpace conventions. The texture space direction of each
+//    face is projected into the plane of the corner normal and summed by
+//    corner angle over the corners of a vertex which share normal, texcoord
+//    and handedness, then made orthogonal to the normal. w is the sign of
+//    the bitangent: bitangent = w * cross(normal, tangent). The corners of a
+//    vertex are sorted once so the members of a group are adjacent.
+//    Corners are matched by index, not by value, and the angles are not
+//    projected, so the result is close to but not bit exact with the
+//    reference implementation.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MESH_NORMALS_H_DEF
+#define MESH_NORMALS_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "ObjMesh.h"
+#include "ParallelFor.h"
+
+struct MeshNormalStats
+{
+	size_t missingCorners;		// corners without a normal in the file
+	size_t generatedNormals;	// appended to mesh->normals
+	size_t tangentCorners;		// 0 without texcoords
+	double adjacencyMs;
+	double normalsMs;			// face pass and per vertex sums
+	double tangentsMs;
+};
+
+namespace meshnormals_detail
+{
+	const size_t BLOCK = 4096;	// items per ParallelFor task
+
+	// task(first, last) over [0, count) in blocks
+	template <typename Task>
+	inline void ParallelBlocks(size_t count, unsigned int threadCount, const Task& task)
+	{
+		ParallelFor((count + BLOCK - 1) / BLOCK, threadCount, [&](size_t b)
+		{
+			task(b * BLOCK, std::min(count, (b + 1) * BLOCK));
+		});
+	}
+
+	inline double ElapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	inline void Sub(const float* a, const float* b, float* out)
+	{
+		out[0] = a[0] - b[0];
+		out[1] = a[1] - b[1];
+		out[2] = a[2] - b[2];
+	}
+
+	inline void Cross(const float* a, const float* b, float* out)
+	{
+		out[0] = a[1] * b[2] - a[2] * b[1];
+		out[1] = a[2] * b[0] - a[0] * b[2];
+		out[2] = a[0] * b[1] - a[1] * b[0];
+	}
+
+	inline float Dot(const float* a, const float* b)
+	{
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	// returns the old length, v is left alone when it is zero
+	inline float Normalize(float* v)
+	{
+		float length = sqrtf(Dot(v, v));
+		if (length > 0)
+		{
+			v[0] /= length;
+			v[1] /= length;
+			v[2] /= length;
+		}
+		return length;
+	}
+
+	// angle between the edges a and b
+	inline float Angle(const float* a, const float* b)
+	{
+		float lengths = sqrtf(Dot(a, a) * Dot(b, b));
+		if (lengths <= 0)
+			return 0;
+		float c = Dot(a, b) / lengths;
+		return acosf(std::max(-1.0f, std::min(1.0f, c)));
+	}
+
+	// any unit vector orthogonal to n
+	inline void Orthogonal(const float* n, float* out)
+	{
+		float axis[3] = { 0, 0, 0 };
+		axis[fabsf(n[0]) < 0.577f ? 0 : (fabsf(n[1]) < 0.577f ? 1 : 2)] = 1;
+		Cross(n, axis, out);
+		if (Normalize(out) == 0)
+		{
+			out[0] = 1;
+			out[1] = out[2] = 0;
+		}
+	}
+
+	struct FaceData
+	{
+		std::vector<float> normals;		// unit, 3 per face
+		std::vector<float> areas;		// twice the area, 1 per face
+		std::vector<float> angles;		// 3 per face
+	};
+
+	inline void ComputeFaces(const ObjMesh& mesh, unsigned int threadCount, FaceData* faces)
+	{
+		size_t faceCount = mesh.indices.size() / 3;
+		faces->normals.resize(faceCount * 3);
+		faces->areas.resize(faceCount);
+		faces->angles.resize(faceCount * 3);
+		ParallelBlocks(faceCount, threadCount, [&](size_t first, size_t last)
+		{
+			for (size_t f = first; f < last; f++)
+			{
+				const float* p[3];
+				for (int c = 0; c < 3; c++)
+					p[c] = &mesh.positions[3 * mesh.indices[3 * f + c].vertex_index];
+				// the angle at corner c lies between the edges to c+1 and to c+2
+				float next[3][3], prev[3][3];
+				for (int c = 0; c < 3; c++)
+				{
+					Sub(p[(c + 1) % 3], p[c], next[c]);
+					Sub(p[(c + 2) % 3], p[c], prev[c]);
+					faces->angles[3 * f + c] = Angle(next[c], prev[c]);
+				}
+				// counterclockwise faces are front facing
+				float* n = &faces->normals[3 * f];
+				Cross(next[0], prev[0], n);
+				faces->areas[f] = Normalize(n);
+			}
+		});
+	}
+
+	// corners of vertex v: corners[offsets[v]] .. corners[offsets[v + 1] - 1]
+	struct VertexCorners
+	{
+		std::vector<unsigned int> offsets;
+		std::vector<unsigned int> corners;
+	};
+
+	inline void BuildAdjacency(const ObjMesh& mesh, VertexCorners* adjacency)
+	{
+		size_t vertexCount = mesh.positions.size() / 3;
+		size_t cornerCount = mesh.indices.size();
+		adjacency->offsets.assign(vertexCount + 1, 0);
+		for (size_t i = 0; i < cornerCount; i++)
+			adjacency->offsets[mesh.indices[i].vertex_index + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			adjacency->offsets[v + 1] += adjacency->offsets[v];
+		std::vector<unsigned int> fill(adjacency->offsets.begin(), adjacency->offsets.end() - 1);
+		adjacency->corners.resize(cornerCount);
+		for (size_t i = 0; i < cornerCount; i++)
+			adjacency->corners[fill[mesh.indices[i].vertex_index]++] = (unsigned int)i;
+	}
+
+	// weighted sum of the face normals around every vertex, 3 floats per vertex
+	inline void SumVertexNormals(const FaceData& faces, const VertexCorners& adjacency, unsigned int threadCount, float* out)
+	{
+		size_t vertexCount = adjacency.offsets.size() - 1;
+		ParallelBlocks(vertexCount, threadCount, [&](size_t first, size_t last)
+		{
+			for (size_t v = first; v < last; v++)
+			{
+				float sum[3] = { 0, 0, 0 };
+				for (unsigned int i = adjacency.offsets[v]; i < adjacency.offsets[v + 1]; i++)
+				{
+					unsigned int corner = adjacency.corners[i];
+					const float* n = &faces.normals[3 * (corner / 3)];
+					float w = faces.areas[corner / 3] * faces.angles[corner];
+					sum[0] += n[0] * w;
+					sum[1] += n[1] * w;
+					sum[2] += n[2] * w;
+				}
+				Normalize(sum);
+				out[3 * v] = sum[0];
+				out[3 * v + 1] = sum[1];
+				out[3 * v + 2] = sum[2];
+			}
+		});
+	}
+
+	// texture space u direction of every face, unit, and its handedness
+	inline void ComputeFaceTangents(const ObjMesh& mesh, unsigned int threadCount, std::vector<float>* tangents, std::vector<signed char>* orientation)
+	{
+		size_t faceCount = mesh.indices.size() / 3;
+		tangents->resize(faceCount * 3);
+		orientation->resize(faceCount);
+		ParallelBlocks(faceCount, threadCount, [&](size_t first, size_t last)
+		{
+			for (size_t f = first; f < last; f++)
+			{
+				const tinyobj::index_t* idx = &mesh.indices[3 * f];
+				float* t = &(*tangents)[3 * f];
+				t[0] = t[1] = t[2] = 0;
+				(*orientation)[f] = 1;
+				if (idx[0].texcoord_index < 0 || idx[1].texcoord_index < 0 || idx[2].texcoord_index < 0)
+					continue;
+				const float* uv0 = &mesh.texcoords[2 * idx[0].texcoord_index];
+				const float* uv1 = &mesh.texcoords[2 * idx[1].texcoord_index];
+				const float* uv2 = &mesh.texcoords[2 * idx[2].texcoord_index];
+				float e1[3], e2[3];
+				Sub(&mesh.positions[3 * idx[1].vertex_index], &mesh.positions[3 * idx[0].vertex_index], e1);
+				Sub(&mesh.positions[3 * idx[2].vertex_index], &mesh.positions[3 * idx[0].vertex_index], e2);
+				float du1 = uv1[0] - uv0[0], dv1 = uv1[1] - uv0[1];
+				float du2 = uv2[0] - uv0[0], dv2 = uv2[1] - uv0[1];
+				float signedArea = du1 * dv2 - du2 * dv1;
+				float sign = (signedArea >= 0) ? 1.0f : -1.0f;
+				for (int k = 0; k < 3; k++)
+					t[k] = (dv2 * e1[k] - dv1 * e2[k]) * sign;
+				Normalize(t);
+				(*orientation)[f] = (signed char)sign;
+			}
+		});
+	}
+
+	// order of the corners of a vertex for the tangent groups: normal, texcoord,
+	// handedness, the face for corners without normal, then the corner itself
+	struct TangentGroupLess
+	{
+		const ObjMesh& mesh;
+		const std::vector<signed char>& orientation;
+
+		bool sameGroup(unsigned int a, unsigned int b) const
+		{
+			const tinyobj::index_t& ia = mesh.indices[a];
+			const tinyobj::index_t& ib = mesh.indices[b];
+			return ia.normal_index == ib.normal_index && ia.texcoord_index == ib.texcoord_index &&
+				orientation[a / 3] == orientation[b / 3] && (ia.normal_index >= 0 || a / 3 == b / 3);
+		}
+
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			const tinyobj::index_t& ia = mesh.indices[a];
+			const tinyobj::index_t& ib = mesh.indices[b];
+			if (ia.normal_index != ib.normal_index)
+				return ia.normal_index < ib.normal_index;
+			if (ia.texcoord_index != ib.texcoord_index)
+				return ia.texcoord_index < ib.texcoord_index;
+			if (orientation[a / 3] != orientation[b / 3])
+				return orientation[a / 3] < orientation[b / 3];
+			if (ia.normal_index < 0 && a / 3 != b / 3)
+				return a / 3 < b / 3;
+			return a < b;
+		}
+	};
+
+	// corner normals for the tangent frame: the mesh normal, the face normal when there is none
+	inline void CornerNormal(const ObjMesh& mesh, const FaceData& faces, size_t corner, float* out)
+	{
+		int normal = mesh.indices[corner].normal_index;
+		const float* n = (normal >= 0) ? &mesh.normals[3 * normal] : &faces.normals[3 * (corner / 3)];
+		out[0] = n[0];
+		out[1] = n[1];
+		out[2] = n[2];
+		Normalize(out);
+	}
+
+	inline void ComputeTangents(const ObjMesh& mesh, const FaceData& faces, const VertexCorners& adjacency,
+		unsigned int threadCount, std::vector<float>* out)
+	{
+		std::vector<float> faceTangents;
+		std::vector<signed char> orientation;
+		ComputeFaceTangents(mesh, threadCount, &faceTangents, &orientation);
+
+		out->resize(mesh.indices.size() * 4);
+		size_t vertexCount = adjacency.offsets.size() - 1;
+		TangentGroupLess less = { mesh, orientation };
+		ParallelBlocks(vertexCount, threadCount, [&](size_t first, size_t last)
+		{
+			std::vector<unsigned int> sorted;
+			for (size_t v = first; v < last; v++)
+			{
+				// the members of a group follow each other, in corner order
+				sorted.assign(adjacency.corners.begin() + adjacency.offsets[v], adjacency.corners.begin() + adjacency.offsets[v + 1]);
+				std::sort(sorted.begin(), sorted.end(), less);
+				size_t groupEnd;
+				for (size_t groupBegin = 0; groupBegin < sorted.size(); groupBegin = groupEnd)
+				{
+					groupEnd = groupBegin + 1;
+					while (groupEnd < sorted.size() && less.sameGroup(sorted[groupBegin], sorted[groupEnd]))
+						groupEnd++;
+
+					// the frame is the one of the first corner of the group
+					unsigned int corner = sorted[groupBegin];
+					signed char orient = orientation[corner / 3];
+					float n[3], sum[3] = { 0, 0, 0 };
+					CornerNormal(mesh, faces, corner, n);
+					for (size_t k = groupBegin; k < groupEnd; k++)
+					{
+						unsigned int member = sorted[k];
+						const float* t = &faceTangents[3 * (member / 3)];
+						float d = Dot(n, t);
+						float projected[3] = { t[0] - n[0] * d, t[1] - n[1] * d, t[2] - n[2] * d };
+						Normalize(projected);
+						float angle = faces.angles[member];
+						sum[0] += projected[0] * angle;
+						sum[1] += projected[1] * angle;
+						sum[2] += projected[2] * angle;
+					}
+					float d = Dot(n, sum);
+					sum[0] -= n[0] * d;
+					sum[1] -= n[1] * d;
+					sum[2] -= n[2] * d;
+					if (Normalize(sum) == 0)
+						Orthogonal(n, sum);
+					for (size_t k = groupBegin; k < groupEnd; k++)
+					{
+						float* t = &(*out)[4 * sorted[k]];
+						t[0] = sum[0];
+						t[1] = sum[1];
+						t[2] = sum[2];
+						t[3] = orient;
+					}
+				}
+			}
+		});
+	}
+}
+
+// fill in the normals the file lacks and, with withTangents and texcoords,
+// mesh->tangents (4 floats per index). The renderers have no normal maps and
+// leave the tangents out. threadCount 0 = one thread per hardware thread.
+// Returns whether anything was generated.
+inline bool GenerateMeshNormals(ObjMesh* mesh, unsigned int threadCount = 0, MeshNormalStats* stats = NULL, bool withTangents = false)
+{
+	using namespace meshnormals_detail;
+	MeshNormalStats local;
+	if (!stats)
+		stats = &local;
+	stats->missingCorners = stats->generatedNormals = stats->tangentCorners = 0;
+	stats->adjacencyMs = stats->normalsMs = stats->tangentsMs = 0;
+
+	for (size_t i = 0; i < mesh->indices.size(); i++)
+		stats->missingCorners += (mesh->indices[i].normal_index < 0) ? 1 : 0;
+	bool tangents = withTangents && !mesh->texcoords.empty() && !mesh->indices.empty();
+	if (stats->missingCorners == 0 && !tangents)
+		return false;
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	FaceData faces;
+	ComputeFaces(*mesh, threadCount, &faces);
+	double faceMs = ElapsedMs(start);
+
+	start = std::chrono::steady_clock::now();
+	VertexCorners adjacency;
+	BuildAdjacency(*mesh, &adjacency);
+	stats->adjacencyMs = ElapsedMs(start);
+
+	start = std::chrono::steady_clock::now();
+	if (stats->missingCorners > 0)
+	{
+		// one normal per vertex, the corners without one use the normal of their vertex
+		size_t base = mesh->normals.size() / 3;
+		size_t vertexCount = mesh->positions.size() / 3;
+		mesh->normals.resize((base + vertexCount) * 3);
+		SumVertexNormals(faces, adjacency, threadCount, &mesh->normals[base * 3]);
+		for (size_t i = 0; i < mesh->indices.size(); i++)
+		{
+			if (mesh->indices[i].normal_index < 0)
+				mesh->indices[i].normal_index = (int)(base + mesh->indices[i].vertex_index);
+		}
+		stats->generatedNormals = vertexCount;
+	}
+	stats->normalsMs = faceMs + ElapsedMs(start);
+
+	if (tangents)
+	{
+		start = std::chrono::steady_clock::now();
+		ComputeTangents(*mesh, faces, adjacency, threadCount, &mesh->tangents);
+		stats->tangentCorners = mesh->indices.size();
+		stats->tangentsMs = ElapsedMs(start);
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,515 @@
+///////////////////////////////////////////////////////////////////////////////
+// MeshSimplifier.h
+// ================
+// Level of detail chain for the indexed meshes of OptimizeTriangleList().
+// The mesh is simplified with quadric error metrics (Garland, Heckbert,
+// "Surface Simplification Using Quadric Error Metrics", 1997) by half edge
+// collapses: a vertex is merged into a neighbour and nothing moves, so every
+// level indexes the same vertex buffer and only needs its own indices.
+//
+// Seams stay where they are:
+// - a vertex whose position is used by exactly two welded vertices (a UV,
+//   normal or color seam) only collapses along the seam, together with its
+//   twin on the other side, so both sides stay stitched.
+// - any other vertex on an open edge never moves. These are the borders of
+//   the mesh and, for meshes split by material, the material seams.
+//
+// The error of a level is the largest collapse error so far as a distance in
+// model units. The renderer projects it to pixels to pick the level.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MESH_SIMPLIFIER_H_DEF
+#define MESH_SIMPLIFIER_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "MeshOptimizer.h"
+
+const int MAX_LOD_COUNT = 4;
+const float LOD_RATIOS[MAX_LOD_COUNT] = { 1.0f, 0.5f, 0.25f, 0.1f };	// triangles kept per level
+
+struct MeshLod
+{
+	int indexOffset;	// first index of the level in the element buffer
+	int indexCount;
+	float error;		// geometric error in model units
+};
+
+struct MeshSimplifyStats
+{
+	size_t collapses;
+	int passes;
+	double simplifyMs;
+
+	MeshSimplifyStats() : collapses(0), passes(0), simplifyMs(0) {}
+};
+
+namespace meshsimp_detail
+{
+	// weight of the planes through the open edges, relative to the faces
+	const double SEAM_WEIGHT = 10.0;
+
+	const unsigned int NO_VERTEX = ~0u;
+	const unsigned int MANY_VERTICES = ~0u - 1;
+
+	struct Quadric
+	{
+		double a00, a11, a22, a01, a02, a12;
+		double b0, b1, b2;
+		double c;
+		double weight;
+	};
+
+	// plane n.p + d = 0, n unit length
+	inline void AddPlane(Quadric& q, double nx, double ny, double nz, double d, double w)
+	{
+		q.a00 += w * nx * nx;
+		q.a11 += w * ny * ny;
+		q.a22 += w * nz * nz;
+		q.a01 += w * nx * ny;
+		q.a02 += w * nx * nz;
+		q.a12 += w * ny * nz;
+		q.b0 += w * nx * d;
+		q.b1 += w * ny * d;
+		q.b2 += w * nz * d;
+		q.c += w * d * d;
+		q.weight += w;
+	}
+
+	inline void AddQuadric(Quadric& q, const Quadric& r)
+	{
+		q.a00 += r.a00; q.a11 += r.a11; q.a22 += r.a22;
+		q.a01 += r.a01; q.a02 += r.a02; q.a12 += r.a12;
+		q.b0 += r.b0; q.b1 += r.b1; q.b2 += r.b2;
+		q.c += r.c;
+		q.weight += r.weight;
+	}
+
+	// weighted mean of the squared distances of p to the planes of q and r
+	inline double QuadricError(const Quadric& q, const Quadric& r, const float* p)
+	{
+		double x = p[0], y = p[1], z = p[2];
+		double a00 = q.a00 + r.a00, a11 = q.a11 + r.a11, a22 = q.a22 + r.a22;
+		double a01 = q.a01 + r.a01, a02 = q.a02 + r.a02, a12 = q.a12 + r.a12;
+		double e = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z)
+			+ 2 * ((q.b0 + r.b0) * x + (q.b1 + r.b1) * y + (q.b2 + r.b2) * z) + q.c + r.c;
+		double weight = q.weight + r.weight;
+		return (weight > 0) ? fabs(e) / weight : 0;
+	}
+
+	inline void TriangleNormal(const float* p0, const float* p1, const float* p2, double* n)
+	{
+		double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	}
+
+	inline unsigned long long EdgeKey(unsigned int a, unsigned int b)
+	{
+		return ((unsigned long long)a << 32) | b;
+	}
+
+	enum VertexKind
+	{
+		Manifold = 0,	// free to collapse into any neighbour
+		Seam = 1,		// collapses along its seam, with its twin
+		Locked = 2,
+	};
+
+	struct Collapse
+	{
+		unsigned int v, u;	// v is merged into u
+		double error;
+	};
+
+	class Simplifier
+	{
+	public:
+		Simplifier(const LoadArenaVector<float>& positions, const LoadArenaVector<unsigned int>& indices, MeshSimplifyStats* stats)
+			: positions(positions), vertexCount(positions.size() / 3), arena(indices.get_allocator().arena),
+			current(indices), positionId(arena), twin(arena), kind(arena), quadrics(arena), edges(arena),
+			openNext(arena), openPrev(arena), offsets(arena), adjacency(arena), remap(arena), locked(arena),
+			collapses(arena), maxError(0), stats(stats)
+		{
+			findTwins();
+			findOpenEdges();
+			classifyVertices();
+			computeQuadrics();
+		}
+
+		// collapse edges until at most targetIndexCount indices are left or nothing can collapse
+		void simplify(size_t targetIndexCount)
+		{
+			while (current.size() > targetIndexCount)
+			{
+				if (!collapsePass((current.size() - targetIndexCount) / 3))
+					break;
+				findOpenEdges();
+			}
+		}
+
+		const LoadArenaVector<unsigned int>& indices() const { return current; }
+		float error() const { return (float)sqrt(maxError); }
+
+	private:
+		// twin[v] is the other vertex at the position of v when exactly two share it
+		void findTwins()
+		{
+			positionId.assign(vertexCount, 0);
+			twin.assign(vertexCount, NO_VERTEX);
+			LoadArenaVector<unsigned int> useCount(vertexCount, 0, arena);
+
+			size_t tableSize = 16;
+			while (tableSize < vertexCount * 2)
+				tableSize *= 2;
+			LoadArenaVector<unsigned int> table(tableSize, NO_VERTEX, arena);
+			for (size_t v = 0; v < vertexCount; v++)
+			{
+				const float* key = &positions[v * 3];
+				size_t slot = meshopt_detail::HashVertex(key, 3) & (tableSize - 1);
+				while (table[slot] != NO_VERTEX && memcmp(&positions[table[slot] * 3], key, 3 * sizeof(float)) != 0)
+					slot = (slot + 1) & (tableSize - 1);
+				if (table[slot] == NO_VERTEX)
+					table[slot] = (unsigned int)v;
+				positionId[v] = table[slot];
+				useCount[table[slot]]++;
+			}
+			for (size_t v = 0; v < vertexCount; v++)
+			{
+				unsigned int first = positionId[v];
+				if (first != v && useCount[first] == 2)
+				{
+					twin[v] = first;
+					twin[first] = (unsigned int)v;
+				}
+				else if (first == v && useCount[first] > 2)
+				{
+					twin[v] = MANY_VERTICES;
+				}
+			}
+			for (size_t v = 0; v < vertexCount; v++)
+			{
+				if (twin[positionId[v]] == MANY_VERTICES)
+					twin[v] = MANY_VERTICES;
+			}
+		}
+
+		// an edge is open when no triangle uses it the other way round
+		bool isOpen(unsigned int a, unsigned int b) const
+		{
+			return !std::binary_search(edges.begin(), edges.end(), EdgeKey(b, a));
+		}
+
+		// openNext[v] / openPrev[v] is the far end of the open edge leaving / entering v
+		void findOpenEdges()
+		{
+			edges.resize(current.size());
+			for (size_t t = 0; t < current.size(); t += 3)
+			{
+				for (int k = 0; k < 3; k++)
+					edges[t + k] = EdgeKey(current[t + k], current[t + (k + 1) % 3]);
+			}
+			std::sort(edges.begin(), edges.end());
+
+			openNext.assign(vertexCount, NO_VERTEX);
+			openPrev.assign(vertexCount, NO_VERTEX);
+			for (size_t t = 0; t < current.size(); t += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int a = current[t + k], b = current[t + (k + 1) % 3];
+					if (!isOpen(a, b))
+						continue;
+					openNext[a] = (openNext[a] == NO_VERTEX) ? b : MANY_VERTICES;
+					openPrev[b] = (openPrev[b] == NO_VERTEX) ? a : MANY_VERTICES;
+				}
+			}
+		}
+
+		bool onSimpleSeam(unsigned int v) const
+		{
+			return openNext[v] < MANY_VERTICES && openPrev[v] < MANY_VERTICES;
+		}
+
+		void classifyVertices()
+		{
+			kind.assign(vertexCount, Locked);
+			for (size_t v = 0; v < vertexCount; v++)
+			{
+				unsigned int t = twin[v];
+				if (t == NO_VERTEX && openNext[v] == NO_VERTEX && openPrev[v] == NO_VERTEX)
+					kind[v] = Manifold;
+				else if (t < MANY_VERTICES && onSimpleSeam((unsigned int)v) && onSimpleSeam(t))
+					kind[v] = Seam;
+			}
+		}
+
+		void computeQuadrics()
+		{
+			Quadric zero = {};
+			quadrics.assign(vertexCount, zero);
+			for (size_t t = 0; t < current.size(); t += 3)
+			{
+				const float* p[3] = { &positions[current[t] * 3], &positions[current[t + 1] * 3], &positions[current[t + 2] * 3] };
+				double n[3];
+				TriangleNormal(p[0], p[1], p[2], n);
+				double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length == 0)
+					continue;
+				n[0] /= length; n[1] /= length; n[2] /= length;
+
+				// the plane of the face, weighted by its area
+				Quadric face = {};
+				AddPlane(face, n[0], n[1], n[2], -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]), length * 0.5);
+				for (int k = 0; k < 3; k++)
+					AddQuadric(quadrics[positionId[current[t + k]]], face);
+
+				// open edges: a plane through the edge, perpendicular to the face
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int a = current[t + k], b = current[t + (k + 1) % 3];
+					if (!isOpen(a, b))
+						continue;
+					const float* pa = p[k];
+					const float* pb = p[(k + 1) % 3];
+					double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+					double m[3] = { e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0] };
+					double mLength = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+					if (mLength == 0)
+						continue;
+					m[0] /= mLength; m[1] /= mLength; m[2] /= mLength;
+					Quadric edge = {};
+					AddPlane(edge, m[0], m[1], m[2], -(m[0] * pa[0] + m[1] * pa[1] + m[2] * pa[2]), (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * SEAM_WEIGHT);
+					AddQuadric(quadrics[positionId[a]], edge);
+					AddQuadric(quadrics[positionId[b]], edge);
+				}
+			}
+		}
+
+		// vertex -> triangles of the current indices
+		void buildAdjacency()
+		{
+			offsets.assign(vertexCount + 1, 0);
+			for (size_t i = 0; i < current.size(); i++)
+				offsets[current[i] + 1]++;
+			for (size_t v = 0; v < vertexCount; v++)
+				offsets[v + 1] += offsets[v];
+			adjacency.resize(current.size());
+			LoadArenaVector<unsigned int> fill(offsets.begin(), offsets.end() - 1, arena);
+			for (size_t i = 0; i < current.size(); i++)
+				adjacency[fill[current[i]]++] = (unsigned int)(i / 3);
+		}
+
+		bool alongSeam(unsigned int v, unsigned int u) const
+		{
+			return onSimpleSeam(v) && (openNext[v] == u || openPrev[v] == u);
+		}
+
+		bool canCollapse(unsigned int v, unsigned int u) const
+		{
+			if (kind[v] == Manifold)
+				return true;
+			if (kind[v] != Seam || kind[u] != Seam || positionId[v] == positionId[u])
+				return false;
+			return alongSeam(v, u) && alongSeam(twin[v], twin[u]);
+		}
+
+		// moving v onto u must not flip or squash the triangles around v which survive
+		bool flipsTriangle(unsigned int v, unsigned int u) const
+		{
+			for (unsigned int a = offsets[v]; a < offsets[v + 1]; a++)
+			{
+				const unsigned int* tri = &current[adjacency[a] * 3];
+				if (tri[0] == u || tri[1] == u || tri[2] == u)
+					continue;
+				const float* before[3];
+				const float* after[3];
+				for (int k = 0; k < 3; k++)
+				{
+					before[k] = &positions[tri[k] * 3];
+					after[k] = &positions[(tri[k] == v ? u : tri[k]) * 3];
+				}
+				double n0[3], n1[3];
+				TriangleNormal(before[0], before[1], before[2], n0);
+				TriangleNormal(after[0], after[1], after[2], n1);
+				double dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+				double l0 = n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2];
+				double l1 = n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2];
+				if (dot < 0.25 * sqrt(l0 * l1))
+					return true;
+			}
+			return false;
+		}
+
+		// the triangles around v change, so nothing of them may take part in another collapse this pass
+		size_t lockAround(unsigned int v, unsigned int u)
+		{
+			size_t removed = 0;
+			for (unsigned int a = offsets[v]; a < offsets[v + 1]; a++)
+			{
+				const unsigned int* tri = &current[adjacency[a] * 3];
+				locked[tri[0]] = locked[tri[1]] = locked[tri[2]] = 1;
+				if (tri[0] == u || tri[1] == u || tri[2] == u)
+					removed++;
+			}
+			return removed;
+		}
+
+		// one round of independent collapses, cheapest first, returns false if none was possible
+		bool collapsePass(size_t triangleGoal)
+		{
+			buildAdjacency();
+			collapses.clear();
+			for (size_t t = 0; t < current.size(); t += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int a = current[t + k], b = current[t + (k + 1) % 3];
+					// inner edges show up twice, take them once
+					if (a > b && !isOpen(a, b))
+						continue;
+					Collapse best = { NO_VERTEX, NO_VERTEX, 0 };
+					if (canCollapse(a, b))
+					{
+						Collapse c = { a, b, QuadricError(quadrics[positionId[a]], quadrics[positionId[b]], &positions[b * 3]) };
+						best = c;
+					}
+					if (canCollapse(b, a))
+					{
+						Collapse c = { b, a, QuadricError(quadrics[positionId[b]], quadrics[positionId[a]], &positions[a * 3]) };
+						if (best.v == NO_VERTEX || c.error < best.error)
+							best = c;
+					}
+					if (best.v != NO_VERTEX)
+						collapses.push_back(best);
+				}
+			}
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) { return x.error < y.error; });
+
+			remap.resize(vertexCount);
+			for (size_t v = 0; v < vertexCount; v++)
+				remap[v] = (unsigned int)v;
+			locked.assign(vertexCount, 0);
+
+			// keep to the cheaper half of the candidates, later passes see the updated quadrics
+			size_t applied = 0, removed = 0;
+			size_t half = (collapses.size() + 1) / 2;
+			for (size_t i = 0; i < collapses.size() && removed < triangleGoal; i++)
+			{
+				if (i >= half && applied > 0)
+					break;
+				unsigned int v = collapses[i].v, u = collapses[i].u;
+				bool seam = kind[v] == Seam;
+				unsigned int v2 = seam ? twin[v] : v, u2 = seam ? twin[u] : u;
+				if (locked[v] || locked[u] || locked[v2] || locked[u2])
+					continue;
+				if (flipsTriangle(v, u) || (seam && flipsTriangle(v2, u2)))
+					continue;
+
+				removed += lockAround(v, u);
+				remap[v] = u;
+				if (seam)
+				{
+					removed += lockAround(v2, u2);
+					remap[v2] = u2;
+				}
+				locked[u] = locked[u2] = 1;
+				AddQuadric(quadrics[positionId[u]], quadrics[positionId[v]]);
+				maxError = std::max(maxError, collapses[i].error);
+				applied++;
+			}
+			if (applied == 0)
+				return false;
+
+			// move the indices and drop the triangles which collapsed
+			size_t kept = 0;
+			for (size_t t = 0; t < current.size(); t += 3)
+			{
+				unsigned int a = remap[current[t]], b = remap[current[t + 1]], c = remap[current[t + 2]];
+				if (a == b || b == c || c == a)
+					continue;
+				current[kept++] = a;
+				current[kept++] = b;
+				current[kept++] = c;
+			}
+			current.resize(kept);
+
+			if (stats)
+			{
+				stats->collapses += applied;
+				stats->passes++;
+			}
+			return true;
+		}
+
+		Simplifier(const Simplifier&);
+		Simplifier& operator=(const Simplifier&);
+
+		const LoadArenaVector<float>& positions;
+		size_t vertexCount;
+		LoadArena* arena;
+		LoadArenaVector<unsigned int> current;
+		LoadArenaVector<unsigned int> positionId;	// first vertex at the same position, owns the quadric
+		LoadArenaVector<unsigned int> twin;
+		LoadArenaVector<char> kind;
+		LoadArenaVector<Quadric> quadrics;
+		LoadArenaVector<unsigned long long> edges;	// sorted directed edges of current
+		LoadArenaVector<unsigned int> openNext, openPrev;
+		LoadArenaVector<unsigned int> offsets, adjacency;
+		LoadArenaVector<unsigned int> remap;
+		LoadArenaVector<char> locked;
+		LoadArenaVector<Collapse> collapses;
+		double maxError;	// squared
+		MeshSimplifyStats* stats;
+	};
+}
+
+// Build the levels of LOD_RATIOS for an indexed mesh, level 0 being the mesh itself.
+// Each level continues from the one before, is reordered for the vertex cache and
+// appended to lodIndices. Stops early when the seams keep a level from shrinking.
+// Returns the number of levels written to lods.
+inline int BuildLodChain(const LoadArenaVector<float>& positions, const LoadArenaVector<unsigned int>& indices,
+	LoadArenaVector<unsigned int>* lodIndices, MeshLod* lods, MeshSimplifyStats* stats = NULL)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	LoadArena* arena = indices.get_allocator().arena;
+
+	lodIndices->assign(indices.begin(), indices.end());
+	MeshLod full = { 0, (int)indices.size(), 0.0f };
+	lods[0] = full;
+	int lodCount = 1;
+
+	meshsimp_detail::Simplifier simplifier(positions, indices, stats);
+	size_t triangleCount = indices.size() / 3;
+	for (int level = 1; level < MAX_LOD_COUNT; level++)
+	{
+		simplifier.simplify((size_t)(triangleCount * LOD_RATIOS[level]) * 3);
+		const LoadArenaVector<unsigned int>& simplified = simplifier.indices();
+		if (simplified.empty() || simplified.size() * 10 > (size_t)lods[lodCount - 1].indexCount * 9)
+			break;
+
+		LoadArenaVector<unsigned int> ordered(simplified.begin(), simplified.end(), arena);
+		OptimizeTriangleOrder(positions, &ordered);
+		MeshLod lod = { (int)lodIndices->size(), (int)ordered.size(), simplifier.error() };
+		lodIndices->insert(lodIndices->end(), ordered.begin(), ordered.end());
+		lods[lodCount++] = lod;
+	}
+
+	if (stats)
+		stats->simplifyMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return lodCount;
+}
+
+// Coarsest level whose error, scaled by pixelsPerUnit, stays within maxPixelError
+inline int SelectLod(const MeshLod* lods, int lodCount, float pixelsPerUnit, float maxPixelError)
+{
+	int level = 0;
+	while (level + 1 < lodCount && lods[level + 1].error * pixelsPerUnit <= maxPixelError)
+		level++;
+	return level;
+}
+
+#endif
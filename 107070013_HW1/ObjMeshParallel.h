@@ -0,0 +1,430 @@
+///////////////////////////////////////////////////////////////////////////////
+// ObjMeshParallel.h
+// =================
+// Multithreaded version of LoadObjMesh() for large OBJ files.
+//
+// The file is memory mapped and split into newline aligned chunks, which are
+// handed out to the worker threads one by one:
+// 1. scan: every chunk counts its v / vn / vt lines and remembers its mtllib
+//    lines and its last usemtl. Prefix sums of the counts give the index base
+//    of every chunk, so relative (negative) face indices still resolve.
+// 2. parse: every chunk is parsed by tinyobj::LoadObjWithCallback into its
+//    own ObjMesh with the same callbacks as the single threaded loader.
+// 3. merge: groups are stitched across chunk borders, then every chunk is
+//    copied to its prefix summed offset of the final arrays and normalized.
+//
+// The result is identical to LoadObjMesh(), except that a usemtl in front of
+// the mtllib line which defines its material is resolved as well.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef OBJ_MESH_PARALLEL_H_DEF
+#define OBJ_MESH_PARALLEL_H_DEF
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include "ObjMesh.h"
+#include "ParallelFor.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// read only view of a whole file
+class MappedFile
+{
+public:
+	MappedFile() : bytes(NULL), byteCount(0) {}
+	~MappedFile() { close(); }
+
+	bool open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			CloseHandle(file);
+			return false;
+		}
+		byteCount = (size_t)size.QuadPart;
+		if (byteCount > 0)
+		{
+			// the view keeps the mapping alive after the handles are closed
+			HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping)
+			{
+				bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int file = ::open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return false;
+		struct stat info;
+		if (fstat(file, &info) != 0)
+		{
+			::close(file);
+			return false;
+		}
+		byteCount = (size_t)info.st_size;
+		if (byteCount > 0)
+		{
+			void* view = mmap(NULL, byteCount, PROT_READ, MAP_PRIVATE, file, 0);
+			if (view != MAP_FAILED)
+			{
+				madvise(view, byteCount, MADV_WILLNEED);
+				bytes = (const char*)view;
+			}
+		}
+		::close(file);
+#endif
+		if (byteCount > 0 && !bytes)
+		{
+			byteCount = 0;
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (bytes)
+		{
+#ifdef _WIN32
+			UnmapViewOfFile(bytes);
+#else
+			munmap((void*)bytes, byteCount);
+#endif
+		}
+		bytes = NULL;
+		byteCount = 0;
+	}
+
+	const char* data() const { return bytes; }
+	size_t size() const { return byteCount; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const char* bytes;
+	size_t byteCount;
+};
+
+namespace objmesh_detail
+{
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+
+		// scan results
+		size_t vertexCount, normalCount, texcoordCount;
+		std::string mtllibLines;
+		bool hasUsemtl;
+		std::string lastUsemtl;
+
+		// state of the file in front of the chunk
+		size_t vertexBase, normalBase, texcoordBase, faceBase;
+		int startMaterial;
+
+		// parse results
+		ObjMesh mesh;
+		size_t continuedFaces;
+		bool pendingGroup;		// g / o after the last face of the chunk
+		std::string pendingName;
+		std::string warn, err;
+		bool parsed;
+	};
+
+	// same line classification as LoadObjWithCallback, without parsing the numbers
+	inline void ScanChunk(Chunk* chunk)
+	{
+		chunk->vertexCount = chunk->normalCount = chunk->texcoordCount = 0;
+		chunk->hasUsemtl = false;
+
+		// lines from the structural index of tinyobj::ScanLines, one window at a time
+		tinyobj::line_index_t index;
+		const char* window = chunk->begin;
+		const size_t defaultWindowBytes = 64 * 1024;
+		size_t windowBytes = defaultWindowBytes;
+		while (window < chunk->end)
+		{
+			size_t remaining = chunk->end - window;
+			bool atEnd = (remaining <= windowBytes);
+			size_t consumed = tinyobj::ScanLines(window, atEnd ? remaining : windowBytes, atEnd, &index);
+			if (consumed == 0)
+			{
+				// a line longer than the window
+				windowBytes *= 2;
+				continue;
+			}
+
+			for (size_t i = 0; i < index.line_end.size(); i++)
+			{
+				const char* p = window + index.token_begin[i];
+				const char* lineEnd = window + index.line_end[i];
+				size_t length = lineEnd - p;
+				if (length >= 2 && p[0] == 'v')
+				{
+					if (p[1] == ' ' || p[1] == '\t')
+						chunk->vertexCount++;
+					else if (length >= 3 && (p[2] == ' ' || p[2] == '\t'))
+					{
+						if (p[1] == 'n')
+							chunk->normalCount++;
+						else if (p[1] == 't')
+							chunk->texcoordCount++;
+					}
+				}
+				else if (length >= 7 && (p[6] == ' ' || p[6] == '\t'))
+				{
+					if (memcmp(p, "usemtl", 6) == 0)
+					{
+						chunk->hasUsemtl = true;
+						chunk->lastUsemtl.assign(p + 7, lineEnd);
+					}
+					else if (memcmp(p, "mtllib", 6) == 0)
+					{
+						chunk->mtllibLines.append(p, lineEnd);
+						chunk->mtllibLines += '\n';
+					}
+				}
+			}
+			window += consumed;
+			windowBytes = defaultWindowBytes;
+		}
+	}
+
+	inline void ParseChunk(Chunk* chunk, const std::map<std::string, int>& materialMap)
+	{
+		ObjMesh* mesh = &chunk->mesh;
+		size_t bytes = chunk->end - chunk->begin;
+		mesh->positions.reserve(chunk->vertexCount * 3);
+		mesh->colors.reserve(chunk->vertexCount * 3);
+		mesh->normals.reserve(chunk->normalCount * 3);
+		mesh->texcoords.reserve(chunk->texcoordCount * 2);
+		mesh->indices.reserve(bytes / 20);
+
+		LoadState state;
+		InitLoadState(&state, mesh);
+		state.material = chunk->startMaterial;
+		state.newGroup = false;
+		state.vertexBase = chunk->vertexBase;
+		state.normalBase = chunk->normalBase;
+		state.texcoordBase = chunk->texcoordBase;
+		state.materialMap = &materialMap;
+
+		tinyobj::callback_t callback;
+		callback.vertex_color_cb = VertexCallback;
+		callback.normal_cb = NormalCallback;
+		callback.texcoord_cb = TexcoordCallback;
+		callback.index_cb = IndexCallback;
+		callback.usemtl_cb = UsemtlCallback;
+		callback.group_cb = GroupCallback;
+		callback.object_cb = ObjectCallback;
+		// no material reader, the mtllib lines were loaded after the scan
+		chunk->parsed = tinyobj::LoadObjWithCallback(chunk->begin, bytes, callback, &state, NULL, &chunk->warn, &chunk->err);
+
+		chunk->continuedFaces = state.continuedFaces;
+		chunk->pendingGroup = state.newGroup;
+		chunk->pendingName = state.groupName;
+	}
+
+	// copy a parsed chunk to its offsets in the final arrays and normalize its positions
+	inline void CopyChunk(Chunk* chunk, ObjMesh* mesh, const float offset[3], float scale)
+	{
+		ObjMesh& local = chunk->mesh;
+		if (!local.positions.empty())
+		{
+			float* p = &mesh->positions[chunk->vertexBase * 3];
+			std::copy(local.positions.begin(), local.positions.end(), p);
+			NormalizePositions(p, local.positions.size(), offset, scale);
+			std::copy(local.colors.begin(), local.colors.end(), mesh->colors.begin() + chunk->vertexBase * 3);
+		}
+		std::copy(local.normals.begin(), local.normals.end(), mesh->normals.begin() + chunk->normalBase * 3);
+		std::copy(local.texcoords.begin(), local.texcoords.end(), mesh->texcoords.begin() + chunk->texcoordBase * 2);
+		std::copy(local.indices.begin(), local.indices.end(), mesh->indices.begin() + chunk->faceBase * 3);
+		std::copy(local.faceMaterials.begin(), local.faceMaterials.end(), mesh->faceMaterials.begin() + chunk->faceBase);
+		local = ObjMesh();
+	}
+
+	inline void MaterialsCallback(void* user_data, const tinyobj::material_t* materials, int num_materials)
+	{
+		((ObjMesh*)user_data)->materials.assign(materials, materials + num_materials);
+	}
+}
+
+// threadCount 0 = one thread per hardware thread
+inline bool LoadObjMeshParallel(const std::string& path, const std::string& baseDir, ObjMesh* mesh,
+	std::string* warn, std::string* err, ObjLoadStats* stats = NULL, unsigned int threadCount = 0)
+{
+	using namespace objmesh_detail;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	MappedFile file;
+	if (!file.open(path))
+	{
+		if (err)
+			(*err) += "Cannot open file [" + path + "]\n";
+		return false;
+	}
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	// a few chunks per thread keep the threads busy when some chunks are slower, but not below 1 MB each
+	const size_t minChunkBytes = 1 << 20;
+	size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threadCount * 4, file.size() / minChunkBytes));
+	std::vector<Chunk> chunks(chunkCount);
+	const char* data = file.data();
+	const char* fileEnd = data + file.size();
+	const char* chunkBegin = data;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		const char* chunkEnd = fileEnd;
+		if (i + 1 < chunkCount)
+		{
+			chunkEnd = std::max(chunkBegin, data + file.size() / chunkCount * (i + 1));
+			const char* newline = (const char*)memchr(chunkEnd, '\n', fileEnd - chunkEnd);
+			chunkEnd = newline ? newline + 1 : fileEnd;
+		}
+		chunks[i].begin = chunkBegin;
+		chunks[i].end = chunkEnd;
+		chunkBegin = chunkEnd;
+	}
+
+	ParallelFor(chunkCount, threadCount, [&](size_t i) { ScanChunk(&chunks[i]); });
+
+	*mesh = ObjMesh();
+	size_t vertexCount = 0, normalCount = 0, texcoordCount = 0;
+	std::string mtllibLines;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		chunks[i].vertexBase = vertexCount;
+		chunks[i].normalBase = normalCount;
+		chunks[i].texcoordBase = texcoordCount;
+		vertexCount += chunks[i].vertexCount;
+		normalCount += chunks[i].normalCount;
+		texcoordCount += chunks[i].texcoordCount;
+		mtllibLines += chunks[i].mtllibLines;
+	}
+
+	// materials of every mtllib line, loaded by tinyobj as usual
+	bool ret = true;
+	if (!mtllibLines.empty())
+	{
+		tinyobj::callback_t callback;
+		callback.mtllib_cb = MaterialsCallback;
+		tinyobj::MaterialFileReader materialReader(baseDir);
+		ret = tinyobj::LoadObjWithCallback(mtllibLines.c_str(), mtllibLines.size(), callback, mesh, &materialReader, warn, err);
+	}
+	std::map<std::string, int> materialMap;
+	for (size_t i = 0; i < mesh->materials.size(); i++)
+		materialMap.insert(std::make_pair(mesh->materials[i].name, (int)i));
+
+	int material = -1;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		chunks[i].startMaterial = material;
+		if (chunks[i].hasUsemtl)
+		{
+			std::map<std::string, int>::const_iterator it = materialMap.find(chunks[i].lastUsemtl);
+			material = (it != materialMap.end()) ? it->second : -1;
+		}
+	}
+
+	ParallelFor(chunkCount, threadCount, [&](size_t i) { ParseChunk(&chunks[i], materialMap); });
+
+	// stitch the groups, a group is created by the first face after g / o like in LoadObjMesh()
+	size_t faceCount = 0;
+	bool newGroup = true;
+	std::string groupName;
+	bool hasBound = false;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		Chunk& chunk = chunks[i];
+		chunk.faceBase = faceCount;
+		if (chunk.continuedFaces > 0)
+		{
+			if (newGroup)
+			{
+				ObjGroup group;
+				group.name = groupName;
+				group.firstFace = faceCount;
+				group.faceCount = 0;
+				mesh->groups.push_back(group);
+				newGroup = false;
+			}
+			mesh->groups.back().faceCount += chunk.continuedFaces;
+		}
+		for (size_t g = 0; g < chunk.mesh.groups.size(); g++)
+		{
+			ObjGroup group = chunk.mesh.groups[g];
+			group.firstFace += faceCount;
+			mesh->groups.push_back(group);
+			newGroup = false;
+		}
+		if (chunk.pendingGroup)
+		{
+			newGroup = true;
+			groupName = chunk.pendingName;
+		}
+		faceCount += chunk.mesh.triangleCount();
+
+		if (!chunk.mesh.positions.empty())
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (!hasBound || chunk.mesh.minBound[axis] < mesh->minBound[axis]) mesh->minBound[axis] = chunk.mesh.minBound[axis];
+				if (!hasBound || chunk.mesh.maxBound[axis] > mesh->maxBound[axis]) mesh->maxBound[axis] = chunk.mesh.maxBound[axis];
+			}
+			hasBound = true;
+		}
+		if (warn) (*warn) += chunk.warn;
+		if (err) (*err) += chunk.err;
+		// an error in any chunk fails the whole load
+		ret = ret && chunk.parsed && chunk.err.empty();
+	}
+
+	std::chrono::steady_clock::time_point parsed = std::chrono::steady_clock::now();
+
+	float offset[3] = { 0, 0, 0 }, scale = 1.0f;
+	if (hasBound)
+		GetNormalizeTransform(*mesh, offset, &scale);
+	mesh->positions.resize(vertexCount * 3);
+	mesh->colors.resize(vertexCount * 3);
+	mesh->normals.resize(normalCount * 3);
+	mesh->texcoords.resize(texcoordCount * 2);
+	mesh->indices.resize(faceCount * 3);
+	mesh->faceMaterials.resize(faceCount);
+	ParallelFor(chunkCount, threadCount, [&](size_t i) { CopyChunk(&chunks[i], mesh, offset, scale); });
+	if (hasBound)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			mesh->minBound[axis] = (mesh->minBound[axis] - offset[axis]) / scale;
+			mesh->maxBound[axis] = (mesh->maxBound[axis] - offset[axis]) / scale;
+		}
+	}
+	std::chrono::steady_clock::time_point normalized = std::chrono::steady_clock::now();
+
+	if (stats)
+	{
+		stats->fileBytes = file.size();
+		stats->parseMs = std::chrono::duration<double, std::milli>(parsed - start).count();
+		stats->normalizeMs = std::chrono::duration<double, std::milli>(normalized - parsed).count();
+		stats->peakMemoryBytes = GetPeakMemoryUsage();
+	}
+	return ret;
+}
+
+#endif
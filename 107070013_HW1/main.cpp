@@ -6,11 +6,25 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "textfile.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include <STB/stb_image.h>
 
 #include "Vectors.h"
 #include "Matrices.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
+#include "ObjMesh.h"
+#include "ObjMeshParallel.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "MeshNormals.h"
+#include "LoaderBenchmark.h"
+#include "NormalsBenchmark.h"
+#include "FramePacing.h"
+#include "GpuResources.h"
+#include "ImageWriter.h"
+#include "SceneManifest.h"
+#include "AssetLoader.h"
 
 #define PI 3.1415926
 
@@ -25,11 +39,16 @@ using namespace std;
 // Default window size
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
+int screenWidth = WINDOW_WIDTH;
+int screenHeight = WINDOW_HEIGHT;
 
 bool mouse_pressed = false;
 int starting_press_x = -1;
 int starting_press_y = -1;
 
+// frames are drawn when something changed, or continuously with --continuous / V
+FramePacer pacer;
+
 GLenum mode = GL_FILL;
 //bool change_mode = false;
 
@@ -46,12 +65,18 @@ enum TransMode
 GLint iLocMVP;
 
 vector<string> filenames; // .obj filename list
+GpuResources gpuResources; // owns the GL objects of the shapes and the program
+GpuHandle programObject;
+LoadArena loadArena; // temporaries of the model being loaded
+vector<string> model_list{ "../ColorModels/bunny5KC.obj", "../ColorModels/dragon10KC.obj", "../ColorModels/lucy25KC.obj", "../ColorModels/teapot4KC.obj", "../ColorModels/dolphinC.obj"};
+SceneManifest sceneManifest; // --scene <manifest.json>, its meshes replace model_list
 
 struct model
 {
 	Vector3 position = Vector3(0, 0, 0);
 	Vector3 scale = Vector3(1, 1, 1);
 	Vector3 rotation = Vector3(0, 0, 0);	// Euler form
+	bool loaded = false;	// taken in from the loader, a model that cannot be loaded has no levels
 };
 vector<model> models;
 
@@ -84,26 +109,82 @@ TransMode cur_trans_mode = GeoTranslation;
 
 Matrix4 view_matrix;
 Matrix4 project_matrix;
+bool view_changed = false;	// main_camera moved, view_matrix is rebuilt once before the next frame
 
 
 typedef struct
 {
-	GLuint vao;
-	GLuint vbo;
-	GLuint vboTex;
-	GLuint ebo;
-	GLuint p_color;
+	GpuHandle vao;
+	GpuHandle vbo;
+	GpuHandle ebo;
+	GpuHandle p_color;
 	int vertex_count;
-	GLuint p_normal;
 	int materialId;
 	int indexCount;
 	GLuint m_texture;
+	MeshLod lods[MAX_LOD_COUNT];	// index ranges in ebo, level 0 is the full mesh
+	int lodCount;
 } Shape;
 Shape quad;
 Shape m_shpae;
 vector<Shape> m_shape_list;
 int cur_idx = 0; // represent which model should be rendered now
 
+// a model parsed and simplified on the loader thread, uploaded by the main thread
+struct model_asset
+{
+	vector<GLfloat> vertices;
+	vector<GLfloat> colors;
+	vector<GLuint> lodIndices;	// every level, one after the other
+	int indexCount = 0;
+	MeshLod lods[MAX_LOD_COUNT];
+	int lodCount = 0;
+};
+
+// models are loaded the first time they are shown, on the loader thread, and taken in
+// by the main thread before the next frame (ResolveModels); the plane is drawn until then
+struct model_loading
+{
+	AssetLoader<model_asset> loader;	// by file
+	vector<AssetLoader<model_asset>::Future> pending;	// by model, valid from the request until taken in
+	vector<double> requestTime;
+};
+model_loading modelLoading;
+
+// time to the first frame and to the first model, since the app started
+struct startup_setting
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	double manifestMs = -1;	// --scene parsed
+	double firstFrameMs = -1;	// first frame swapped
+	double modelMs = -1;	// the model shown first is taken in
+};
+startup_setting startup;
+
+double StartupMs()
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - startup.start).count();
+}
+
+// level of detail: picked by the size of the model on screen unless forced with L
+const float LOD_PIXEL_ERROR = 0.5f;	// largest simplification error on screen, in pixels
+int lod_mode = -1;	// -1 auto, else the forced level
+
+// frame time and triangles per LOD, the window title shows the last second. A frame
+// is timed from RenderScene() through the swap, the waits between frames drawn on
+// demand are not counted
+struct lod_stats
+{
+	int level = 0;			// drawn in the last frame
+	float pixels = 0;		// height of the model on screen
+	int frames[MAX_LOD_COUNT] = {};
+	double frameTime[MAX_LOD_COUNT] = {};
+	int intervalFrames = 0;
+	double intervalTime = 0;	// frame time of the frames since intervalStart
+	double intervalStart = 0;
+};
+lod_stats lodStats;
+
 
 static GLvoid Normalize(GLfloat v[3])
 {
@@ -243,7 +324,14 @@ void setViewingMatrix()
 
 	view_matrix = R * T;
 	//cout << view_matrix << endl;
+	view_changed = false;
+}
 
+// rebuild view_matrix if the camera moved since it was built
+void UpdateViewingMatrix()
+{
+	if (view_changed)
+		setViewingMatrix();
 }
 
 // [DONE] compute orthogonal projection matrix
@@ -308,6 +396,9 @@ GLuint VAO, VBO;
 void ChangeSize(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
+	screenWidth = width;
+	screenHeight = height;
+	pacer.requestFrame();
 	// [TODO] change your aspect ratio
 	proj.aspect = (float)width / (float)height;
 	if (cur_proj_mode == Perspective) {
@@ -319,6 +410,13 @@ void ChangeSize(GLFWwindow* window, int width, int height)
 	
 }
 
+// Call back function for an exposed or damaged window, its contents have to be drawn
+// again even when nothing changed
+void RefreshWindow(GLFWwindow* window)
+{
+	pacer.requestFrame();
+}
+
 void drawPlane()
 {
 	// [TODO] draw the plane with above vertices and color
@@ -332,7 +430,7 @@ void drawPlane()
 	mvp[2] = MVP[8];  mvp[6] = MVP[9];   mvp[10] = MVP[10];   mvp[14] = MVP[11];
 	mvp[3] = MVP[12]; mvp[7] = MVP[13];  mvp[11] = MVP[14];   mvp[15] = MVP[15];
 	
-	glBindVertexArray(quad.vao);
+	glBindVertexArray(quad.vao.get());
 	glUniformMatrix4fv(iLocMVP, 1, GL_FALSE, mvp);
 	//GL.begin();
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -340,8 +438,46 @@ void drawPlane()
 	
 }
 
+// Pixels covered by one model unit at the distance of the model, along the model
+// axis which is stretched most in the screen plane
+float PixelsPerUnit(const Matrix4& modelView)
+{
+	float stretch = 0;
+	for (int i = 0; i < 3; i++)
+		stretch = max(stretch, sqrt(modelView[i] * modelView[i] + modelView[4 + i] * modelView[4 + i]));
+
+	float viewportSize = (float)min(screenWidth, screenHeight);
+	if (cur_proj_mode == Orthogonal)
+		return stretch * viewportSize / (proj.top - proj.bottom);
+	float distance = max(-modelView[11], proj.nearClip);
+	return stretch * viewportSize / (2 * distance * tan(proj.fovy / 2 * PI / 180.0f));
+}
+
+// Add the last frame to its level and refresh the window title once a second
+void UpdateLodStats(GLFWwindow* window, double frameTime)
+{
+	lodStats.frames[lodStats.level]++;
+	lodStats.frameTime[lodStats.level] += frameTime;
+	lodStats.intervalFrames++;
+	lodStats.intervalTime += frameTime;
+
+	double now = glfwGetTime();
+	if (now - lodStats.intervalStart >= 1.0)
+	{
+		const Shape& shape = m_shape_list[cur_idx];
+		char title[256];
+		snprintf(title, sizeof(title), "Student ID HW1 | LOD %d%s: %d triangles, %.0f px | %.2f ms/frame", lodStats.level, lod_mode >= 0 ? " (forced)" : "",
+			shape.lods[lodStats.level].indexCount / 3, lodStats.pixels, lodStats.intervalTime * 1000.0 / lodStats.intervalFrames);
+		glfwSetWindowTitle(window, title);
+		lodStats.intervalFrames = 0;
+		lodStats.intervalTime = 0;
+		lodStats.intervalStart = now;
+	}
+}
+
 // Render function for display rendering
 void RenderScene(void) {	
+	UpdateViewingMatrix();
 	// clear canvas
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
@@ -370,18 +506,49 @@ void RenderScene(void) {
 	
 	// use uniform to send mvp to vertex shader
 	glUniformMatrix4fv(iLocMVP, 1, GL_FALSE, mvp);
-	glBindVertexArray(m_shape_list[cur_idx].vao);
+	glBindVertexArray(m_shape_list[cur_idx].vao.get());
+
+	// pick the level whose error stays below LOD_PIXEL_ERROR on screen
+	const Shape& shape = m_shape_list[cur_idx];
+	float pixelsPerUnit = PixelsPerUnit(view_matrix * T * R * S);
+	int level = SelectLod(shape.lods, shape.lodCount, pixelsPerUnit, LOD_PIXEL_ERROR);
+	if (lod_mode >= 0)
+		level = max(min(lod_mode, shape.lodCount - 1), 0);
+	lodStats.level = level;
+	lodStats.pixels = 2 * pixelsPerUnit;
 	
 	glPolygonMode(GL_FRONT_AND_BACK, mode);
-	glDrawArrays(GL_TRIANGLES, 0, m_shape_list[cur_idx].vertex_count);
+	if (shape.lodCount > 0)
+		glDrawElements(GL_TRIANGLES, shape.lods[level].indexCount, GL_UNSIGNED_INT, (void*)(shape.lods[level].indexOffset * sizeof(GLuint)));
 
 	drawPlane();
 
 }
 
 
+// Frames drawn and CPU use since the last print or mode switch
+void PrintFramePacing()
+{
+	FramePacingReport r = pacer.report(glfwGetTime());
+	printf("Frame pacing (%s): %.1f s, %llu frames, %llu idle wakeups, %.1f s waiting (%.0f frames skipped), CPU %.1f%%\n",
+		pacer.isContinuous() ? "continuous" : "on demand", r.seconds, r.frames, r.idleWakeups, r.waitSeconds, r.skippedFrames, r.cpuPercent);
+}
+
+void PrintGpuResources()
+{
+	GpuResourceReport r = gpuResources.report();
+	printf("GPU memory: %.2f MB, peak %.2f MB\n", r.totalBytes / 1048576.0, r.peakBytes / 1048576.0);
+	for (int i = 0; i < GPU_CATEGORIES; i++)
+	{
+		printf("  %-14s %5d objects %9.2f MB\n", GpuResources::categoryName(i), (int)r.count[i], r.bytes[i] / 1048576.0);
+	}
+}
+
+void RequestModel(int idx);
+
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+	pacer.requestFrame();
 	// [DONE] Call back function for keyboard
 	if (key == GLFW_KEY_W && action == GLFW_PRESS) {/* switch between solid and wireframe mode*/
 		if (mode == GL_FILL) {
@@ -395,14 +562,16 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 	else if (key == GLFW_KEY_Z && action == GLFW_PRESS) {/* switch pre model */
 		cur_idx -= 1;
 		if (cur_idx < 0) {
-			cur_idx = 4;
+			cur_idx = model_list.size() - 1;
 		}
+		RequestModel(cur_idx);
 	}
 	else if (key == GLFW_KEY_X && action == GLFW_PRESS) {/* switch post model */
 		cur_idx += 1;
-		if (cur_idx > 4) {
+		if (cur_idx >= model_list.size()) {
 			cur_idx = 0;
 		}
+		RequestModel(cur_idx);
 	}
 	else if (key == GLFW_KEY_O && action == GLFW_PRESS) {/* orthogonal projection */
 		//cur_proj_mode = Orthogonal;
@@ -434,6 +603,7 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 		printf("Matrix Value:\n");
 
 		printf("Viewing Matrix:\n");
+		UpdateViewingMatrix();
 		cout << view_matrix << endl;
 
 		printf("Projectiong Matrix:\n");
@@ -454,6 +624,31 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 		printf("Scaling Matrix:\n");
 		cout << S << endl;
 
+		// frame time per level since the last print
+		const Shape& shape = m_shape_list[cur_idx];
+		printf("LOD (%s, model %.0f px high):\n", lod_mode >= 0 ? "forced" : "auto", lodStats.pixels);
+		for (int i = 0; i < shape.lodCount; i++)
+		{
+			printf("  %d: %6d triangles, error %.2f px, %6d frames, %.3f ms/frame\n", i, shape.lods[i].indexCount / 3,
+				shape.lods[i].error * lodStats.pixels / 2, lodStats.frames[i], lodStats.frames[i] ? lodStats.frameTime[i] * 1000.0 / lodStats.frames[i] : 0.0);
+			lodStats.frames[i] = 0;
+			lodStats.frameTime[i] = 0;
+		}
+		PrintFramePacing();
+		PrintGpuResources();
+	}
+	else if (key == GLFW_KEY_V && action == GLFW_PRESS) {/* switch between render on demand and continuous */
+		PrintFramePacing();
+		pacer.setContinuous(!pacer.isContinuous());
+		pacer.startPeriod(glfwGetTime());
+		printf("Rendering %s\n", pacer.isContinuous() ? "continuously" : "on demand");
+	}
+	else if (key == GLFW_KEY_L && action == GLFW_PRESS) {/* cycle LOD: auto, then every level */
+		lod_mode = (lod_mode + 2 > m_shape_list[cur_idx].lodCount) ? -1 : lod_mode + 1;
+		if (lod_mode < 0)
+			printf("LOD: auto\n");
+		else
+			printf("LOD: level %d\n", lod_mode);
 	}
 
 }
@@ -464,6 +659,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
 	// [DONE] scroll up positive, otherwise it would be negtive
 	//A normal mouse wheel, being vertical, provides offsets along the Y - axis.
+	pacer.requestFrame();
 
 	if (cur_trans_mode == GeoTranslation) {
 		models[cur_idx].position.z += 0.5*yoffset;
@@ -476,12 +672,15 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 	}
 	else if (cur_trans_mode == ViewCenter) {
 		main_camera.center.z += 0.5*yoffset;
+		view_changed = true;
 	}
 	else if (cur_trans_mode == ViewEye) {
 		main_camera.position.z += 0.5*yoffset;
+		view_changed = true;
 	}
 	else if (cur_trans_mode == ViewUp) {
 		main_camera.up_vector.z += 0.5*yoffset;
+		view_changed = true;
 	}
 
 }
@@ -507,6 +706,7 @@ static void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos)
 	starting_press_y = ypos;
 
 	if (mouse_pressed) {
+		pacer.requestFrame();
 		if (cur_trans_mode == GeoTranslation) {
 			models[cur_idx].position.x += 0.01*xoffset;
 			models[cur_idx].position.y += 0.01*yoffset;
@@ -522,17 +722,18 @@ static void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos)
 		else if (cur_trans_mode == ViewCenter) {
 			main_camera.center.x += 0.01*xoffset;
 			main_camera.center.y += 0.01*yoffset;
-			setViewingMatrix();
+			// many cursor events come per frame, the matrix is rebuilt once in RenderScene
+			view_changed = true;
 		}
 		else if (cur_trans_mode == ViewEye) {
 			main_camera.position.x += 0.01*xoffset;
 			main_camera.position.y += 0.01*yoffset;
-			setViewingMatrix();
+			view_changed = true;
 		}
 		else if (cur_trans_mode == ViewUp) {
 			main_camera.up_vector.x += 0.01*xoffset;
 			main_camera.up_vector.y += 0.01*yoffset;
-			setViewingMatrix();
+			view_changed = true;
 		}
 	}
 
@@ -607,137 +808,23 @@ void setShaders()
         system("pause");
         exit(123);
     }
+	programObject = gpuResources.adoptProgram(p);
 }
 
-void normalization(tinyobj::attrib_t* attrib, vector<GLfloat>& vertices, vector<GLfloat>& colors, tinyobj::shape_t* shape)
-{
-	vector<float> xVector, yVector, zVector;
-	float minX = 10000, maxX = -10000, minY = 10000, maxY = -10000, minZ = 10000, maxZ = -10000;
-
-	// find out min and max value of X, Y and Z axis
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		//maxs = max(maxs, attrib->vertices.at(i));
-		if (i % 3 == 0)
-		{
-
-			xVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minX)
-			{
-				minX = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxX)
-			{
-				maxX = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 1)
-		{
-			yVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minY)
-			{
-				minY = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxY)
-			{
-				maxY = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 2)
-		{
-			zVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minZ)
-			{
-				minZ = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxZ)
-			{
-				maxZ = attrib->vertices.at(i);
-			}
-		}
-	}
-
-	float offsetX = (maxX + minX) / 2;
-	float offsetY = (maxY + minY) / 2;
-	float offsetZ = (maxZ + minZ) / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		if (offsetX != 0 && i % 3 == 0)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetX;
-		}
-		else if (offsetY != 0 && i % 3 == 1)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetY;
-		}
-		else if (offsetZ != 0 && i % 3 == 2)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetZ;
-		}
-	}
-
-	float greatestAxis = maxX - minX;
-	float distanceOfYAxis = maxY - minY;
-	float distanceOfZAxis = maxZ - minZ;
-
-	if (distanceOfYAxis > greatestAxis)
-	{
-		greatestAxis = distanceOfYAxis;
-	}
-
-	if (distanceOfZAxis > greatestAxis)
-	{
-		greatestAxis = distanceOfZAxis;
-	}
-
-	float scale = greatestAxis / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		//std::cout << i << " = " << (double)(attrib.vertices.at(i) / greatestAxis) << std::endl;
-		attrib->vertices.at(i) = attrib->vertices.at(i)/ scale;
-	}
-	size_t index_offset = 0;
-	vertices.reserve(shape->mesh.num_face_vertices.size() * 3);
-	colors.reserve(shape->mesh.num_face_vertices.size() * 3);
-	for (size_t f = 0; f < shape->mesh.num_face_vertices.size(); f++) {
-		int fv = shape->mesh.num_face_vertices[f];
-
-		// Loop over vertices in the face.
-		for (size_t v = 0; v < fv; v++) {
-			// access to vertex
-			tinyobj::index_t idx = shape->mesh.indices[index_offset + v];
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 0]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 1]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 2]);
-			// Optional: vertex colors
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 0]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 1]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 2]);
-		}
-		index_offset += fv;
-	}
-}
-
-void LoadModels(string model_path)
+// Parse, optimize and simplify model_path into asset, on the loader thread
+bool LoadModels(string model_path, model_asset* asset)
 {
-	vector<tinyobj::shape_t> shapes;
-	vector<tinyobj::material_t> materials;
-	tinyobj::attrib_t attrib;
-	vector<GLfloat> vertices;
-	vector<GLfloat> colors;
+	ObjMesh mesh;
+	ObjLoadStats stats;
+	// temporaries live in loadArena, which is reset after the load
+	LoadArenaVector<GLfloat> vertices(&loadArena);
+	LoadArenaVector<GLfloat> colors(&loadArena);
 
 	string err;
 	string warn;
 
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, model_path.c_str());
+	// parse, find the bounding box and normalize in one go
+	bool ret = LoadObjMeshParallel(model_path, "", &mesh, &warn, &err, &stats);
 
 	if (!warn.empty()) {
 		cout << warn << std::endl;
@@ -747,39 +834,160 @@ void LoadModels(string model_path)
 		cerr << err << std::endl;
 	}
 
-	if (!ret) {
-		exit(1);
+	if (!ret || mesh.groups.empty()) {
+		return false;
 	}
 
-	printf("Load Models Success ! Shapes size %d Maerial size %d\n", shapes.size(), materials.size());
-	
-	normalization(&attrib, vertices, colors, &shapes[0]);
+	printf("Load Models Success ! Shapes size %d Maerial size %d\n", int(mesh.groups.size()), int(mesh.materials.size()));
+	printf("  %.2f MB, parse %.2f ms, normalize %.2f ms, peak memory %.2f MB\n", stats.fileBytes / 1048576.0,
+		stats.parseMs, stats.normalizeMs, stats.peakMemoryBytes / 1048576.0);
+
+	FlattenObjGroup(mesh, 0, &vertices, &colors, NULL, NULL, NULL);
+	// indexed and reordered for the vertex cache, overdraw and vertex fetch
+	LoadArenaVector<GLuint> indices(&loadArena);
+	MeshOptimizeStats optimizeStats = OptimizeTriangleList(&vertices, &colors, NULL, NULL, &indices);
+	printf("  vertex cache (%d entry FIFO): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %d vertices welded to %d, %d clusters, %.2f ms\n",
+		VERTEX_CACHE_SIZE, optimizeStats.acmrBefore(), optimizeStats.acmrAfter(), optimizeStats.atvrBefore(), optimizeStats.atvrAfter(),
+		(int)optimizeStats.triangles * 3, (int)optimizeStats.vertices, (int)optimizeStats.clusters, optimizeStats.optimizeMs);
+
+	// simplified levels follow the full mesh in the same element buffer
+	LoadArenaVector<GLuint> lodIndices(&loadArena);
+	MeshSimplifyStats simplifyStats;
+	asset->lodCount = BuildLodChain(vertices, indices, &lodIndices, asset->lods, &simplifyStats);
+	printf("  LOD:");
+	for (int i = 0; i < asset->lodCount; i++)
+		printf(" %d triangles (error %.4f)%s", asset->lods[i].indexCount / 3, asset->lods[i].error, i + 1 < asset->lodCount ? "," : "");
+	printf(", %d collapses in %d passes, %.2f ms\n", (int)simplifyStats.collapses, simplifyStats.passes, simplifyStats.simplifyMs);
+
+	// out of the arena, which is reset once the load returns
+	asset->vertices.assign(vertices.begin(), vertices.end());
+	asset->colors.assign(colors.begin(), colors.end());
+	asset->lodIndices.assign(lodIndices.begin(), lodIndices.end());
+	asset->indexCount = indices.size();
+	return true;
+}
+
+shared_ptr<model_asset> LoadModelAsset(const string& model_path)
+{
+	shared_ptr<model_asset> asset(new model_asset());
+	bool loaded = LoadModels(model_path, asset.get());
+	// the temporaries of the load are dead now, drop them all at once
+	const LoadArenaStats& arenaStats = loadArena.getStats();
+	printf("  temporaries: %d allocations, %.2f MB, %d heap blocks\n", (int)arenaStats.allocations,
+		arenaStats.bytes / 1048576.0, (int)arenaStats.heapBlocks);
+	loadArena.reset();
+	return loaded ? asset : shared_ptr<model_asset>();
+}
 
+// Upload a loaded model into m_shape_list[idx]
+void AdoptModel(int idx, const model_asset& asset)
+{
 	Shape tmp_shape;
-	glGenVertexArrays(1, &tmp_shape.vao);
-	glBindVertexArray(tmp_shape.vao);
+	tmp_shape.lodCount = asset.lodCount;
+	memcpy(tmp_shape.lods, asset.lods, sizeof(tmp_shape.lods));
+
+	tmp_shape.vao = gpuResources.createVertexArray();
+	glBindVertexArray(tmp_shape.vao.get());
 
-	glGenBuffers(1, &tmp_shape.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.vbo);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GL_FLOAT), &vertices.at(0), GL_STATIC_DRAW);
+	tmp_shape.vbo = gpuResources.createBuffer(GPU_GEOMETRY);
+	GpuBufferData(GL_ARRAY_BUFFER, tmp_shape.vbo, asset.vertices.size() * sizeof(GLfloat), &asset.vertices.at(0), GL_STATIC_DRAW);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	tmp_shape.vertex_count = vertices.size() / 3;
+	tmp_shape.vertex_count = asset.vertices.size() / 3;
 
-	glGenBuffers(1, &tmp_shape.p_color);
-	glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_color);
-	glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(GL_FLOAT), &colors.at(0), GL_STATIC_DRAW);
+	tmp_shape.p_color = gpuResources.createBuffer(GPU_GEOMETRY);
+	GpuBufferData(GL_ARRAY_BUFFER, tmp_shape.p_color, asset.colors.size() * sizeof(GLfloat), &asset.colors.at(0), GL_STATIC_DRAW);
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-	m_shape_list.push_back(tmp_shape);
-	model tmp_model;
-	models.push_back(tmp_model);
+	tmp_shape.ebo = gpuResources.createBuffer(GPU_GEOMETRY);
+	GpuBufferData(GL_ELEMENT_ARRAY_BUFFER, tmp_shape.ebo, asset.lodIndices.size() * sizeof(GLuint), &asset.lodIndices.at(0), GL_STATIC_DRAW);
+	tmp_shape.indexCount = asset.indexCount;
+
+	m_shape_list[idx] = std::move(tmp_shape);
 
 
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
+}
 
-	shapes.clear();
-	materials.clear();
+// Queue the load of model_list[idx] the first time it is shown; Z / X and the golden
+// images get to the others. A model that cannot be loaded is not tried again
+void RequestModel(int idx)
+{
+	if (models[idx].loaded || modelLoading.pending[idx].valid())
+		return;
+	string path = model_list[idx];
+	modelLoading.requestTime[idx] = glfwGetTime();
+	modelLoading.pending[idx] = modelLoading.loader.request(path, [path] { return LoadModelAsset(path); });
+}
+
+// On the main thread before a frame: take in the models loaded since the last one,
+// true if there was one
+bool ResolveModels()
+{
+	bool taken = false;
+	for (int m = 0; m < models.size(); m++)
+	{
+		AssetLoader<model_asset>::Future& pending = modelLoading.pending[m];
+		if (!pending.valid() || pending.wait_for(chrono::seconds(0)) != future_status::ready)
+			continue;
+		shared_ptr<model_asset> asset = pending.get();
+		pending = AssetLoader<model_asset>::Future();
+		double ms = (glfwGetTime() - modelLoading.requestTime[m]) * 1000.0;
+		models[m].loaded = true;
+		taken = true;
+		if (asset)
+		{
+			AdoptModel(m, *asset);
+			printf("Loaded %s on first use, %.2f ms after the request\n", model_list[m].c_str(), ms);
+		}
+		else
+			printf("Cannot load %s, only the plane is drawn\n", model_list[m].c_str());
+		if (startup.modelMs < 0)
+		{
+			startup.modelMs = StartupMs();
+			printf("Startup: the model shown first was taken in %.2f ms after start\n", startup.modelMs);
+		}
+	}
+	return taken;
+}
+
+// Load model_list[idx] now, for the golden images
+void WaitForModel(int idx)
+{
+	RequestModel(idx);
+	if (modelLoading.pending[idx].valid())
+		modelLoading.pending[idx].wait();
+	ResolveModels();
+}
+
+// The time from the start of the app to the first frame swapped, once
+void StartupFrameShown()
+{
+	if (startup.firstFrameMs >= 0)
+		return;
+	startup.firstFrameMs = StartupMs();
+	if (startup.manifestMs >= 0)
+		printf("Startup: manifest parsed %.2f ms, first frame drawn %.2f ms after start\n", startup.manifestMs, startup.firstFrameMs);
+	else
+		printf("Startup: first frame drawn %.2f ms after start\n", startup.firstFrameMs);
+}
+
+// Camera and projection of the --scene manifest; HW1 has no lights or textures and
+// shows one model at a time, so the instances are not used either
+void ApplySceneManifest()
+{
+	if (sceneManifest.hasCamera)
+	{
+		main_camera.position = Vector3(sceneManifest.cameraPosition[0], sceneManifest.cameraPosition[1], sceneManifest.cameraPosition[2]);
+		main_camera.center = Vector3(sceneManifest.cameraCenter[0], sceneManifest.cameraCenter[1], sceneManifest.cameraCenter[2]);
+		main_camera.up_vector = Vector3(sceneManifest.cameraUp[0], sceneManifest.cameraUp[1], sceneManifest.cameraUp[2]);
+		setViewingMatrix();
+	}
+	proj.fovy = sceneManifest.fovy > 0 ? sceneManifest.fovy : proj.fovy;
+	if (sceneManifest.projection == Orthogonal)
+		setOrthogonal();
+	else
+		setPerspective();
 }
 
 void initParameter()
@@ -826,29 +1034,44 @@ void setupRC()
 		0.0,0.5,0.8,
 		0.0,1.0,0.0 };
 
-	glGenVertexArrays(1, &quad.vao);
-	glGenBuffers(1, &quad.vbo);
+	quad.vao = gpuResources.createVertexArray();
+	quad.vbo = gpuResources.createBuffer(GPU_GEOMETRY);
 
-	glBindVertexArray(quad.vao);
+	glBindVertexArray(quad.vao.get());
 
-	glBindBuffer(GL_ARRAY_BUFFER, quad.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	GpuBufferData(GL_ARRAY_BUFFER, quad.vbo, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 	glEnableVertexAttribArray(0);
 
-	glGenBuffers(1, &quad.p_color);
-	glBindBuffer(GL_ARRAY_BUFFER, quad.p_color);
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(colors), colors, GL_STATIC_DRAW);
+	quad.p_color = gpuResources.createBuffer(GPU_GEOMETRY);
+	GpuBufferData(GL_ARRAY_BUFFER, quad.p_color, sizeof(colors), colors, GL_STATIC_DRAW);
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 	glEnableVertexAttribArray(1);
 
-	vector<string> model_list{ "../ColorModels/bunny5KC.obj", "../ColorModels/dragon10KC.obj", "../ColorModels/lucy25KC.obj", "../ColorModels/teapot4KC.obj", "../ColorModels/dolphinC.obj"};
+	if (!sceneManifest.meshes.empty())
+		ApplySceneManifest();
+
 	// [DONE] Load five model at here
-	for (int i = 0; i <= 4; i++) {
-		LoadModels(model_list[i]);
-	}
+	// only the one shown first, the others once they are switched to
+	m_shape_list.resize(model_list.size());
+	models.resize(model_list.size());
+	modelLoading.pending.resize(model_list.size());
+	modelLoading.requestTime.assign(model_list.size(), 0);
+	// a finished load wakes the main loop up to take the model in
+	modelLoading.loader.setListener(glfwPostEmptyEvent);
+	RequestModel(cur_idx);
+}
+
+// Delete every GL object while the context is still current
+void ReleaseGpuResources()
+{
+	// no load may finish into the shapes being deleted
+	modelLoading.loader.stop();
+	m_shape_list.clear();
+	quad = Shape();
+	programObject.reset();
+	gpuResources.closeContext();
 }
 
 void glPrintContextInfo(bool printExtension)
@@ -869,9 +1092,254 @@ void glPrintContextInfo(bool printExtension)
 	}
 }
 
+// Golden image regression test:
+//     --golden record|check <dir> [gl [min PSNR]]
+// renders every model of model_list with both projections, filled and as
+// wireframe, into a framebuffer object of a hidden window and writes PNGs to
+// dir. check compares with them and fails below min PSNR (40 dB by default),
+// the image of a failed case is kept next to its golden one. It runs headless
+// on Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1).
+struct GoldenOptions
+{
+	bool record;
+	string dir;
+	double minPsnr;
+};
+
+// false after printing the usage when the arguments are not record|check <dir> [gl [min PSNR]]
+bool ParseGoldenArguments(int argc, char **argv, GoldenOptions* options)
+{
+	string command = (argc > 2) ? argv[2] : "";
+	string backend = (argc > 4) ? argv[4] : "gl";
+	options->record = command == "record";
+	options->dir = (argc > 3) ? argv[3] : "";
+	options->minPsnr = (argc > 5) ? atof(argv[5]) : 40.0;
+	if ((command != "record" && command != "check") || options->dir.empty() || backend != "gl" || options->minPsnr <= 0)
+	{
+		printf("Usage: --golden record|check <dir> [gl [min PSNR]]\n");
+		return false;
+	}
+	return true;
+}
+
+// file name of model_list[model] without directory and extension
+string ModelName(int model)
+{
+	string base = model_list[model];
+	size_t slash = base.find_last_of("/\\");
+	if (slash != string::npos)
+		base = base.substr(slash + 1);
+	return base.substr(0, base.find_last_of('.'));
+}
+
+// RGBA8 of a PNG written by WritePng(), top row first
+bool ReadGoldenImage(const string& path, vector<unsigned char>* rgba, int width, int height)
+{
+	int imageWidth, imageHeight, channels;
+	stbi_set_flip_vertically_on_load(false);
+	stbi_uc* data = stbi_load(path.c_str(), &imageWidth, &imageHeight, &channels, 4);
+	if (!data)
+		return false;
+	bool sameSize = imageWidth == width && imageHeight == height;
+	if (sameSize)
+		rgba->assign(data, data + (size_t)width * height * 4);
+	stbi_image_free(data);
+	return sameSize;
+}
+
+// PSNR of the RGB of two RGBA8 images, offShare: part of the pixels with a channel off by more than 8
+double CompareImages(const vector<unsigned char>& a, const vector<unsigned char>& b, double* offShare)
+{
+	double squared = 0;
+	size_t off = 0, pixels = a.size() / 4;
+	for (size_t i = 0; i < pixels; i++)
+	{
+		int maxDifference = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			int difference = abs((int)a[i * 4 + k] - (int)b[i * 4 + k]);
+			squared += difference * difference;
+			maxDifference = max(maxDifference, difference);
+		}
+		off += (maxDifference > 8) ? 1 : 0;
+	}
+	*offShare = pixels ? (double)off / pixels : 0;
+	double mse = squared / max(pixels * 3, (size_t)1);
+	return (mse > 0) ? 10.0 * log10(255.0 * 255.0 / mse) : 1e9;
+}
+
+// record the image or compare it with the golden one, print its line; false when it failed
+bool RecordOrCheckImage(const GoldenOptions& options, const string& name, const vector<unsigned char>& image, int width, int height, double ms)
+{
+	string path = options.dir + "/" + name;
+	if (options.record)
+	{
+		bool written = WritePng(path, image, width, height);
+		printf("  %-44s %10.2f %10s %8s  %s\n", name.c_str(), ms, "", "", written ? "recorded" : "CANNOT WRITE");
+		return written;
+	}
+	vector<unsigned char> golden;
+	if (!ReadGoldenImage(path, &golden, width, height))
+	{
+		WritePng(path + ".actual.png", image, width, height);
+		printf("  %-44s %10.2f %10s %8s  MISSING\n", name.c_str(), ms, "", "");
+		return false;
+	}
+	double offShare;
+	double psnr = CompareImages(image, golden, &offShare);
+	bool pass = psnr >= options.minPsnr;
+	if (pass)
+		remove((path + ".actual.png").c_str());
+	else
+		WritePng(path + ".actual.png", image, width, height);
+	printf("  %-44s %10.2f %10.2f %8.3f  %s\n", name.c_str(), ms, min(psnr, 999.99), offShare * 100.0, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Bind a new framebuffer object of width x height, RGBA8 color with depth and stencil
+bool CreateOffscreenFramebuffer(int width, int height, GLuint* framebuffer, GLuint renderbuffers[2])
+{
+	glGenFramebuffers(1, framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void DeleteOffscreenFramebuffer(GLuint framebuffer, const GLuint renderbuffers[2])
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(2, renderbuffers);
+}
+
+// RGBA8 of the bound framebuffer, top row first
+vector<unsigned char> ReadFramebuffer(int width, int height)
+{
+	vector<unsigned char> rows((size_t)width * height * 4), image(rows.size());
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &rows[0]);
+	for (int y = 0; y < height; y++)
+	{
+		memcpy(&image[(size_t)y * width * 4], &rows[(size_t)(height - 1 - y) * width * 4], (size_t)width * 4);
+	}
+	return image;
+}
+
+string GoldenName(int model, ProjMode projection, GLenum polygonMode)
+{
+	return "gl_" + ModelName(model) + "_" + (projection == Orthogonal ? "ortho" : "persp") + "_" + (polygonMode == GL_FILL ? "fill" : "line") + ".png";
+}
+
+int RunGoldenImages(const GoldenOptions& options)
+{
+	int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+	GLuint framebuffer = 0, renderbuffers[2] = { 0, 0 };
+	if (!CreateOffscreenFramebuffer(width, height, &framebuffer, renderbuffers))
+	{
+		printf("Cannot create the offscreen framebuffer\n");
+		return 1;
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	ChangeSize(NULL, width, height);
+
+	printf("Golden images, %dx%d, %s %s, min PSNR %.1f dB\n", width, height,
+		options.record ? "recording to" : "checking against", options.dir.c_str(), options.minPsnr);
+	printf("  %-44s %10s %10s %8s\n", "image", "frame(ms)", "PSNR(dB)", "off(%)");
+	int images = 0, failed = 0;
+	double totalMs = 0;
+	ProjMode projections[] = { Orthogonal, Perspective };
+	GLenum polygonModes[] = { GL_FILL, GL_LINE };
+	for (int m = 0; m < model_list.size(); m++)
+	{
+		cur_idx = m;
+		WaitForModel(m);
+		for (int p = 0; p < 2; p++)
+		{
+			if (projections[p] == Orthogonal)
+				setOrthogonal();
+			else
+				setPerspective();
+			for (int w = 0; w < 2; w++)
+			{
+				mode = polygonModes[w];
+				glFinish();
+				double start = glfwGetTime();
+				RenderScene();
+				glFinish();
+				double ms = (glfwGetTime() - start) * 1000.0;
+				totalMs += ms;
+				images++;
+				if (!RecordOrCheckImage(options, GoldenName(m, projections[p], mode), ReadFramebuffer(width, height), width, height, ms))
+					failed++;
+			}
+		}
+	}
+	mode = GL_FILL;
+	DeleteOffscreenFramebuffer(framebuffer, renderbuffers);
+	printf("%d images, %d %s, %.2f ms per frame, %.2f ms total\n", images, failed, options.record ? "not written" : "failed",
+		totalMs / max(images, 1), totalMs);
+	return failed ? 1 : 0;
+}
+
+bool HasArgument(int argc, char **argv, const char* argument)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (string(argv[i]) == argument)
+			return true;
+	}
+	return false;
+}
+
+// the argument after name, or fallback
+const char* ArgumentValue(int argc, char **argv, const char* name, const char* fallback)
+{
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (string(argv[i]) == name)
+			return argv[i + 1];
+	}
+	return fallback;
+}
 
 int main(int argc, char **argv)
 {
+	// loader validation and benchmark, runs without a window
+	if (argc > 1 && string(argv[1]) == "--bench-loader")
+		return RunLoaderBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	if (argc > 1 && string(argv[1]) == "--bench-normals")
+		return RunNormalsBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	// golden image regression test, in a hidden window
+	bool golden = argc > 1 && string(argv[1]) == "--golden";
+	GoldenOptions goldenOptions;
+	if (golden && !ParseGoldenArguments(argc, argv, &goldenOptions))
+		return 1;
+	// --scene <manifest.json> replaces model_list and sets the camera, the models are
+	// still loaded once they are shown
+	const char* manifestPath = ArgumentValue(argc, argv, "--scene", NULL);
+	if (manifestPath && !golden)
+	{
+		string err;
+		if (!LoadSceneManifest(manifestPath, &sceneManifest, &err))
+		{
+			printf("Cannot read the scene: %s\n", err.c_str());
+			return 1;
+		}
+		model_list.clear();
+		for (int i = 0; i < sceneManifest.meshes.size(); i++)
+		{
+			model_list.push_back(sceneManifest.meshes[i].file);
+		}
+		startup.manifestMs = StartupMs();
+		printf("Scene %s: %d meshes, parsed in %.2f ms, %.2f ms after start\n", manifestPath, (int)sceneManifest.meshes.size(),
+			sceneManifest.parseMs, startup.manifestMs);
+	}
+
     // initial glfw
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -881,6 +1349,10 @@ int main(int argc, char **argv)
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // fix compilation on OS X
 #endif
+	if (golden)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
 
     
     // create window
@@ -908,22 +1380,51 @@ int main(int argc, char **argv)
 	glfwSetCursorPosCallback(window, cursor_pos_callback);
 
     glfwSetFramebufferSizeCallback(window, ChangeSize);
+    glfwSetWindowRefreshCallback(window, RefreshWindow);
 	glEnable(GL_DEPTH_TEST);
 	// Setup render context
 	setupRC();
+	if (golden)
+	{
+		int result = RunGoldenImages(goldenOptions);
+		ReleaseGpuResources();
+		return result;
+	}
+
+	// --continuous draws every iteration, for benchmarks
+	pacer.setContinuous(HasArgument(argc, argv, "--continuous"));
+	const GLFWvidmode* videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	pacer.setRefreshRate(videoMode ? videoMode->refreshRate : 60);
+	pacer.startPeriod(glfwGetTime());
 
 	// main loop
     while (!glfwWindowShouldClose(window))
     {
+		if (ResolveModels())
+			pacer.requestFrame();
+		// sleep until an event changes what is shown
+		if (!pacer.shouldDraw())
+		{
+			double waitStart = glfwGetTime();
+			glfwWaitEventsTimeout(FRAME_WAIT_TIMEOUT);
+			pacer.waited(glfwGetTime() - waitStart, pacer.shouldDraw());
+			continue;
+		}
+
         // render
+		double frameStart = glfwGetTime();
         RenderScene();
         
         // swap buffer from back to front
         glfwSwapBuffers(window);
+		pacer.frameDrawn();
+		UpdateLodStats(window, glfwGetTime() - frameStart);
+		StartupFrameShown();
         
         // Poll input event
         glfwPollEvents();
     }
+	ReleaseGpuResources();
 	
 	// just for compatibiliy purposes
 	return 0;
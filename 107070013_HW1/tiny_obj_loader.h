@@ -396,6 +396,11 @@ struct attrib_t {
 struct callback_t {
   // W is optional and set to 1 if there is no `w` item in `v` line
   void (*vertex_cb)(void *user_data, real_t x, real_t y, real_t z, real_t w);
+  // Extension: when set, called instead of `vertex_cb` with the optional
+  // vertex color(`v x y z r g b`). r, g and b are set to 1 if there is no
+  // color.
+  void (*vertex_color_cb)(void *user_data, real_t x, real_t y, real_t z,
+                          real_t r, real_t g, real_t b);
   void (*normal_cb)(void *user_data, real_t x, real_t y, real_t z);
 
   // y and z are optional and set to 0 if there is no `y` and/or `z` item(s) in
@@ -419,6 +424,7 @@ struct callback_t {
 
   callback_t()
       : vertex_cb(NULL),
+        vertex_color_cb(NULL),
         normal_cb(NULL),
         texcoord_cb(NULL),
         index_cb(NULL),
@@ -586,6 +592,30 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
                          MaterialReader *readMatFn = NULL,
                          std::string *warn = NULL, std::string *err = NULL);
 
+/// Same as above, but parses `len` bytes of memory (e.g. a memory mapped
+/// file or one chunk of it). The buffer does not need to be null terminated.
+/// Lines end at '\n', '\r\n' or '\r', like safeGetline().
+bool LoadObjWithCallback(const char *buf, size_t len,
+                         const callback_t &callback, void *user_data = NULL,
+                         MaterialReader *readMatFn = NULL,
+                         std::string *warn = NULL, std::string *err = NULL);
+
+/// Line index of a buffer, filled by ScanLines().
+struct line_index_t {
+  std::vector<unsigned int> token_begin;  // first non-space character
+  std::vector<unsigned int> line_end;     // '\n', '\r' or the buffer end
+};
+
+/// Structural index of `len` (< 4GB) bytes of .obj text, in the style of
+/// simdjson stage 1: newlines and spaces are classified 64 bytes at a time
+/// (AVX2 or SSE2 when the compiler targets them) and turned into the offsets
+/// of every line which has at least one token. Blank lines are left out.
+/// A last line without line ending is only returned when `at_end` is true.
+/// Returns the number of bytes covered by the index, i.e. where the next
+/// call should continue.
+size_t ScanLines(const char *buf, size_t len, bool at_end,
+                 line_index_t *index);
+
 /// Loads object from a std::istream, uses `readMatFn` to retrieve
 /// std::istream for materials.
 /// Returns true when loading .obj become success.
@@ -628,6 +658,19 @@ bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
 #include <limits>
 #include <utility>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define TINYOBJ_SCAN_AVX2
+#include <immintrin.h>
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+    defined(__SSE2__)
+#define TINYOBJ_SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
 #include <fstream>
 #include <sstream>
 
@@ -739,6 +782,230 @@ static std::istream &safeGetline(std::istream &is, std::string &t) {
   return is;
 }
 
+static inline int countTrailingZeros64(unsigned long long x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  unsigned long bit;
+  _BitScanForward64(&bit, x);
+  return static_cast<int>(bit);
+#elif defined(_MSC_VER)
+  unsigned long bit;
+  if (_BitScanForward(&bit, static_cast<unsigned long>(x)))
+    return static_cast<int>(bit);
+  _BitScanForward(&bit, static_cast<unsigned long>(x >> 32));
+  return static_cast<int>(bit) + 32;
+#else
+  int n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// Bit i of *newline / *space is set when p[i] is '\n' or '\r' / ' ' or '\t'.
+static inline void classifyBlock64Scalar(const char *p,
+                                         unsigned long long *newline,
+                                         unsigned long long *space) {
+  unsigned long long nl = 0, sp = 0;
+  for (int i = 0; i < 64; i++) {
+    nl |= static_cast<unsigned long long>(p[i] == '\n' || p[i] == '\r') << i;
+    sp |= static_cast<unsigned long long>(p[i] == ' ' || p[i] == '\t') << i;
+  }
+  *newline = nl;
+  *space = sp;
+}
+
+#if defined(TINYOBJ_SCAN_AVX2)
+static inline void classifyBlock64(const char *p, unsigned long long *newline,
+                                   unsigned long long *space) {
+  const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+  unsigned int nl_lo = static_cast<unsigned int>(_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, lf), _mm256_cmpeq_epi8(lo, cr))));
+  unsigned int nl_hi = static_cast<unsigned int>(_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, lf), _mm256_cmpeq_epi8(hi, cr))));
+  unsigned int sp_lo = static_cast<unsigned int>(_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, sp), _mm256_cmpeq_epi8(lo, tab))));
+  unsigned int sp_hi = static_cast<unsigned int>(_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, sp), _mm256_cmpeq_epi8(hi, tab))));
+  *newline = nl_lo | (static_cast<unsigned long long>(nl_hi) << 32);
+  *space = sp_lo | (static_cast<unsigned long long>(sp_hi) << 32);
+}
+#elif defined(TINYOBJ_SCAN_SSE2)
+static inline void classifyBlock64(const char *p, unsigned long long *newline,
+                                   unsigned long long *space) {
+  const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  unsigned long long nl = 0, spaces = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+    unsigned long long n = static_cast<unsigned int>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr))));
+    unsigned long long s = static_cast<unsigned int>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab))));
+    nl |= n << (16 * i);
+    spaces |= s << (16 * i);
+  }
+  *newline = nl;
+  *space = spaces;
+}
+#else
+static inline void classifyBlock64(const char *p, unsigned long long *newline,
+                                   unsigned long long *space) {
+  classifyBlock64Scalar(p, newline, space);
+}
+#endif
+
+// Stage 2: walks the token starts and line ends of the bit masks in order.
+// `Classify` is classifyBlock64 or classifyBlock64Scalar (for benchmarks).
+template <void (*Classify)(const char *, unsigned long long *,
+                           unsigned long long *)>
+static size_t scanLinesWith(const char *buf, size_t len, bool at_end,
+                            line_index_t *index) {
+  index->token_begin.clear();
+  index->line_end.clear();
+
+  unsigned long long prev_separator = 1;  // the buffer starts a line
+  bool in_line = false;
+  size_t consumed = 0;
+  for (size_t block = 0; block < len; block += 64) {
+    unsigned long long newline, space;
+    if (block + 64 <= len) {
+      Classify(buf + block, &newline, &space);
+    } else {
+      // the tail is padded with spaces, which are neither tokens nor lines
+      char tail[64];
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, buf + block, len - block);
+      Classify(tail, &newline, &space);
+    }
+
+    // a token starts at a non-separator which follows a separator
+    unsigned long long separator = newline | space;
+    unsigned long long token_start =
+        ~separator & ((separator << 1) | prev_separator);
+    prev_separator = separator >> 63;
+
+    unsigned long long events = token_start | newline;
+    while (events) {
+      int bit = countTrailingZeros64(events);
+      events &= events - 1;
+      unsigned int pos = static_cast<unsigned int>(block + bit);
+      if ((newline >> bit) & 1) {
+        if (in_line) {
+          index->line_end.push_back(pos);
+          in_line = false;
+        }
+        consumed = pos + 1;
+      } else if (!in_line) {
+        index->token_begin.push_back(pos);
+        in_line = true;
+      }
+    }
+  }
+
+  if (at_end) {
+    if (in_line) index->line_end.push_back(static_cast<unsigned int>(len));
+    return len;
+  }
+  if (in_line) index->token_begin.pop_back();
+  return consumed;
+}
+
+size_t ScanLines(const char *buf, size_t len, bool at_end,
+                 line_index_t *index) {
+  return scanLinesWith<classifyBlock64>(buf, len, at_end, index);
+}
+
+// Line sources of LoadObjWithCallback.
+static const size_t kLineWindow = 64 * 1024;
+
+// Reads the stream one window at a time and takes the lines from the
+// ScanLines() index of it. A line cut by the window end is kept for the next
+// read, so a line longer than a window just spans more reads.
+struct StreamLineReader {
+  explicit StreamLineReader(std::istream &is)
+      : is_(is), scanned_(0), line_(0), eof_(false) {}
+
+  bool next(std::string &t) {
+    while (line_ >= index_.line_end.size()) {
+      if (!read()) return false;
+    }
+    t.assign(buf_.data() + index_.token_begin[line_],
+             buf_.data() + index_.line_end[line_]);
+    line_++;
+    return true;
+  }
+
+  bool read() {
+    if (eof_ && scanned_ >= buf_.size()) return false;
+    buf_.erase(buf_.begin(), buf_.begin() + static_cast<long>(scanned_));
+    if (!eof_) {
+      size_t kept = buf_.size();
+      buf_.resize(kept + kLineWindow);
+      is_.read(&buf_[kept], static_cast<std::streamsize>(kLineWindow));
+      size_t got = static_cast<size_t>(is_.gcount());
+      buf_.resize(kept + got);
+      eof_ = (got < kLineWindow);
+    }
+    scanned_ = ScanLines(buf_.data(), buf_.size(), eof_, &index_);
+    line_ = 0;
+    return true;
+  }
+
+  std::istream &is_;
+  std::vector<char> buf_;
+  line_index_t index_;
+  size_t scanned_;
+  size_t line_;
+  bool eof_;
+};
+
+// Takes the lines from the ScanLines() index of one window of the buffer at
+// a time and copies each line once, without its leading whitespace.
+struct MemoryLineReader {
+  MemoryLineReader(const char *begin, const char *end)
+      : base_(begin), cur_(begin), end_(end), line_(0) {}
+
+  bool next(std::string &t) {
+    while (line_ >= index_.line_end.size()) {
+      if (cur_ >= end_) return false;
+      scanWindow();
+    }
+    t.assign(base_ + index_.token_begin[line_], base_ + index_.line_end[line_]);
+    line_++;
+    return true;
+  }
+
+  void scanWindow() {
+    size_t window = kLineWindow;
+    for (;;) {
+      size_t len = static_cast<size_t>(end_ - cur_);
+      bool at_end = (len <= window);
+      if (!at_end) len = window;
+      size_t consumed = ScanLines(cur_, len, at_end, &index_);
+      if (consumed > 0) {
+        base_ = cur_;
+        cur_ += consumed;
+        line_ = 0;
+        return;
+      }
+      window *= 2;  // a line longer than the window
+    }
+  }
+
+  const char *base_;
+  const char *cur_;
+  const char *end_;
+  line_index_t index_;
+  size_t line_;
+};
+
 #define IS_SPACE(x) (((x) == ' ') || ((x) == '\t'))
 #define IS_DIGIT(x) \
   (static_cast<unsigned int>((x) - '0') < static_cast<unsigned int>(10))
@@ -784,6 +1051,104 @@ static inline int parseInt(const char **token) {
   return i;
 }
 
+// Number of zero bytes appended to each line, so that the number parsers can
+// always load 8 bytes at once.
+#define TINYOBJ_LINE_PADDING 8
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86) || defined(__aarch64__) || defined(_M_ARM64)
+#define TINYOBJ_SWAR_LITTLE_ENDIAN
+#endif
+
+#ifdef TINYOBJ_SWAR_LITTLE_ENDIAN
+// Loads 8 bytes at s and returns how many of them are leading ASCII digits.
+static inline int countDigits8(const char *s, unsigned long long *chunk) {
+  memcpy(chunk, s, sizeof(*chunk));
+  // a byte is a digit if its high nibble is 3 and its low nibble + 6 < 16
+  unsigned long long nondigit =
+      ((*chunk) & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL;
+  nondigit |= (((*chunk) & 0x0F0F0F0F0F0F0F0FULL) + 0x0606060606060606ULL) &
+              0xF0F0F0F0F0F0F0F0ULL;
+  if (nondigit == 0) return 8;
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(nondigit) >> 3;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  unsigned long bit;
+  _BitScanForward64(&bit, nondigit);
+  return static_cast<int>(bit >> 3);
+#else
+  int n = 0;
+  while (!(nondigit & 0xFF)) {
+    nondigit >>= 8;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// Value of the first `digits`(1 - 8) ASCII digits of chunk, all at once
+// (SWAR: SIMD within a register).
+static inline unsigned int convertDigits8(unsigned long long chunk,
+                                          int digits) {
+  // align the digits to the top bytes, the bytes shifted in are zeros
+  chunk = (chunk & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - digits));
+  chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+  chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+  chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFFULL;
+  return static_cast<unsigned int>(chunk);
+}
+#endif
+
+// Appends the decimal digits at (*s) to (*value), reading at most
+// max_digits of them. Returns the number of digits read. (*value) wraps
+// around after 19 digits. Requires TINYOBJ_LINE_PADDING readable bytes after
+// the end of the line.
+static inline int parseDigits(const char **s, int max_digits,
+                              unsigned long long *value) {
+  int count = 0;
+#ifdef TINYOBJ_SWAR_LITTLE_ENDIAN
+  static const unsigned int pow10_lut[] = {1,      10,      100,
+                                           1000,   10000,   100000,
+                                           1000000, 10000000, 100000000};
+  for (;;) {
+    unsigned long long chunk;
+    int n = countDigits8(*s, &chunk);
+    if (n > max_digits - count) n = max_digits - count;
+    if (n <= 0) break;
+    (*value) = (*value) * pow10_lut[n] + convertDigits8(chunk, n);
+    (*s) += n;
+    count += n;
+    if (n < 8) break;
+  }
+#else
+  while (count < max_digits && IS_DIGIT(**s)) {
+    (*value) = (*value) * 10 + static_cast<unsigned int>(**s - '0');
+    (*s)++;
+    count++;
+  }
+#endif
+  return count;
+}
+
+// atoi() replacement for face indices. Stops at the first non digit
+// character and returns it in `end`. Requires TINYOBJ_LINE_PADDING readable
+// bytes after the end of the line.
+static inline int parseIndex(const char *s, const char **end) {
+  s += strspn(s, " \t");
+  bool negative = false;
+  if (*s == '-' || *s == '+') {
+    negative = (*s == '-');
+    s++;
+  }
+
+  unsigned long long value = 0;
+  parseDigits(&s, 64, &value);
+
+  (*end) = s;
+  int i = static_cast<int>(value);
+  return negative ? -i : i;
+}
+
 // Tries to parse a floating point number located at s.
 //
 // s_end should be a location in the string where reading should absolutely
@@ -937,26 +1302,106 @@ fail:
   return false;
 }
 
+// Fast path for the common short decimals like `-0.123456` or `1.5e-3`.
+// Up to 19 digits are gathered into an integer, and when it fits in 53 bits
+// and the decimal exponent is within [-22, 22] a single IEEE multiplication
+// or division by an exact power of ten gives the correctly rounded
+// result(Clinger's fast path). Parsing stops at the first character which
+// can not continue the number, returned in `end`. Returns false without
+// touching `result` for anything else, so the caller can fall back to
+// tryParseDouble. Requires TINYOBJ_LINE_PADDING readable bytes after the end
+// of the line.
+static inline bool tryParseDoubleFast(const char *s, const char **end,
+                                      double *result) {
+  static const double pow10_lut[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  // the sign is random in vertex data, so avoid a branch for it
+  const char *curr = s;
+  const bool negative = (*curr == '-');
+  curr += (negative || *curr == '+') ? 1 : 0;
+
+  // more than 19 digits may overflow, those are left to tryParseDouble
+  unsigned long long mantissa = 0;
+  int digits = parseDigits(&curr, 20, &mantissa);
+  int fraction_digits = 0;
+  if (*curr == '.') {
+    curr++;
+    fraction_digits = parseDigits(&curr, 20, &mantissa);
+    digits += fraction_digits;
+  }
+  if (digits == 0 || digits > 19) return false;
+
+  int exponent = 0;
+  if (*curr == 'e' || *curr == 'E') {
+    curr++;
+    bool exp_negative = (*curr == '-');
+    curr += (exp_negative || *curr == '+') ? 1 : 0;
+    if (!IS_DIGIT(*curr)) return false;
+    while (IS_DIGIT(*curr)) {
+      exponent = exponent * 10 + (*curr - '0');
+      if (exponent > 1000) return false;
+      curr++;
+    }
+    if (exp_negative) exponent = -exponent;
+  }
+  exponent -= fraction_digits;
+
+  double value;
+  if (mantissa == 0) {
+    value = 0.0;
+  } else {
+    if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+      return false;
+    value = static_cast<double>(mantissa);
+    if (exponent < 0)
+      value /= pow10_lut[-exponent];
+    else
+      value *= pow10_lut[exponent];
+  }
+  (*result) = negative ? -value : value;
+  (*end) = curr;
+  return true;
+}
+
+// Parses the number at (*token) with tryParseDoubleFast, which also finds the
+// end of the token so no strcspn() is needed. Leaves (*token) alone and
+// returns false when the token has to go through tryParseDouble.
+static inline bool parseDoubleFast(const char **token, double *result) {
+  const char *end;
+  double val;
+  if (!tryParseDoubleFast((*token), &end, &val)) return false;
+  if (!IS_SPACE(*end) && *end != '\r' && *end != '\0') return false;
+  (*result) = val;
+  (*token) = end;
+  return true;
+}
+
 static inline real_t parseReal(const char **token, double default_value = 0.0) {
-  (*token) += strspn((*token), " \t");
-  const char *end = (*token) + strcspn((*token), " \t\r");
+  while (IS_SPACE(**token)) (*token)++;
   double val = default_value;
-  tryParseDouble((*token), end, &val);
-  real_t f = static_cast<real_t>(val);
-  (*token) = end;
-  return f;
+  if (!parseDoubleFast(token, &val)) {
+    const char *end = (*token) + strcspn((*token), " \t\r");
+    tryParseDouble((*token), end, &val);
+    (*token) = end;
+  }
+  return static_cast<real_t>(val);
 }
 
 static inline bool parseReal(const char **token, real_t *out) {
-  (*token) += strspn((*token), " \t");
-  const char *end = (*token) + strcspn((*token), " \t\r");
+  while (IS_SPACE(**token)) (*token)++;
   double val;
-  bool ret = tryParseDouble((*token), end, &val);
+  bool ret = parseDoubleFast(token, &val);
+  if (!ret) {
+    const char *end = (*token) + strcspn((*token), " \t\r");
+    ret = tryParseDouble((*token), end, &val);
+    (*token) = end;
+  }
   if (ret) {
     real_t f = static_cast<real_t>(val);
     (*out) = f;
   }
-  (*token) = end;
   return ret;
 }
 
@@ -1075,6 +1520,7 @@ static tag_sizes parseTagTriple(const char **token) {
 }
 
 // Parse triples with index offsets: i, i/j/k, i//k, i/j
+// The line must be padded with TINYOBJ_LINE_PADDING bytes(see parseIndex).
 static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
                         vertex_index_t *ret) {
   if (!ret) {
@@ -1083,7 +1529,7 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 
   vertex_index_t vi(-1);
 
-  if (!fixIndex(atoi((*token)), vsize, &(vi.v_idx))) {
+  if (!fixIndex(parseIndex((*token), token), vsize, &(vi.v_idx))) {
     return false;
   }
 
@@ -1097,7 +1543,7 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
   // i//k
   if ((*token)[0] == '/') {
     (*token)++;
-    if (!fixIndex(atoi((*token)), vnsize, &(vi.vn_idx))) {
+    if (!fixIndex(parseIndex((*token), token), vnsize, &(vi.vn_idx))) {
       return false;
     }
     (*token) += strcspn((*token), "/ \t\r");
@@ -1106,7 +1552,7 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
   }
 
   // i/j/k or i/j
-  if (!fixIndex(atoi((*token)), vtsize, &(vi.vt_idx))) {
+  if (!fixIndex(parseIndex((*token), token), vtsize, &(vi.vt_idx))) {
     return false;
   }
 
@@ -1118,7 +1564,7 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 
   // i/j/k
   (*token)++;  // skip '/'
-  if (!fixIndex(atoi((*token)), vnsize, &(vi.vn_idx))) {
+  if (!fixIndex(parseIndex((*token), token), vnsize, &(vi.vn_idx))) {
     return false;
   }
   (*token) += strcspn((*token), "/ \t\r");
@@ -1129,10 +1575,11 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 }
 
 // Parse raw triples: i, i/j/k, i//k, i/j
+// The line must be padded with TINYOBJ_LINE_PADDING bytes(see parseIndex).
 static vertex_index_t parseRawTriple(const char **token) {
   vertex_index_t vi(static_cast<int>(0));  // 0 is an invalid index in OBJ
 
-  vi.v_idx = atoi((*token));
+  vi.v_idx = parseIndex((*token), token);
   (*token) += strcspn((*token), "/ \t\r");
   if ((*token)[0] != '/') {
     return vi;
@@ -1142,13 +1589,13 @@ static vertex_index_t parseRawTriple(const char **token) {
   // i//k
   if ((*token)[0] == '/') {
     (*token)++;
-    vi.vn_idx = atoi((*token));
+    vi.vn_idx = parseIndex((*token), token);
     (*token) += strcspn((*token), "/ \t\r");
     return vi;
   }
 
   // i/j/k or i/j
-  vi.vt_idx = atoi((*token));
+  vi.vt_idx = parseIndex((*token), token);
   (*token) += strcspn((*token), "/ \t\r");
   if ((*token)[0] != '/') {
     return vi;
@@ -1156,13 +1603,16 @@ static vertex_index_t parseRawTriple(const char **token) {
 
   // i/j/k
   (*token)++;  // skip '/'
-  vi.vn_idx = atoi((*token));
+  vi.vn_idx = parseIndex((*token), token);
   (*token) += strcspn((*token), "/ \t\r");
   return vi;
 }
 
-bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
-                               const char *linebuf) {
+// The line must be padded with TINYOBJ_LINE_PADDING bytes(see parseIndex), as
+// the lines of LoadMtl are.
+static bool parseTextureNameAndOption(std::string *texname,
+                                      texture_option_t *texopt,
+                                      const char *linebuf) {
   // @todo { write more robust lexer and parser. }
   bool found_texname = false;
   std::string texture_name;
@@ -1247,6 +1697,14 @@ bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
   }
 }
 
+bool ParseTextureNameAndOption(std::string *texname, texture_option_t *texopt,
+                               const char *linebuf) {
+  // callers pass plain strings, the number parsers read past their end
+  std::string padded(linebuf);
+  padded.append(TINYOBJ_LINE_PADDING, '\0');
+  return parseTextureNameAndOption(texname, texopt, padded.c_str());
+}
+
 static void InitTexOpt(texture_option_t *texopt, const bool is_bump) {
   if (is_bump) {
     texopt->imfchan = 'l';
@@ -1707,6 +2165,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     if (linebuf.empty()) {
       continue;
     }
+    linebuf.append(TINYOBJ_LINE_PADDING, '\0');
 
     // Skip leading space.
     const char *token = linebuf.c_str();
@@ -1904,7 +2363,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // ambient texture
     if ((0 == strncmp(token, "map_Ka", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.ambient_texname),
+      parseTextureNameAndOption(&(material.ambient_texname),
                                 &(material.ambient_texopt), token);
       continue;
     }
@@ -1912,7 +2371,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // diffuse texture
     if ((0 == strncmp(token, "map_Kd", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.diffuse_texname),
+      parseTextureNameAndOption(&(material.diffuse_texname),
                                 &(material.diffuse_texopt), token);
 
       // Set a decent diffuse default value if a diffuse texture is specified
@@ -1930,7 +2389,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // specular texture
     if ((0 == strncmp(token, "map_Ks", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.specular_texname),
+      parseTextureNameAndOption(&(material.specular_texname),
                                 &(material.specular_texopt), token);
       continue;
     }
@@ -1938,7 +2397,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // specular highlight texture
     if ((0 == strncmp(token, "map_Ns", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.specular_highlight_texname),
+      parseTextureNameAndOption(&(material.specular_highlight_texname),
                                 &(material.specular_highlight_texopt), token);
       continue;
     }
@@ -1946,7 +2405,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // bump texture
     if ((0 == strncmp(token, "map_bump", 8)) && IS_SPACE(token[8])) {
       token += 9;
-      ParseTextureNameAndOption(&(material.bump_texname),
+      parseTextureNameAndOption(&(material.bump_texname),
                                 &(material.bump_texopt), token);
       continue;
     }
@@ -1954,7 +2413,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // bump texture
     if ((0 == strncmp(token, "map_Bump", 8)) && IS_SPACE(token[8])) {
       token += 9;
-      ParseTextureNameAndOption(&(material.bump_texname),
+      parseTextureNameAndOption(&(material.bump_texname),
                                 &(material.bump_texopt), token);
       continue;
     }
@@ -1962,7 +2421,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // bump texture
     if ((0 == strncmp(token, "bump", 4)) && IS_SPACE(token[4])) {
       token += 5;
-      ParseTextureNameAndOption(&(material.bump_texname),
+      parseTextureNameAndOption(&(material.bump_texname),
                                 &(material.bump_texopt), token);
       continue;
     }
@@ -1971,7 +2430,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     if ((0 == strncmp(token, "map_d", 5)) && IS_SPACE(token[5])) {
       token += 6;
       material.alpha_texname = token;
-      ParseTextureNameAndOption(&(material.alpha_texname),
+      parseTextureNameAndOption(&(material.alpha_texname),
                                 &(material.alpha_texopt), token);
       continue;
     }
@@ -1979,7 +2438,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // displacement texture
     if ((0 == strncmp(token, "disp", 4)) && IS_SPACE(token[4])) {
       token += 5;
-      ParseTextureNameAndOption(&(material.displacement_texname),
+      parseTextureNameAndOption(&(material.displacement_texname),
                                 &(material.displacement_texopt), token);
       continue;
     }
@@ -1987,7 +2446,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // reflection map
     if ((0 == strncmp(token, "refl", 4)) && IS_SPACE(token[4])) {
       token += 5;
-      ParseTextureNameAndOption(&(material.reflection_texname),
+      parseTextureNameAndOption(&(material.reflection_texname),
                                 &(material.reflection_texopt), token);
       continue;
     }
@@ -1995,7 +2454,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // PBR: roughness texture
     if ((0 == strncmp(token, "map_Pr", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.roughness_texname),
+      parseTextureNameAndOption(&(material.roughness_texname),
                                 &(material.roughness_texopt), token);
       continue;
     }
@@ -2003,7 +2462,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // PBR: metallic texture
     if ((0 == strncmp(token, "map_Pm", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.metallic_texname),
+      parseTextureNameAndOption(&(material.metallic_texname),
                                 &(material.metallic_texopt), token);
       continue;
     }
@@ -2011,7 +2470,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // PBR: sheen texture
     if ((0 == strncmp(token, "map_Ps", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.sheen_texname),
+      parseTextureNameAndOption(&(material.sheen_texname),
                                 &(material.sheen_texopt), token);
       continue;
     }
@@ -2019,7 +2478,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // PBR: emissive texture
     if ((0 == strncmp(token, "map_Ke", 6)) && IS_SPACE(token[6])) {
       token += 7;
-      ParseTextureNameAndOption(&(material.emissive_texname),
+      parseTextureNameAndOption(&(material.emissive_texname),
                                 &(material.emissive_texopt), token);
       continue;
     }
@@ -2027,7 +2486,7 @@ void LoadMtl(std::map<std::string, int> *material_map,
     // PBR: normal map texture
     if ((0 == strncmp(token, "norm", 4)) && IS_SPACE(token[4])) {
       token += 5;
-      ParseTextureNameAndOption(&(material.normal_texname),
+      parseTextureNameAndOption(&(material.normal_texname),
                                 &(material.normal_texopt), token);
       continue;
     }
@@ -2222,6 +2681,7 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
     if (linebuf.empty()) {
       continue;
     }
+    linebuf.append(TINYOBJ_LINE_PADDING, '\0');
 
     // Skip leading space.
     const char *token = linebuf.c_str();
@@ -2680,11 +3140,12 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
   return true;
 }
 
-bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
-                         void *user_data /*= NULL*/,
-                         MaterialReader *readMatFn /*= NULL*/,
-                         std::string *warn, /* = NULL*/
-                         std::string *err /*= NULL*/) {
+template <typename LineReader>
+static bool LoadObjWithCallbackLines(LineReader &lines,
+                                     const callback_t &callback,
+                                     void *user_data,
+                                     MaterialReader *readMatFn,
+                                     std::string *warn, std::string *err) {
   std::stringstream errss;
 
   // material
@@ -2698,8 +3159,7 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
   std::vector<const char *> names_out;
 
   std::string linebuf;
-  while (inStream.peek() != -1) {
-    safeGetline(inStream, linebuf);
+  while (lines.next(linebuf)) {
 
     // Trim newline '\r\n' or '\n'
     if (linebuf.size() > 0) {
@@ -2715,6 +3175,7 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
     if (linebuf.empty()) {
       continue;
     }
+    linebuf.append(TINYOBJ_LINE_PADDING, '\0');
 
     // Skip leading space.
     const char *token = linebuf.c_str();
@@ -2728,7 +3189,12 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
     // vertex
     if (token[0] == 'v' && IS_SPACE((token[1]))) {
       token += 2;
-      // TODO(syoyo): Support parsing vertex color extension.
+      if (callback.vertex_color_cb) {
+        real_t x, y, z, r, g, b;  // color is optional. default = 1.0
+        parseVertexWithColor(&x, &y, &z, &r, &g, &b, &token);
+        callback.vertex_color_cb(user_data, x, y, z, r, g, b);
+        continue;
+      }
       real_t x, y, z, w;  // w is optional. default = 1.0
       parseV(&x, &y, &z, &w, &token);
       if (callback.vertex_cb) {
@@ -2789,9 +3255,7 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
     // use mtl
     if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
       token += 7;
-      std::stringstream ss;
-      ss << token;
-      std::string namebuf = ss.str();
+      std::string namebuf(token);
 
       int newMaterialId = -1;
       std::map<std::string, int>::const_iterator it = material_map.find(namebuf);
@@ -2904,9 +3368,7 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
       // @todo { multiple object name? }
       token += 2;
 
-      std::stringstream ss;
-      ss << token;
-      std::string object_name = ss.str();
+      std::string object_name(token);
 
       if (callback.object_cb) {
         callback.object_cb(user_data, object_name.c_str());
@@ -2963,6 +3425,27 @@ bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
   return true;
 }
 
+bool LoadObjWithCallback(std::istream &inStream, const callback_t &callback,
+                         void *user_data /*= NULL*/,
+                         MaterialReader *readMatFn /*= NULL*/,
+                         std::string *warn, /* = NULL*/
+                         std::string *err /*= NULL*/) {
+  StreamLineReader lines(inStream);
+  return LoadObjWithCallbackLines(lines, callback, user_data, readMatFn, warn,
+                                  err);
+}
+
+bool LoadObjWithCallback(const char *buf, size_t len,
+                         const callback_t &callback,
+                         void *user_data /*= NULL*/,
+                         MaterialReader *readMatFn /*= NULL*/,
+                         std::string *warn, /* = NULL*/
+                         std::string *err /*= NULL*/) {
+  MemoryLineReader lines(buf, buf + len);
+  return LoadObjWithCallbackLines(lines, callback, user_data, readMatFn, warn,
+                                  err);
+}
+
 bool ObjReader::ParseFromFile(const std::string &filename,
                               const ObjReaderConfig &config) {
   std::string mtl_search_path;
@@ -0,0 +1,189 @@
+///////////////////////////////////////////////////////////////////////////////
+// AssetLoader.h
+// =============
+// Loading of assets on first use.
+//
+// request(key, load) returns a future of the asset; the first request of a
+// key queues load() for the worker thread of the loader, later requests get
+// the same future, so an asset shared by many users is loaded once. The
+// asset is NULL if load() failed. Loaders run one load at a time in request
+// order, which keeps the load functions free of locking among themselves;
+// a load may request assets of another loader and wait for them.
+//
+// A listener set with setListener() is called on the worker thread after each
+// load, to wake up a thread waiting for events. stop() drops the loads not
+// started and waits for the one running; call it before anything the load
+// functions write to goes away.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef ASSET_LOADER_H_DEF
+#define ASSET_LOADER_H_DEF
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct AssetLoaderReport
+{
+	size_t requested;	// keys
+	size_t loaded;		// with an asset
+	size_t failed;
+	size_t queued;		// not started yet
+	double loadMs;		// in load(), in total
+	double waitMs;		// request to start of load(), in total
+};
+
+template <typename Asset>
+class AssetLoader
+{
+public:
+	typedef std::shared_ptr<Asset> Handle;
+	typedef std::shared_future<Handle> Future;
+	typedef std::function<Handle()> Load;
+
+	AssetLoader() : stopping(false), running(false), loading(false)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	~AssetLoader()
+	{
+		stop();
+	}
+
+	Future request(const std::string& key, const Load& load)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		typename std::map<std::string, Future>::iterator found = futures.find(key);
+		if (found != futures.end())
+			return found->second;
+
+		std::shared_ptr<std::promise<Handle> > promise(new std::promise<Handle>());
+		Future future = promise->get_future().share();
+		futures[key] = future;
+		stats.requested++;
+		if (stopping)
+		{
+			promise->set_value(Handle());
+			stats.failed++;
+			return future;
+		}
+		Task task = { load, promise, Clock::now() };
+		tasks.push_back(task);
+		if (!running)
+		{
+			running = true;
+			worker = std::thread(&AssetLoader::workerLoop, this);
+		}
+		wake.notify_one();
+		return future;
+	}
+
+	void setListener(const std::function<void()>& loaded)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		listener = loaded;
+	}
+
+	bool isRequested(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return futures.count(key) != 0;
+	}
+
+	// true while a load is queued or running
+	bool busy()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return !tasks.empty() || loading;
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			for (size_t i = 0; i < tasks.size(); i++)
+			{
+				tasks[i].promise->set_value(Handle());
+				stats.failed++;
+			}
+			tasks.clear();
+		}
+		wake.notify_one();
+		if (worker.joinable())
+			worker.join();
+	}
+
+	AssetLoaderReport report()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		AssetLoaderReport r = stats;
+		r.queued = tasks.size();
+		return r;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Task
+	{
+		Load load;
+		std::shared_ptr<std::promise<Handle> > promise;
+		Clock::time_point requested;
+	};
+
+	static double elapsedMs(Clock::time_point start, Clock::time_point end)
+	{
+		return std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	void workerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this] { return !tasks.empty() || stopping; });
+			if (tasks.empty())
+				return;
+			Task task = tasks.front();
+			tasks.pop_front();
+			loading = true;
+			std::function<void()> loaded = listener;
+			lock.unlock();
+
+			Clock::time_point start = Clock::now();
+			Handle asset = task.load();
+			Clock::time_point end = Clock::now();
+			task.promise->set_value(asset);
+			if (loaded)
+				loaded();
+
+			lock.lock();
+			loading = false;
+			stats.loaded += asset ? 1 : 0;
+			stats.failed += asset ? 0 : 1;
+			stats.loadMs += elapsedMs(start, end);
+			stats.waitMs += elapsedMs(task.requested, start);
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::map<std::string, Future> futures;
+	std::deque<Task> tasks;
+	std::function<void()> listener;
+	std::thread worker;
+	bool stopping, running, loading;
+	AssetLoaderReport stats;
+};
+
+#endif
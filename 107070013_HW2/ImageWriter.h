@@ -0,0 +1,393 @@
+///////////////////////////////////////////////////////////////////////////////
+// ImageWriter.h
+// =============
+// Image files of the renderers without an image library.
+//
+// WritePng() writes 8 bit RGB with zlib stored (uncompressed) deflate blocks,
+// which every PNG reader accepts (RFC 1950, 1951, PNG specification 1.2).
+// WriteQoi() writes 8 bit RGB in the Quite OK Image format (specification
+// 1.0), a few times smaller than the stored PNG and as fast to write.
+// WriteExr() writes a scanline OpenEXR file of 32 bit float R, G, B without
+// compression, for the linear radiance of the path tracer.
+// Y4mWriter writes a YUV4MPEG2 stream of 4:2:0 frames with full range BT.601
+// colors (C420jpeg), which video encoders and players read directly.
+// All take images with the top row first. EncodePng() / EncodeQoi() return
+// the file in memory instead.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGE_WRITER_H_DEF
+#define IMAGE_WRITER_H_DEF
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace imagewriter_detail
+{
+	struct CrcTable
+	{
+		unsigned int entries[256];
+
+		CrcTable()
+		{
+			for (unsigned int n = 0; n < 256; n++)
+			{
+				unsigned int c = n;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				entries[n] = c;
+			}
+		}
+	};
+
+	inline unsigned int Crc32(const unsigned char* data, size_t size, unsigned int crc = 0)
+	{
+		// built by the first call, the capture workers write PNGs at the same time
+		static const CrcTable table;
+		crc = ~crc;
+		for (size_t i = 0; i < size; i++)
+			crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline void PutBigEndian(std::vector<unsigned char>& out, unsigned int value)
+	{
+		out.push_back((unsigned char)(value >> 24));
+		out.push_back((unsigned char)(value >> 16));
+		out.push_back((unsigned char)(value >> 8));
+		out.push_back((unsigned char)value);
+	}
+
+	template <typename T>
+	inline void PutLittleEndian(std::vector<unsigned char>& out, T value)
+	{
+		for (size_t i = 0; i < sizeof(T); i++)
+			out.push_back((unsigned char)(value >> (i * 8)));
+	}
+
+	inline void PutFloat(std::vector<unsigned char>& out, float value)
+	{
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof(bits));
+		PutLittleEndian(out, bits);
+	}
+
+	inline void PutString(std::vector<unsigned char>& out, const char* text)
+	{
+		out.insert(out.end(), text, text + strlen(text) + 1);
+	}
+
+	// length, type, data, crc of type and data
+	inline void PutPngChunk(std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data)
+	{
+		PutBigEndian(out, (unsigned int)data.size());
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data.begin(), data.end());
+		PutBigEndian(out, Crc32(&out[start], out.size() - start));
+	}
+
+	// EXR header attribute: name, type, size, value
+	inline void PutExrAttribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value)
+	{
+		PutString(out, name);
+		PutString(out, type);
+		PutLittleEndian(out, (int)value.size());
+		out.insert(out.end(), value.begin(), value.end());
+	}
+
+	inline bool WriteFile(const std::string& path, const std::vector<unsigned char>& bytes)
+	{
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+		bool written = fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+		written = (fclose(file) == 0) && written;
+		return written;
+	}
+}
+
+// rgba: width * height RGBA8 texels, alpha is dropped
+inline bool EncodePng(const std::vector<unsigned char>& rgba, int width, int height, std::vector<unsigned char>* file)
+{
+	using namespace imagewriter_detail;
+	if (width <= 0 || height <= 0 || rgba.size() < (size_t)width * height * 4)
+		return false;
+
+	// every row starts with filter type 0 (none)
+	size_t rowBytes = (size_t)width * 3 + 1;
+	std::vector<unsigned char> raw(rowBytes * height);
+	for (int y = 0; y < height; y++)
+	{
+		unsigned char* row = &raw[y * rowBytes];
+		row[0] = 0;
+		for (int x = 0; x < width; x++)
+			memcpy(&row[1 + x * 3], &rgba[((size_t)y * width + x) * 4], 3);
+	}
+
+	// zlib stream of stored blocks, at most 65535 bytes each
+	std::vector<unsigned char> idat;
+	idat.push_back(0x78);
+	idat.push_back(0x01);
+	for (size_t offset = 0; offset < raw.size(); offset += 65535)
+	{
+		size_t size = std::min(raw.size() - offset, (size_t)65535);
+		idat.push_back(offset + size == raw.size() ? 1 : 0);
+		PutLittleEndian(idat, (unsigned short)size);
+		PutLittleEndian(idat, (unsigned short)~size);
+		idat.insert(idat.end(), raw.begin() + offset, raw.begin() + offset + size);
+	}
+	unsigned int a = 1, b = 0;
+	for (size_t i = 0; i < raw.size(); i++)
+	{
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	PutBigEndian(idat, (b << 16) | a);
+
+	std::vector<unsigned char> header;
+	PutBigEndian(header, (unsigned int)width);
+	PutBigEndian(header, (unsigned int)height);
+	header.push_back(8);	// bit depth
+	header.push_back(2);	// RGB
+	header.push_back(0);	// deflate
+	header.push_back(0);	// adaptive filtering
+	header.push_back(0);	// no interlace
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	file->assign(signature, signature + 8);
+	PutPngChunk(*file, "IHDR", header);
+	PutPngChunk(*file, "IDAT", idat);
+	PutPngChunk(*file, "IEND", std::vector<unsigned char>());
+	return true;
+}
+
+inline bool WritePng(const std::string& path, const std::vector<unsigned char>& rgba, int width, int height)
+{
+	std::vector<unsigned char> file;
+	return EncodePng(rgba, width, height, &file) && imagewriter_detail::WriteFile(path, file);
+}
+
+// rgba: width * height RGBA8 texels, alpha is dropped
+inline bool EncodeQoi(const std::vector<unsigned char>& rgba, int width, int height, std::vector<unsigned char>* out)
+{
+	using namespace imagewriter_detail;
+	if (width <= 0 || height <= 0 || rgba.size() < (size_t)width * height * 4)
+		return false;
+
+	std::vector<unsigned char>& file = *out;
+	file.clear();
+	file.reserve((size_t)width * height * 2);
+	file.insert(file.end(), "qoif", "qoif" + 4);
+	PutBigEndian(file, (unsigned int)width);
+	PutBigEndian(file, (unsigned int)height);
+	file.push_back(3);	// RGB
+	file.push_back(0);	// sRGB with linear alpha
+
+	// RGBA by hash, all zero (transparent black) at the start as in the decoder,
+	// the pixels written are opaque
+	unsigned char seen[64][4];
+	memset(seen, 0, sizeof(seen));
+	unsigned char prev[3] = { 0, 0, 0 };
+	int run = 0;
+	size_t count = (size_t)width * height;
+	for (size_t i = 0; i < count; i++)
+	{
+		const unsigned char* px = &rgba[i * 4];
+		if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2])
+		{
+			if (++run == 62 || i + 1 == count)
+			{
+				file.push_back((unsigned char)(0xc0 | (run - 1)));	// QOI_OP_RUN
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0)
+		{
+			file.push_back((unsigned char)(0xc0 | (run - 1)));
+			run = 0;
+		}
+		const unsigned char color[4] = { px[0], px[1], px[2], 255 };
+		int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+		if (memcmp(seen[hash], color, 4) == 0)
+		{
+			file.push_back((unsigned char)hash);	// QOI_OP_INDEX
+		}
+		else
+		{
+			memcpy(seen[hash], color, 4);
+			int dr = (signed char)(px[0] - prev[0]);
+			int dg = (signed char)(px[1] - prev[1]);
+			int db = (signed char)(px[2] - prev[2]);
+			int drg = dr - dg, dbg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+			{
+				file.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));	// QOI_OP_DIFF
+			}
+			else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+			{
+				file.push_back((unsigned char)(0x80 | (dg + 32)));	// QOI_OP_LUMA
+				file.push_back((unsigned char)((drg + 8) << 4 | (dbg + 8)));
+			}
+			else
+			{
+				file.push_back(0xfe);	// QOI_OP_RGB
+				file.insert(file.end(), px, px + 3);
+			}
+		}
+		memcpy(prev, px, 3);
+	}
+	static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	file.insert(file.end(), end, end + 8);
+	return true;
+}
+
+inline bool WriteQoi(const std::string& path, const std::vector<unsigned char>& rgba, int width, int height)
+{
+	std::vector<unsigned char> file;
+	return EncodeQoi(rgba, width, height, &file) && imagewriter_detail::WriteFile(path, file);
+}
+
+// rgb: width * height linear RGB floats
+inline bool WriteExr(const std::string& path, const std::vector<float>& rgb, int width, int height)
+{
+	using namespace imagewriter_detail;
+	if (width <= 0 || height <= 0 || rgb.size() < (size_t)width * height * 3)
+		return false;
+
+	std::vector<unsigned char> file;
+	PutLittleEndian(file, 20000630);	// magic number
+	PutLittleEndian(file, 2);			// version 2, single part scanline
+
+	// channels sorted by name, FLOAT pixels, no subsampling
+	std::vector<unsigned char> channels;
+	const char* names[3] = { "B", "G", "R" };
+	for (int c = 0; c < 3; c++)
+	{
+		PutString(channels, names[c]);
+		PutLittleEndian(channels, 2);
+		PutLittleEndian(channels, 0);
+		PutLittleEndian(channels, 1);
+		PutLittleEndian(channels, 1);
+	}
+	channels.push_back(0);
+	PutExrAttribute(file, "channels", "chlist", channels);
+	PutExrAttribute(file, "compression", "compression", std::vector<unsigned char>(1, 0));
+	std::vector<unsigned char> window;
+	PutLittleEndian(window, 0);
+	PutLittleEndian(window, 0);
+	PutLittleEndian(window, width - 1);
+	PutLittleEndian(window, height - 1);
+	PutExrAttribute(file, "dataWindow", "box2i", window);
+	PutExrAttribute(file, "displayWindow", "box2i", window);
+	PutExrAttribute(file, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));
+	std::vector<unsigned char> one;
+	PutFloat(one, 1.0f);
+	PutExrAttribute(file, "pixelAspectRatio", "float", one);
+	PutExrAttribute(file, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+	PutExrAttribute(file, "screenWindowWidth", "float", one);
+	file.push_back(0);
+
+	// offset table, then one line per block: y, size, B, G and R of the line
+	size_t lineBytes = (size_t)width * 3 * sizeof(float);
+	size_t firstLine = file.size() + (size_t)height * 8;
+	for (int y = 0; y < height; y++)
+		PutLittleEndian(file, (unsigned long long)(firstLine + y * (lineBytes + 8)));
+	for (int y = 0; y < height; y++)
+	{
+		PutLittleEndian(file, y);
+		PutLittleEndian(file, (int)lineBytes);
+		for (int c = 2; c >= 0; c--)
+		{
+			for (int x = 0; x < width; x++)
+				PutFloat(file, rgb[((size_t)y * width + x) * 3 + c]);
+		}
+	}
+	return WriteFile(path, file);
+}
+
+// rgba: width * height RGBA8 texels to the Y, Cb and Cr planes of a 4:2:0 frame, chroma
+// averaged over 2 x 2 texels
+inline void RgbaToI420(const std::vector<unsigned char>& rgba, int width, int height, std::vector<unsigned char>* yuv)
+{
+	int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+	yuv->resize((size_t)width * height + 2 * (size_t)chromaWidth * chromaHeight);
+	unsigned char* y = &(*yuv)[0];
+	unsigned char* cb = y + (size_t)width * height;
+	unsigned char* cr = cb + (size_t)chromaWidth * chromaHeight;
+	for (size_t i = 0; i < (size_t)width * height; i++)
+	{
+		const unsigned char* px = &rgba[i * 4];
+		y[i] = (unsigned char)((77 * px[0] + 150 * px[1] + 29 * px[2] + 128) >> 8);
+	}
+	for (int cy = 0; cy < chromaHeight; cy++)
+	{
+		for (int cx = 0; cx < chromaWidth; cx++)
+		{
+			int sum[3] = { 0, 0, 0 };
+			for (int k = 0; k < 4; k++)
+			{
+				int x = std::min(cx * 2 + (k & 1), width - 1), row = std::min(cy * 2 + (k >> 1), height - 1);
+				const unsigned char* px = &rgba[((size_t)row * width + x) * 4];
+				sum[0] += px[0];
+				sum[1] += px[1];
+				sum[2] += px[2];
+			}
+			// sums of 4 texels, so the weights are a quarter of 256ths; 128 + rounding is in the offset
+			int u = (-43 * sum[0] - 85 * sum[1] + 128 * sum[2] + 4 * 32896) >> 10;
+			int v = (128 * sum[0] - 107 * sum[1] - 21 * sum[2] + 4 * 32896) >> 10;
+			cb[(size_t)cy * chromaWidth + cx] = (unsigned char)std::min(u, 255);
+			cr[(size_t)cy * chromaWidth + cx] = (unsigned char)std::min(v, 255);
+		}
+	}
+}
+
+// YUV4MPEG2 stream, frames from RgbaToI420() appended in order
+class Y4mWriter
+{
+public:
+	Y4mWriter() : file(NULL), width(0), height(0), frames(0) {}
+	~Y4mWriter() { close(); }
+
+	bool open(const std::string& path, int frameWidth, int frameHeight, int fps)
+	{
+		close();
+		file = fopen(path.c_str(), "wb");
+		if (!file)
+			return false;
+		width = frameWidth;
+		height = frameHeight;
+		frames = 0;
+		return fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps) > 0;
+	}
+
+	bool writeFrame(const std::vector<unsigned char>& yuv)
+	{
+		if (!file)
+			return false;
+		frames++;
+		return fputs("FRAME\n", file) >= 0 && fwrite(&yuv[0], 1, yuv.size(), file) == yuv.size();
+	}
+
+	bool close()
+	{
+		if (!file)
+			return true;
+		bool closed = fclose(file) == 0;
+		file = NULL;
+		return closed;
+	}
+
+	bool isOpen() const { return file != NULL; }
+	int getFrames() const { return frames; }
+
+private:
+	FILE* file;
+	int width, height;
+	int frames;
+};
+
+#endif
@@ -0,0 +1,255 @@
+///////////////////////////////////////////////////////////////////////////////
+// NormalsBenchmark.h
+// ==================
+// Validation and timings of GenerateMeshNormals(), run with
+//     <app> --bench-normals [file.obj ...]
+// (the app's own model list is used when no file is given).
+//
+// Every model with its normals removed and a generated torus of 1M
+// triangles with a texture seam are run with 1, 2, 4, ... threads up to the
+// hardware threads (best of 3), and each result is checked bit by bit
+// against the one thread result. Generated normals are compared with the
+// normals of the file (or the exact torus normals) as the mean angle
+// between them, and tangents are checked for unit length, orthogonality to
+// the normal and a w of +-1.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef NORMALS_BENCHMARK_H_DEF
+#define NORMALS_BENCHMARK_H_DEF
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ObjMesh.h"
+#include "MeshNormals.h"
+
+namespace normalsbench_detail
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline double ElapsedMs(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// the normal of every corner, 3 floats each
+	inline std::vector<float> CornerNormals(const ObjMesh& mesh)
+	{
+		std::vector<float> normals(mesh.indices.size() * 3, 0.0f);
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+		{
+			if (mesh.indices[i].normal_index >= 0)
+				memcpy(&normals[i * 3], &mesh.normals[3 * mesh.indices[i].normal_index], 3 * sizeof(float));
+		}
+		return normals;
+	}
+
+	inline void StripNormals(ObjMesh* mesh)
+	{
+		mesh->normals.clear();
+		mesh->tangents.clear();
+		for (size_t i = 0; i < mesh->indices.size(); i++)
+			mesh->indices[i].normal_index = -1;
+	}
+
+	// mean angle in degrees between the unit vectors of a and the vectors of b
+	inline double MeanAngle(const std::vector<float>& a, const std::vector<float>& b)
+	{
+		double sum = 0;
+		size_t count = 0;
+		for (size_t i = 0; i + 2 < a.size() && i + 2 < b.size(); i += 3)
+		{
+			double length = sqrt((double)b[i] * b[i] + (double)b[i + 1] * b[i + 1] + (double)b[i + 2] * b[i + 2]);
+			if (length == 0)
+				continue;
+			double c = (a[i] * b[i] + a[i + 1] * b[i + 1] + a[i + 2] * b[i + 2]) / length;
+			sum += acos(std::max(-1.0, std::min(1.0, c)));
+			count++;
+		}
+		return count ? sum / count * 180.0 / 3.14159265358979 : 0;
+	}
+
+	// tangents which are not unit, not orthogonal to the corner normal or have another w than +-1
+	inline size_t BadTangents(const ObjMesh& mesh)
+	{
+		std::vector<float> normals = CornerNormals(mesh);
+		size_t bad = 0;
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+		{
+			const float* t = &mesh.tangents[4 * i];
+			const float* n = &normals[3 * i];
+			float length = sqrtf(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+			float d = t[0] * n[0] + t[1] * n[1] + t[2] * n[2];
+			if (fabsf(length - 1) > 1e-3f || fabsf(d) > 1e-3f || fabsf(fabsf(t[3]) - 1) > 0)
+				bad++;
+		}
+		return bad;
+	}
+
+	// torus around y, u around the ring, v around the tube; the texcoords have a seam
+	// where the positions wrap. normals and tangents get the exact values per corner
+	inline void GenerateTorus(int ring, int tube, ObjMesh* mesh, std::vector<float>* normals, std::vector<float>* tangents)
+	{
+		const float R = 0.7f, r = 0.3f, PI2 = 6.2831853f;
+		*mesh = ObjMesh();
+		for (int i = 0; i < ring; i++)
+		{
+			for (int j = 0; j < tube; j++)
+			{
+				float a = PI2 * i / ring, b = PI2 * j / tube;
+				mesh->positions.push_back((R + r * cosf(b)) * cosf(a));
+				mesh->positions.push_back(r * sinf(b));
+				mesh->positions.push_back(-(R + r * cosf(b)) * sinf(a));
+				for (int c = 0; c < 3; c++)
+					mesh->colors.push_back(1.0f);
+			}
+		}
+		for (int i = 0; i <= ring; i++)
+		{
+			for (int j = 0; j <= tube; j++)
+			{
+				mesh->texcoords.push_back((float)i / ring);
+				mesh->texcoords.push_back((float)j / tube);
+			}
+		}
+		mesh->minBound[0] = mesh->minBound[2] = -(R + r);
+		mesh->maxBound[0] = mesh->maxBound[2] = R + r;
+		mesh->minBound[1] = -r;
+		mesh->maxBound[1] = r;
+
+		normals->clear();
+		tangents->clear();
+		for (int i = 0; i < ring; i++)
+		{
+			for (int j = 0; j < tube; j++)
+			{
+				// two counterclockwise triangles of the quad (i, j) - (i + 1, j + 1)
+				static const int corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+				for (int k = 0; k < 6; k++)
+				{
+					int ci = i + corners[k][0], cj = j + corners[k][1];
+					tinyobj::index_t idx;
+					idx.vertex_index = (ci % ring) * tube + cj % tube;
+					idx.normal_index = -1;
+					idx.texcoord_index = ci * (tube + 1) + cj;
+					mesh->indices.push_back(idx);
+					float a = PI2 * ci / ring, b = PI2 * cj / tube;
+					normals->push_back(cosf(b) * cosf(a));
+					normals->push_back(sinf(b));
+					normals->push_back(-cosf(b) * sinf(a));
+					tangents->push_back(-sinf(a));
+					tangents->push_back(0);
+					tangents->push_back(-cosf(a));
+				}
+				mesh->faceMaterials.push_back(-1);
+				mesh->faceMaterials.push_back(-1);
+			}
+		}
+		ObjGroup group;
+		group.name = "torus";
+		group.firstFace = 0;
+		group.faceCount = mesh->faceMaterials.size();
+		mesh->groups.push_back(group);
+	}
+
+	// the xyz of every tangent
+	inline std::vector<float> TangentDirections(const ObjMesh& mesh)
+	{
+		std::vector<float> directions(mesh.indices.size() * 3);
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+			memcpy(&directions[3 * i], &mesh.tangents[4 * i], 3 * sizeof(float));
+		return directions;
+	}
+
+	// run GenerateMeshNormals on copies of source with every thread count and print the numbers
+	inline void Benchmark(const std::string& name, const ObjMesh& source, const std::vector<unsigned int>& threadCounts,
+		const std::vector<float>& expectedNormals, const std::vector<float>& expectedTangents)
+	{
+		ObjMesh reference;
+		double oneThreadMs = 0;
+		for (size_t c = 0; c < threadCounts.size(); c++)
+		{
+			double best = 1e30;
+			MeshNormalStats bestStats;
+			bool same = true;
+			for (int r = 0; r < 3; r++)
+			{
+				ObjMesh mesh = source;
+				MeshNormalStats stats;
+				Clock::time_point start = Clock::now();
+				GenerateMeshNormals(&mesh, threadCounts[c], &stats, true);
+				double ms = ElapsedMs(start);
+				if (ms < best)
+				{
+					best = ms;
+					bestStats = stats;
+				}
+				if (c == 0 && r == 0)
+					reference = mesh;
+				same = same && mesh.normals == reference.normals && mesh.tangents == reference.tangents;
+			}
+			if (c == 0)
+				oneThreadMs = best;
+			printf("  %-40s %2u threads %8.2f ms (adjacency %.2f, normals %.2f, tangents %.2f)  speedup %.2fx  %s\n",
+				name.c_str(), threadCounts[c], best, bestStats.adjacencyMs, bestStats.normalsMs, bestStats.tangentsMs,
+				oneThreadMs / best, same ? "identical" : "DIFFERENT from 1 thread");
+		}
+
+		printf("  %-40s %d triangles, %d normals generated", name.c_str(), (int)reference.triangleCount(), (int)(reference.normals.size() / 3));
+		if (!expectedNormals.empty())
+			printf(", %.3f deg from the %s normals", MeanAngle(CornerNormals(reference), expectedNormals), expectedTangents.empty() ? "file" : "exact");
+		if (!reference.tangents.empty())
+		{
+			printf(", %d bad tangents", (int)BadTangents(reference));
+			if (!expectedTangents.empty())
+				printf(", %.3f deg from the exact tangents", MeanAngle(TangentDirections(reference), expectedTangents));
+		}
+		printf("\n");
+	}
+}
+
+// returns the exit code of the app
+inline int RunNormalsBenchmark(const std::vector<std::string>& files)
+{
+	using namespace normalsbench_detail;
+
+	unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t < hardwareThreads; t *= 2)
+		threadCounts.push_back(t);
+	threadCounts.push_back(hardwareThreads);
+	printf("GenerateMeshNormals scaling, %u hardware threads (best of 3)\n", hardwareThreads);
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		ObjMesh mesh;
+		std::string warn, err;
+		size_t slash = files[i].find_last_of("/\\");
+		std::string baseDir = (slash == std::string::npos) ? "" : files[i].substr(0, slash + 1);
+		if (!LoadObjMesh(files[i], baseDir, &mesh, &warn, &err))
+		{
+			printf("Cannot read %s\n", files[i].c_str());
+			return 1;
+		}
+		// the normals of the file, where it has them, to compare with
+		std::vector<float> fileNormals;
+		bool complete = true;
+		for (size_t k = 0; k < mesh.indices.size(); k++)
+			complete = complete && mesh.indices[k].normal_index >= 0;
+		if (complete)
+			fileNormals = CornerNormals(mesh);
+		StripNormals(&mesh);
+		Benchmark(files[i], mesh, threadCounts, fileNormals, std::vector<float>());
+	}
+
+	ObjMesh torus;
+	std::vector<float> normals, tangents;
+	GenerateTorus(1024, 512, &torus, &normals, &tangents);
+	Benchmark("generated torus", torus, threadCounts, normals, tangents);
+	return 0;
+}
+
+#endif
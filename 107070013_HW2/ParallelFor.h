@@ -0,0 +1,34 @@
+///////////////////////////////////////////////////////////////////////////////
+// ParallelFor.h
+// =============
+// ParallelFor() hands out the indices of a loop to a few threads one at a
+// time, so tasks of uneven cost still keep every thread busy. The calling
+// thread takes part, and the threads are started and joined per call.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef PARALLEL_FOR_H_DEF
+#define PARALLEL_FOR_H_DEF
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// run task(i) for i in [0, count) on threadCount threads, the calling thread included
+template <typename Task>
+inline void ParallelFor(size_t count, unsigned int threadCount, const Task& task)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+			task(i);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < threadCount && t < count; t++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+#endif
@@ -6,11 +6,24 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "textfile.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include <STB/stb_image.h>
 
 #include "Vectors.h"
 #include "Matrices.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
+#include "ObjMesh.h"
+#include "ObjMeshParallel.h"
+#include "MeshOptimizer.h"
+#include "MeshNormals.h"
+#include "LoaderBenchmark.h"
+#include "NormalsBenchmark.h"
+#include "FramePacing.h"
+#include "GpuResources.h"
+#include "ImageWriter.h"
+#include "SceneManifest.h"
+#include "AssetLoader.h"
 
 #define PI 3.1415926
 
@@ -32,6 +45,9 @@ bool mouse_pressed = false;
 int starting_press_x = -1;
 int starting_press_y = -1;
 
+// frames are drawn when something changed, or continuously with --continuous / V
+FramePacer pacer;
+
 enum TransMode
 {
 	GeoTranslation = 0,
@@ -81,6 +97,11 @@ Vector3 lightPos_p = Vector3(0.0f, 2.0f, 1.0f);
 Vector3 lightPos_s = Vector3(0.0f, 0.0f, 2.0f);
 
 vector<string> filenames; // .obj filename list
+GpuResources gpuResources; // owns the GL objects of the shapes and the program
+GpuHandle programObject;
+LoadArena loadArena; // temporaries of the model being loaded
+vector<string> model_list{ "../NormalModels/bunny5KN.obj", "../NormalModels/dragon10KN.obj", "../NormalModels/lucy25KN.obj", "../NormalModels/teapot4KN.obj", "../NormalModels/dolphinN.obj" };
+SceneManifest sceneManifest; // --scene <manifest.json>, its meshes replace model_list
 
 struct PhongMaterial
 {
@@ -91,13 +112,12 @@ struct PhongMaterial
 
 typedef struct
 {
-	GLuint vao;
-	GLuint vbo;
-	GLuint vboTex;
-	GLuint ebo;
-	GLuint p_color;
+	GpuHandle vao;
+	GpuHandle vbo;
+	GpuHandle ebo;
+	GpuHandle p_color;
 	int vertex_count;
-	GLuint p_normal;
+	GpuHandle p_normal;
 	PhongMaterial material;
 	int indexCount;
 	GLuint m_texture;
@@ -108,11 +128,51 @@ struct model
 	Vector3 position = Vector3(0, 0, 0);
 	Vector3 scale = Vector3(1, 1, 1);
 	Vector3 rotation = Vector3(0, 0, 0);	// Euler form
+	bool loaded = false;	// taken in from the loader, a model that cannot be loaded has no shapes
 
 	vector<Shape> shapes;
 };
 vector<model> models;
 
+// a model parsed on the loader thread, uploaded by the main thread
+struct shape_asset
+{
+	vector<GLfloat> vertices;
+	vector<GLfloat> colors;
+	vector<GLfloat> normals;
+	vector<GLuint> indices;
+	PhongMaterial material;
+};
+struct model_asset
+{
+	vector<shape_asset> shapes;
+};
+
+// models are loaded the first time they are shown, on the loader thread, and taken in
+// by the main thread before the next frame (ResolveModels); nothing is drawn until then
+struct model_loading
+{
+	AssetLoader<model_asset> loader;	// by file
+	vector<AssetLoader<model_asset>::Future> pending;	// by model, valid from the request until taken in
+	vector<double> requestTime;
+};
+model_loading modelLoading;
+
+// time to the first frame and to the first model, since the app started
+struct startup_setting
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	double manifestMs = -1;	// --scene parsed
+	double firstFrameMs = -1;	// first frame swapped
+	double modelMs = -1;	// the model shown first is taken in
+};
+startup_setting startup;
+
+double StartupMs()
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - startup.start).count();
+}
+
 struct camera
 {
 	Vector3 position;
@@ -327,6 +387,14 @@ void ChangeSize(GLFWwindow* window, int width, int height)
 	// [TODO] change your aspect ratio
 	proj.aspect = (float)(width/2) / (float)height;
 	setPerspective();
+	pacer.requestFrame();
+}
+
+// Call back function for an exposed or damaged window, its contents have to be drawn
+// again even when nothing changed
+void RefreshWindow(GLFWwindow* window)
+{
+	pacer.requestFrame();
 }
 
 
@@ -377,8 +445,8 @@ void RenderScene(void) {
 		// set glViewport and draw twice ... 
 		per_vertex = 1;
 		glUniform1i(uniform.iLocper_vertex, per_vertex);
-		glBindVertexArray(models[cur_idx].shapes[i].vao);
-		glDrawArrays(GL_TRIANGLES, 0, models[cur_idx].shapes[i].vertex_count);
+		glBindVertexArray(models[cur_idx].shapes[i].vao.get());
+		glDrawElements(GL_TRIANGLES, models[cur_idx].shapes[i].indexCount, GL_UNSIGNED_INT, 0);
 		glUniform3fv(uniform.iLocKa, 1, &(models[cur_idx].shapes[i].material.Ka[0]));
 		glUniform3fv(uniform.iLocKd, 1, &(models[cur_idx].shapes[i].material.Kd[0]));
 		glUniform3fv(uniform.iLocKs, 1, &(models[cur_idx].shapes[i].material.Ks[0]));
@@ -392,8 +460,8 @@ void RenderScene(void) {
 		// set glViewport and draw twice ...
 		per_vertex = 0;
 		glUniform1i(uniform.iLocper_vertex, per_vertex);
-		glBindVertexArray(models[cur_idx].shapes[i].vao);
-		glDrawArrays(GL_TRIANGLES, 0, models[cur_idx].shapes[i].vertex_count);
+		glBindVertexArray(models[cur_idx].shapes[i].vao.get());
+		glDrawElements(GL_TRIANGLES, models[cur_idx].shapes[i].indexCount, GL_UNSIGNED_INT, 0);
 		glUniform3fv(uniform.iLocKa, 1, &(models[cur_idx].shapes[i].material.Ka[0]));
 		glUniform3fv(uniform.iLocKd, 1, &(models[cur_idx].shapes[i].material.Kd[0]));
 		glUniform3fv(uniform.iLocKs, 1, &(models[cur_idx].shapes[i].material.Ks[0]));
@@ -405,20 +473,42 @@ void RenderScene(void) {
 }
 
 
+void PrintFramePacing()
+{
+	FramePacingReport r = pacer.report(glfwGetTime());
+	printf("Frame pacing (%s): %.1f s, %llu frames, %llu idle wakeups, %.1f s waiting (%.0f frames skipped), CPU %.1f%%\n",
+		pacer.isContinuous() ? "continuous" : "on demand", r.seconds, r.frames, r.idleWakeups, r.waitSeconds, r.skippedFrames, r.cpuPercent);
+}
+
+void PrintGpuResources()
+{
+	GpuResourceReport r = gpuResources.report();
+	printf("GPU memory: %.2f MB, peak %.2f MB\n", r.totalBytes / 1048576.0, r.peakBytes / 1048576.0);
+	for (int i = 0; i < GPU_CATEGORIES; i++)
+	{
+		printf("  %-14s %5d objects %9.2f MB\n", GpuResources::categoryName(i), (int)r.count[i], r.bytes[i] / 1048576.0);
+	}
+}
+
+void RequestModel(int idx);
+
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+	pacer.requestFrame();
 	// [TODO] Call back function for keyboard
 	if (key == GLFW_KEY_Z && action == GLFW_PRESS) {/* switch pre model */
 		cur_idx -= 1;
 		if (cur_idx < 0) {
-			cur_idx = 4;
+			cur_idx = model_list.size() - 1;
 		}
+		RequestModel(cur_idx);
 	}
 	else if (key == GLFW_KEY_X && action == GLFW_PRESS) {/* switch post model */
 		cur_idx += 1;
-		if (cur_idx > 4) {
+		if (cur_idx >= model_list.size()) {
 			cur_idx = 0;
 		}
+		RequestModel(cur_idx);
 	}
 	else if (key == GLFW_KEY_T && action == GLFW_PRESS) {/* translation mode */
 		cur_trans_mode = GeoTranslation;
@@ -442,11 +532,22 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 	else if (key == GLFW_KEY_J && action == GLFW_PRESS) {/* switch to shininess editinig mode */
 		cur_trans_mode = ShininessEdit;
 	}
+	else if (key == GLFW_KEY_I && action == GLFW_PRESS) {/* print frame pacing and GPU memory */
+		PrintFramePacing();
+		PrintGpuResources();
+	}
+	else if (key == GLFW_KEY_V && action == GLFW_PRESS) {/* switch between render on demand and continuous */
+		PrintFramePacing();
+		pacer.setContinuous(!pacer.isContinuous());
+		pacer.startPeriod(glfwGetTime());
+		printf("Rendering %s\n", pacer.isContinuous() ? "continuously" : "on demand");
+	}
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
 	// [TODO] scroll up positive, otherwise it would be negtive
+	pacer.requestFrame();
 	if (cur_trans_mode == GeoTranslation) {
 		models[cur_idx].position.z += 0.5*yoffset;
 	}
@@ -497,6 +598,7 @@ static void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos)
 	starting_press_y = ypos;
 
 	if (mouse_pressed) {
+		pacer.requestFrame();
 		if (cur_trans_mode == GeoTranslation) {
 			models[cur_idx].position.x += 0.01*xoffset;
 			models[cur_idx].position.y += 0.01*yoffset;
@@ -617,127 +719,7 @@ void setShaders()
 		system("pause");
 		exit(123);
 	}
-}
-
-void normalization(tinyobj::attrib_t* attrib, vector<GLfloat>& vertices, vector<GLfloat>& colors, vector<GLfloat>& normals, tinyobj::shape_t* shape)
-{
-	vector<float> xVector, yVector, zVector;
-	float minX = 10000, maxX = -10000, minY = 10000, maxY = -10000, minZ = 10000, maxZ = -10000;
-
-	// find out min and max value of X, Y and Z axis
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		//maxs = max(maxs, attrib->vertices.at(i));
-		if (i % 3 == 0)
-		{
-
-			xVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minX)
-			{
-				minX = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxX)
-			{
-				maxX = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 1)
-		{
-			yVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minY)
-			{
-				minY = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxY)
-			{
-				maxY = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 2)
-		{
-			zVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minZ)
-			{
-				minZ = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxZ)
-			{
-				maxZ = attrib->vertices.at(i);
-			}
-		}
-	}
-
-	float offsetX = (maxX + minX) / 2;
-	float offsetY = (maxY + minY) / 2;
-	float offsetZ = (maxZ + minZ) / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		if (offsetX != 0 && i % 3 == 0)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetX;
-		}
-		else if (offsetY != 0 && i % 3 == 1)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetY;
-		}
-		else if (offsetZ != 0 && i % 3 == 2)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetZ;
-		}
-	}
-
-	float greatestAxis = maxX - minX;
-	float distanceOfYAxis = maxY - minY;
-	float distanceOfZAxis = maxZ - minZ;
-
-	if (distanceOfYAxis > greatestAxis)
-	{
-		greatestAxis = distanceOfYAxis;
-	}
-
-	if (distanceOfZAxis > greatestAxis)
-	{
-		greatestAxis = distanceOfZAxis;
-	}
-
-	float scale = greatestAxis / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
-	{
-		//std::cout << i << " = " << (double)(attrib.vertices.at(i) / greatestAxis) << std::endl;
-		attrib->vertices.at(i) = attrib->vertices.at(i) / scale;
-	}
-	size_t index_offset = 0;
-	for (size_t f = 0; f < shape->mesh.num_face_vertices.size(); f++) {
-		int fv = shape->mesh.num_face_vertices[f];
-
-		// Loop over vertices in the face.
-		for (size_t v = 0; v < fv; v++) {
-			// access to vertex
-			tinyobj::index_t idx = shape->mesh.indices[index_offset + v];
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 0]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 1]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 2]);
-			// Optional: vertex colors
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 0]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 1]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 2]);
-			// Optional: vertex normals
-			if (idx.normal_index >= 0) {
-				normals.push_back(attrib->normals[3 * idx.normal_index + 0]);
-				normals.push_back(attrib->normals[3 * idx.normal_index + 1]);
-				normals.push_back(attrib->normals[3 * idx.normal_index + 2]);
-			}
-		}
-		index_offset += fv;
-	}
+	programObject = gpuResources.adoptProgram(p);
 }
 
 string GetBaseDir(const string& filepath) {
@@ -746,14 +728,17 @@ string GetBaseDir(const string& filepath) {
 	return "";
 }
 
-void LoadModels(string model_path)
+// Parse and optimize model_path into asset, on the loader thread
+bool LoadModels(string model_path, model_asset* asset)
 {
-	vector<tinyobj::shape_t> shapes;
-	vector<tinyobj::material_t> materials;
-	tinyobj::attrib_t attrib;
-	vector<GLfloat> vertices;
-	vector<GLfloat> colors;
-	vector<GLfloat> normals;
+	ObjMesh mesh;
+	ObjLoadStats stats;
+	// temporaries live in loadArena, which is reset after the load
+	LoadArenaVector<GLfloat> vertices(&loadArena);
+	LoadArenaVector<GLfloat> colors(&loadArena);
+	LoadArenaVector<GLfloat> normals(&loadArena);
+	LoadArenaVector<GLuint> indices(&loadArena);
+	MeshOptimizeStats optimizeStats;
 
 	string err;
 	string warn;
@@ -766,7 +751,8 @@ void LoadModels(string model_path)
 	base_dir += "/";
 #endif
 
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, model_path.c_str(), base_dir.c_str());
+	// parse, find the bounding box and normalize in one go
+	bool ret = LoadObjMeshParallel(model_path, base_dir, &mesh, &warn, &err, &stats);
 
 	if (!warn.empty()) {
 		cout << warn << std::endl;
@@ -777,12 +763,20 @@ void LoadModels(string model_path)
 	}
 
 	if (!ret) {
-		exit(1);
+		return false;
 	}
 
-	printf("Load Models Success ! Shapes size %d Material size %d\n", int(shapes.size()), int(materials.size()));
-	model tmp_model;
+	printf("Load Models Success ! Shapes size %d Material size %d\n", int(mesh.groups.size()), int(mesh.materials.size()));
+	printf("  %.2f MB, parse %.2f ms, normalize %.2f ms, peak memory %.2f MB\n", stats.fileBytes / 1048576.0,
+		stats.parseMs, stats.normalizeMs, stats.peakMemoryBytes / 1048576.0);
+
+	// smooth normals for the faces without, no tangents as the shaders have no normal maps
+	MeshNormalStats normalStats;
+	if (GenerateMeshNormals(&mesh, 0, &normalStats))
+		printf("  %d normals for %d corners: adjacency %.2f ms, normals %.2f ms\n",
+			int(normalStats.generatedNormals), int(normalStats.missingCorners), normalStats.adjacencyMs, normalStats.normalsMs);
 
+	const vector<tinyobj::material_t>& materials = mesh.materials;
 	vector<PhongMaterial> allMaterial;
 	for (int i = 0; i < materials.size(); i++)
 	{
@@ -793,47 +787,184 @@ void LoadModels(string model_path)
 		allMaterial.push_back(material);
 	}
 
-	for (int i = 0; i < shapes.size(); i++)
+	for (int i = 0; i < mesh.groups.size(); i++)
 	{
 
 		vertices.clear();
 		colors.clear();
 		normals.clear();
-		normalization(&attrib, vertices, colors, normals, &shapes[i]);
+		FlattenObjGroup(mesh, i, &vertices, &colors, &normals, NULL, NULL);
+		// indexed and reordered for the vertex cache, overdraw and vertex fetch
+		optimizeStats.add(OptimizeTriangleList(&vertices, &colors, &normals, NULL, &indices));
 		// printf("Vertices size: %d", vertices.size() / 3);
 
+		// out of the arena, which is reset once the load returns
+		shape_asset shape;
+		shape.vertices.assign(vertices.begin(), vertices.end());
+		shape.colors.assign(colors.begin(), colors.end());
+		shape.normals.assign(normals.begin(), normals.end());
+		shape.indices.assign(indices.begin(), indices.end());
+
+		// not support per face material, use material of first face
+		int material_id = mesh.faceMaterials[mesh.groups[i].firstFace];
+		if (material_id >= 0 && material_id < allMaterial.size())
+			shape.material = allMaterial[material_id];
+		asset->shapes.push_back(std::move(shape));
+	}
+	printf("  vertex cache (%d entry FIFO): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %d vertices welded to %d, %d clusters, %.2f ms\n",
+		VERTEX_CACHE_SIZE, optimizeStats.acmrBefore(), optimizeStats.acmrAfter(), optimizeStats.atvrBefore(), optimizeStats.atvrAfter(),
+		(int)optimizeStats.triangles * 3, (int)optimizeStats.vertices, (int)optimizeStats.clusters, optimizeStats.optimizeMs);
+	return true;
+}
+
+shared_ptr<model_asset> LoadModelAsset(const string& model_path)
+{
+	shared_ptr<model_asset> asset(new model_asset());
+	bool loaded = LoadModels(model_path, asset.get());
+	// the temporaries of the load are dead now, drop them all at once
+	const LoadArenaStats& arenaStats = loadArena.getStats();
+	printf("  temporaries: %d allocations, %.2f MB, %d heap blocks\n", (int)arenaStats.allocations,
+		arenaStats.bytes / 1048576.0, (int)arenaStats.heapBlocks);
+	loadArena.reset();
+	return loaded ? asset : shared_ptr<model_asset>();
+}
+
+// Upload the shapes of a loaded model into models[idx]
+void AdoptModel(int idx, const model_asset& asset)
+{
+	for (int i = 0; i < asset.shapes.size(); i++)
+	{
+		const shape_asset& shape = asset.shapes[i];
 		Shape tmp_shape;
-		glGenVertexArrays(1, &tmp_shape.vao);
-		glBindVertexArray(tmp_shape.vao);
+		tmp_shape.vao = gpuResources.createVertexArray();
+		glBindVertexArray(tmp_shape.vao.get());
 
-		glGenBuffers(1, &tmp_shape.vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.vbo);
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GL_FLOAT), &vertices.at(0), GL_STATIC_DRAW);
+		tmp_shape.vbo = gpuResources.createBuffer(GPU_GEOMETRY);
+		GpuBufferData(GL_ARRAY_BUFFER, tmp_shape.vbo, shape.vertices.size() * sizeof(GLfloat), &shape.vertices.at(0), GL_STATIC_DRAW);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		tmp_shape.vertex_count = vertices.size() / 3;
+		tmp_shape.vertex_count = shape.vertices.size() / 3;
 
-		glGenBuffers(1, &tmp_shape.p_color);
-		glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_color);
-		glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(GL_FLOAT), &colors.at(0), GL_STATIC_DRAW);
+		tmp_shape.p_color = gpuResources.createBuffer(GPU_GEOMETRY);
+		GpuBufferData(GL_ARRAY_BUFFER, tmp_shape.p_color, shape.colors.size() * sizeof(GLfloat), &shape.colors.at(0), GL_STATIC_DRAW);
 		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-		glGenBuffers(1, &tmp_shape.p_normal);
-		glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_normal);
-		glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(GL_FLOAT), &normals.at(0), GL_STATIC_DRAW);
+		tmp_shape.p_normal = gpuResources.createBuffer(GPU_GEOMETRY);
+		GpuBufferData(GL_ARRAY_BUFFER, tmp_shape.p_normal, shape.normals.size() * sizeof(GLfloat), &shape.normals.at(0), GL_STATIC_DRAW);
 		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
+		tmp_shape.ebo = gpuResources.createBuffer(GPU_GEOMETRY);
+		GpuBufferData(GL_ELEMENT_ARRAY_BUFFER, tmp_shape.ebo, shape.indices.size() * sizeof(GLuint), &shape.indices.at(0), GL_STATIC_DRAW);
+		tmp_shape.indexCount = shape.indices.size();
+
 		glEnableVertexAttribArray(0);
 		glEnableVertexAttribArray(1);
 		glEnableVertexAttribArray(2);
 
-		// not support per face material, use material of first face
-		if (allMaterial.size() > 0)
-			tmp_shape.material = allMaterial[shapes[i].mesh.material_ids[0]];
-		tmp_model.shapes.push_back(tmp_shape);
+		tmp_shape.material = shape.material;
+		models[idx].shapes.push_back(std::move(tmp_shape));
+	}
+}
+
+// Queue the load of model_list[idx] the first time it is shown; Z / X and the golden
+// images get to the others. A model that cannot be loaded is not tried again
+void RequestModel(int idx)
+{
+	if (models[idx].loaded || modelLoading.pending[idx].valid())
+		return;
+	string path = model_list[idx];
+	modelLoading.requestTime[idx] = glfwGetTime();
+	modelLoading.pending[idx] = modelLoading.loader.request(path, [path] { return LoadModelAsset(path); });
+}
+
+// On the main thread before a frame: take in the models loaded since the last one,
+// true if there was one
+bool ResolveModels()
+{
+	bool taken = false;
+	for (int m = 0; m < models.size(); m++)
+	{
+		AssetLoader<model_asset>::Future& pending = modelLoading.pending[m];
+		if (!pending.valid() || pending.wait_for(chrono::seconds(0)) != future_status::ready)
+			continue;
+		shared_ptr<model_asset> asset = pending.get();
+		pending = AssetLoader<model_asset>::Future();
+		double ms = (glfwGetTime() - modelLoading.requestTime[m]) * 1000.0;
+		models[m].loaded = true;
+		taken = true;
+		if (asset)
+		{
+			AdoptModel(m, *asset);
+			printf("Loaded %s on first use, %.2f ms after the request\n", model_list[m].c_str(), ms);
+		}
+		else
+			printf("Cannot load %s, nothing is drawn for it\n", model_list[m].c_str());
+		if (startup.modelMs < 0)
+		{
+			startup.modelMs = StartupMs();
+			printf("Startup: the model shown first was taken in %.2f ms after start\n", startup.modelMs);
+		}
 	}
-	shapes.clear();
-	materials.clear();
-	models.push_back(tmp_model);
+	return taken;
+}
+
+// Load model_list[idx] now, for the golden images
+void WaitForModel(int idx)
+{
+	RequestModel(idx);
+	if (modelLoading.pending[idx].valid())
+		modelLoading.pending[idx].wait();
+	ResolveModels();
+}
+
+// The time from the start of the app to the first frame swapped, once
+void StartupFrameShown()
+{
+	if (startup.firstFrameMs >= 0)
+		return;
+	startup.firstFrameMs = StartupMs();
+	if (startup.manifestMs >= 0)
+		printf("Startup: manifest parsed %.2f ms, first frame drawn %.2f ms after start\n", startup.manifestMs, startup.firstFrameMs);
+	else
+		printf("Startup: first frame drawn %.2f ms after start\n", startup.firstFrameMs);
+}
+
+// Lights and camera of the --scene manifest. HW2 has no textures, projects in
+// perspective only and shows one model at a time, so the instances are not used
+void ApplySceneManifest()
+{
+	Vector3* positions[] = { &lightPos_d, &lightPos_p, &lightPos_s };
+	Vector3* intensities[] = { &I_d, &I_p, &I_s };
+	for (int l = 0; l < 3; l++)
+	{
+		const ManifestLight& light = sceneManifest.lights[l];
+		if (!light.set)
+			continue;
+		*positions[l] = Vector3(light.position[0], light.position[1], light.position[2]);
+		*intensities[l] = Vector3(light.intensity[0], light.intensity[1], light.intensity[2]);
+	}
+	cur_light_id = sceneManifest.lightType >= 0 ? sceneManifest.lightType : cur_light_id;
+	shininess = sceneManifest.shininess >= 0 ? sceneManifest.shininess : shininess;
+	spot_cutoff = sceneManifest.spotCutoff >= 0 ? sceneManifest.spotCutoff : spot_cutoff;
+
+	if (sceneManifest.hasCamera)
+	{
+		main_camera.position = Vector3(sceneManifest.cameraPosition[0], sceneManifest.cameraPosition[1], sceneManifest.cameraPosition[2]);
+		main_camera.center = Vector3(sceneManifest.cameraCenter[0], sceneManifest.cameraCenter[1], sceneManifest.cameraCenter[2]);
+		main_camera.up_vector = Vector3(sceneManifest.cameraUp[0], sceneManifest.cameraUp[1], sceneManifest.cameraUp[2]);
+		setViewingMatrix();
+	}
+	proj.fovy = sceneManifest.fovy > 0 ? sceneManifest.fovy : proj.fovy;
+	setPerspective();
+}
+
+// Delete every GL object while the context is still current
+void ReleaseGpuResources()
+{
+	// no load may finish into the shapes being deleted
+	modelLoading.loader.stop();
+	models.clear();
+	programObject.reset();
+	gpuResources.closeContext();
 }
 
 void initParameter()
@@ -864,11 +995,17 @@ void setupRC()
 
 	// OpenGL States and Values
 	glClearColor(0.2, 0.2, 0.2, 1.0);
-	vector<string> model_list{ "../NormalModels/bunny5KN.obj", "../NormalModels/dragon10KN.obj", "../NormalModels/lucy25KN.obj", "../NormalModels/teapot4KN.obj", "../NormalModels/dolphinN.obj" };
+	if (!sceneManifest.meshes.empty())
+		ApplySceneManifest();
+
 	// [DONE] Load five model at here
-	for (int i = 0; i <= 4; i++) {
-		LoadModels(model_list[i]);
-	}
+	// only the one shown first, the others once they are switched to
+	models.resize(model_list.size());
+	modelLoading.pending.resize(model_list.size());
+	modelLoading.requestTime.assign(model_list.size(), 0);
+	// a finished load wakes the main loop up to take the model in
+	modelLoading.loader.setListener(glfwPostEmptyEvent);
+	RequestModel(cur_idx);
 }
 
 void glPrintContextInfo(bool printExtension)
@@ -889,9 +1026,261 @@ void glPrintContextInfo(bool printExtension)
 	}
 }
 
+// Golden image regression test:
+//     --golden record|check <dir> [gl [min PSNR]]
+// renders every model of model_list with all lights into a framebuffer object
+// of a hidden window, the per-pixel and per-vertex viewports go to separate
+// PNGs in dir. check compares with them and fails below min PSNR (40 dB by
+// default), the image of a failed case is kept next to its golden one. It runs
+// headless on Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1).
+struct GoldenOptions
+{
+	bool record;
+	string dir;
+	double minPsnr;
+};
+
+// false after printing the usage when the arguments are not record|check <dir> [gl [min PSNR]]
+bool ParseGoldenArguments(int argc, char **argv, GoldenOptions* options)
+{
+	string command = (argc > 2) ? argv[2] : "";
+	string backend = (argc > 4) ? argv[4] : "gl";
+	options->record = command == "record";
+	options->dir = (argc > 3) ? argv[3] : "";
+	options->minPsnr = (argc > 5) ? atof(argv[5]) : 40.0;
+	if ((command != "record" && command != "check") || options->dir.empty() || backend != "gl" || options->minPsnr <= 0)
+	{
+		printf("Usage: --golden record|check <dir> [gl [min PSNR]]\n");
+		return false;
+	}
+	return true;
+}
+
+// file name of model_list[model] without directory and extension
+string ModelName(int model)
+{
+	string base = model_list[model];
+	size_t slash = base.find_last_of("/\\");
+	if (slash != string::npos)
+		base = base.substr(slash + 1);
+	return base.substr(0, base.find_last_of('.'));
+}
+
+// RGBA8 of a PNG written by WritePng(), top row first
+bool ReadGoldenImage(const string& path, vector<unsigned char>* rgba, int width, int height)
+{
+	int imageWidth, imageHeight, channels;
+	stbi_set_flip_vertically_on_load(false);
+	stbi_uc* data = stbi_load(path.c_str(), &imageWidth, &imageHeight, &channels, 4);
+	if (!data)
+		return false;
+	bool sameSize = imageWidth == width && imageHeight == height;
+	if (sameSize)
+		rgba->assign(data, data + (size_t)width * height * 4);
+	stbi_image_free(data);
+	return sameSize;
+}
+
+// PSNR of the RGB of two RGBA8 images, offShare: part of the pixels with a channel off by more than 8
+double CompareImages(const vector<unsigned char>& a, const vector<unsigned char>& b, double* offShare)
+{
+	double squared = 0;
+	size_t off = 0, pixels = a.size() / 4;
+	for (size_t i = 0; i < pixels; i++)
+	{
+		int maxDifference = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			int difference = abs((int)a[i * 4 + k] - (int)b[i * 4 + k]);
+			squared += difference * difference;
+			maxDifference = max(maxDifference, difference);
+		}
+		off += (maxDifference > 8) ? 1 : 0;
+	}
+	*offShare = pixels ? (double)off / pixels : 0;
+	double mse = squared / max(pixels * 3, (size_t)1);
+	return (mse > 0) ? 10.0 * log10(255.0 * 255.0 / mse) : 1e9;
+}
+
+// record the image or compare it with the golden one, print its line; false when it failed
+bool RecordOrCheckImage(const GoldenOptions& options, const string& name, const vector<unsigned char>& image, int width, int height, double ms)
+{
+	string path = options.dir + "/" + name;
+	if (options.record)
+	{
+		bool written = WritePng(path, image, width, height);
+		printf("  %-44s %10.2f %10s %8s  %s\n", name.c_str(), ms, "", "", written ? "recorded" : "CANNOT WRITE");
+		return written;
+	}
+	vector<unsigned char> golden;
+	if (!ReadGoldenImage(path, &golden, width, height))
+	{
+		WritePng(path + ".actual.png", image, width, height);
+		printf("  %-44s %10.2f %10s %8s  MISSING\n", name.c_str(), ms, "", "");
+		return false;
+	}
+	double offShare;
+	double psnr = CompareImages(image, golden, &offShare);
+	bool pass = psnr >= options.minPsnr;
+	if (pass)
+		remove((path + ".actual.png").c_str());
+	else
+		WritePng(path + ".actual.png", image, width, height);
+	printf("  %-44s %10.2f %10.2f %8.3f  %s\n", name.c_str(), ms, min(psnr, 999.99), offShare * 100.0, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Bind a new framebuffer object of width x height, RGBA8 color with depth and stencil
+bool CreateOffscreenFramebuffer(int width, int height, GLuint* framebuffer, GLuint renderbuffers[2])
+{
+	glGenFramebuffers(1, framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void DeleteOffscreenFramebuffer(GLuint framebuffer, const GLuint renderbuffers[2])
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(2, renderbuffers);
+}
+
+// RGBA8 of the bound framebuffer, top row first
+vector<unsigned char> ReadFramebuffer(int width, int height)
+{
+	vector<unsigned char> rows((size_t)width * height * 4), image(rows.size());
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &rows[0]);
+	for (int y = 0; y < height; y++)
+	{
+		memcpy(&image[(size_t)y * width * 4], &rows[(size_t)(height - 1 - y) * width * 4], (size_t)width * 4);
+	}
+	return image;
+}
+
+// view 0 is the left (per-pixel) viewport, 1 the right (per-vertex) one
+string GoldenName(int model, int light, int view)
+{
+	const char* lights[] = { "directional", "point", "spot" };
+	return string("gl_") + ModelName(model) + "_" + lights[light] + "_" + (view == 0 ? "pixel" : "vertex") + ".png";
+}
+
+int RunGoldenImages(const GoldenOptions& options)
+{
+	int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+	GLuint framebuffer = 0, renderbuffers[2] = { 0, 0 };
+	if (!CreateOffscreenFramebuffer(width, height, &framebuffer, renderbuffers))
+	{
+		printf("Cannot create the offscreen framebuffer\n");
+		return 1;
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	ChangeSize(NULL, width, height);
+
+	printf("Golden images, %dx%d per view, %s %s, min PSNR %.1f dB\n", width / 2, height,
+		options.record ? "recording to" : "checking against", options.dir.c_str(), options.minPsnr);
+	printf("  %-44s %10s %10s %8s\n", "image", "frame(ms)", "PSNR(dB)", "off(%)");
+	int images = 0, failed = 0;
+	double totalMs = 0;
+	for (int m = 0; m < model_list.size(); m++)
+	{
+		cur_idx = m;
+		WaitForModel(m);
+		for (int light = 0; light < 3; light++)
+		{
+			cur_light_id = light;
+			// RenderScene leaves the viewport and the materials for the next frame,
+			// the second frame is the one shown on screen
+			RenderScene();
+			glFinish();
+			double start = glfwGetTime();
+			RenderScene();
+			glFinish();
+			double ms = (glfwGetTime() - start) * 1000.0;
+			totalMs += ms;
+			vector<unsigned char> frame = ReadFramebuffer(width, height);
+
+			for (int view = 0; view < 2; view++)
+			{
+				int viewWidth = width / 2;
+				vector<unsigned char> image((size_t)viewWidth * height * 4);
+				for (int y = 0; y < height; y++)
+				{
+					memcpy(&image[(size_t)y * viewWidth * 4], &frame[((size_t)y * width + view * viewWidth) * 4], (size_t)viewWidth * 4);
+				}
+				images++;
+				if (!RecordOrCheckImage(options, GoldenName(m, light, view), image, viewWidth, height, ms))
+					failed++;
+			}
+		}
+	}
+	cur_light_id = 0;
+	DeleteOffscreenFramebuffer(framebuffer, renderbuffers);
+	printf("%d images, %d %s, %.2f ms per frame, %.2f ms total\n", images, failed, options.record ? "not written" : "failed",
+		totalMs / max(images / 2, 1), totalMs);
+	return failed ? 1 : 0;
+}
+
+bool HasArgument(int argc, char **argv, const char* argument)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (string(argv[i]) == argument)
+			return true;
+	}
+	return false;
+}
+
+// the argument after name, or fallback
+const char* ArgumentValue(int argc, char **argv, const char* name, const char* fallback)
+{
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (string(argv[i]) == name)
+			return argv[i + 1];
+	}
+	return fallback;
+}
 
 int main(int argc, char **argv)
 {
+	// loader validation and benchmark, runs without a window
+	if (argc > 1 && string(argv[1]) == "--bench-loader")
+		return RunLoaderBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	if (argc > 1 && string(argv[1]) == "--bench-normals")
+		return RunNormalsBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	// golden image regression test, in a hidden window
+	bool golden = argc > 1 && string(argv[1]) == "--golden";
+	GoldenOptions goldenOptions;
+	if (golden && !ParseGoldenArguments(argc, argv, &goldenOptions))
+		return 1;
+	// --scene <manifest.json> replaces model_list and sets the lights and the camera,
+	// the models are still loaded once they are shown
+	const char* manifestPath = ArgumentValue(argc, argv, "--scene", NULL);
+	if (manifestPath && !golden)
+	{
+		string err;
+		if (!LoadSceneManifest(manifestPath, &sceneManifest, &err))
+		{
+			printf("Cannot read the scene: %s\n", err.c_str());
+			return 1;
+		}
+		model_list.clear();
+		for (int i = 0; i < sceneManifest.meshes.size(); i++)
+		{
+			model_list.push_back(sceneManifest.meshes[i].file);
+		}
+		startup.manifestMs = StartupMs();
+		printf("Scene %s: %d meshes, parsed in %.2f ms, %.2f ms after start\n", manifestPath, (int)sceneManifest.meshes.size(),
+			sceneManifest.parseMs, startup.manifestMs);
+	}
+
 	// initial glfw
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -901,6 +1290,10 @@ int main(int argc, char **argv)
 #ifdef __APPLE__
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // fix compilation on OS X
 #endif
+	if (golden)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
 
 
 	// create window
@@ -928,22 +1321,49 @@ int main(int argc, char **argv)
 	glfwSetCursorPosCallback(window, cursor_pos_callback);
 
 	glfwSetFramebufferSizeCallback(window, ChangeSize);
+	glfwSetWindowRefreshCallback(window, RefreshWindow);
 	glEnable(GL_DEPTH_TEST);
 	// Setup render context
 	setupRC();
+	if (golden)
+	{
+		int result = RunGoldenImages(goldenOptions);
+		ReleaseGpuResources();
+		return result;
+	}
+
+	// --continuous draws every iteration, for benchmarks
+	pacer.setContinuous(HasArgument(argc, argv, "--continuous"));
+	const GLFWvidmode* videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	pacer.setRefreshRate(videoMode ? videoMode->refreshRate : 60);
+	pacer.startPeriod(glfwGetTime());
 
 	// main loop
 	while (!glfwWindowShouldClose(window))
 	{
+		if (ResolveModels())
+			pacer.requestFrame();
+		// sleep until an event changes what is shown
+		if (!pacer.shouldDraw())
+		{
+			double waitStart = glfwGetTime();
+			glfwWaitEventsTimeout(FRAME_WAIT_TIMEOUT);
+			pacer.waited(glfwGetTime() - waitStart, pacer.shouldDraw());
+			continue;
+		}
+
 		// render
 		RenderScene();
 
 		// swap buffer from back to front
 		glfwSwapBuffers(window);
+		pacer.frameDrawn();
+		StartupFrameShown();
 
 		// Poll input event
 		glfwPollEvents();
 	}
+	ReleaseGpuResources();
 
 	// just for compatibiliy purposes
 	return 0;
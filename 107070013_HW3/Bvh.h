@@ -0,0 +1,742 @@
+///////////////////////////////////////////////////////////////////////////////
+// Bvh.h
+// =====
+// Bounding volume hierarchies for ray queries against the loaded models.
+//
+// BuildBvh() splits primitive boxes with the binned surface area heuristic
+// (Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies",
+// 2007): the centroids are sorted into BVH_BINS bins per axis and the
+// cheapest bin border wins, or the node stays a leaf when that is cheaper.
+// The top of the tree is split on the calling thread until there is a
+// subtree for every worker, the subtrees are built in parallel and appended
+// to one node array.
+//
+// Nodes are 32 bytes, two per cache line, and the two children of a node are
+// stored next to each other, so a node keeps the index of the first one only.
+// A ray is tested against a node box with one SSE slab test.
+//
+// MeshBvh is the bottom level over the triangles of a model, SceneBvh the top
+// level over the instances of the scene, each pointing to the MeshBvh of its
+// model and carrying its world matrix. ScreenRay() turns a cursor position
+// into a world space ray for picking.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef BVH_H_DEF
+#define BVH_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "Matrices.h"
+#include "ParallelFor.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define BVH_SSE
+#include <emmintrin.h>
+#endif
+
+struct BvhNode
+{
+	float min[3];
+	int leftFirst;	// first child of an inner node, first primitive of a leaf
+	float max[3];
+	int count;		// primitives of a leaf, 0 for inner nodes
+};
+
+struct BvhBuildStats
+{
+	size_t nodes;
+	size_t leaves;
+	int depth;
+	float sahCost;	// expected cost of a ray relative to one primitive test
+	double buildMs;
+
+	BvhBuildStats() : nodes(0), leaves(0), depth(0), sahCost(0), buildMs(0) {}
+};
+
+struct RayHit
+{
+	float t;			// hit point = origin + t * direction
+	float u, v;			// barycentric coordinates of the hit in the triangle
+	int triangle;		// id given to MeshBvh::build()
+	int instance;		// id given to SceneBvh::build(), -1 for a MeshBvh query
+};
+
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 8;
+const float BVH_TRAVERSAL_COST = 1.0f;	// relative to one primitive test
+
+namespace bvh_detail
+{
+	const float NO_HIT = 1e30f;
+
+	struct Box
+	{
+		float min[3], max[3];
+
+		void reset()
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				min[k] = 1e30f;
+				max[k] = -1e30f;
+			}
+		}
+
+		void grow(const float* boxMin, const float* boxMax)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				min[k] = std::min(min[k], boxMin[k]);
+				max[k] = std::max(max[k], boxMax[k]);
+			}
+		}
+
+		float area() const
+		{
+			float e[3] = { max[0] - min[0], max[1] - min[1], max[2] - min[2] };
+			if (e[0] < 0 || e[1] < 0 || e[2] < 0)
+				return 0;
+			return 2 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+		}
+	};
+
+	struct Task
+	{
+		size_t node;
+		unsigned int begin, end;
+	};
+
+	// Binned SAH over the primitive boxes (6 floats each: min xyz, max xyz)
+	class Builder
+	{
+	public:
+		Builder(const std::vector<float>& boxes, std::vector<unsigned int>* order) : boxes(boxes), order(*order)
+		{
+			size_t count = boxes.size() / 6;
+			centroids.resize(count * 3);
+			for (size_t i = 0; i < count; i++)
+			{
+				for (int k = 0; k < 3; k++)
+					centroids[i * 3 + k] = (boxes[i * 6 + k] + boxes[i * 6 + 3 + k]) * 0.5f;
+			}
+			this->order.resize(count);
+			for (size_t i = 0; i < count; i++)
+				this->order[i] = (unsigned int)i;
+		}
+
+		// fill the box of node and split its primitives once, returns false for a leaf
+		bool split(std::vector<BvhNode>& nodes, const Task& task, Task* left, Task* right)
+		{
+			Box box, centroidBox;
+			box.reset();
+			centroidBox.reset();
+			for (unsigned int i = task.begin; i < task.end; i++)
+			{
+				unsigned int p = order[i];
+				box.grow(&boxes[p * 6], &boxes[p * 6 + 3]);
+				centroidBox.grow(&centroids[p * 3], &centroids[p * 3]);
+			}
+			BvhNode& node = nodes[task.node];
+			for (int k = 0; k < 3; k++)
+			{
+				node.min[k] = box.min[k];
+				node.max[k] = box.max[k];
+			}
+			node.leftFirst = (int)task.begin;
+			node.count = (int)(task.end - task.begin);
+			if (node.count == 1)
+				return false;
+
+			int axis = -1, splitBin = 0;
+			float bestCost = 1e30f;
+			findSplit(task, centroidBox, &axis, &splitBin, &bestCost);
+
+			unsigned int mid;
+			if (axis < 0)
+			{
+				// every centroid in one spot: split in the middle once the leaf gets too big
+				if (node.count <= BVH_MAX_LEAF_SIZE)
+					return false;
+				mid = (task.begin + task.end) / 2;
+			}
+			else
+			{
+				float leafCost = (float)node.count * box.area();
+				float splitCost = BVH_TRAVERSAL_COST * box.area() + bestCost;
+				if (node.count <= BVH_MAX_LEAF_SIZE && leafCost <= splitCost)
+					return false;
+
+				float scale = BVH_BINS / (centroidBox.max[axis] - centroidBox.min[axis]);
+				float base = centroidBox.min[axis];
+				const float* c = &centroids[0];
+				mid = (unsigned int)(std::partition(order.begin() + task.begin, order.begin() + task.end, [&](unsigned int p)
+				{
+					return binOf(c[p * 3 + axis], base, scale) < splitBin;
+				}) - order.begin());
+				if (mid == task.begin || mid == task.end)
+					mid = (task.begin + task.end) / 2;
+			}
+
+			size_t first = nodes.size();
+			nodes.resize(first + 2);
+			nodes[task.node].leftFirst = (int)first;
+			nodes[task.node].count = 0;
+			Task l = { first, task.begin, mid };
+			Task r = { first + 1, mid, task.end };
+			*left = l;
+			*right = r;
+			return true;
+		}
+
+		// build the whole subtree of task, depth first so siblings stay close
+		void buildSubtree(std::vector<BvhNode>& nodes, const Task& task)
+		{
+			std::vector<Task> stack(1, task);
+			while (!stack.empty())
+			{
+				Task current = stack.back();
+				stack.pop_back();
+				Task left, right;
+				if (split(nodes, current, &left, &right))
+				{
+					stack.push_back(right);
+					stack.push_back(left);
+				}
+			}
+		}
+
+	private:
+		static int binOf(float centroid, float base, float scale)
+		{
+			int bin = (int)((centroid - base) * scale);
+			return std::min(std::max(bin, 0), BVH_BINS - 1);
+		}
+
+		// cheapest bin border over the three axes, cost = area * count of both sides
+		void findSplit(const Task& task, const Box& centroidBox, int* bestAxis, int* bestBin, float* bestCost)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				float extent = centroidBox.max[axis] - centroidBox.min[axis];
+				if (extent <= 0)
+					continue;
+				float scale = BVH_BINS / extent;
+
+				Box bins[BVH_BINS];
+				int counts[BVH_BINS] = {};
+				for (int b = 0; b < BVH_BINS; b++)
+					bins[b].reset();
+				for (unsigned int i = task.begin; i < task.end; i++)
+				{
+					unsigned int p = order[i];
+					int b = binOf(centroids[p * 3 + axis], centroidBox.min[axis], scale);
+					bins[b].grow(&boxes[p * 6], &boxes[p * 6 + 3]);
+					counts[b]++;
+				}
+
+				// areas and counts left of every border, then sweep back from the right
+				float leftArea[BVH_BINS - 1];
+				int leftCount[BVH_BINS - 1];
+				Box sweep;
+				sweep.reset();
+				int count = 0;
+				for (int b = 0; b < BVH_BINS - 1; b++)
+				{
+					sweep.grow(bins[b].min, bins[b].max);
+					count += counts[b];
+					leftArea[b] = sweep.area();
+					leftCount[b] = count;
+				}
+				sweep.reset();
+				count = 0;
+				for (int b = BVH_BINS - 1; b > 0; b--)
+				{
+					sweep.grow(bins[b].min, bins[b].max);
+					count += counts[b];
+					if (leftCount[b - 1] == 0 || count == 0)
+						continue;
+					float cost = leftArea[b - 1] * leftCount[b - 1] + sweep.area() * count;
+					if (cost < *bestCost)
+					{
+						*bestCost = cost;
+						*bestAxis = axis;
+						*bestBin = b;
+					}
+				}
+			}
+		}
+
+		const std::vector<float>& boxes;
+		std::vector<float> centroids;
+		std::vector<unsigned int>& order;
+	};
+
+	inline void CollectStats(const std::vector<BvhNode>& nodes, BvhBuildStats* stats)
+	{
+		stats->nodes = nodes.size();
+		stats->leaves = 0;
+		stats->depth = 0;
+		stats->sahCost = 0;
+		if (nodes.empty())
+			return;
+
+		Box root;
+		root.reset();
+		root.grow(nodes[0].min, nodes[0].max);
+		float rootArea = std::max(root.area(), 1e-30f);
+		std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 1));
+		while (!stack.empty())
+		{
+			const BvhNode& node = nodes[stack.back().first];
+			int depth = stack.back().second;
+			stack.pop_back();
+			Box box;
+			box.reset();
+			box.grow(node.min, node.max);
+			float area = box.area() / rootArea;
+			stats->depth = std::max(stats->depth, depth);
+			if (node.count > 0)
+			{
+				stats->leaves++;
+				stats->sahCost += area * node.count;
+			}
+			else
+			{
+				stats->sahCost += area * BVH_TRAVERSAL_COST;
+				stack.push_back(std::make_pair(node.leftFirst, depth + 1));
+				stack.push_back(std::make_pair(node.leftFirst + 1, depth + 1));
+			}
+		}
+	}
+
+	// ray with the reciprocal direction, zero components nudged so the slabs stay finite
+	struct Ray
+	{
+		float origin[3], direction[3], invDirection[3];
+#ifdef BVH_SSE
+		__m128 origin4, invDirection4;
+#endif
+
+		Ray(const float o[3], const float d[3])
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				origin[k] = o[k];
+				direction[k] = d[k];
+				float dk = (fabsf(d[k]) < 1e-20f) ? (d[k] < 0 ? -1e-20f : 1e-20f) : d[k];
+				invDirection[k] = 1.0f / dk;
+			}
+#ifdef BVH_SSE
+			// lane 3 meets leftFirst / count of the node, zero keeps it out of the way
+			origin4 = _mm_setr_ps(origin[0], origin[1], origin[2], 0.0f);
+			invDirection4 = _mm_setr_ps(invDirection[0], invDirection[1], invDirection[2], 0.0f);
+#endif
+		}
+	};
+
+	// entry distance of the ray into the node box, NO_HIT if it misses or enters beyond tMax
+	inline float IntersectNode(const BvhNode& node, const Ray& ray, float tMax)
+	{
+#ifdef BVH_SSE
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min), ray.origin4), ray.invDirection4);
+		__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max), ray.origin4), ray.invDirection4);
+		__m128 nearT = _mm_min_ps(t1, t2);
+		__m128 farT = _mm_max_ps(t1, t2);
+		// entry: max over xyz and lane 3 (0, the ray start), exit: min over xyz
+		__m128 entry = _mm_max_ps(nearT, _mm_shuffle_ps(nearT, nearT, _MM_SHUFFLE(2, 3, 0, 1)));
+		entry = _mm_max_ps(entry, _mm_shuffle_ps(entry, entry, _MM_SHUFFLE(1, 0, 3, 2)));
+		__m128 exit = _mm_min_ss(farT, _mm_shuffle_ps(farT, farT, _MM_SHUFFLE(1, 1, 1, 1)));
+		exit = _mm_min_ss(exit, _mm_shuffle_ps(farT, farT, _MM_SHUFFLE(2, 2, 2, 2)));
+		float tEntry = _mm_cvtss_f32(entry);
+		float tExit = _mm_cvtss_f32(exit);
+#else
+		float tEntry = 0, tExit = 1e30f;
+		for (int k = 0; k < 3; k++)
+		{
+			float t1 = (node.min[k] - ray.origin[k]) * ray.invDirection[k];
+			float t2 = (node.max[k] - ray.origin[k]) * ray.invDirection[k];
+			tEntry = std::max(tEntry, std::min(t1, t2));
+			tExit = std::min(tExit, std::max(t1, t2));
+		}
+#endif
+		return (tEntry <= tExit && tEntry < tMax) ? tEntry : NO_HIT;
+	}
+
+	// closest first traversal, leaf(first, count, &tMax) tests the primitives and lowers tMax.
+	// depth is the number of levels of the tree, see BvhBuildStats
+	template <typename LeafTest>
+	inline void Traverse(const std::vector<BvhNode>& nodes, int depth, const Ray& ray, float& tMax, const LeafTest& leaf)
+	{
+		if (nodes.empty() || IntersectNode(nodes[0], ray, tMax) == NO_HIT)
+			return;
+		// one far child per level at most, on the heap only for degenerate trees
+		struct Entry { int node; float t; };
+		const int localSize = 64;
+		Entry local[localSize];
+		std::vector<Entry> heap;
+		Entry* stack = local;
+		if (depth > localSize)
+		{
+			heap.resize(depth);
+			stack = &heap[0];
+		}
+		int stackSize = 0;
+		int current = 0;
+		for (;;)
+		{
+			const BvhNode& node = nodes[current];
+			if (node.count > 0)
+			{
+				leaf(node.leftFirst, node.count, tMax);
+			}
+			else
+			{
+				// near / far are macros on Windows
+				int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+				float tNear = IntersectNode(nodes[nearChild], ray, tMax);
+				float tFar = IntersectNode(nodes[farChild], ray, tMax);
+				if (tFar < tNear)
+				{
+					std::swap(nearChild, farChild);
+					std::swap(tNear, tFar);
+				}
+				if (tNear != NO_HIT)
+				{
+					if (tFar != NO_HIT)
+					{
+						Entry e = { farChild, tFar };
+						stack[stackSize++] = e;
+					}
+					current = nearChild;
+					continue;
+				}
+			}
+			// pop, skipping nodes behind the closest hit so far
+			current = -1;
+			while (stackSize > 0 && current < 0)
+			{
+				Entry e = stack[--stackSize];
+				if (e.t < tMax)
+					current = e.node;
+			}
+			if (current < 0)
+				return;
+		}
+	}
+
+	inline void TransformPoint(const Matrix4& m, const float p[3], float out[3])
+	{
+		for (int r = 0; r < 3; r++)
+			out[r] = m[r * 4] * p[0] + m[r * 4 + 1] * p[1] + m[r * 4 + 2] * p[2] + m[r * 4 + 3];
+	}
+
+	inline void TransformVector(const Matrix4& m, const float v[3], float out[3])
+	{
+		for (int r = 0; r < 3; r++)
+			out[r] = m[r * 4] * v[0] + m[r * 4 + 1] * v[1] + m[r * 4 + 2] * v[2];
+	}
+}
+
+// Build nodes over primitive boxes (6 floats each: min xyz, max xyz). order
+// receives the primitive of every leaf slot. threadCount 0 uses the hardware threads.
+inline void BuildBvh(const std::vector<float>& boxes, unsigned int threadCount, std::vector<BvhNode>* nodes,
+	std::vector<unsigned int>* order, BvhBuildStats* stats = NULL)
+{
+	using namespace bvh_detail;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	nodes->clear();
+	Builder builder(boxes, order);
+	size_t count = boxes.size() / 6;
+	if (count > 0)
+	{
+		// split the largest subtree until every worker has a few, small trees stay serial
+		nodes->resize(1);
+		Task root = { 0, 0, (unsigned int)count };
+		std::vector<Task> tasks(1, root);
+		const unsigned int minTaskSize = 4096;
+		while (threadCount > 1 && tasks.size() < threadCount * 4)
+		{
+			size_t largest = 0;
+			for (size_t i = 1; i < tasks.size(); i++)
+			{
+				if (tasks[i].end - tasks[i].begin > tasks[largest].end - tasks[largest].begin)
+					largest = i;
+			}
+			if (tasks[largest].end - tasks[largest].begin < minTaskSize)
+				break;
+			Task left, right;
+			Task task = tasks[largest];
+			tasks.erase(tasks.begin() + largest);
+			if (builder.split(*nodes, task, &left, &right))
+			{
+				tasks.push_back(left);
+				tasks.push_back(right);
+			}
+		}
+
+		// every subtree into its own array, rooted at 0
+		std::vector<std::vector<BvhNode> > subtrees(tasks.size());
+		ParallelFor(tasks.size(), threadCount, [&](size_t i)
+		{
+			subtrees[i].resize(1);
+			Task local = { 0, tasks[i].begin, tasks[i].end };
+			builder.buildSubtree(subtrees[i], local);
+		});
+
+		// append them, the root takes the place of its task node
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			const std::vector<BvhNode>& subtree = subtrees[i];
+			int base = (int)nodes->size() - 1;
+			for (size_t n = 0; n < subtree.size(); n++)
+			{
+				BvhNode node = subtree[n];
+				if (node.count == 0)
+					node.leftFirst += base;
+				if (n == 0)
+					(*nodes)[tasks[i].node] = node;
+				else
+					nodes->push_back(node);
+			}
+		}
+	}
+
+	if (stats)
+	{
+		CollectStats(*nodes, stats);
+		stats->buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+// Bottom level: the triangles of one model
+class MeshBvh
+{
+public:
+	MeshBvh() : depth(0) {}
+
+	// positions xyz, three indices per triangle, ids[t] is reported for triangle t (NULL: t itself)
+	void build(const float* positions, const unsigned int* indices, size_t triangleCount, const int* ids,
+		unsigned int threadCount = 0, BvhBuildStats* stats = NULL)
+	{
+		std::vector<float> boxes(triangleCount * 6);
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			const float* p[3] = { &positions[indices[t * 3] * 3], &positions[indices[t * 3 + 1] * 3], &positions[indices[t * 3 + 2] * 3] };
+			for (int k = 0; k < 3; k++)
+			{
+				boxes[t * 6 + k] = std::min(std::min(p[0][k], p[1][k]), p[2][k]);
+				boxes[t * 6 + 3 + k] = std::max(std::max(p[0][k], p[1][k]), p[2][k]);
+			}
+		}
+		std::vector<unsigned int> order;
+		BvhBuildStats built;
+		BuildBvh(boxes, threadCount, &nodes, &order, &built);
+		depth = built.depth;
+		if (stats)
+			*stats = built;
+
+		// triangles in leaf order, as vertex + edges for the intersection test
+		triangles.resize(triangleCount);
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			unsigned int t = order[i];
+			const float* p[3] = { &positions[indices[t * 3] * 3], &positions[indices[t * 3 + 1] * 3], &positions[indices[t * 3 + 2] * 3] };
+			Triangle& tri = triangles[i];
+			for (int k = 0; k < 3; k++)
+			{
+				tri.v0[k] = p[0][k];
+				tri.e1[k] = p[1][k] - p[0][k];
+				tri.e2[k] = p[2][k] - p[0][k];
+			}
+			tri.id = ids ? ids[t] : (int)t;
+		}
+	}
+
+	// closest hit before tMax, direction need not be unit length
+	bool intersect(const float origin[3], const float direction[3], float tMax, RayHit* hit) const
+	{
+		bvh_detail::Ray ray(origin, direction);
+		return intersect(ray, tMax, hit);
+	}
+
+	bool intersect(const bvh_detail::Ray& ray, float tMax, RayHit* hit) const
+	{
+		float t = tMax;
+		bool found = false;
+		bvh_detail::Traverse(nodes, depth, ray, t, [&](int first, int count, float& closest)
+		{
+			for (int i = first; i < first + count; i++)
+			{
+				float u, v, tHit;
+				if (intersectTriangle(triangles[i], ray, closest, &tHit, &u, &v))
+				{
+					closest = tHit;
+					hit->t = tHit;
+					hit->u = u;
+					hit->v = v;
+					hit->triangle = triangles[i].id;
+					hit->instance = -1;
+					found = true;
+				}
+			}
+		});
+		return found;
+	}
+
+	const std::vector<BvhNode>& getNodes() const { return nodes; }
+	size_t getTriangleCount() const { return triangles.size(); }
+
+private:
+	struct Triangle
+	{
+		float v0[3], e1[3], e2[3];
+		int id;
+	};
+
+	// Moller, Trumbore
+	static bool intersectTriangle(const Triangle& tri, const bvh_detail::Ray& ray, float tMax, float* t, float* u, float* v)
+	{
+		const float* d = ray.direction;
+		float p[3] = { d[1] * tri.e2[2] - d[2] * tri.e2[1], d[2] * tri.e2[0] - d[0] * tri.e2[2], d[0] * tri.e2[1] - d[1] * tri.e2[0] };
+		float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+		if (fabsf(det) < 1e-12f)
+			return false;
+		float invDet = 1.0f / det;
+		float s[3] = { ray.origin[0] - tri.v0[0], ray.origin[1] - tri.v0[1], ray.origin[2] - tri.v0[2] };
+		*u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+		if (*u < 0 || *u > 1)
+			return false;
+		float q[3] = { s[1] * tri.e1[2] - s[2] * tri.e1[1], s[2] * tri.e1[0] - s[0] * tri.e1[2], s[0] * tri.e1[1] - s[1] * tri.e1[0] };
+		*v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+		if (*v < 0 || *u + *v > 1)
+			return false;
+		*t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * invDet;
+		return *t >= 0 && *t < tMax;
+	}
+
+	std::vector<BvhNode> nodes;
+	std::vector<Triangle> triangles;	// in leaf order
+	int depth;
+};
+
+struct BvhInstance
+{
+	const MeshBvh* mesh;
+	Matrix4 world;	// affine
+	int id;			// reported as RayHit::instance
+};
+
+// Top level: the instances of the scene, rays move into model space at the leaves
+class SceneBvh
+{
+public:
+	SceneBvh() : depth(0) {}
+
+	void build(const std::vector<BvhInstance>& sceneInstances, unsigned int threadCount = 0, BvhBuildStats* stats = NULL)
+	{
+		// world box of every instance from the root box of its mesh (Arvo)
+		std::vector<float> boxes(sceneInstances.size() * 6, 0.0f);
+		for (size_t i = 0; i < sceneInstances.size(); i++)
+		{
+			const std::vector<BvhNode>& meshNodes = sceneInstances[i].mesh->getNodes();
+			if (meshNodes.empty())
+				continue;
+			const BvhNode& root = meshNodes[0];
+			const Matrix4& m = sceneInstances[i].world;
+			for (int r = 0; r < 3; r++)
+			{
+				float center = m[r * 4 + 3], extent = 0;
+				for (int c = 0; c < 3; c++)
+				{
+					center += m[r * 4 + c] * (root.min[c] + root.max[c]) * 0.5f;
+					extent += fabsf(m[r * 4 + c]) * (root.max[c] - root.min[c]) * 0.5f;
+				}
+				boxes[i * 6 + r] = center - extent;
+				boxes[i * 6 + 3 + r] = center + extent;
+			}
+		}
+		std::vector<unsigned int> order;
+		BvhBuildStats built;
+		BuildBvh(boxes, threadCount, &nodes, &order, &built);
+		depth = built.depth;
+		if (stats)
+			*stats = built;
+
+		instances.resize(order.size());
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			const BvhInstance& source = sceneInstances[order[i]];
+			Instance& instance = instances[i];
+			instance.mesh = source.mesh;
+			instance.inverse = source.world;
+			instance.inverse.invertAffine();
+			instance.id = source.id;
+		}
+	}
+
+	// closest hit over all instances, t is in the units of the world space direction
+	bool intersect(const float origin[3], const float direction[3], float tMax, RayHit* hit) const
+	{
+		bvh_detail::Ray ray(origin, direction);
+		float t = tMax;
+		bool found = false;
+		bvh_detail::Traverse(nodes, depth, ray, t, [&](int first, int count, float& closest)
+		{
+			for (int i = first; i < first + count; i++)
+			{
+				// the same t on both sides, as the direction is transformed without normalizing
+				const Instance& instance = instances[i];
+				float localOrigin[3], localDirection[3];
+				bvh_detail::TransformPoint(instance.inverse, ray.origin, localOrigin);
+				bvh_detail::TransformVector(instance.inverse, ray.direction, localDirection);
+				if (instance.mesh->intersect(localOrigin, localDirection, closest, hit))
+				{
+					closest = hit->t;
+					hit->instance = instance.id;
+					found = true;
+				}
+			}
+		});
+		return found;
+	}
+
+	const std::vector<BvhNode>& getNodes() const { return nodes; }
+
+private:
+	struct Instance
+	{
+		const MeshBvh* mesh;
+		Matrix4 inverse;
+		int id;
+	};
+
+	std::vector<BvhNode> nodes;
+	std::vector<Instance> instances;	// in leaf order
+	int depth;
+};
+
+// World space ray through the screen point (ndcX, ndcY) in [-1, 1]. It starts
+// on the near plane and reaches the far plane at t = 1.
+inline void ScreenRay(const Matrix4& viewProjection, float ndcX, float ndcY, float origin[3], float direction[3])
+{
+	Matrix4 inverse = viewProjection;
+	inverse.invert();
+	Vector4 nearPoint = inverse * Vector4(ndcX, ndcY, -1.0f, 1.0f);
+	Vector4 farPoint = inverse * Vector4(ndcX, ndcY, 1.0f, 1.0f);
+	float nearW = (nearPoint.w != 0) ? 1.0f / nearPoint.w : 1.0f;
+	float farW = (farPoint.w != 0) ? 1.0f / farPoint.w : 1.0f;
+	origin[0] = nearPoint.x * nearW;
+	origin[1] = nearPoint.y * nearW;
+	origin[2] = nearPoint.z * nearW;
+	direction[0] = farPoint.x * farW - origin[0];
+	direction[1] = farPoint.y * farW - origin[1];
+	direction[2] = farPoint.z * farW - origin[2];
+}
+
+#endif
@@ -0,0 +1,287 @@
+///////////////////////////////////////////////////////////////////////////////
+// BvhBenchmark.h
+// ==============
+// Validation and throughput numbers for the BVH, run with
+//     <app> --bench-bvh [file.obj ...]
+// (the app's own model list is used when no file is given).
+//
+// 1. MeshBvh of every model, built with 1, 2, 4, ... threads up to the
+//    hardware threads: build time, nodes, depth and SAH cost.
+// 2. Random rays from a sphere around the model towards points in its box:
+//    millions of rays per second, single thread. A part of the rays is
+//    checked against a linear scan of all triangles.
+// 3. SceneBvh over a grid of instances of all models: build time and rays
+//    per second, checked the same way against a scan of all instances.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef BVH_BENCHMARK_H_DEF
+#define BVH_BENCHMARK_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ObjMesh.h"
+#include "Bvh.h"
+
+namespace bvhbench_detail
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline double ElapsedMs(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	struct Model
+	{
+		std::string path;
+		std::vector<float> positions;
+		std::vector<unsigned int> indices;
+		float center[3];
+		float radius;
+		MeshBvh bvh;
+	};
+
+	inline bool LoadModel(const std::string& path, Model* model)
+	{
+		ObjMesh mesh;
+		std::string warn, err;
+		if (!LoadObjMesh(path, "", &mesh, &warn, &err))
+			return false;
+		model->path = path;
+		model->positions = mesh.positions;
+		model->indices.resize(mesh.indices.size());
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+			model->indices[i] = (unsigned int)mesh.indices[i].vertex_index;
+
+		float boxMin[3] = { 1e30f, 1e30f, 1e30f }, boxMax[3] = { -1e30f, -1e30f, -1e30f };
+		for (size_t v = 0; v < model->positions.size(); v += 3)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				boxMin[k] = std::min(boxMin[k], model->positions[v + k]);
+				boxMax[k] = std::max(boxMax[k], model->positions[v + k]);
+			}
+		}
+		float r2 = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			model->center[k] = (boxMin[k] + boxMax[k]) * 0.5f;
+			r2 += (boxMax[k] - boxMin[k]) * (boxMax[k] - boxMin[k]) * 0.25f;
+		}
+		model->radius = sqrtf(r2);
+		return true;
+	}
+
+	// origin on a sphere of radius around center, direction towards a point inside it
+	inline void RandomRay(std::mt19937& random, const float center[3], float radius, float origin[3], float direction[3])
+	{
+		std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+		float d[3], length2;
+		do
+		{
+			for (int k = 0; k < 3; k++)
+				d[k] = uniform(random);
+			length2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		} while (length2 > 1 || length2 < 1e-4f);
+		float scale = 1.0f / sqrtf(length2);
+		for (int k = 0; k < 3; k++)
+		{
+			origin[k] = center[k] + d[k] * scale * radius * 2;
+			direction[k] = center[k] + uniform(random) * radius * 0.5f - origin[k];
+		}
+	}
+
+	// closest triangle by testing every one of them, written out separately from MeshBvh
+	inline bool ScanTriangles(const Model& model, const float o[3], const float d[3], float* tClosest)
+	{
+		bool found = false;
+		*tClosest = 1e30f;
+		for (size_t t = 0; t < model.indices.size(); t += 3)
+		{
+			const float* p0 = &model.positions[model.indices[t] * 3];
+			const float* p1 = &model.positions[model.indices[t + 1] * 3];
+			const float* p2 = &model.positions[model.indices[t + 2] * 3];
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float p[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+			float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+			if (fabsf(det) < 1e-12f)
+				continue;
+			float s[3] = { o[0] - p0[0], o[1] - p0[1], o[2] - p0[2] };
+			float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) / det;
+			float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+			float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) / det;
+			float tHit = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) / det;
+			if (u >= 0 && v >= 0 && u + v <= 1 && tHit >= 0 && tHit < *tClosest)
+			{
+				*tClosest = tHit;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	inline bool SameHit(bool foundA, float tA, bool foundB, float tB)
+	{
+		if (foundA != foundB)
+			return false;
+		return !foundA || fabsf(tA - tB) <= 1e-4f * std::max(1.0f, fabsf(tA));
+	}
+}
+
+// returns the exit code of the app
+inline int RunBvhBenchmark(const std::vector<std::string>& files)
+{
+	using namespace bvhbench_detail;
+
+	std::vector<Model> models(files.size());
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (!LoadModel(files[i], &models[i]))
+		{
+			printf("Cannot load %s\n", files[i].c_str());
+			return 1;
+		}
+	}
+
+	unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t < hardwareThreads; t *= 2)
+		threadCounts.push_back(t);
+	threadCounts.push_back(hardwareThreads);
+
+	printf("MeshBvh build, binned SAH with %d bins, %u hardware threads (best of 5)\n", BVH_BINS, hardwareThreads);
+	for (size_t i = 0; i < models.size(); i++)
+	{
+		Model& model = models[i];
+		size_t triangleCount = model.indices.size() / 3;
+		for (size_t c = 0; c < threadCounts.size(); c++)
+		{
+			BvhBuildStats best;
+			best.buildMs = 1e30;
+			for (int r = 0; r < 5; r++)
+			{
+				BvhBuildStats stats;
+				model.bvh.build(&model.positions[0], &model.indices[0], triangleCount, NULL, threadCounts[c], &stats);
+				if (stats.buildMs < best.buildMs)
+					best = stats;
+			}
+			printf("  %-40s %7d triangles %2u threads %8.3f ms %7.2f Mtri/s  %6d nodes, depth %2d, SAH cost %.2f\n", model.path.c_str(),
+				(int)triangleCount, threadCounts[c], best.buildMs, triangleCount / (best.buildMs * 1000.0), (int)best.nodes, best.depth, best.sahCost);
+		}
+	}
+
+	const int rayCount = 1000000, checkCount = 1000;
+	printf("MeshBvh closest hit, %d random rays, 1 thread\n", rayCount);
+	for (size_t i = 0; i < models.size(); i++)
+	{
+		const Model& model = models[i];
+		std::mt19937 random(1234);
+		std::vector<float> rays(rayCount * 6);
+		for (int r = 0; r < rayCount; r++)
+			RandomRay(random, model.center, model.radius, &rays[r * 6], &rays[r * 6 + 3]);
+
+		Clock::time_point start = Clock::now();
+		int hits = 0;
+		for (int r = 0; r < rayCount; r++)
+		{
+			RayHit hit;
+			hits += model.bvh.intersect(&rays[r * 6], &rays[r * 6 + 3], 1e30f, &hit) ? 1 : 0;
+		}
+		double ms = ElapsedMs(start);
+
+		int mismatches = 0;
+		for (int r = 0; r < checkCount; r++)
+		{
+			RayHit hit;
+			float t;
+			bool found = model.bvh.intersect(&rays[r * 6], &rays[r * 6 + 3], 1e30f, &hit);
+			bool scanned = ScanTriangles(model, &rays[r * 6], &rays[r * 6 + 3], &t);
+			mismatches += SameHit(found, found ? hit.t : 0, scanned, t) ? 0 : 1;
+		}
+		printf("  %-40s %8.2f Mrays/s  %5.1f%% hit  %s\n", model.path.c_str(), rayCount / (ms * 1000.0), hits * 100.0 / rayCount,
+			mismatches ? "DIFFERENT from the linear scan" : "same as the linear scan");
+	}
+
+	// a grid of instances cycling through the models, like the stress test
+	const int side = 16;
+	std::vector<BvhInstance> instances;
+	std::mt19937 random(5678);
+	std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+	for (int i = 0; i < side * side * side; i++)
+	{
+		Matrix4 world;
+		world.rotateY(angle(random) * 57.29578f);
+		world.scale(0.4f);
+		world.translate((float)(i % side), (float)((i / side) % side), (float)(i / (side * side)));
+		BvhInstance instance = { &models[i % models.size()].bvh, world, i };
+		instances.push_back(instance);
+	}
+	printf("SceneBvh over %d instances\n", (int)instances.size());
+	for (size_t c = 0; c < threadCounts.size(); c++)
+	{
+		BvhBuildStats best;
+		best.buildMs = 1e30;
+		SceneBvh scene;
+		for (int r = 0; r < 5; r++)
+		{
+			BvhBuildStats stats;
+			scene.build(instances, threadCounts[c], &stats);
+			if (stats.buildMs < best.buildMs)
+				best = stats;
+		}
+		printf("  build %2u threads %8.3f ms  %6d nodes, depth %2d, SAH cost %.2f\n", threadCounts[c], best.buildMs,
+			(int)best.nodes, best.depth, best.sahCost);
+	}
+
+	SceneBvh scene;
+	scene.build(instances, 0);
+	float center[3] = { side * 0.5f, side * 0.5f, side * 0.5f };
+	std::vector<float> rays(rayCount * 6);
+	for (int r = 0; r < rayCount; r++)
+		RandomRay(random, center, side * 0.9f, &rays[r * 6], &rays[r * 6 + 3]);
+	Clock::time_point start = Clock::now();
+	int hits = 0;
+	for (int r = 0; r < rayCount; r++)
+	{
+		RayHit hit;
+		hits += scene.intersect(&rays[r * 6], &rays[r * 6 + 3], 1e30f, &hit) ? 1 : 0;
+	}
+	double ms = ElapsedMs(start);
+
+	// every instance with its own bottom level, no top level
+	int mismatches = 0;
+	for (int r = 0; r < checkCount; r++)
+	{
+		RayHit hit;
+		bool found = scene.intersect(&rays[r * 6], &rays[r * 6 + 3], 1e30f, &hit);
+		float tScan = 1e30f;
+		bool scanned = false;
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			Matrix4 inverse = instances[i].world;
+			inverse.invertAffine();
+			float origin[3], direction[3];
+			bvh_detail::TransformPoint(inverse, &rays[r * 6], origin);
+			bvh_detail::TransformVector(inverse, &rays[r * 6 + 3], direction);
+			RayHit instanceHit;
+			if (instances[i].mesh->intersect(origin, direction, tScan, &instanceHit))
+			{
+				tScan = instanceHit.t;
+				scanned = true;
+			}
+		}
+		mismatches += SameHit(found, found ? hit.t : 0, scanned, tScan) ? 0 : 1;
+	}
+	printf("  %8.2f Mrays/s  %5.1f%% hit  %s\n", rayCount / (ms * 1000.0), hits * 100.0 / rayCount,
+		mismatches ? "DIFFERENT from the instance scan" : "same as the instance scan");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,237 @@
+///////////////////////////////////////////////////////////////////////////////
+// Culling.h
+// =========
+// Bounding volumes of the loaded shapes and view frustum culling.
+//
+// Bounds (AABB + sphere around its center) are computed once at load time in
+// model space. Each frame the six frustum planes are taken from
+// projection * view (Gribb, Hartmann, "Fast Extraction of Viewing Frustum
+// Planes from the World-View-Projection Matrix", 2001). Single shapes are
+// tested with their world space AABB. Instances are gathered into a
+// SphereBatch and tested four at a time with SSE.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef CULLING_H_DEF
+#define CULLING_H_DEF
+
+#include <cmath>
+#include <vector>
+#include "Matrices.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define CULLING_SSE
+#include <emmintrin.h>
+#endif
+
+struct Bounds
+{
+	float min[3], max[3];	// axis aligned box
+	float center[3];		// sphere around the center of the box
+	float radius;
+};
+
+// bounds of count positions (xyz), an empty box at the origin for count == 0
+inline Bounds ComputeBounds(const float* positions, size_t count)
+{
+	Bounds b;
+	for (int k = 0; k < 3; k++)
+	{
+		b.min[k] = count ? positions[k] : 0.0f;
+		b.max[k] = b.min[k];
+	}
+	for (size_t v = 1; v < count; v++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			float p = positions[v * 3 + k];
+			b.min[k] = (p < b.min[k]) ? p : b.min[k];
+			b.max[k] = (p > b.max[k]) ? p : b.max[k];
+		}
+	}
+
+	float radius2 = 0;
+	for (int k = 0; k < 3; k++)
+		b.center[k] = (b.min[k] + b.max[k]) * 0.5f;
+	for (size_t v = 0; v < count; v++)
+	{
+		const float* p = &positions[v * 3];
+		float dx = p[0] - b.center[0], dy = p[1] - b.center[1], dz = p[2] - b.center[2];
+		float d2 = dx * dx + dy * dy + dz * dz;
+		radius2 = (d2 > radius2) ? d2 : radius2;
+	}
+	b.radius = sqrtf(radius2);
+	return b;
+}
+
+// bounds enclosing both a and b
+inline Bounds MergeBounds(const Bounds& a, const Bounds& b)
+{
+	Bounds m;
+	for (int k = 0; k < 3; k++)
+	{
+		m.min[k] = (a.min[k] < b.min[k]) ? a.min[k] : b.min[k];
+		m.max[k] = (a.max[k] > b.max[k]) ? a.max[k] : b.max[k];
+		m.center[k] = (m.min[k] + m.max[k]) * 0.5f;
+	}
+	// smallest sphere around the new center which holds both spheres
+	float da = 0, db = 0;
+	for (int k = 0; k < 3; k++)
+	{
+		da += (a.center[k] - m.center[k]) * (a.center[k] - m.center[k]);
+		db += (b.center[k] - m.center[k]) * (b.center[k] - m.center[k]);
+	}
+	da = sqrtf(da) + a.radius;
+	db = sqrtf(db) + b.radius;
+	m.radius = (da > db) ? da : db;
+	return m;
+}
+
+// planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside, (a, b, c) unit length
+struct Frustum
+{
+	float planes[6][4];
+};
+
+inline Frustum ExtractFrustum(const Matrix4& viewProjection)
+{
+	// row 3 +- rows 0, 1, 2: left, right, bottom, top, near, far
+	const Matrix4& m = viewProjection;
+	Frustum f;
+	for (int i = 0; i < 6; i++)
+	{
+		int row = i / 2;
+		float sign = (i % 2) ? -1.0f : 1.0f;
+		float length = 0;
+		for (int k = 0; k < 4; k++)
+		{
+			f.planes[i][k] = m[12 + k] + sign * m[row * 4 + k];
+			if (k < 3)
+				length += f.planes[i][k] * f.planes[i][k];
+		}
+		length = sqrtf(length);
+		for (int k = 0; k < 4 && length > 0; k++)
+			f.planes[i][k] /= length;
+	}
+	return f;
+}
+
+inline bool SphereInFrustum(const Frustum& f, const float center[3], float radius)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		const float* p = f.planes[i];
+		if (p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3] < -radius)
+			return false;
+	}
+	return true;
+}
+
+// the box of b moved to world space by the affine world matrix (Arvo), then the
+// corner furthest along each plane normal has to be inside
+inline bool BoxInFrustum(const Frustum& f, const Bounds& b, const Matrix4& world)
+{
+	float center[3], extent[3];
+	for (int r = 0; r < 3; r++)
+	{
+		center[r] = world[r * 4 + 3];
+		extent[r] = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			center[r] += world[r * 4 + c] * (b.min[c] + b.max[c]) * 0.5f;
+			extent[r] += fabsf(world[r * 4 + c]) * (b.max[c] - b.min[c]) * 0.5f;
+		}
+	}
+	for (int i = 0; i < 6; i++)
+	{
+		const float* p = f.planes[i];
+		float distance = p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3];
+		float reach = fabsf(p[0]) * extent[0] + fabsf(p[1]) * extent[1] + fabsf(p[2]) * extent[2];
+		if (distance < -reach)
+			return false;
+	}
+	return true;
+}
+
+// World space spheres of many instances as structure of arrays, padded to a
+// multiple of four so the SSE loop needs no tail
+class SphereBatch
+{
+public:
+	SphereBatch() : count(0) {}
+
+	void clear()
+	{
+		count = 0;
+		x.clear(); y.clear(); z.clear(); r.clear();
+	}
+
+	// sphere of bounds under the affine world matrix
+	void add(const Bounds& b, const Matrix4& world)
+	{
+		float scale2 = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			float column2 = world[c] * world[c] + world[4 + c] * world[4 + c] + world[8 + c] * world[8 + c];
+			scale2 = (column2 > scale2) ? column2 : scale2;
+		}
+		float center[3];
+		for (int row = 0; row < 3; row++)
+			center[row] = world[row * 4] * b.center[0] + world[row * 4 + 1] * b.center[1] + world[row * 4 + 2] * b.center[2] + world[row * 4 + 3];
+
+		if (count == x.size())
+		{
+			// padding has a hugely negative radius, so it never passes
+			x.resize(count + 4, 0.0f); y.resize(count + 4, 0.0f); z.resize(count + 4, 0.0f); r.resize(count + 4, -1e30f);
+		}
+		x[count] = center[0];
+		y[count] = center[1];
+		z[count] = center[2];
+		r[count] = b.radius * sqrtf(scale2);
+		count++;
+	}
+
+	size_t size() const { return count; }
+
+	// visible[i] = 1 when sphere i touches the frustum, returns the number of visible spheres
+	size_t cull(const Frustum& f, std::vector<char>* visible) const
+	{
+		visible->resize(x.size());
+		size_t visibleCount = 0;
+#ifdef CULLING_SSE
+		for (size_t i = 0; i < x.size(); i += 4)
+		{
+			__m128 cx = _mm_loadu_ps(&x[i]), cy = _mm_loadu_ps(&y[i]), cz = _mm_loadu_ps(&z[i]);
+			__m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&r[i]));
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (int p = 0; p < 6; p++)
+			{
+				const float* plane = f.planes[p];
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane[0])), _mm_mul_ps(cy, _mm_set1_ps(plane[1]))),
+					_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane[2])), _mm_set1_ps(plane[3])));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negRadius));
+			}
+			int mask = _mm_movemask_ps(inside);
+			for (int k = 0; k < 4; k++)
+			{
+				(*visible)[i + k] = (char)((mask >> k) & 1);
+				visibleCount += (mask >> k) & 1;
+			}
+		}
+#else
+		for (size_t i = 0; i < x.size(); i++)
+		{
+			float center[3] = { x[i], y[i], z[i] };
+			(*visible)[i] = (r[i] >= 0 && SphereInFrustum(f, center, r[i])) ? 1 : 0;
+			visibleCount += (*visible)[i];
+		}
+#endif
+		visible->resize(count);
+		return visibleCount;
+	}
+
+private:
+	size_t count;
+	std::vector<float> x, y, z, r;
+};
+
+#endif
@@ -0,0 +1,478 @@
+///////////////////////////////////////////////////////////////////////////////
+// FrameCapture.h
+// ==============
+// Recording of the frames drawn as an image sequence or a video.
+//
+// glReadPixels into client memory waits until the GPU has drawn the frame,
+// every frame. FrameCapture reads the frame into one of a ring of pixel pack
+// buffers instead and fences it; the GPU copies it while the next frames are
+// drawn, and the frame is mapped and copied out only once the fence has
+// passed, CAPTURE_SLOTS - 1 frames later. Only a full ring, or encoders
+// behind by CAPTURE_QUEUE frames, make the GL thread wait.
+//
+// Worker threads flip the frames to top row first and write them as
+// <prefix>_000000.png / .qoi, or append them to <prefix>.y4m in frame order.
+// With synchronous set, frames are read with a plain glReadPixels, to
+// compare the overhead with.
+//
+// Everything except isRecording() and report() from the thread owning the
+// context.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FRAME_CAPTURE_H_DEF
+#define FRAME_CAPTURE_H_DEF
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ImageWriter.h"
+
+const int CAPTURE_SLOTS = 3;			// frames read back at once, the oldest is copied out
+const int CAPTURE_QUEUE = 8;			// frames waiting for an encoder before the GL thread waits
+const int CAPTURE_MAX_WORKERS = 4;
+
+enum CaptureFormat
+{
+	CAPTURE_PNG = 0,
+	CAPTURE_QOI = 1,
+	CAPTURE_Y4M = 2,
+};
+
+struct FrameCaptureReport
+{
+	bool recording;
+	CaptureFormat format;
+	bool synchronous;
+	int workers;
+	int width, height;
+	unsigned long long frames;	// captured
+	unsigned long long written;	// encoded and written
+	unsigned long long failed;	// not written
+	unsigned long long skipped;	// with another size than the first frame
+	double glMs, glMaxMs;		// GL thread per frame: readback, copy out, waits; mean and largest
+	double stallMs;				// of it, waiting for fences and encoders, in total
+	unsigned long long stalls;
+	double encodeMs;			// worker time per frame, mean
+	double lag;					// frames between readback and copy out, mean
+	size_t bytes;				// written
+	double seconds;				// since start()
+};
+
+class FrameCapture
+{
+public:
+	FrameCapture() : recording(false), format(CAPTURE_PNG), synchronous(false), fps(60), width(0), height(0),
+		frameCount(0), nextSlot(0), stopping(false), busyWorkers(0), nextWrite(0), copied(0)
+	{
+		for (int i = 0; i < CAPTURE_SLOTS; i++)
+		{
+			buffers[i] = 0;
+			fences[i] = 0;
+			slotFrames[i] = 0;
+		}
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	~FrameCapture()
+	{
+		stopWorkers();
+	}
+
+	static const char* formatName(CaptureFormat format)
+	{
+		static const char* names[3] = { "png", "qoi", "y4m" };
+		return names[format];
+	}
+
+	// "png", "qoi" or "y4m"
+	static bool parseFormat(const std::string& name, CaptureFormat* format)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			if (name == formatName((CaptureFormat)i))
+			{
+				*format = (CaptureFormat)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// start recording; fps goes into the y4m header
+	void start(const std::string& filePrefix, CaptureFormat captureFormat, int framesPerSecond, bool readSynchronously)
+	{
+		stop();
+		prefix = filePrefix;
+		format = captureFormat;
+		fps = std::max(framesPerSecond, 1);
+		synchronous = readSynchronously;
+		width = height = 0;
+		frameCount = 0;
+		nextSlot = 0;
+		nextWrite = 0;
+		startTime = Clock::now();
+
+		int count = (int)std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned int)CAPTURE_MAX_WORKERS));
+		stopping = false;
+		for (int i = 0; i < count; i++)
+			workers.push_back(std::thread(&FrameCapture::workerLoop, this));
+
+		std::lock_guard<std::mutex> lock(statsMutex);
+		memset(&stats, 0, sizeof(stats));
+		copied = 0;
+		stats.format = format;
+		stats.synchronous = synchronous;
+		stats.workers = count;
+		recording = true;
+		stats.recording = true;
+	}
+
+	bool isRecording() const { return recording.load(); }
+
+	// After the frame is drawn, before the swap: width x height texels of framebuffer,
+	// 0 for the back buffer. The first frame sets the size of the recording.
+	void capture(GLuint framebuffer, int frameWidth, int frameHeight)
+	{
+		if (!recording)
+			return;
+		Clock::time_point start = Clock::now();
+		double stalled = 0;
+		if (width == 0)
+		{
+			width = frameWidth;
+			height = frameHeight;
+			if (!synchronous)
+				allocate();
+		}
+		if (frameWidth != width || frameHeight != height)
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.skipped++;
+			return;
+		}
+
+		GLint readFramebuffer = 0, packBuffer = 0;
+		glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFramebuffer);
+		glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &packBuffer);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		if (synchronous)
+		{
+			std::vector<unsigned char> pixels = takeBuffer();
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+			stalled += enqueue(frameCount, pixels);
+		}
+		else
+		{
+			// frames whose copy is done, oldest first, then the slot of this frame
+			while (oldest() >= 0 && glClientWaitSync(fences[oldest()], 0, 0) != GL_TIMEOUT_EXPIRED)
+				stalled += copyOut(oldest());
+			if (fences[nextSlot])
+			{
+				Clock::time_point waitStart = Clock::now();
+				wait(nextSlot);
+				stalled += elapsedMs(waitStart);
+				stalled += copyOut(nextSlot);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[nextSlot]);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+			fences[nextSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			slotFrames[nextSlot] = frameCount;
+			nextSlot = (nextSlot + 1) % CAPTURE_SLOTS;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, packBuffer);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+		frameCount++;
+
+		double ms = elapsedMs(start);
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.frames++;
+		stats.glMs += ms;
+		stats.glMaxMs = std::max(stats.glMaxMs, ms);
+		stats.stallMs += stalled;
+		stats.stalls += stalled > 0 ? 1 : 0;
+	}
+
+	// read back and write every frame captured, then close the files
+	void stop()
+	{
+		if (!recording)
+			return;
+		int slot;
+		while ((slot = oldest()) >= 0)
+		{
+			wait(slot);
+			copyOut(slot);
+		}
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this] { return tasks.empty() && busyWorkers == 0; });
+		}
+		stopWorkers();
+		if (!synchronous && buffers[0])
+		{
+			glDeleteBuffers(CAPTURE_SLOTS, buffers);
+			for (int i = 0; i < CAPTURE_SLOTS; i++)
+				buffers[i] = 0;
+		}
+		video.close();
+		pending.clear();
+		freeBuffers.clear();
+		recording = false;
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.recording = false;
+		stats.seconds = elapsedMs(startTime) / 1000.0;
+	}
+
+	FrameCaptureReport report()
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		FrameCaptureReport r = stats;
+		r.width = width;
+		r.height = height;
+		if (r.recording)
+			r.seconds = elapsedMs(startTime) / 1000.0;
+		r.glMs = stats.frames ? stats.glMs / stats.frames : 0;
+		r.encodeMs = stats.written + stats.failed ? stats.encodeMs / (stats.written + stats.failed) : 0;
+		r.lag = copied ? stats.lag / copied : 0;
+		return r;
+	}
+
+	std::string getPrefix() const { return prefix; }
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Task
+	{
+		unsigned long long frame;
+		std::vector<unsigned char> pixels;	// bottom row first, as read
+	};
+
+	static double elapsedMs(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	static size_t fileSize(const std::string& path)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file)
+			return 0;
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fclose(file);
+		return size > 0 ? (size_t)size : 0;
+	}
+
+	void allocate()
+	{
+		glGenBuffers(CAPTURE_SLOTS, buffers);
+		for (int i = 0; i < CAPTURE_SLOTS; i++)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	// slot of the oldest frame being read back, -1 if none
+	int oldest() const
+	{
+		int slot = -1;
+		for (int i = 0; i < CAPTURE_SLOTS; i++)
+		{
+			if (fences[i] && (slot < 0 || slotFrames[i] < slotFrames[slot]))
+				slot = i;
+		}
+		return slot;
+	}
+
+	void wait(int slot)
+	{
+		while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+	}
+
+	// the frame of a slot whose fence passed to the encoders, returns ms waited for them
+	double copyOut(int slot)
+	{
+		glDeleteSync(fences[slot]);
+		fences[slot] = 0;
+		std::vector<unsigned char> pixels = takeBuffer();
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[slot]);
+		const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)pixels.size(), GL_MAP_READ_BIT);
+		if (mapped)
+			memcpy(&pixels[0], mapped, pixels.size());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.lag += (double)(frameCount - slotFrames[slot]);
+			copied++;
+		}
+		return enqueue(slotFrames[slot], pixels);
+	}
+
+	// a frame sized buffer, reused from the frames written
+	std::vector<unsigned char> takeBuffer()
+	{
+		std::vector<unsigned char> pixels;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!freeBuffers.empty())
+			{
+				pixels.swap(freeBuffers.back());
+				freeBuffers.pop_back();
+			}
+		}
+		pixels.resize((size_t)width * height * 4);
+		return pixels;
+	}
+
+	// returns ms waited for the encoders
+	double enqueue(unsigned long long frame, std::vector<unsigned char>& pixels)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		double waited = 0;
+		if (tasks.size() >= CAPTURE_QUEUE)
+		{
+			Clock::time_point start = Clock::now();
+			idle.wait(lock, [this] { return tasks.size() < CAPTURE_QUEUE; });
+			waited = elapsedMs(start);
+		}
+		tasks.push_back(Task());
+		tasks.back().frame = frame;
+		tasks.back().pixels.swap(pixels);
+		wake.notify_one();
+		return waited;
+	}
+
+	void stopWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+		tasks.clear();
+	}
+
+	void workerLoop()
+	{
+		std::vector<unsigned char> image, yuv;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			Task task;
+			task.frame = tasks.front().frame;
+			task.pixels.swap(tasks.front().pixels);
+			tasks.pop_front();
+			busyWorkers++;
+			idle.notify_all();
+			lock.unlock();
+
+			Clock::time_point start = Clock::now();
+			size_t rowBytes = (size_t)width * 4;
+			image.resize(task.pixels.size());
+			for (int y = 0; y < height; y++)
+				memcpy(&image[(size_t)y * rowBytes], &task.pixels[(size_t)(height - 1 - y) * rowBytes], rowBytes);
+			bool written = true;
+			size_t bytes = 0;
+			if (format == CAPTURE_Y4M)
+			{
+				RgbaToI420(image, width, height, &yuv);
+				bytes = yuv.size() + 6;
+				written = writeInOrder(task.frame, yuv);
+			}
+			else
+			{
+				char number[32];
+				snprintf(number, sizeof(number), "_%06llu.", task.frame);
+				std::string path = prefix + number + formatName(format);
+				written = format == CAPTURE_PNG ? WritePng(path, image, width, height) : WriteQoi(path, image, width, height);
+				bytes = fileSize(path);
+			}
+			double ms = elapsedMs(start);
+
+			lock.lock();
+			freeBuffers.push_back(std::vector<unsigned char>());
+			freeBuffers.back().swap(task.pixels);
+			busyWorkers--;
+			idle.notify_all();
+			std::lock_guard<std::mutex> statsLock(statsMutex);
+			stats.encodeMs += ms;
+			stats.bytes += written ? bytes : 0;
+			stats.written += written ? 1 : 0;
+			stats.failed += written ? 0 : 1;
+		}
+	}
+
+	// frames reach the video in order, whichever worker converted them first
+	bool writeInOrder(unsigned long long frame, std::vector<unsigned char>& yuv)
+	{
+		std::lock_guard<std::mutex> lock(videoMutex);
+		if (!video.isOpen() && nextWrite == 0 && !video.open(prefix + ".y4m", width, height, fps))
+			return false;
+		pending[frame].swap(yuv);
+		bool written = true;
+		std::map<unsigned long long, std::vector<unsigned char> >::iterator next;
+		while ((next = pending.find(nextWrite)) != pending.end())
+		{
+			written = video.writeFrame(next->second) && written;
+			pending.erase(next);
+			nextWrite++;
+		}
+		return written;
+	}
+
+	std::atomic<bool> recording;
+	std::string prefix;
+	CaptureFormat format;
+	bool synchronous;
+	int fps;
+	int width, height;
+	unsigned long long frameCount;
+	Clock::time_point startTime;
+
+	GLuint buffers[CAPTURE_SLOTS];
+	GLsync fences[CAPTURE_SLOTS];
+	unsigned long long slotFrames[CAPTURE_SLOTS];
+	int nextSlot;
+
+	std::mutex mutex;					// tasks and freeBuffers, with the workers
+	std::condition_variable wake;		// tasks for the workers
+	std::condition_variable idle;		// a task was taken or finished
+	std::deque<Task> tasks;
+	std::vector<std::vector<unsigned char> > freeBuffers;
+	std::vector<std::thread> workers;
+	bool stopping;
+	int busyWorkers;
+
+	std::mutex videoMutex;				// the y4m stream
+	Y4mWriter video;
+	std::map<unsigned long long, std::vector<unsigned char> > pending;	// converted frames waiting for the ones before
+	unsigned long long nextWrite;
+
+	std::mutex statsMutex;				// for report() from another thread
+	FrameCaptureReport stats;
+	unsigned long long copied;			// frames copied out of the ring, for the mean lag
+};
+
+#endif
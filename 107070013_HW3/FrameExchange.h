@@ -0,0 +1,198 @@
+///////////////////////////////////////////////////////////////////////////////
+// FrameExchange.h
+// ===============
+// Hand-off of frame snapshots from the thread updating the scene to the
+// thread owning the GL context.
+//
+// TripleBuffer keeps three copies of the snapshot: the writer fills one, the
+// reader draws another and the third holds the latest published one. Both
+// sides swap their copy with the middle one by a single atomic exchange, so
+// neither ever waits for the other. A slot is reused every third publish and
+// keeps its old contents, so the writer only has to copy what changed since.
+//
+// ThreadActivity records when each thread works and waits, how long both
+// work at the same time, the age of a snapshot when it is shown and the
+// input latency of the frames shown.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FRAME_EXCHANGE_H_DEF
+#define FRAME_EXCHANGE_H_DEF
+
+#include <atomic>
+#include <mutex>
+#include "InputQueue.h"
+
+// one writer, one reader
+template <typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : back(0), middle(1), front(2) {}
+
+	// the copy the writer fills
+	T& writeSlot() { return slots[back]; }
+
+	// make the write slot the latest one, returns false if the one it replaces was never read
+	bool publish()
+	{
+		int old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+		back = old & INDEX;
+		return (old & FRESH) == 0;
+	}
+
+	// a published snapshot is waiting for the reader
+	bool hasFresh() const { return (middle.load(std::memory_order_acquire) & FRESH) != 0; }
+
+	// take the latest snapshot, false if nothing was published since the last call
+	bool acquire()
+	{
+		if (!hasFresh())
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	// the copy the reader draws
+	const T& readSlot() const { return slots[front]; }
+
+private:
+	enum { INDEX = 3, FRESH = 4 };
+
+	T slots[3];
+	int back;					// writer only
+	std::atomic<int> middle;	// slot index, FRESH while not taken by the reader
+	int front;					// reader only
+};
+
+enum FrameThread
+{
+	MAIN_THREAD = 0,	// input, scene update, culling, snapshot
+	RENDER_THREAD = 1,	// GL submission and swap
+};
+
+struct ThreadActivityReport
+{
+	double seconds;			// wall time of the period
+	double busy[2];			// by FrameThread
+	double waiting[2];		// for the other thread
+	unsigned long long frames[2];	// snapshots published, snapshots drawn
+	unsigned long long dropped;	// published over a snapshot the render thread never took
+	double overlap;			// both threads busy
+	double submitMs;		// mean GL submission time of the render thread
+	double ageMean, ageMax;	// ms from publish to swap
+	double inputMean, input95, inputMax;	// ms from the first input event of a frame to its swap
+	size_t inputFrames;
+};
+
+class ThreadActivity
+{
+public:
+	ThreadActivity() : busyThreads(0)
+	{
+		workStart[MAIN_THREAD] = workStart[RENDER_THREAD] = 0;
+		reset(0);
+	}
+
+	// start counting at now (glfwGetTime()), the threads may be working
+	void reset(double now)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		startTime = now;
+		overlapStart = overlap = 0;
+		dropped = 0;
+		submitTime = lastSubmit = 0;
+		for (int t = 0; t < 2; t++)
+		{
+			busy[t] = waiting[t] = 0;
+			frames[t] = 0;
+		}
+		age = LatencyStats();
+		input = LatencyStats();
+	}
+
+	void begin(FrameThread thread, double now)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		workStart[thread] = now;
+		if (++busyThreads == 2)
+			overlapStart = now;
+	}
+
+	void end(FrameThread thread, double now)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (busyThreads-- == 2)
+			overlap += now - overlapStart;
+		busy[thread] += now - workStart[thread];
+		frames[thread]++;
+	}
+
+	// seconds the thread could not go on until the other one got further
+	void waited(FrameThread thread, double seconds)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		waiting[thread] += seconds;
+	}
+
+	void published(bool unreadReplaced)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		dropped += unreadReplaced ? 1 : 0;
+	}
+
+	// the render thread swapped a snapshot published at publishTime, changeTime is
+	// the time of the input it shows first or negative if it shows no input
+	void shown(double submitSeconds, double publishTime, double changeTime, double now)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		submitTime += submitSeconds;
+		lastSubmit = submitSeconds;
+		age.add((now - publishTime) * 1000.0);
+		if (changeTime >= 0)
+			input.add((now - changeTime) * 1000.0);
+	}
+
+	// GL submission time of the last frame drawn
+	double getLastSubmit()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return lastSubmit;
+	}
+
+	ThreadActivityReport report(double now)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ThreadActivityReport r;
+		r.seconds = now - startTime;
+		for (int t = 0; t < 2; t++)
+		{
+			r.busy[t] = busy[t];
+			r.waiting[t] = waiting[t];
+			r.frames[t] = frames[t];
+		}
+		r.dropped = dropped;
+		r.overlap = overlap;
+		r.submitMs = frames[RENDER_THREAD] ? submitTime * 1000.0 / frames[RENDER_THREAD] : 0;
+		r.ageMean = age.mean();
+		r.ageMax = age.maximum();
+		r.inputMean = input.mean();
+		r.input95 = input.percentile(0.95);
+		r.inputMax = input.maximum();
+		r.inputFrames = input.count();
+		return r;
+	}
+
+private:
+	std::mutex mutex;
+	double startTime;
+	int busyThreads;
+	double overlapStart, overlap;
+	double busy[2], waiting[2], workStart[2];
+	unsigned long long frames[2];
+	unsigned long long dropped;
+	double submitTime, lastSubmit;
+	LatencyStats age;
+	LatencyStats input;
+};
+
+#endif
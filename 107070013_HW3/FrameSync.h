@@ -0,0 +1,322 @@
+///////////////////////////////////////////////////////////////////////////////
+// FrameSync.h
+// ===========
+// CPU/GPU synchronization of the frame loop. Left alone, the driver queues
+// as many frames behind glfwSwapBuffers() as it likes, and the time from
+// input to the screen grows with the load.
+//
+// FrameSync puts a fence after every frame and, before the next one starts,
+// waits for the fence of the frame framesInFlight back, so no more frames
+// than that are ever queued. GPU timestamps at the start and the end of each
+// frame give its GPU time once the fence has passed. The frame is GPU bound when the CPU had to
+// wait for the GPU before it or the GPU took longer than the CPU, otherwise
+// CPU bound.
+//
+// FrameRing is a buffer with one segment per frame in flight for data written
+// every frame. With GL 4.4 or ARB_buffer_storage it is mapped once,
+// persistent and coherent; otherwise each segment is mapped unsynchronized
+// while it is written. The fences keep the GPU off the segment either way.
+//
+// Include after glad and GLFW, and call everything from the thread owning
+// the context, except setFramesInFlight() and report().
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef FRAME_SYNC_H_DEF
+#define FRAME_SYNC_H_DEF
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+const int MAX_FRAMES_IN_FLIGHT = 4;
+const int FRAME_SYNC_HISTORY = 512;			// frames kept for report()
+const double FRAME_SYNC_WAIT_BOUND_MS = 0.1;	// a longer fence wait means the GPU is behind
+
+namespace framesync_detail
+{
+	// glBufferStorage is GL 4.4, past what the loader knows
+	typedef void (APIENTRY* BufferStorageProc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+	inline BufferStorageProc GetBufferStorage()
+	{
+		GLint major = 0, minor = 0, extensions = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+		bool supported = major > 4 || (major == 4 && minor >= 4);
+		for (GLint i = 0; i < extensions && !supported; i++)
+			supported = strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0;
+		return supported ? (BufferStorageProc)glfwGetProcAddress("glBufferStorage") : NULL;
+	}
+}
+
+class FrameRing
+{
+public:
+	FrameRing() : buffer(0), segmentSize(0), segments(0), mapped(NULL), persistent(false), storageChecked(false), bufferStorage(NULL) {}
+
+	// count segments of at least size bytes; a new buffer is made only when they do not
+	// fit, and the caller has to make sure the GPU is done with the old one then
+	void reserve(size_t size, int count)
+	{
+		if (buffer && size <= segmentSize && count == segments)
+			return;
+		if (!storageChecked)
+		{
+			bufferStorage = framesync_detail::GetBufferStorage();
+			storageChecked = true;
+		}
+		release();
+		// grow by half at least, so a slowly growing scene does not reallocate every frame
+		segmentSize = std::max(std::max(size, segmentSize + segmentSize / 2), (size_t)4096);
+		segmentSize = (segmentSize + 255) & ~(size_t)255;
+		segments = count;
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		GLsizeiptr total = (GLsizeiptr)(segmentSize * segments);
+		if (bufferStorage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			bufferStorage(GL_ARRAY_BUFFER, total, NULL, flags);
+			mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags);
+			persistent = mapped != NULL;
+		}
+		else
+		{
+			glBufferData(GL_ARRAY_BUFFER, total, NULL, GL_STREAM_DRAW);
+		}
+	}
+
+	// write pointer to the segment of slot, unmap() when done
+	void* map(int slot)
+	{
+		if (persistent)
+			return (char*)mapped + getOffset(slot);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		return glMapBufferRange(GL_ARRAY_BUFFER, getOffset(slot), segmentSize,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	}
+
+	void unmap()
+	{
+		if (persistent)
+			return;
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+
+	void release()
+	{
+		if (!buffer)
+			return;
+		if (persistent)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		mapped = NULL;
+		persistent = false;
+	}
+
+	GLuint getBuffer() const { return buffer; }
+	size_t getOffset(int slot) const { return (size_t)slot * segmentSize; }
+	size_t getSegmentSize() const { return segmentSize; }
+	bool isPersistent() const { return persistent; }
+
+private:
+	GLuint buffer;
+	size_t segmentSize;
+	int segments;
+	void* mapped;	// whole buffer, persistent mapping only
+	bool persistent;
+	bool storageChecked;
+	framesync_detail::BufferStorageProc bufferStorage;
+};
+
+struct FrameTiming
+{
+	unsigned long long frame;
+	double waitMs;	// CPU waiting for the fence before the frame
+	double cpuMs;	// from the end of the wait until the frame was submitted
+	double swapMs;
+	double gpuMs;	// between the GPU timestamps of the frame
+	bool gpuBound;
+};
+
+struct FrameSyncReport
+{
+	int framesInFlight;
+	unsigned long long frames;	// finished on the GPU and classified
+	unsigned long long gpuBound, cpuBound;
+	double waitMs, cpuMs, swapMs, gpuMs;	// means over the kept frames
+	std::vector<FrameTiming> last;	// newest last
+};
+
+class FrameSync
+{
+public:
+	FrameSync() : requested(2), framesInFlight(0), slot(-1), frameCount(0), frameStart(0), submitTime(0), queriesReady(false), next(0), classified(0), gpuBoundCount(0)
+	{
+		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+		{
+			fences[i] = 0;
+			queries[i][0] = queries[i][1] = 0;
+		}
+	}
+
+	// applied at the next beginFrame(); 0 turns the cap off and leaves the queue to the driver
+	void setFramesInFlight(int count) { requested = std::max(0, std::min(count, MAX_FRAMES_IN_FLIGHT)); }
+	int getFramesInFlight() const { return requested; }
+
+	// before the first GL call of a frame: returns its ring segment, -1 without a cap
+	int beginFrame()
+	{
+		if (!queriesReady)
+		{
+			glGenQueries(MAX_FRAMES_IN_FLIGHT * 2, queries[0]);
+			queriesReady = true;
+		}
+		int count = requested;
+		if (count != framesInFlight)
+		{
+			drain();
+			framesInFlight = count;
+		}
+		double waitStart = glfwGetTime();
+		if (framesInFlight == 0)
+		{
+			slot = -1;
+			frameStart = waitStart;
+			return slot;
+		}
+
+		slot = (int)(frameCount % framesInFlight);
+		if (fences[slot])
+			finish(slot);
+		frameStart = glfwGetTime();
+		pending[slot].frame = frameCount;
+		pending[slot].waitMs = (frameStart - waitStart) * 1000.0;
+		glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+		return slot;
+	}
+
+	// every command of the frame is issued, right before the swap
+	void endSubmit()
+	{
+		submitTime = glfwGetTime();
+		if (slot < 0)
+			return;
+		glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+		pending[slot].cpuMs = (submitTime - frameStart) * 1000.0;
+	}
+
+	// after the swap
+	void endFrame()
+	{
+		if (slot >= 0)
+		{
+			pending[slot].swapMs = (glfwGetTime() - submitTime) * 1000.0;
+			fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		frameCount++;
+	}
+
+	// wait for every frame in flight, before buffers they use are replaced
+	void drain()
+	{
+		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+		{
+			if (fences[i])
+				finish(i);
+		}
+	}
+
+	FrameSyncReport report(int lastCount)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		FrameSyncReport r;
+		r.framesInFlight = requested;
+		r.frames = classified;
+		r.gpuBound = gpuBoundCount;
+		r.cpuBound = classified - gpuBoundCount;
+		r.waitMs = r.cpuMs = r.swapMs = r.gpuMs = 0;
+		for (size_t i = 0; i < history.size(); i++)
+		{
+			r.waitMs += history[i].waitMs;
+			r.cpuMs += history[i].cpuMs;
+			r.swapMs += history[i].swapMs;
+			r.gpuMs += history[i].gpuMs;
+		}
+		if (!history.empty())
+		{
+			r.waitMs /= history.size();
+			r.cpuMs /= history.size();
+			r.swapMs /= history.size();
+			r.gpuMs /= history.size();
+		}
+		// oldest kept frame is at next once the history is full
+		size_t count = std::min((size_t)lastCount, history.size());
+		size_t start = history.size() < FRAME_SYNC_HISTORY ? history.size() - count : (next + FRAME_SYNC_HISTORY - count) % FRAME_SYNC_HISTORY;
+		for (size_t i = 0; i < count; i++)
+			r.last.push_back(history[(start + i) % history.size()]);
+		return r;
+	}
+
+private:
+	// wait for the fence of the frame in slot i, then classify it
+	void finish(int i)
+	{
+		GLenum result;
+		do
+		{
+			result = glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while (result == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[i]);
+		fences[i] = 0;
+
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(queries[i][0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(queries[i][1], GL_QUERY_RESULT, &end);
+		FrameTiming& t = pending[i];
+		t.gpuMs = (end - start) / 1000000.0;
+		t.gpuBound = t.waitMs > FRAME_SYNC_WAIT_BOUND_MS || t.gpuMs > t.cpuMs;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (history.size() < FRAME_SYNC_HISTORY)
+			history.push_back(t);
+		else
+			history[next] = t;
+		next = (next + 1) % FRAME_SYNC_HISTORY;
+		classified++;
+		gpuBoundCount += t.gpuBound ? 1 : 0;
+	}
+
+	std::atomic<int> requested;
+	int framesInFlight;
+	int slot;	// of the frame being recorded
+	GLsync fences[MAX_FRAMES_IN_FLIGHT];
+	GLuint queries[MAX_FRAMES_IN_FLIGHT][2];	// GPU timestamps at the start and the end of the frame
+	FrameTiming pending[MAX_FRAMES_IN_FLIGHT];
+	unsigned long long frameCount;
+	double frameStart, submitTime;
+	bool queriesReady;
+
+	std::mutex mutex;	// for report() from another thread
+	std::vector<FrameTiming> history;
+	size_t next;
+	unsigned long long classified, gpuBoundCount;
+};
+
+#endif
@@ -0,0 +1,390 @@
+///////////////////////////////////////////////////////////////////////////////
+// ImageBenchmark.h
+// ================
+// Round trip validation and timings of the ImageWriter.h encoders, run with
+//     <app> --bench-images
+//
+// 1. Crc32() of "123456789" against the check value 0xcbf43926.
+// 2. Test images (a row which repeats a color after a hash collision, runs
+//    longer than 62 pixels, gradients for DIFF / LUMA, random noise and a
+//    single pixel) are encoded with EncodeQoi() and decoded by a decoder
+//    written from the QOI specification 1.0, which must give every pixel
+//    back.
+// 3. The same images are encoded with EncodePng() and read back: signature,
+//    chunk CRCs, the stored deflate blocks and the adler32 of the zlib
+//    stream are checked and the rows must match the image.
+// 4. PNGs are encoded on several threads at once (the first Crc32() call
+//    builds its table) and must be the bytes of the one thread encode.
+// 5. Encode times and file sizes of a 1920x1080 image.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGE_BENCHMARK_H_DEF
+#define IMAGE_BENCHMARK_H_DEF
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ImageWriter.h"
+
+namespace imagebench_detail
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline double ElapsedMs(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	struct TestImage
+	{
+		std::string name;
+		int width, height;
+		std::vector<unsigned char> rgba;
+
+		TestImage(const std::string& name, int width, int height)
+			: name(name), width(width), height(height), rgba((size_t)width * height * 4, 255)
+		{
+		}
+
+		void set(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+		{
+			unsigned char* px = &rgba[((size_t)y * width + x) * 4];
+			px[0] = r;
+			px[1] = g;
+			px[2] = b;
+		}
+	};
+
+	inline unsigned int ReadBigEndian(const unsigned char* p)
+	{
+		return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+	}
+
+	// QOI decoder after the specification, the output is RGBA; false on a malformed file
+	inline bool DecodeQoi(const std::vector<unsigned char>& file, int* width, int* height, std::vector<unsigned char>* rgba)
+	{
+		if (file.size() < 14 + 8 || memcmp(&file[0], "qoif", 4) != 0)
+			return false;
+		*width = (int)ReadBigEndian(&file[4]);
+		*height = (int)ReadBigEndian(&file[8]);
+		size_t count = (size_t)*width * *height;
+		rgba->assign(count * 4, 0);
+
+		unsigned char index[64][4];
+		memset(index, 0, sizeof(index));
+		unsigned char px[4] = { 0, 0, 0, 255 };
+		size_t p = 14, end = file.size() - 8;
+		int run = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (run > 0)
+			{
+				run--;
+			}
+			else
+			{
+				if (p >= end)
+					return false;
+				unsigned char b = file[p++];
+				if (b == 0xfe)
+				{
+					if (p + 3 > end)
+						return false;
+					memcpy(px, &file[p], 3);
+					p += 3;
+				}
+				else if (b == 0xff)
+				{
+					if (p + 4 > end)
+						return false;
+					memcpy(px, &file[p], 4);
+					p += 4;
+				}
+				else if ((b & 0xc0) == 0x00)
+				{
+					memcpy(px, index[b], 4);
+				}
+				else if ((b & 0xc0) == 0x40)
+				{
+					px[0] += ((b >> 4) & 3) - 2;
+					px[1] += ((b >> 2) & 3) - 2;
+					px[2] += (b & 3) - 2;
+				}
+				else if ((b & 0xc0) == 0x80)
+				{
+					if (p >= end)
+						return false;
+					unsigned char b2 = file[p++];
+					int dg = (b & 0x3f) - 32;
+					px[0] += dg - 8 + ((b2 >> 4) & 0x0f);
+					px[1] += dg;
+					px[2] += dg - 8 + (b2 & 0x0f);
+				}
+				else
+				{
+					run = b & 0x3f;
+				}
+				memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+			}
+			memcpy(&(*rgba)[i * 4], px, 4);
+		}
+		static const unsigned char marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		return p == end && memcmp(&file[end], marker, 8) == 0;
+	}
+
+	// reader of the PNGs of EncodePng(): 8 bit RGB, stored deflate blocks, no filter.
+	// checks every CRC and the adler32; false with a reason in error otherwise
+	inline bool DecodeStoredPng(const std::vector<unsigned char>& file, int* width, int* height, std::vector<unsigned char>* rgb, std::string* error)
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		if (file.size() < 8 || memcmp(&file[0], signature, 8) != 0)
+			return (*error = "no PNG signature"), false;
+		std::vector<unsigned char> zlib;
+		bool ended = false;
+		size_t p = 8;
+		*width = *height = 0;
+		while (!ended)
+		{
+			if (p + 12 > file.size())
+				return (*error = "truncated chunk"), false;
+			unsigned int length = ReadBigEndian(&file[p]);
+			if (p + 12 + length > file.size())
+				return (*error = "truncated chunk"), false;
+			const unsigned char* type = &file[p + 4];
+			const unsigned char* data = &file[p + 8];
+			if (imagewriter_detail::Crc32(type, 4 + length) != ReadBigEndian(data + length))
+				return (*error = "chunk CRC"), false;
+			if (memcmp(type, "IHDR", 4) == 0)
+			{
+				*width = (int)ReadBigEndian(data);
+				*height = (int)ReadBigEndian(data + 4);
+				if (length != 13 || data[8] != 8 || data[9] != 2 || data[10] || data[11] || data[12])
+					return (*error = "IHDR is not 8 bit RGB"), false;
+			}
+			else if (memcmp(type, "IDAT", 4) == 0)
+				zlib.insert(zlib.end(), data, data + length);
+			else if (memcmp(type, "IEND", 4) == 0)
+				ended = true;
+			p += 12 + length;
+		}
+		if (zlib.size() < 6 || ((zlib[0] << 8) | zlib[1]) % 31 != 0 || (zlib[0] & 0x0f) != 8)
+			return (*error = "zlib header"), false;
+
+		std::vector<unsigned char> raw;
+		bool last = false;
+		size_t z = 2;
+		while (!last)
+		{
+			if (z + 5 > zlib.size() || (zlib[z] & 6) != 0)
+				return (*error = "not a stored deflate block"), false;
+			last = (zlib[z] & 1) != 0;
+			unsigned int len = zlib[z + 1] | (zlib[z + 2] << 8);
+			unsigned int nlen = zlib[z + 3] | (zlib[z + 4] << 8);
+			if ((len ^ 0xffff) != nlen || z + 5 + len > zlib.size())
+				return (*error = "stored block length"), false;
+			raw.insert(raw.end(), &zlib[z + 5], &zlib[z + 5] + len);
+			z += 5 + len;
+		}
+		unsigned int a = 1, b = 0;
+		for (size_t i = 0; i < raw.size(); i++)
+		{
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		if (z + 4 != zlib.size() || ReadBigEndian(&zlib[z]) != ((b << 16) | a))
+			return (*error = "adler32"), false;
+
+		size_t stride = (size_t)*width * 3;
+		if (raw.size() != (stride + 1) * *height)
+			return (*error = "image data size"), false;
+		rgb->clear();
+		for (int y = 0; y < *height; y++)
+		{
+			const unsigned char* row = &raw[y * (stride + 1)];
+			if (row[0] != 0)
+				return (*error = "row filter"), false;
+			rgb->insert(rgb->end(), row + 1, row + 1 + stride);
+		}
+		return true;
+	}
+
+	inline std::vector<TestImage> TestImages()
+	{
+		std::vector<TestImage> images;
+
+		// (200, 10, 90) hashes to the slot of (0, 0, 0); the 5th pixel must not be
+		// written as an index into the table when the slot still holds the start value
+		TestImage collision("hash collision row", 5, 1);
+		collision.set(0, 0, 50, 60, 70);
+		collision.set(1, 0, 0, 0, 0);
+		collision.set(2, 0, 200, 10, 90);
+		collision.set(3, 0, 120, 120, 120);
+		collision.set(4, 0, 200, 10, 90);
+		images.push_back(collision);
+
+		TestImage black("black, starts as a run", 3, 2);
+		for (int i = 0; i < 6; i++)
+			black.set(i % 3, i / 3, 0, 0, 0);
+		images.push_back(black);
+
+		TestImage runs("runs over 62 pixels", 200, 3);
+		for (int x = 0; x < 200; x++)
+		{
+			runs.set(x, 0, 10, 20, 30);
+			runs.set(x, 1, x < 130 ? 10 : 255, 20, 30);
+			runs.set(x, 2, 255, 255, 255);
+		}
+		images.push_back(runs);
+
+		TestImage gradient("gradients", 256, 64);
+		for (int y = 0; y < 64; y++)
+		{
+			for (int x = 0; x < 256; x++)
+				gradient.set(x, y, (unsigned char)x, (unsigned char)(x + y * 3), (unsigned char)(255 - x + y));
+		}
+		images.push_back(gradient);
+
+		TestImage noise("random noise", 97, 61);
+		std::mt19937 random(1234);
+		for (int y = 0; y < 61; y++)
+		{
+			for (int x = 0; x < 97; x++)
+			{
+				// a few colors only, so INDEX and small differences happen
+				unsigned int v = random();
+				if (v % 4 == 0)
+					noise.set(x, y, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24));
+				else
+					noise.set(x, y, (unsigned char)(v % 5 * 40), (unsigned char)(v % 3 * 60), 77);
+			}
+		}
+		images.push_back(noise);
+
+		TestImage single("single pixel", 1, 1);
+		single.set(0, 0, 1, 2, 3);
+		images.push_back(single);
+		return images;
+	}
+
+	// number of pixels of rgba (4 per pixel) whose rgb is not the rgb of decoded
+	// with the given channels per pixel, or of an alpha other than 255
+	inline size_t DifferentPixels(const std::vector<unsigned char>& rgba, const std::vector<unsigned char>& decoded, int channels)
+	{
+		size_t count = rgba.size() / 4;
+		if (decoded.size() != count * channels)
+			return count;
+		size_t different = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			const unsigned char* d = &decoded[i * channels];
+			if (memcmp(&rgba[i * 4], d, 3) != 0 || (channels == 4 && d[3] != 255))
+				different++;
+		}
+		return different;
+	}
+}
+
+// returns the exit code of the app
+inline int RunImageBenchmark()
+{
+	using namespace imagebench_detail;
+	bool ok = true;
+
+	unsigned int crc = imagewriter_detail::Crc32((const unsigned char*)"123456789", 9);
+	printf("Crc32(\"123456789\") = %08x, %s\n", crc, crc == 0xcbf43926u ? "correct" : "WRONG, expected cbf43926");
+	ok = ok && crc == 0xcbf43926u;
+
+	std::vector<TestImage> images = TestImages();
+	printf("%-28s %9s %7s %-22s %7s %s\n", "image", "size", "qoi", "qoi round trip", "png", "png round trip");
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		const TestImage& image = images[i];
+		std::vector<unsigned char> qoi, png, decoded;
+		int width = 0, height = 0;
+		std::string qoiResult = "encode failed", pngResult = "encode failed";
+		if (EncodeQoi(image.rgba, image.width, image.height, &qoi))
+		{
+			if (!DecodeQoi(qoi, &width, &height, &decoded))
+				qoiResult = "malformed";
+			else if (width != image.width || height != image.height)
+				qoiResult = "wrong size";
+			else
+			{
+				size_t different = DifferentPixels(image.rgba, decoded, 4);
+				qoiResult = different ? std::to_string(different) + " pixels DIFFERENT" : "identical";
+			}
+		}
+		if (EncodePng(image.rgba, image.width, image.height, &png))
+		{
+			std::string error;
+			if (!DecodeStoredPng(png, &width, &height, &decoded, &error))
+				pngResult = error;
+			else if (width != image.width || height != image.height)
+				pngResult = "wrong size";
+			else
+			{
+				size_t different = DifferentPixels(image.rgba, decoded, 3);
+				pngResult = different ? std::to_string(different) + " pixels DIFFERENT" : "identical";
+			}
+		}
+		printf("%-28s %4dx%-4d %7d %-22s %7d %s\n", image.name.c_str(), image.width, image.height,
+			(int)qoi.size(), qoiResult.c_str(), (int)png.size(), pngResult.c_str());
+		ok = ok && qoiResult == "identical" && pngResult == "identical";
+	}
+
+	// the frame capture encodes on its workers at the same time
+	const TestImage& gradient = images[3];
+	std::vector<unsigned char> reference;
+	EncodePng(gradient.rgba, gradient.width, gradient.height, &reference);
+	unsigned int threadCount = std::max(2u, std::thread::hardware_concurrency());
+	std::vector<std::vector<unsigned char> > results(threadCount);
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			for (int r = 0; r < 20; r++)
+				EncodePng(gradient.rgba, gradient.width, gradient.height, &results[t]);
+		}));
+	}
+	bool same = true;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		threads[t].join();
+		same = same && results[t] == reference;
+	}
+	printf("PNG encode on %u threads at once: %s\n", threadCount, same ? "identical" : "DIFFERENT from 1 thread");
+	ok = ok && same;
+
+	TestImage frame("1920x1080 frame", 1920, 1080);
+	for (int y = 0; y < 1080; y++)
+	{
+		for (int x = 0; x < 1920; x++)
+			frame.set(x, y, (unsigned char)(x / 8), (unsigned char)(y / 5), (unsigned char)((x ^ y) & 0xf0));
+	}
+	std::vector<unsigned char> file;
+	for (int format = 0; format < 2; format++)
+	{
+		double best = 1e30;
+		for (int r = 0; r < 3; r++)
+		{
+			Clock::time_point start = Clock::now();
+			if (format == 0)
+				EncodePng(frame.rgba, frame.width, frame.height, &file);
+			else
+				EncodeQoi(frame.rgba, frame.width, frame.height, &file);
+			best = std::min(best, ElapsedMs(start));
+		}
+		printf("%s %s: %.2f ms (best of 3), %.1f MB\n", format == 0 ? "EncodePng" : "EncodeQoi", frame.name.c_str(),
+			best, file.size() / (1024.0 * 1024.0));
+	}
+
+	printf("%s\n", ok ? "all images round trip" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+#endif
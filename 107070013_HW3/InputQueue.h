@@ -0,0 +1,111 @@
+///////////////////////////////////////////////////////////////////////////////
+// InputQueue.h
+// ============
+// GLFW callbacks only record what happened; the frame loop takes the events
+// once per frame and applies them in order. Changes to the camera, the
+// projection, the scene or the shading only set DirtyFlag bits, and the
+// matrices are rebuilt once before the frame is drawn, however many events
+// arrived since the last one.
+//
+// LatencyStats keeps the time from the callback of the first event of a
+// frame to the swap of that frame, over the last LATENCY_SAMPLES frames.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef INPUT_QUEUE_H_DEF
+#define INPUT_QUEUE_H_DEF
+
+#include <algorithm>
+#include <vector>
+
+enum InputEventType
+{
+	INPUT_KEY = 0,
+	INPUT_MOUSE_BUTTON = 1,
+	INPUT_CURSOR = 2,
+	INPUT_SCROLL = 3,
+};
+
+struct InputEvent
+{
+	InputEventType type;
+	int code;		// key or mouse button
+	int action;		// GLFW_PRESS, GLFW_RELEASE, GLFW_REPEAT
+	int mods;
+	double x, y;	// cursor position or scroll offset
+	double time;	// glfwGetTime() in the callback
+};
+
+// what has to be updated before the next frame
+enum DirtyFlag
+{
+	DIRTY_VIEW = 1,			// main_camera changed, view matrix
+	DIRTY_PROJECTION = 2,	// projection mode or clip planes
+	DIRTY_SCENE = 4,		// transforms, visible models, culling
+	DIRTY_SHADING = 8,		// lights, materials, texture filters
+};
+
+class InputQueue
+{
+public:
+	void push(const InputEvent& event) { events.push_back(event); }
+
+	// hand the events queued since the last call to out, oldest first
+	void drain(std::vector<InputEvent>* out)
+	{
+		out->clear();
+		out->swap(events);
+	}
+
+	size_t size() const { return events.size(); }
+
+private:
+	std::vector<InputEvent> events;
+};
+
+const int LATENCY_SAMPLES = 512;
+
+class LatencyStats
+{
+public:
+	LatencyStats() : next(0), total(0) {}
+
+	void add(double ms)
+	{
+		if (samples.size() < LATENCY_SAMPLES)
+			samples.push_back(ms);
+		else
+			samples[next] = ms;
+		next = (next + 1) % LATENCY_SAMPLES;
+		total++;
+	}
+
+	// over the kept samples
+	double mean() const
+	{
+		double sum = 0;
+		for (size_t i = 0; i < samples.size(); i++)
+			sum += samples[i];
+		return samples.empty() ? 0 : sum / samples.size();
+	}
+
+	// p in [0, 1]
+	double percentile(double p) const
+	{
+		if (samples.empty())
+			return 0;
+		std::vector<double> sorted(samples);
+		size_t index = std::min((size_t)(p * (sorted.size() - 1) + 0.5), sorted.size() - 1);
+		std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+		return sorted[index];
+	}
+
+	double maximum() const { return samples.empty() ? 0 : *std::max_element(samples.begin(), samples.end()); }
+	size_t count() const { return total; }
+
+private:
+	std::vector<double> samples;
+	size_t next;
+	size_t total;	// frames measured since the start
+};
+
+#endif
@@ -0,0 +1,517 @@
+///////////////////////////////////////////////////////////////////////////////
+// LoaderBenchmark.h
+// =================
+// Validation and throughput numbers for the OBJ loader, run with
+//     <app> --bench-loader [file.obj ...]
+// (the app's own model list is used when no file is given).
+//
+// 1. Every number of the corpus (the given models plus generated decimals in
+//    the usual OBJ formats) is parsed by the original tinyobj::tryParseDouble
+//    and by the fast path, and the results are compared bit by bit. Face
+//    indices are compared against atoi().
+// 2. Number / index parsing speed of both paths in MB/s.
+// 3. Whole file load speed of LoadObjMesh() in MB/s.
+// 4. LoadObjMeshParallel() with 1, 2, 4, ... threads up to the hardware
+//    threads, checked against the result of LoadObjMesh().
+// 5. Line scanning speed in GB/s: memchr per line vs tinyobj::ScanLines
+//    with scalar and SIMD classification, on the models and a generated
+//    64 MB OBJ text.
+//
+// Uses the static parser functions of tiny_obj_loader.h, so it has to be
+// included after the tinyobj implementation (TINYOBJLOADER_IMPLEMENTATION).
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LOADER_BENCHMARK_H_DEF
+#define LOADER_BENCHMARK_H_DEF
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include "ObjMesh.h"
+#include "ObjMeshParallel.h"
+
+namespace loaderbench_detail
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline double ElapsedMs(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	inline bool ReadFile(const std::string& path, std::string* text)
+	{
+		std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+		if (!file)
+			return false;
+		std::stringstream ss;
+		ss << file.rdbuf();
+		*text = ss.str();
+		return true;
+	}
+
+	// numbers of v / vn / vt lines and index strings of f lines, each kept in
+	// one space separated text with the same padding the loader gives a line
+	struct Corpus
+	{
+		std::string numberText;
+		std::vector<size_t> numberStart;
+		std::vector<int> numberLength;
+		std::string indexText;
+		std::vector<size_t> indexStart;
+
+		void addNumber(const std::string& s)
+		{
+			numberStart.push_back(numberText.size());
+			numberLength.push_back((int)s.size());
+			numberText += s + " ";
+		}
+
+		void addIndex(const std::string& s)
+		{
+			indexStart.push_back(indexText.size());
+			indexText += s + " ";
+		}
+
+		void finish()
+		{
+			numberText.append(TINYOBJ_LINE_PADDING, '\0');
+			indexText.append(TINYOBJ_LINE_PADDING, '\0');
+		}
+
+		size_t numberCount() const { return numberStart.size(); }
+		size_t indexCount() const { return indexStart.size(); }
+		const char* number(size_t i) const { return numberText.c_str() + numberStart[i]; }
+		const char* index(size_t i) const { return indexText.c_str() + indexStart[i]; }
+	};
+
+	inline void CollectTokens(const std::string& text, Corpus* corpus)
+	{
+		std::istringstream lines(text);
+		std::string line;
+		while (std::getline(lines, line))
+		{
+			std::istringstream tokens(line);
+			std::string tag, token;
+			tokens >> tag;
+			if (tag == "v" || tag == "vn" || tag == "vt")
+			{
+				while (tokens >> token)
+					corpus->addNumber(token);
+			}
+			else if (tag == "f")
+			{
+				// i, i/j, i//k, i/j/k
+				while (tokens >> token)
+				{
+					size_t start = 0;
+					while (start <= token.size())
+					{
+						size_t slash = token.find('/', start);
+						if (slash == std::string::npos)
+							slash = token.size();
+						if (slash > start)
+							corpus->addIndex(token.substr(start, slash - start));
+						start = slash + 1;
+					}
+				}
+			}
+		}
+	}
+
+	// decimals as written by common exporters, from a fixed seed
+	inline void GenerateNumbers(size_t count, Corpus* corpus)
+	{
+		unsigned int seed = 12345;
+		char buf[64];
+		for (size_t i = 0; i < count; i++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			double mantissa = (seed >> 8) / 16777216.0 - 0.5;
+			seed = seed * 1664525u + 1013904223u;
+			double value = mantissa * pow(10.0, (int)(seed >> 28) - 6);
+			switch (i % 6)
+			{
+			case 0: snprintf(buf, sizeof(buf), "%f", value); break;
+			case 1: snprintf(buf, sizeof(buf), "%.4f", value); break;
+			case 2: snprintf(buf, sizeof(buf), "%g", value); break;
+			case 3: snprintf(buf, sizeof(buf), "%e", value); break;
+			case 4: snprintf(buf, sizeof(buf), "%.9g", value); break;
+			default: snprintf(buf, sizeof(buf), "%.17g", value); break;
+			}
+			corpus->addNumber(buf);
+		}
+		for (size_t i = 0; i < count / 4; i++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			snprintf(buf, sizeof(buf), (i % 8 == 0) ? "-%u" : "%u", (seed >> 8) % (1u << (i % 25)) + 1);
+			corpus->addIndex(buf);
+		}
+	}
+
+	inline double ParseLegacy(const char* s, int length)
+	{
+		double value = 0.0;
+		tinyobj::tryParseDouble(s, s + length, &value);
+		return value;
+	}
+
+	inline double ParseFast(const char* s, int length)
+	{
+		double value = 0.0;
+		if (!tinyobj::parseDoubleFast(&s, &value))
+			tinyobj::tryParseDouble(s, s + length, &value);
+		return value;
+	}
+
+	inline void ValidateCorpus(const char* name, const Corpus& corpus)
+	{
+		size_t realMismatch = 0, legacyWrong = 0, doubleMismatch = 0, fastPath = 0, fastCorrect = 0, indexMismatch = 0;
+		for (size_t i = 0; i < corpus.numberCount(); i++)
+		{
+			const char* s = corpus.number(i);
+			int length = corpus.numberLength[i];
+			double legacy = ParseLegacy(s, length);
+			double fast = ParseFast(s, length);
+			double exact = strtod(s, NULL);
+			tinyobj::real_t legacyReal = static_cast<tinyobj::real_t>(legacy);
+			tinyobj::real_t fastReal = static_cast<tinyobj::real_t>(fast);
+			if (memcmp(&legacyReal, &fastReal, sizeof(tinyobj::real_t)) != 0)
+			{
+				// count the cases where the old parser is the one off the correctly rounded value
+				tinyobj::real_t exactReal = static_cast<tinyobj::real_t>(exact);
+				if (memcmp(&exactReal, &fastReal, sizeof(tinyobj::real_t)) == 0)
+					legacyWrong++;
+				else if (realMismatch - legacyWrong < 5)
+					printf("    real_t mismatch \"%.*s\": legacy %.9g fast %.9g\n", length, s, (double)legacyReal, (double)fastReal);
+				realMismatch++;
+			}
+			if (memcmp(&legacy, &fast, sizeof(double)) != 0)
+				doubleMismatch++;
+
+			double value;
+			const char* token = s;
+			if (tinyobj::parseDoubleFast(&token, &value))
+			{
+				fastPath++;
+				if (memcmp(&exact, &value, sizeof(double)) == 0)
+					fastCorrect++;
+			}
+		}
+		for (size_t i = 0; i < corpus.indexCount(); i++)
+		{
+			const char* end;
+			if (tinyobj::parseIndex(corpus.index(i), &end) != atoi(corpus.index(i)))
+				indexMismatch++;
+		}
+
+		printf("  %s: %d numbers, real_t mismatches %d (legacy not correctly rounded in %d), double mismatches %d\n", name,
+			(int)corpus.numberCount(), (int)realMismatch, (int)legacyWrong, (int)doubleMismatch);
+		printf("  %s: fast path taken %d, correctly rounded (== strtod) %d; %d indices, mismatches %d\n", name,
+			(int)fastPath, (int)fastCorrect, (int)corpus.indexCount(), (int)indexMismatch);
+	}
+
+	inline void BenchmarkParsers(const char* name, const Corpus& corpus)
+	{
+		const int repeat = 5;
+		double legacyMs = 1e30, fastMs = 1e30, atoiMs = 1e30, swarMs = 1e30;
+		double sink = 0;
+		long long isink = 0;
+		for (int r = 0; r < repeat; r++)
+		{
+			// walk the numbers like parseReal did before and does now
+			Clock::time_point start = Clock::now();
+			const char* token = corpus.numberText.c_str();
+			for (size_t i = 0; i < corpus.numberCount(); i++)
+			{
+				token += strspn(token, " \t");
+				const char* end = token + strcspn(token, " \t\r");
+				double value = 0.0;
+				tinyobj::tryParseDouble(token, end, &value);
+				sink += value;
+				token = end;
+			}
+			double ms = ElapsedMs(start);
+			if (ms < legacyMs) legacyMs = ms;
+
+			start = Clock::now();
+			token = corpus.numberText.c_str();
+			for (size_t i = 0; i < corpus.numberCount(); i++)
+				sink += tinyobj::parseReal(&token);
+			ms = ElapsedMs(start);
+			if (ms < fastMs) fastMs = ms;
+
+			// walk the indices like parseRawTriple does
+			start = Clock::now();
+			token = corpus.indexText.c_str();
+			for (size_t i = 0; i < corpus.indexCount(); i++)
+			{
+				isink += atoi(token);
+				token += strcspn(token, "/ \t\r") + 1;
+			}
+			ms = ElapsedMs(start);
+			if (ms < atoiMs) atoiMs = ms;
+
+			start = Clock::now();
+			token = corpus.indexText.c_str();
+			for (size_t i = 0; i < corpus.indexCount(); i++)
+			{
+				isink += tinyobj::parseIndex(token, &token);
+				token += strcspn(token, "/ \t\r") + 1;
+			}
+			ms = ElapsedMs(start);
+			if (ms < swarMs) swarMs = ms;
+		}
+
+		double numberMB = corpus.numberText.size() / 1048576.0;
+		double indexMB = corpus.indexText.size() / 1048576.0;
+		printf("  %s numbers: legacy %.1f MB/s, fast %.1f MB/s (%.2fx)\n", name,
+			numberMB / (legacyMs / 1000), numberMB / (fastMs / 1000), legacyMs / fastMs);
+		printf("  %s indices: atoi %.1f MB/s, swar %.1f MB/s (%.2fx)   [checksum %g %lld]\n", name,
+			indexMB / (atoiMs / 1000), indexMB / (swarMs / 1000), atoiMs / swarMs, sink, isink);
+	}
+
+	template <typename T>
+	inline bool SameArray(const std::vector<T>& a, const std::vector<T>& b)
+	{
+		return a.size() == b.size() && (a.empty() || memcmp(&a[0], &b[0], a.size() * sizeof(T)) == 0);
+	}
+
+	inline bool SameMesh(const ObjMesh& a, const ObjMesh& b)
+	{
+		if (!SameArray(a.positions, b.positions) || !SameArray(a.colors, b.colors) || !SameArray(a.normals, b.normals) ||
+			!SameArray(a.texcoords, b.texcoords) || !SameArray(a.indices, b.indices) || !SameArray(a.faceMaterials, b.faceMaterials) ||
+			a.groups.size() != b.groups.size() || a.materials.size() != b.materials.size())
+			return false;
+		for (size_t i = 0; i < a.groups.size(); i++)
+		{
+			if (a.groups[i].name != b.groups[i].name || a.groups[i].firstFace != b.groups[i].firstFace ||
+				a.groups[i].faceCount != b.groups[i].faceCount)
+				return false;
+		}
+		return true;
+	}
+
+	// vertices, texcoords, normals and faces in the layout of common exporters
+	inline std::string GenerateObjText(size_t bytes)
+	{
+		std::string text;
+		text.reserve(bytes + 256);
+		unsigned int seed = 6789;
+		char line[256];
+		for (int n = 1; text.size() < bytes; n++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			float x = (seed >> 8) / 16777216.0f - 0.5f;
+			switch (n % 8)
+			{
+			case 0: snprintf(line, sizeof(line), "v %f %f %f\r\n", x, x * 2, x * 3); break;
+			case 1: snprintf(line, sizeof(line), "vt %f %f\r\n", x + 0.5f, 0.5f - x); break;
+			case 2: snprintf(line, sizeof(line), "vn %f %f %f\r\n", x, 0.7f, -x); break;
+			case 3: snprintf(line, sizeof(line), "# comment %d\r\n\r\n", n); break;
+			default: snprintf(line, sizeof(line), "f %d/%d/%d %d/%d/%d %d/%d/%d\r\n", n, n, n, n + 1, n, n + 2, n + 2, n + 1, n); break;
+			}
+			text += line;
+		}
+		return text;
+	}
+
+	typedef size_t (*ScanFunction)(const char* buf, size_t len, bool at_end, tinyobj::line_index_t* index);
+
+	// lines with tokens, scanned in windows like the loader does
+	inline size_t CountLines(const std::string& text, ScanFunction scan, size_t* checksum)
+	{
+		tinyobj::line_index_t index;
+		const char* window = text.c_str();
+		const char* end = window + text.size();
+		size_t lines = 0;
+		while (window < end)
+		{
+			size_t base = window - text.c_str();
+			bool atEnd = (size_t)(end - window) <= 64 * 1024;
+			size_t consumed = scan(window, atEnd ? end - window : 64 * 1024, atEnd, &index);
+			for (size_t i = 0; i < index.line_end.size(); i++)
+				*checksum += (base + index.token_begin[i]) * 3 + base + index.line_end[i];
+			lines += index.line_end.size();
+			window += consumed;
+		}
+		return lines;
+	}
+
+	// the same with two memchr calls per line ('\n' and '\r'), as the loader did before ScanLines
+	inline size_t CountLinesMemchr(const std::string& text, size_t* checksum)
+	{
+		const char* p = text.c_str();
+		const char* end = p + text.size();
+		const char* newline = p;
+		size_t lines = 0;
+		while (p < end)
+		{
+			if (newline <= p)
+			{
+				newline = (const char*)memchr(p, '\n', end - p);
+				if (!newline)
+					newline = end;
+			}
+			const char* lineEnd = newline;
+			const char* cr = (const char*)memchr(p, '\r', lineEnd - p);
+			if (cr)
+				lineEnd = cr;
+			p += strspn(p, " \t");
+			if (p < lineEnd)
+			{
+				*checksum += (p - text.c_str()) * 3 + (lineEnd - text.c_str());
+				lines++;
+			}
+			p = lineEnd + 1;
+		}
+		return lines;
+	}
+
+	inline void BenchmarkScanner(const char* name, const std::string& text)
+	{
+		const int repeat = 5;
+		double memchrMs = 1e30, scalarMs = 1e30, simdMs = 1e30;
+		size_t memchrSum = 0, scalarSum = 0, simdSum = 0;
+		size_t memchrLines = 0, scalarLines = 0, simdLines = 0;
+		for (int r = 0; r < repeat; r++)
+		{
+			memchrSum = scalarSum = simdSum = 0;
+			Clock::time_point start = Clock::now();
+			memchrLines = CountLinesMemchr(text, &memchrSum);
+			double ms = ElapsedMs(start);
+			if (ms < memchrMs) memchrMs = ms;
+
+			start = Clock::now();
+			scalarLines = CountLines(text, tinyobj::scanLinesWith<tinyobj::classifyBlock64Scalar>, &scalarSum);
+			ms = ElapsedMs(start);
+			if (ms < scalarMs) scalarMs = ms;
+
+			start = Clock::now();
+			simdLines = CountLines(text, tinyobj::ScanLines, &simdSum);
+			ms = ElapsedMs(start);
+			if (ms < simdMs) simdMs = ms;
+		}
+
+#if defined(TINYOBJ_SCAN_AVX2)
+		const char* simd = "avx2";
+#elif defined(TINYOBJ_SCAN_SSE2)
+		const char* simd = "sse2";
+#else
+		const char* simd = "scalar";
+#endif
+		double GB = text.size() / 1073741824.0;
+		bool same = memchrLines == simdLines && scalarLines == simdLines && memchrSum == simdSum && scalarSum == simdSum;
+		printf("  %s (%.2f MB, %d lines): memchr %.2f GB/s, scalar %.2f GB/s, %s %.2f GB/s, index %s\n", name,
+			text.size() / 1048576.0, (int)simdLines, GB / (memchrMs / 1000), GB / (scalarMs / 1000), simd, GB / (simdMs / 1000),
+			same ? "identical" : "DIFFERENT");
+	}
+
+	inline std::string BaseDir(const std::string& path)
+	{
+		size_t slash = path.find_last_of("/\\");
+		return (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+	}
+}
+
+// returns the exit code of the app
+inline int RunLoaderBenchmark(const std::vector<std::string>& files)
+{
+	using namespace loaderbench_detail;
+
+	Corpus models, generated;
+	std::string modelText;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		std::string text;
+		if (!ReadFile(files[i], &text))
+		{
+			printf("Cannot read %s\n", files[i].c_str());
+			return 1;
+		}
+		CollectTokens(text, &models);
+		modelText += text;
+	}
+	GenerateNumbers(1000000, &generated);
+	models.finish();
+	generated.finish();
+
+	printf("Number parser validation (legacy tryParseDouble vs fast path)\n");
+	ValidateCorpus("models", models);
+	ValidateCorpus("generated", generated);
+
+	printf("Number parser throughput\n");
+	BenchmarkParsers("models", models);
+	BenchmarkParsers("generated", generated);
+
+	printf("LoadObjMesh throughput (best of 5)\n");
+	size_t totalBytes = 0;
+	double totalMs = 0;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		double best = 1e30;
+		ObjLoadStats stats;
+		for (int r = 0; r < 5; r++)
+		{
+			ObjMesh mesh;
+			std::string warn, err;
+			Clock::time_point start = Clock::now();
+			LoadObjMesh(files[i], BaseDir(files[i]), &mesh, &warn, &err, &stats);
+			double ms = ElapsedMs(start);
+			if (ms < best) best = ms;
+		}
+		totalBytes += stats.fileBytes;
+		totalMs += best;
+		printf("  %-40s %8.2f MB %8.2f ms %8.1f MB/s\n", files[i].c_str(), stats.fileBytes / 1048576.0, best,
+			stats.fileBytes / 1048576.0 / (best / 1000));
+	}
+	if (totalMs > 0)
+		printf("  total %.2f MB in %.2f ms, %.1f MB/s\n", totalBytes / 1048576.0, totalMs, totalBytes / 1048576.0 / (totalMs / 1000));
+
+	unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t < hardwareThreads; t *= 2)
+		threadCounts.push_back(t);
+	threadCounts.push_back(hardwareThreads);
+	printf("LoadObjMeshParallel scaling, %u hardware threads (best of 3)\n", hardwareThreads);
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		ObjMesh reference;
+		std::string warn, err;
+		LoadObjMesh(files[i], BaseDir(files[i]), &reference, &warn, &err);
+		double oneThreadMs = 0;
+		for (size_t c = 0; c < threadCounts.size(); c++)
+		{
+			double best = 1e30;
+			bool same = true;
+			ObjLoadStats stats;
+			for (int r = 0; r < 3; r++)
+			{
+				ObjMesh mesh;
+				Clock::time_point start = Clock::now();
+				LoadObjMeshParallel(files[i], BaseDir(files[i]), &mesh, &warn, &err, &stats, threadCounts[c]);
+				double ms = ElapsedMs(start);
+				if (ms < best) best = ms;
+				same = same && SameMesh(mesh, reference);
+			}
+			if (c == 0)
+				oneThreadMs = best;
+			printf("  %-40s %2u threads %8.2f ms %8.1f MB/s  speedup %.2fx  %s\n", files[i].c_str(), threadCounts[c], best,
+				stats.fileBytes / 1048576.0 / (best / 1000), oneThreadMs / best, same ? "identical" : "DIFFERENT from LoadObjMesh");
+		}
+	}
+
+	printf("Line scanner throughput (best of 5)\n");
+	BenchmarkScanner("models", modelText);
+	BenchmarkScanner("generated", GenerateObjText(64 << 20));
+	return 0;
+}
+
+#endif
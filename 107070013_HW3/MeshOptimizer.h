@@ -0,0 +1,385 @@
+///////////////////////////////////////////////////////////////////////////////
+// MeshOptimizer.h
+// ===============
+// Turns the flat triangle lists of FlattenObjGroup() into indexed meshes
+// ordered for the GPU:
+// 1. weld: identical vertices (all attributes equal) are merged.
+// 2. post-transform cache: triangles are reordered with Tipsify (Sander,
+//    Nehab, Barczak, "Fast Triangle Reordering for Vertex Locality and
+//    Reduced Overdraw", 2007) for a FIFO cache of 16 vertices.
+// 3. overdraw: the Tipsify sequence is cut at its dead ends into clusters,
+//    which are sorted by occlusion potential, so the outward facing parts of
+//    the model are drawn first and hide more of what follows.
+// 4. vertex fetch: vertices are renumbered in the order of first use.
+//
+// ACMR (cache misses per triangle) and ATVR (cache misses per vertex) of a
+// 16 entry FIFO are measured on the welded mesh in file order and after the
+// optimization. Without indices every vertex is a miss, ACMR 3.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef MESH_OPTIMIZER_H_DEF
+#define MESH_OPTIMIZER_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "LoadArena.h"
+
+struct MeshOptimizeStats
+{
+	size_t triangles;
+	size_t vertices;		// after welding
+	size_t missesBefore;	// FIFO cache misses in file order
+	size_t missesAfter;		// FIFO cache misses after the optimization
+	size_t clusters;		// overdraw clusters
+	double optimizeMs;
+
+	MeshOptimizeStats() : triangles(0), vertices(0), missesBefore(0), missesAfter(0), clusters(0), optimizeMs(0) {}
+
+	void add(const MeshOptimizeStats& other)
+	{
+		triangles += other.triangles;
+		vertices += other.vertices;
+		missesBefore += other.missesBefore;
+		missesAfter += other.missesAfter;
+		clusters += other.clusters;
+		optimizeMs += other.optimizeMs;
+	}
+
+	float acmrBefore() const { return triangles ? (float)missesBefore / triangles : 0.0f; }
+	float acmrAfter() const { return triangles ? (float)missesAfter / triangles : 0.0f; }
+	float atvrBefore() const { return vertices ? (float)missesBefore / vertices : 0.0f; }
+	float atvrAfter() const { return vertices ? (float)missesAfter / vertices : 0.0f; }
+};
+
+const int VERTEX_CACHE_SIZE = 16;
+
+// misses of a FIFO post-transform cache
+inline size_t CountCacheMisses(const LoadArenaVector<unsigned int>& indices, size_t vertexCount, int cacheSize = VERTEX_CACHE_SIZE)
+{
+	// a vertex is cached while fewer than cacheSize misses happened since its own
+	LoadArenaVector<unsigned int> stamp(vertexCount, 0, indices.get_allocator());
+	unsigned int time = cacheSize + 1;
+	size_t misses = 0;
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		unsigned int v = indices[i];
+		if (time - stamp[v] > (unsigned int)cacheSize)
+		{
+			stamp[v] = time++;
+			misses++;
+		}
+	}
+	return misses;
+}
+
+namespace meshopt_detail
+{
+	struct Stream
+	{
+		LoadArenaVector<float>* data;
+		int components;
+	};
+
+	inline unsigned int HashVertex(const float* v, int count)
+	{
+		// FNV-1a over the bits of the floats
+		unsigned int hash = 2166136261u;
+		for (int i = 0; i < count; i++)
+		{
+			unsigned int bits;
+			memcpy(&bits, &v[i], sizeof(bits));
+			hash = (hash ^ bits) * 16777619u;
+		}
+		return hash ^ (hash >> 15);
+	}
+
+	// merge bit identical vertices, the streams are compacted in place
+	inline void Weld(Stream* streams, int streamCount, size_t vertexCount, LoadArenaVector<unsigned int>* indices, LoadArena* arena)
+	{
+		int stride = 0;
+		for (int s = 0; s < streamCount; s++)
+			stride += streams[s].components;
+
+		LoadArenaVector<float> interleaved(vertexCount * stride, 0.0f, arena);
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			float* dst = &interleaved[v * stride];
+			for (int s = 0; s < streamCount; s++)
+			{
+				const float* src = &(*streams[s].data)[v * streams[s].components];
+				for (int c = 0; c < streams[s].components; c++)
+					*dst++ = src[c];
+			}
+		}
+
+		// open addressing, table holds the new index of a vertex
+		size_t tableSize = 16;
+		while (tableSize < vertexCount * 2)
+			tableSize *= 2;
+		const unsigned int empty = ~0u;
+		LoadArenaVector<unsigned int> table(tableSize, empty, arena);
+		LoadArenaVector<unsigned int> firstVertex(arena);	// source vertex of every new index
+		firstVertex.reserve(vertexCount);
+		indices->resize(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			const float* key = &interleaved[v * stride];
+			size_t slot = HashVertex(key, stride) & (tableSize - 1);
+			while (table[slot] != empty && memcmp(&interleaved[firstVertex[table[slot]] * stride], key, stride * sizeof(float)) != 0)
+				slot = (slot + 1) & (tableSize - 1);
+			if (table[slot] == empty)
+			{
+				table[slot] = (unsigned int)firstVertex.size();
+				firstVertex.push_back((unsigned int)v);
+			}
+			(*indices)[v] = table[slot];
+		}
+
+		// firstVertex is increasing and firstVertex[i] >= i, so copying forward is safe
+		for (int s = 0; s < streamCount; s++)
+		{
+			LoadArenaVector<float>& data = *streams[s].data;
+			int n = streams[s].components;
+			for (size_t i = 0; i < firstVertex.size(); i++)
+			{
+				for (int c = 0; c < n; c++)
+					data[i * n + c] = data[firstVertex[i] * n + c];
+			}
+			data.resize(firstVertex.size() * n);
+		}
+	}
+
+	// Tipsify, writes the triangle order and the first triangle of every cluster
+	inline void Tipsify(const LoadArenaVector<unsigned int>& indices, size_t vertexCount, int cacheSize,
+		LoadArenaVector<unsigned int>* order, LoadArenaVector<unsigned int>* clusterStarts, LoadArena* arena)
+	{
+		size_t triangleCount = indices.size() / 3;
+
+		// vertex -> triangles adjacency
+		LoadArenaVector<unsigned int> offsets(vertexCount + 1, 0, arena);
+		for (size_t i = 0; i < indices.size(); i++)
+			offsets[indices[i] + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			offsets[v + 1] += offsets[v];
+		LoadArenaVector<unsigned int> adjacency(indices.size(), 0, arena);
+		LoadArenaVector<unsigned int> fill(offsets.begin(), offsets.end() - 1, arena);
+		for (size_t i = 0; i < indices.size(); i++)
+			adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+
+		LoadArenaVector<int> live(vertexCount, 0, arena);
+		for (size_t v = 0; v < vertexCount; v++)
+			live[v] = (int)(offsets[v + 1] - offsets[v]);
+		LoadArenaVector<int> stamp(vertexCount, 0, arena);
+		LoadArenaVector<char> emitted(triangleCount, 0, arena);
+		LoadArenaVector<unsigned int> deadEnd(arena);
+		LoadArenaVector<unsigned int> candidates(arena);
+		order->clear();
+		order->reserve(triangleCount);
+		clusterStarts->clear();
+
+		int time = cacheSize + 1;
+		size_t cursor = 0;
+		int fan = triangleCount ? (int)indices[0] : -1;
+		clusterStarts->push_back(0);
+		while (fan >= 0)
+		{
+			candidates.clear();
+			for (unsigned int a = offsets[fan]; a < offsets[fan + 1]; a++)
+			{
+				unsigned int t = adjacency[a];
+				if (emitted[t])
+					continue;
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int v = indices[t * 3 + k];
+					deadEnd.push_back(v);
+					candidates.push_back(v);
+					live[v]--;
+					if (time - stamp[v] > cacheSize)
+						stamp[v] = time++;
+				}
+				emitted[t] = 1;
+				order->push_back(t);
+			}
+
+			// next fan: the candidate which stays in the cache and has most to emit
+			int next = -1, best = -1;
+			for (size_t c = 0; c < candidates.size(); c++)
+			{
+				unsigned int v = candidates[c];
+				if (live[v] <= 0)
+					continue;
+				int priority = 0;
+				if (time - stamp[v] + 2 * live[v] <= cacheSize)
+					priority = time - stamp[v];
+				if (priority > best)
+				{
+					best = priority;
+					next = (int)v;
+				}
+			}
+			if (next < 0)
+			{
+				// dead end: a recent vertex with triangles left, else the next one in index order
+				while (!deadEnd.empty() && next < 0)
+				{
+					unsigned int v = deadEnd.back();
+					deadEnd.pop_back();
+					if (live[v] > 0)
+						next = (int)v;
+				}
+				while (next < 0 && cursor < vertexCount)
+				{
+					if (live[cursor] > 0)
+						next = (int)cursor;
+					cursor++;
+				}
+				if (next >= 0 && order->size() < triangleCount)
+					clusterStarts->push_back((unsigned int)order->size());
+			}
+			fan = next;
+		}
+	}
+
+	// sort the clusters by occlusion potential, (cluster center - mesh center) . cluster normal
+	inline void SortClusters(const LoadArenaVector<float>& positions, LoadArenaVector<unsigned int>* indices,
+		const LoadArenaVector<unsigned int>& order, const LoadArenaVector<unsigned int>& clusterStarts, LoadArena* arena)
+	{
+		size_t clusterCount = clusterStarts.size();
+		LoadArenaVector<float> clusterData(clusterCount * 7, 0.0f, arena);	// area weighted center, area, normal
+		float meshCenter[3] = { 0, 0, 0 };
+		float meshArea = 0;
+		for (size_t c = 0; c < clusterCount; c++)
+		{
+			size_t end = (c + 1 < clusterCount) ? clusterStarts[c + 1] : order.size();
+			float* data = &clusterData[c * 7];
+			for (size_t i = clusterStarts[c]; i < end; i++)
+			{
+				const float* p0 = &positions[(*indices)[order[i] * 3 + 0] * 3];
+				const float* p1 = &positions[(*indices)[order[i] * 3 + 1] * 3];
+				const float* p2 = &positions[(*indices)[order[i] * 3 + 2] * 3];
+				float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+				float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+				float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+				float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]) * 0.5f;
+				for (int k = 0; k < 3; k++)
+				{
+					data[k] += (p0[k] + p1[k] + p2[k]) / 3 * area;
+					data[4 + k] += n[k];
+				}
+				data[3] += area;
+			}
+			for (int k = 0; k < 3; k++)
+				meshCenter[k] += data[k];
+			meshArea += data[3];
+		}
+		for (int k = 0; k < 3; k++)
+			meshCenter[k] = (meshArea > 0) ? meshCenter[k] / meshArea : 0;
+
+		LoadArenaVector<std::pair<float, unsigned int> > potential(arena);
+		potential.reserve(clusterCount);
+		for (size_t c = 0; c < clusterCount; c++)
+		{
+			const float* data = &clusterData[c * 7];
+			float dot = 0;
+			for (int k = 0; k < 3; k++)
+			{
+				float center = (data[3] > 0) ? data[k] / data[3] : 0;
+				dot += (center - meshCenter[k]) * data[4 + k];
+			}
+			potential.push_back(std::make_pair(-dot, (unsigned int)c));
+		}
+		std::stable_sort(potential.begin(), potential.end());
+
+		LoadArenaVector<unsigned int> sorted(arena);
+		sorted.reserve(indices->size());
+		for (size_t i = 0; i < potential.size(); i++)
+		{
+			unsigned int c = potential[i].second;
+			size_t end = (c + 1 < clusterCount) ? clusterStarts[c + 1] : order.size();
+			for (size_t t = clusterStarts[c]; t < end; t++)
+				sorted.insert(sorted.end(), indices->begin() + order[t] * 3, indices->begin() + order[t] * 3 + 3);
+		}
+		indices->swap(sorted);
+	}
+
+	// renumber the vertices in the order the indices first use them
+	inline void ReorderVertexFetch(Stream* streams, int streamCount, size_t vertexCount, LoadArenaVector<unsigned int>* indices, LoadArena* arena)
+	{
+		const unsigned int unused = ~0u;
+		LoadArenaVector<unsigned int> remap(vertexCount, unused, arena);
+		LoadArenaVector<unsigned int> source(arena);
+		source.reserve(vertexCount);
+		for (size_t i = 0; i < indices->size(); i++)
+		{
+			unsigned int& v = (*indices)[i];
+			if (remap[v] == unused)
+			{
+				remap[v] = (unsigned int)source.size();
+				source.push_back(v);
+			}
+			v = remap[v];
+		}
+		for (int s = 0; s < streamCount; s++)
+		{
+			int n = streams[s].components;
+			LoadArenaVector<float> reordered(source.size() * n, 0.0f, arena);
+			for (size_t i = 0; i < source.size(); i++)
+			{
+				for (int c = 0; c < n; c++)
+					reordered[i * n + c] = (*streams[s].data)[source[i] * n + c];
+			}
+			streams[s].data->swap(reordered);
+		}
+	}
+}
+
+// Reorder the triangles of an indexed mesh for the vertex cache and overdraw, the
+// vertices stay where they are. Returns the number of overdraw clusters.
+inline size_t OptimizeTriangleOrder(const LoadArenaVector<float>& positions, LoadArenaVector<unsigned int>* indices)
+{
+	using namespace meshopt_detail;
+	LoadArena* arena = indices->get_allocator().arena;
+	LoadArenaVector<unsigned int> order(arena), clusterStarts(arena);
+	Tipsify(*indices, positions.size() / 3, VERTEX_CACHE_SIZE, &order, &clusterStarts, arena);
+	SortClusters(positions, indices, order, clusterStarts, arena);
+	return clusterStarts.size();
+}
+
+// Index and reorder a flat triangle list (3 vertices per triangle, as written by
+// FlattenObjGroup). The streams are replaced by the welded vertices, pass NULL for
+// the ones which are not used. Every temporary comes from the arena of positions.
+inline MeshOptimizeStats OptimizeTriangleList(LoadArenaVector<float>* positions, LoadArenaVector<float>* colors,
+	LoadArenaVector<float>* normals, LoadArenaVector<float>* textureCoords, LoadArenaVector<unsigned int>* indices)
+{
+	using namespace meshopt_detail;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	LoadArena* arena = positions->get_allocator().arena;
+
+	Stream streams[4];
+	int streamCount = 0;
+	Stream p = { positions, 3 }, c = { colors, 3 }, n = { normals, 3 }, t = { textureCoords, 2 };
+	streams[streamCount++] = p;
+	if (colors) streams[streamCount++] = c;
+	if (normals) streams[streamCount++] = n;
+	if (textureCoords) streams[streamCount++] = t;
+
+	MeshOptimizeStats stats;
+	size_t flatCount = positions->size() / 3;
+	stats.triangles = flatCount / 3;
+	Weld(streams, streamCount, flatCount, indices, arena);
+	indices->resize(stats.triangles * 3);
+	stats.vertices = positions->size() / 3;
+	stats.missesBefore = CountCacheMisses(*indices, stats.vertices);
+
+	stats.clusters = OptimizeTriangleOrder(*positions, indices);
+	ReorderVertexFetch(streams, streamCount, stats.vertices, indices, arena);
+
+	stats.missesAfter = CountCacheMisses(*indices, stats.vertices);
+	stats.optimizeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+#endif
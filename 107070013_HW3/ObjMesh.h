@@ -0,0 +1,419 @@
+///////////////////////////////////////////////////////////////////////////////
+// ObjMesh.h
+// =========
+// Streaming OBJ loader built on tinyobj::LoadObjWithCallback.
+//
+// Positions, colors, normals, texcoords and face indices are appended straight
+// from the parser callbacks, and the bounding box of the model is accumulated
+// while the 'v' lines are parsed. After parsing, one pass recenters the model
+// to the origin and scales its greatest axis to [-1, 1] (SSE2 when available).
+//
+// Faces are fan triangulated. Groups are split on 'g' / 'o' like the shapes
+// of tinyobj::LoadObj, so a model keeps the same shape list as before.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef OBJ_MESH_H_DEF
+#define OBJ_MESH_H_DEF
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <chrono>
+#ifndef TINY_OBJ_LOADER_H_
+#include "tiny_obj_loader.h"
+#endif
+#include "LoadArena.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define OBJ_MESH_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+struct ObjGroup
+{
+	std::string name;
+	size_t firstFace;
+	size_t faceCount;
+};
+
+struct ObjMesh
+{
+	std::vector<float> positions;			// x, y, z per vertex
+	std::vector<float> colors;				// r, g, b per vertex, 1 when the file has no color
+	std::vector<float> normals;				// x, y, z per normal
+	std::vector<float> texcoords;			// u, v per texcoord
+	std::vector<float> tangents;			// x, y, z, w per index, filled by GenerateMeshNormals() (MeshNormals.h)
+	std::vector<tinyobj::index_t> indices;	// 3 per triangle, 0 based, -1 if missing
+	std::vector<int> faceMaterials;			// material id per triangle
+	std::vector<ObjGroup> groups;
+	std::vector<tinyobj::material_t> materials;
+	float minBound[3];
+	float maxBound[3];
+
+	size_t triangleCount() const { return faceMaterials.size(); }
+};
+
+struct ObjLoadStats
+{
+	size_t fileBytes;
+	double parseMs;			// parse + bounding box
+	double normalizeMs;		// recenter and scale pass
+	size_t peakMemoryBytes;	// peak working set of the process after the load
+};
+
+// peak resident memory of the process so far, in bytes
+inline size_t GetPeakMemoryUsage()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return (size_t)counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+namespace objmesh_detail
+{
+	struct LoadState
+	{
+		ObjMesh* mesh;
+		int material;
+		bool newGroup;
+		std::string groupName;
+		// chunks of a parallel load (ObjMeshParallel.h): counts of the chunks
+		// before this one, material name lookup, and faces which still belong
+		// to the last group of the chunks before
+		size_t vertexBase, normalBase, texcoordBase;
+		const std::map<std::string, int>* materialMap;
+		size_t continuedFaces;
+	};
+
+	inline void InitLoadState(LoadState* state, ObjMesh* mesh)
+	{
+		state->mesh = mesh;
+		state->material = -1;
+		state->newGroup = true;
+		state->vertexBase = state->normalBase = state->texcoordBase = 0;
+		state->materialMap = NULL;
+		state->continuedFaces = 0;
+	}
+
+	// a group is only created once it gets its first face, like the shapes of LoadObj
+	inline void StartGroup(LoadState* state)
+	{
+		ObjMesh* mesh = state->mesh;
+		ObjGroup group;
+		group.name = state->groupName;
+		group.firstFace = mesh->faceMaterials.size();
+		group.faceCount = 0;
+		mesh->groups.push_back(group);
+	}
+
+	inline void VertexCallback(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z,
+		tinyobj::real_t r, tinyobj::real_t g, tinyobj::real_t b)
+	{
+		ObjMesh* mesh = ((LoadState*)user_data)->mesh;
+		if (mesh->positions.empty())
+		{
+			mesh->minBound[0] = mesh->maxBound[0] = (float)x;
+			mesh->minBound[1] = mesh->maxBound[1] = (float)y;
+			mesh->minBound[2] = mesh->maxBound[2] = (float)z;
+		}
+		else
+		{
+			if (x < mesh->minBound[0]) mesh->minBound[0] = (float)x;
+			if (x > mesh->maxBound[0]) mesh->maxBound[0] = (float)x;
+			if (y < mesh->minBound[1]) mesh->minBound[1] = (float)y;
+			if (y > mesh->maxBound[1]) mesh->maxBound[1] = (float)y;
+			if (z < mesh->minBound[2]) mesh->minBound[2] = (float)z;
+			if (z > mesh->maxBound[2]) mesh->maxBound[2] = (float)z;
+		}
+		mesh->positions.push_back((float)x);
+		mesh->positions.push_back((float)y);
+		mesh->positions.push_back((float)z);
+		mesh->colors.push_back((float)r);
+		mesh->colors.push_back((float)g);
+		mesh->colors.push_back((float)b);
+	}
+
+	inline void NormalCallback(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z)
+	{
+		ObjMesh* mesh = ((LoadState*)user_data)->mesh;
+		mesh->normals.push_back((float)x);
+		mesh->normals.push_back((float)y);
+		mesh->normals.push_back((float)z);
+	}
+
+	inline void TexcoordCallback(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z)
+	{
+		ObjMesh* mesh = ((LoadState*)user_data)->mesh;
+		mesh->texcoords.push_back((float)x);
+		mesh->texcoords.push_back((float)y);
+	}
+
+	// raw OBJ index (1 based, negative = relative to the end, 0 = missing) to 0 based
+	inline int FixIndex(int idx, size_t count)
+	{
+		if (idx > 0)
+			return idx - 1;
+		if (idx < 0)
+			return (int)count + idx;
+		return -1;
+	}
+
+	inline void IndexCallback(void* user_data, tinyobj::index_t* indices, int num_indices)
+	{
+		LoadState* state = (LoadState*)user_data;
+		ObjMesh* mesh = state->mesh;
+		if (num_indices < 3)
+			return;
+
+		size_t vertexCount = state->vertexBase + mesh->positions.size() / 3;
+		size_t normalCount = state->normalBase + mesh->normals.size() / 3;
+		size_t texcoordCount = state->texcoordBase + mesh->texcoords.size() / 2;
+		for (int i = 0; i < num_indices; i++)
+		{
+			indices[i].vertex_index = FixIndex(indices[i].vertex_index, vertexCount);
+			indices[i].normal_index = FixIndex(indices[i].normal_index, normalCount);
+			indices[i].texcoord_index = FixIndex(indices[i].texcoord_index, texcoordCount);
+			// skip faces referring to vertices which are not defined (yet)
+			if (indices[i].vertex_index < 0 || indices[i].vertex_index >= (int)vertexCount)
+				return;
+			if (indices[i].normal_index >= (int)normalCount)
+				indices[i].normal_index = -1;
+			if (indices[i].texcoord_index >= (int)texcoordCount)
+				indices[i].texcoord_index = -1;
+		}
+
+		if (state->newGroup)
+		{
+			StartGroup(state);
+			state->newGroup = false;
+		}
+
+		for (int i = 1; i + 1 < num_indices; i++)
+		{
+			mesh->indices.push_back(indices[0]);
+			mesh->indices.push_back(indices[i]);
+			mesh->indices.push_back(indices[i + 1]);
+			mesh->faceMaterials.push_back(state->material);
+			if (mesh->groups.empty())
+				state->continuedFaces++;
+			else
+				mesh->groups.back().faceCount++;
+		}
+	}
+
+	inline void UsemtlCallback(void* user_data, const char* name, int material_id)
+	{
+		LoadState* state = (LoadState*)user_data;
+		if (state->materialMap)
+		{
+			// the chunk parser has no materials, look the name up in the ones of the whole file
+			std::map<std::string, int>::const_iterator it = state->materialMap->find(name);
+			material_id = (it != state->materialMap->end()) ? it->second : -1;
+		}
+		state->material = material_id;
+	}
+
+	inline void GroupCallback(void* user_data, const char** names, int num_names)
+	{
+		LoadState* state = (LoadState*)user_data;
+		state->groupName.clear();
+		for (int i = 0; i < num_names; i++)
+		{
+			if (i > 0)
+				state->groupName += " ";
+			state->groupName += names[i];
+		}
+		state->newGroup = true;
+	}
+
+	inline void ObjectCallback(void* user_data, const char* name)
+	{
+		LoadState* state = (LoadState*)user_data;
+		state->groupName = name;
+		state->newGroup = true;
+	}
+
+	inline void MtllibCallback(void* user_data, const tinyobj::material_t* materials, int num_materials)
+	{
+		ObjMesh* mesh = ((LoadState*)user_data)->mesh;
+		mesh->materials.assign(materials, materials + num_materials);
+	}
+}
+
+// offset (center of the bounding box) and scale which map the greatest axis to [-1, 1]
+inline void GetNormalizeTransform(const ObjMesh& mesh, float offset[3], float* scale)
+{
+	float extent = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		offset[axis] = (mesh.maxBound[axis] + mesh.minBound[axis]) / 2;
+		if (mesh.maxBound[axis] - mesh.minBound[axis] > extent)
+			extent = mesh.maxBound[axis] - mesh.minBound[axis];
+	}
+	*scale = (extent > 0) ? extent / 2 : 1.0f;
+}
+
+// p[i] = (p[i] - offset) / scale for count packed xyz floats
+inline void NormalizePositions(float* p, size_t count, const float offset[3], float scale)
+{
+	size_t i = 0;
+#ifdef OBJ_MESH_SSE2
+	// positions are packed xyz, so four vertices (12 floats) repeat the offset pattern
+	__m128 offset0 = _mm_setr_ps(offset[0], offset[1], offset[2], offset[0]);
+	__m128 offset1 = _mm_setr_ps(offset[1], offset[2], offset[0], offset[1]);
+	__m128 offset2 = _mm_setr_ps(offset[2], offset[0], offset[1], offset[2]);
+	__m128 scales = _mm_set1_ps(scale);
+	for (; i + 12 <= count; i += 12)
+	{
+		_mm_storeu_ps(p + i, _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(p + i), offset0), scales));
+		_mm_storeu_ps(p + i + 4, _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(p + i + 4), offset1), scales));
+		_mm_storeu_ps(p + i + 8, _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(p + i + 8), offset2), scales));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		p[i] = (p[i] - offset[i % 3]) / scale;
+	}
+}
+
+// move the center of the bounding box to the origin and scale the greatest axis to [-1, 1]
+inline void NormalizeObjMesh(ObjMesh* mesh)
+{
+	if (mesh->positions.empty())
+		return;
+
+	float offset[3], scale;
+	GetNormalizeTransform(*mesh, offset, &scale);
+	NormalizePositions(&mesh->positions[0], mesh->positions.size(), offset, scale);
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		mesh->minBound[axis] = (mesh->minBound[axis] - offset[axis]) / scale;
+		mesh->maxBound[axis] = (mesh->maxBound[axis] - offset[axis]) / scale;
+	}
+}
+
+// parse an OBJ file (and its .mtl from baseDir) into mesh and normalize it
+inline bool LoadObjMesh(const std::string& path, const std::string& baseDir, ObjMesh* mesh,
+	std::string* warn, std::string* err, ObjLoadStats* stats = NULL)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if (!file)
+	{
+		if (err)
+			(*err) += "Cannot open file [" + path + "]\n";
+		return false;
+	}
+	file.seekg(0, std::ios::end);
+	size_t fileBytes = (size_t)file.tellg();
+	file.seekg(0, std::ios::beg);
+
+	*mesh = ObjMesh();
+	// typical OBJ lines are ~30 bytes, mostly 'v' and 'f'
+	mesh->positions.reserve(fileBytes / 30);
+	mesh->colors.reserve(fileBytes / 30);
+	mesh->indices.reserve(fileBytes / 20);
+
+	objmesh_detail::LoadState state;
+	objmesh_detail::InitLoadState(&state, mesh);
+
+	tinyobj::callback_t callback;
+	callback.vertex_color_cb = objmesh_detail::VertexCallback;
+	callback.normal_cb = objmesh_detail::NormalCallback;
+	callback.texcoord_cb = objmesh_detail::TexcoordCallback;
+	callback.index_cb = objmesh_detail::IndexCallback;
+	callback.usemtl_cb = objmesh_detail::UsemtlCallback;
+	callback.mtllib_cb = objmesh_detail::MtllibCallback;
+	callback.group_cb = objmesh_detail::GroupCallback;
+	callback.object_cb = objmesh_detail::ObjectCallback;
+
+	tinyobj::MaterialFileReader materialReader(baseDir);
+	bool ret = tinyobj::LoadObjWithCallback(file, callback, &state, &materialReader, warn, err);
+
+	std::chrono::steady_clock::time_point parsed = std::chrono::steady_clock::now();
+	NormalizeObjMesh(mesh);
+	std::chrono::steady_clock::time_point normalized = std::chrono::steady_clock::now();
+
+	if (stats)
+	{
+		stats->fileBytes = fileBytes;
+		stats->parseMs = std::chrono::duration<double, std::milli>(parsed - start).count();
+		stats->normalizeMs = std::chrono::duration<double, std::milli>(normalized - parsed).count();
+		stats->peakMemoryBytes = GetPeakMemoryUsage();
+	}
+	return ret;
+}
+
+// expand one group to flat triangle lists, pass NULL for the outputs which are not needed.
+// missing normals / texcoords are written as zero so the arrays stay aligned
+inline void FlattenObjGroup(const ObjMesh& mesh, size_t group, LoadArenaVector<float>* vertices, LoadArenaVector<float>* colors,
+	LoadArenaVector<float>* normals, LoadArenaVector<float>* textureCoords, LoadArenaVector<int>* materialIds)
+{
+	const ObjGroup& g = mesh.groups[group];
+	size_t vertexCount = g.faceCount * 3;
+	if (vertices) vertices->reserve(vertices->size() + vertexCount * 3);
+	if (colors) colors->reserve(colors->size() + vertexCount * 3);
+	if (normals) normals->reserve(normals->size() + vertexCount * 3);
+	if (textureCoords) textureCoords->reserve(textureCoords->size() + vertexCount * 2);
+	if (materialIds) materialIds->reserve(materialIds->size() + vertexCount);
+
+	for (size_t f = g.firstFace; f < g.firstFace + g.faceCount; f++)
+	{
+		for (size_t v = 0; v < 3; v++)
+		{
+			const tinyobj::index_t& idx = mesh.indices[3 * f + v];
+			const float* p = &mesh.positions[3 * idx.vertex_index];
+			if (vertices)
+				vertices->insert(vertices->end(), p, p + 3);
+			if (colors)
+				colors->insert(colors->end(), &mesh.colors[3 * idx.vertex_index], &mesh.colors[3 * idx.vertex_index] + 3);
+			if (normals)
+			{
+				if (idx.normal_index >= 0)
+					normals->insert(normals->end(), &mesh.normals[3 * idx.normal_index], &mesh.normals[3 * idx.normal_index] + 3);
+				else
+					normals->insert(normals->end(), 3, 0.0f);
+			}
+			if (textureCoords)
+			{
+				if (idx.texcoord_index >= 0)
+					textureCoords->insert(textureCoords->end(), &mesh.texcoords[2 * idx.texcoord_index], &mesh.texcoords[2 * idx.texcoord_index] + 2);
+				else
+					textureCoords->insert(textureCoords->end(), 2, 0.0f);
+			}
+			if (materialIds)
+				materialIds->push_back(mesh.faceMaterials[f]);
+		}
+	}
+}
+
+#endif
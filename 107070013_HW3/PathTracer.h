@@ -0,0 +1,604 @@
+///////////////////////////////////////////////////////////////////////////////
+// PathTracer.h
+// ============
+// Offline reference renderer on the CPU: a unidirectional path tracer over
+// the shapes of the scene, with the Phong materials, textures and the light
+// of SoftLighting.
+//
+// Surfaces reflect light like the shaders describe it, so the result can be
+// compared with the GL and the soft rasterizer images: the texture scales
+// everything, Ia * Ka stays a constant ambient term, and the one light is a
+// delta light with the attenuation and spot cone of the shaders. On top of
+// that the paths bounce on: Kd is sampled as a cosine weighted Lambert lobe,
+// Ks as a normalized Phong lobe around the mirror direction (Lafortune,
+// Willems, "Using the Modified Phong Reflectance Model for Physically Based
+// Rendering", 1994), the light is sampled at every vertex with a shadow ray
+// and long paths end with russian roulette.
+//
+// The image is cut into PATH_TILE_SIZE tiles. Each worker starts with a
+// contiguous block of tiles in its own deque, takes tiles from its back and
+// steals from the front of the others when it runs dry. Every sample draws
+// its random numbers from a generator seeded with (seed, pixel, sample
+// index), and a pixel is summed by one thread in sample order, so the image
+// does not depend on the thread count or on who stole which tile.
+// render() adds samples to the running sums, so it can be called again to
+// refine the image.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef PATH_TRACER_H_DEF
+#define PATH_TRACER_H_DEF
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Matrices.h"
+#include "Bvh.h"
+#include "SoftRasterizer.h"
+
+const int PATH_TILE_SIZE = 16;
+const int PATH_MAX_DEPTH = 6;			// surface hits of a path
+const int PATH_ROULETTE_DEPTH = 3;		// first hit which may end a path early
+
+struct PathTraceStats
+{
+	unsigned long long samples;	// camera samples, pixels * samples per pixel
+	unsigned long long rays;	// closest hit and shadow rays
+	int tiles;
+	int stolenTiles;			// taken from the deque of another worker
+	unsigned int threads;
+	double ms;
+
+	PathTraceStats() : samples(0), rays(0), tiles(0), stolenTiles(0), threads(0), ms(0) {}
+};
+
+namespace pathtrace_detail
+{
+	const float PI = 3.14159265f;
+
+	// splitmix64 (Steele, Lea, Flood, "Fast Splittable Pseudorandom Number Generators", 2014)
+	inline unsigned long long Mix(unsigned long long x)
+	{
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	class Random
+	{
+	public:
+		Random(unsigned long long seed, unsigned long long pixel, unsigned long long sample)
+			: state(Mix(Mix(Mix(seed) ^ pixel) ^ sample)) {}
+
+		// uniform in [0, 1)
+		float next()
+		{
+			state = Mix(state);
+			return (float)(state >> 40) * (1.0f / 16777216.0f);
+		}
+
+	private:
+		unsigned long long state;
+	};
+
+	// tiles of one worker, the owner works from the back and thieves from the front
+	class TileDeque
+	{
+	public:
+		void push(int tile)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tiles.push_back(tile);
+		}
+
+		bool pop(int* tile)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tiles.empty())
+				return false;
+			*tile = tiles.back();
+			tiles.pop_back();
+			return true;
+		}
+
+		bool steal(int* tile)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tiles.empty())
+				return false;
+			*tile = tiles.front();
+			tiles.pop_front();
+			return true;
+		}
+
+	private:
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	inline void Cross(const float a[3], const float b[3], float out[3])
+	{
+		out[0] = a[1] * b[2] - a[2] * b[1];
+		out[1] = a[2] * b[0] - a[0] * b[2];
+		out[2] = a[0] * b[1] - a[1] * b[0];
+	}
+
+	inline float Luminance(const float c[3])
+	{
+		return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+	}
+
+	// direction around the unit vector axis, cosine of the angle to it given
+	inline void AroundAxis(const float axis[3], float cosTheta, float phi, float out[3])
+	{
+		float tangent[3], bitangent[3];
+		float helper[3] = { 0, 0, 0 };
+		helper[(fabsf(axis[0]) < 0.5f) ? 0 : 1] = 1;
+		Cross(axis, helper, tangent);
+		softraster_detail::Normalize(tangent);
+		Cross(axis, tangent, bitangent);
+		float sinTheta = sqrtf(std::max(0.0f, 1 - cosTheta * cosTheta));
+		for (int k = 0; k < 3; k++)
+			out[k] = axis[k] * cosTheta + (tangent[k] * cosf(phi) + bitangent[k] * sinf(phi)) * sinTheta;
+	}
+}
+
+class PathTracer
+{
+public:
+	PathTracer() : width(0), height(0), seed(0), threadCount(0), sampleCount(0)
+	{
+		background[0] = background[1] = background[2] = 0;
+	}
+
+	// 0 uses the hardware threads
+	void setThreadCount(unsigned int count) { threadCount = count; }
+
+	// mesh has to live as long as the tracer, returns the shape for addInstance()
+	int addShape(const SoftMesh& mesh, const SoftMaterial& material)
+	{
+		Shape shape;
+		shape.mesh = &mesh;
+		shape.material = material;
+		shapes.push_back(shape);
+		return (int)shapes.size() - 1;
+	}
+
+	void addInstance(int shape, const Matrix4& world)
+	{
+		Instance instance;
+		instance.shape = shape;
+		instance.world = world;
+		// mat3(transpose(inverse(aModel))), as in the vertex shader
+		instance.normal = world;
+		instance.normal.invertAffine();
+		instance.normal.transpose();
+		instances.push_back(instance);
+	}
+
+	// build the bottom level of every shape and the top level over the instances
+	void commit(BvhBuildStats* stats = NULL)
+	{
+		for (size_t i = 0; i < shapes.size(); i++)
+		{
+			const SoftMesh& mesh = *shapes[i].mesh;
+			if (!mesh.indices.empty())
+				shapes[i].bvh.build(&mesh.positions[0], &mesh.indices[0], mesh.indices.size() / 3, NULL, threadCount);
+		}
+		std::vector<BvhInstance> bvhInstances;
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			if (shapes[instances[i].shape].mesh->indices.empty())
+				continue;
+			BvhInstance instance = { &shapes[instances[i].shape].bvh, instances[i].world, (int)i };
+			bvhInstances.push_back(instance);
+		}
+		sceneBvh.build(bvhInstances, threadCount, stats);
+	}
+
+	// camera rays through viewProjection, what misses shows background
+	void setCamera(const Matrix4& viewProjection, const float backgroundColor[3])
+	{
+		inverseViewProjection = viewProjection;
+		inverseViewProjection.invert();
+		for (int k = 0; k < 3; k++)
+			background[k] = backgroundColor[k];
+	}
+
+	// the light, lighting.cameraPos and perPixel are not used
+	void setLighting(const SoftLighting& sceneLighting) { lighting = sceneLighting; }
+
+	// clear the image, samples of the same seed give the same image
+	void reset(int imageWidth, int imageHeight, unsigned long long imageSeed)
+	{
+		width = imageWidth;
+		height = imageHeight;
+		seed = imageSeed;
+		sampleCount = 0;
+		sums.assign((size_t)width * height * 3, 0.0);
+	}
+
+	// add samples per pixel to the image
+	void render(int samples, PathTraceStats* stats = NULL)
+	{
+		using namespace pathtrace_detail;
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point start = Clock::now();
+		unsigned int threads = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+		int tilesX = (width + PATH_TILE_SIZE - 1) / PATH_TILE_SIZE;
+		int tilesY = (height + PATH_TILE_SIZE - 1) / PATH_TILE_SIZE;
+		int tileCount = tilesX * tilesY;
+		threads = std::max(1u, std::min(threads, (unsigned int)std::max(tileCount, 1)));
+
+		std::vector<TileDeque> deques(threads);
+		for (int t = 0; t < tileCount; t++)
+			deques[(size_t)t * threads / tileCount].push(t);
+
+		std::atomic<unsigned long long> rayCount(0);
+		std::atomic<int> stolen(0);
+		int firstSample = sampleCount;
+		auto worker = [&](unsigned int self)
+		{
+			unsigned long long rays = 0;
+			int tile;
+			for (;;)
+			{
+				bool found = deques[self].pop(&tile);
+				for (unsigned int v = 1; v < threads && !found; v++)
+				{
+					found = deques[(self + v) % threads].steal(&tile);
+					stolen += found ? 1 : 0;
+				}
+				if (!found)
+					break;
+				int x0 = (tile % tilesX) * PATH_TILE_SIZE, y0 = (tile / tilesX) * PATH_TILE_SIZE;
+				int x1 = std::min(x0 + PATH_TILE_SIZE, width), y1 = std::min(y0 + PATH_TILE_SIZE, height);
+				for (int y = y0; y < y1; y++)
+				{
+					for (int x = x0; x < x1; x++)
+						rays += renderPixel(x, y, firstSample, samples);
+				}
+			}
+			rayCount += rays;
+		};
+		std::vector<std::thread> workers;
+		for (unsigned int t = 1; t < threads; t++)
+			workers.push_back(std::thread(worker, t));
+		worker(0);
+		for (size_t t = 0; t < workers.size(); t++)
+			workers[t].join();
+		sampleCount += samples;
+
+		if (stats)
+		{
+			*stats = PathTraceStats();
+			stats->samples = (unsigned long long)width * height * samples;
+			stats->rays = rayCount;
+			stats->tiles = tileCount;
+			stats->stolenTiles = stolen;
+			stats->threads = threads;
+			stats->ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		}
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getSampleCount() const { return sampleCount; }
+
+	// mean radiance, linear RGB floats, top row first
+	std::vector<float> getRadiance() const
+	{
+		std::vector<float> rgb(sums.size());
+		double scale = sampleCount ? 1.0 / sampleCount : 0.0;
+		for (size_t i = 0; i < sums.size(); i++)
+			rgb[i] = (float)(sums[i] * scale);
+		return rgb;
+	}
+
+	// RGBA8 clamped like the GL frame buffer, top row first
+	std::vector<unsigned char> getColor() const
+	{
+		std::vector<float> rgb = getRadiance();
+		std::vector<unsigned char> rgba((size_t)width * height * 4, 255);
+		for (size_t i = 0; i < (size_t)width * height; i++)
+		{
+			for (int k = 0; k < 3; k++)
+				rgba[i * 4 + k] = (unsigned char)(std::min(std::max(rgb[i * 3 + k], 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+		return rgba;
+	}
+
+private:
+	struct Shape
+	{
+		const SoftMesh* mesh;
+		SoftMaterial material;
+		MeshBvh bvh;
+	};
+
+	struct Instance
+	{
+		int shape;
+		Matrix4 world, normal;
+	};
+
+	// what a path needs to know about the surface it hit
+	struct Surface
+	{
+		float position[3];
+		float normal[3];	// shading normal, facing the incoming ray
+		float geometric[3];	// facing the incoming ray
+		float albedo[3];	// texture
+		const SoftMaterial* material;
+	};
+
+	// returns the rays traced for the pixel
+	unsigned long long renderPixel(int x, int y, int firstSample, int samples)
+	{
+		unsigned long long rays = 0;
+		size_t pixel = (size_t)y * width + x;
+		double* sum = &sums[pixel * 3];
+		for (int s = firstSample; s < firstSample + samples; s++)
+		{
+			pathtrace_detail::Random random(seed, pixel, (unsigned long long)s);
+			float ndcX = (x + random.next()) / width * 2 - 1;
+			float ndcY = 1 - (y + random.next()) / height * 2;
+			Vector4 nearPoint = inverseViewProjection * Vector4(ndcX, ndcY, -1.0f, 1.0f);
+			Vector4 farPoint = inverseViewProjection * Vector4(ndcX, ndcY, 1.0f, 1.0f);
+			float origin[3] = { nearPoint.x / nearPoint.w, nearPoint.y / nearPoint.w, nearPoint.z / nearPoint.w };
+			float direction[3] = { farPoint.x / farPoint.w - origin[0], farPoint.y / farPoint.w - origin[1], farPoint.z / farPoint.w - origin[2] };
+			softraster_detail::Normalize(direction);
+			float radiance[3];
+			rays += tracePath(origin, direction, random, radiance);
+			for (int k = 0; k < 3; k++)
+				sum[k] += radiance[k];
+		}
+		return rays;
+	}
+
+	unsigned long long tracePath(float origin[3], float direction[3], pathtrace_detail::Random& random, float radiance[3])
+	{
+		using namespace pathtrace_detail;
+		using softraster_detail::Dot;
+		using softraster_detail::Normalize;
+		unsigned long long rays = 0;
+		float throughput[3] = { 1, 1, 1 };
+		radiance[0] = radiance[1] = radiance[2] = 0;
+		for (int depth = 0; depth < PATH_MAX_DEPTH; depth++)
+		{
+			RayHit hit;
+			rays++;
+			if (!sceneBvh.intersect(origin, direction, 1e30f, &hit))
+			{
+				// nothing lights the scene from outside but the clear color seen by the camera
+				for (int k = 0; k < 3 && depth == 0; k++)
+					radiance[k] = background[k];
+				break;
+			}
+			Surface surface;
+			getSurface(hit, origin, direction, &surface);
+			const SoftMaterial& m = *surface.material;
+
+			// ambient and the light
+			float V[3] = { -direction[0], -direction[1], -direction[2] };
+			float direct[3];
+			rays += sampleLight(surface, V, direct);
+			for (int k = 0; k < 3; k++)
+				radiance[k] += throughput[k] * surface.albedo[k] * (lighting.Ia[k] * m.Ka[k] + direct[k]);
+
+			// next direction from the diffuse or the specular lobe
+			float diffuse[3], specular[3];
+			for (int k = 0; k < 3; k++)
+			{
+				diffuse[k] = m.Kd[k] * surface.albedo[k];
+				specular[k] = m.Ks[k] * surface.albedo[k];
+			}
+			float diffuseWeight = Luminance(diffuse), specularWeight = Luminance(specular);
+			if (diffuseWeight + specularWeight <= 0)
+				break;
+			float diffuseChance = diffuseWeight / (diffuseWeight + specularWeight);
+			float next[3], weight[3];
+			if (random.next() < diffuseChance)
+			{
+				AroundAxis(surface.normal, sqrtf(random.next()), 2 * PI * random.next(), next);
+				for (int k = 0; k < 3; k++)
+					weight[k] = diffuse[k] / diffuseChance;
+			}
+			else
+			{
+				float n = lighting.shininess;
+				float mirror[3];
+				float NdotV = Dot(surface.normal, V);
+				for (int k = 0; k < 3; k++)
+					mirror[k] = 2 * NdotV * surface.normal[k] - V[k];
+				AroundAxis(mirror, powf(random.next(), 1 / (n + 1)), 2 * PI * random.next(), next);
+				float cosine = Dot(next, surface.normal);
+				if (cosine <= 0)
+					break;
+				// f * cos / pdf of the normalized lobe
+				for (int k = 0; k < 3; k++)
+					weight[k] = specular[k] * (n + 2) / (n + 1) * cosine / (1 - diffuseChance);
+			}
+			if (Dot(next, surface.geometric) <= 0)
+				break;
+			for (int k = 0; k < 3; k++)
+				throughput[k] *= weight[k];
+
+			if (depth + 1 >= PATH_ROULETTE_DEPTH)
+			{
+				float survive = std::min(std::max(throughput[0], std::max(throughput[1], throughput[2])), 0.95f);
+				if (random.next() >= survive)
+					break;
+				for (int k = 0; k < 3; k++)
+					throughput[k] /= survive;
+			}
+			offsetOrigin(surface, origin);
+			Normalize(next);
+			for (int k = 0; k < 3; k++)
+				direction[k] = next[k];
+		}
+		return rays;
+	}
+
+	void getSurface(const RayHit& hit, const float origin[3], const float direction[3], Surface* surface) const
+	{
+		using softraster_detail::Dot;
+		using softraster_detail::Normalize;
+		const Instance& instance = instances[hit.instance];
+		const Shape& shape = shapes[instance.shape];
+		const SoftMesh& mesh = *shape.mesh;
+		const unsigned int* index = &mesh.indices[hit.triangle * 3];
+		float w[3] = { 1 - hit.u - hit.v, hit.u, hit.v };
+		surface->material = &shape.material;
+
+		for (int k = 0; k < 3; k++)
+			surface->position[k] = origin[k] + direction[k] * hit.t;
+
+		const float* p0 = &mesh.positions[index[0] * 3];
+		const float* p1 = &mesh.positions[index[1] * 3];
+		const float* p2 = &mesh.positions[index[2] * 3];
+		float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		float local[3];
+		pathtrace_detail::Cross(e1, e2, local);
+		transformNormal(instance, local, surface->geometric);
+
+		size_t vertexCount = mesh.positions.size() / 3;
+		if (mesh.normals.size() >= vertexCount * 3)
+		{
+			for (int k = 0; k < 3; k++)
+				local[k] = w[0] * mesh.normals[index[0] * 3 + k] + w[1] * mesh.normals[index[1] * 3 + k] + w[2] * mesh.normals[index[2] * 3 + k];
+			transformNormal(instance, local, surface->normal);
+		}
+		else
+		{
+			memcpy(surface->normal, surface->geometric, sizeof(surface->normal));
+		}
+
+		// both sides are lit, as GL draws them without culling
+		if (Dot(surface->geometric, direction) > 0)
+		{
+			for (int k = 0; k < 3; k++)
+				surface->geometric[k] = -surface->geometric[k];
+		}
+		if (Dot(surface->normal, surface->geometric) < 0)
+		{
+			for (int k = 0; k < 3; k++)
+				surface->normal[k] = -surface->normal[k];
+		}
+
+		// black without a texture, like an incomplete GL texture
+		surface->albedo[0] = surface->albedo[1] = surface->albedo[2] = 0;
+		const SoftMaterial& m = shape.material;
+		if (m.texture && !m.texture->empty())
+		{
+			float u = 0, v = 0;
+			if (mesh.texcoords.size() >= vertexCount * 2)
+			{
+				u = w[0] * mesh.texcoords[index[0] * 2] + w[1] * mesh.texcoords[index[1] * 2] + w[2] * mesh.texcoords[index[2] * 2];
+				v = w[0] * mesh.texcoords[index[0] * 2 + 1] + w[1] * mesh.texcoords[index[1] * 2 + 1] + w[2] * mesh.texcoords[index[2] * 2 + 1];
+			}
+			if (m.isEye)
+			{
+				u += lighting.offsetX;
+				v += lighting.offsetY;
+			}
+			m.texture->sample(u, v, 0, lighting.magNearest, lighting.minNearest, surface->albedo);
+		}
+	}
+
+	static void transformNormal(const Instance& instance, const float local[3], float out[3])
+	{
+		const Matrix4& n = instance.normal;
+		for (int r = 0; r < 3; r++)
+			out[r] = n[r * 4] * local[0] + n[r * 4 + 1] * local[1] + n[r * 4 + 2] * local[2];
+		softraster_detail::Normalize(out);
+	}
+
+	// move a ray start off the surface it leaves, to the side of the geometric normal
+	static void offsetOrigin(const Surface& surface, float origin[3])
+	{
+		float scale = 1e-4f * (1 + std::max(fabsf(surface.position[0]), std::max(fabsf(surface.position[1]), fabsf(surface.position[2]))));
+		for (int k = 0; k < 3; k++)
+			origin[k] = surface.position[k] + surface.geometric[k] * scale;
+	}
+
+	// direct light of the shaders at the surface, zero in shadow, returns the rays traced
+	unsigned long long sampleLight(const Surface& surface, const float V[3], float out[3]) const
+	{
+		using softraster_detail::Dot;
+		using softraster_detail::Normalize;
+		const SoftLighting& l = lighting;
+		const SoftMaterial& m = *surface.material;
+		const float* N = surface.normal;
+		out[0] = out[1] = out[2] = 0;
+
+		float L[3], distance = 1e30f, attenuation = 1, specular;
+		const float* intensity;
+		if (l.lightId == 0)
+		{
+			for (int k = 0; k < 3; k++)
+				L[k] = l.lightPos_d[k];
+			Normalize(L);
+			float NdotL = Dot(N, L);
+			float R[3] = { 2 * NdotL * N[0] - L[0], 2 * NdotL * N[1] - L[1], 2 * NdotL * N[2] - L[2] };
+			specular = powf(std::max(Dot(R, V), 0.0f), l.shininess);
+			intensity = l.I_d;
+		}
+		else
+		{
+			const float* lightPos = (l.lightId == 1) ? l.lightPos_p : l.lightPos_s;
+			intensity = (l.lightId == 1) ? l.I_p : l.I_s;
+			for (int k = 0; k < 3; k++)
+				L[k] = lightPos[k] - surface.position[k];
+			distance = sqrtf(Dot(L, L));
+			Normalize(L);
+			float d = distance;
+			attenuation = (l.lightId == 1) ? 1.0f / (0.01f + 0.8f * d + 0.1f * d * d) : 1.0f / (0.05f + 0.3f * d + 0.6f * d * d);
+			attenuation = std::min(attenuation, 1.0f);
+			if (l.lightId == 2)
+			{
+				float arc = -Dot(L, l.spotDirection);
+				float angle = acosf(std::min(std::max(arc, -1.0f), 1.0f)) * 57.2957795f;
+				if (l.spotCutoff <= angle)
+					return 0;
+				attenuation *= powf(std::max(arc, 0.0f), 50.0f);
+			}
+			float H[3] = { L[0] + V[0], L[1] + V[1], L[2] + V[2] };
+			Normalize(H);
+			specular = powf(std::max(Dot(N, H), 0.0f), l.shininess);
+		}
+		float diffuse = std::max(Dot(N, L), 0.0f);
+		if ((diffuse <= 0 && specular <= 0) || Dot(L, surface.geometric) <= 0)
+			return 0;
+
+		float origin[3];
+		offsetOrigin(surface, origin);
+		RayHit hit;
+		if (sceneBvh.intersect(origin, L, distance * 0.9999f, &hit))
+			return 1;
+		for (int k = 0; k < 3; k++)
+			out[k] = attenuation * (intensity[k] * m.Kd[k] * diffuse + m.Ks[k] * specular);
+		return 1;
+	}
+
+	std::vector<Shape> shapes;
+	std::vector<Instance> instances;
+	SceneBvh sceneBvh;
+	Matrix4 inverseViewProjection;
+	float background[3];
+	SoftLighting lighting;
+	int width, height;
+	unsigned long long seed;
+	unsigned int threadCount;
+	int sampleCount;
+	std::vector<double> sums;	// radiance summed over the samples so far
+};
+
+#endif
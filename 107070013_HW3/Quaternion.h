@@ -0,0 +1,208 @@
+///////////////////////////////////////////////////////////////////////////////
+// Quaternion.h
+// ============
+// Quaternion for 3D rotations
+// The form is q = s + xi + yj + zk, where s is the scalar part.
+// All angles are in radian, same as rotateX/rotateY/rotateZ in main.cpp.
+//
+// Rotation matrices are row major, same as Matrix4 in Matrices.h.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef QUATERNION_H_DEF
+#define QUATERNION_H_DEF
+
+#include <cmath>
+#include <iostream>
+#include "Vectors.h"
+#include "Matrices.h"
+
+struct Quaternion
+{
+    float s;    // scalar part, s
+    float x;    // vector part (x, y, z)
+    float y;
+    float z;
+
+    // ctors
+    Quaternion() : s(1), x(0), y(0), z(0) {};                   // identity rotation
+    Quaternion(float s, float x, float y, float z) : s(s), x(x), y(y), z(z) {};
+    Quaternion(const Vector3& axis, float angle);               // rotate angle(radian) along the axis
+
+    // utils functions
+    void        set(float s, float x, float y, float z);
+    void        set(const Vector3& axis, float angle);          // axis must be non-zero
+    float       length() const;
+    Quaternion& normalize();
+    Quaternion& conjugate();
+    Quaternion& invert();
+    float       dot(const Quaternion& rhs) const;
+    Vector3     rotate(const Vector3& v) const;                 // rotate a vector by this quaternion
+    Matrix4     getMatrix() const;                              // return as 4x4 rotation matrix
+
+    // euler angles (radian) in the same order as rotate(vec) in main.cpp: Rx * Ry * Rz
+    static Quaternion fromEuler(const Vector3& angles);
+    // spherical linear interpolation between two unit quaternions, t in [0, 1]
+    static Quaternion slerp(const Quaternion& from, const Quaternion& to, float t);
+
+    // operators
+    Quaternion  operator-() const;                              // unary operator (negate)
+    Quaternion  operator+(const Quaternion& rhs) const;         // add rhs
+    Quaternion  operator-(const Quaternion& rhs) const;         // subtract rhs
+    Quaternion  operator*(float a) const;                       // scale
+    Quaternion  operator*(const Quaternion& rhs) const;         // Hamilton product, apply rhs then this
+    Quaternion& operator*=(const Quaternion& rhs);              // multiply rhs and update this object
+    bool        operator==(const Quaternion& rhs) const;        // exact compare, no epsilon
+    bool        operator!=(const Quaternion& rhs) const;        // exact compare, no epsilon
+
+    friend std::ostream& operator<<(std::ostream& os, const Quaternion& q);
+};
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// inline functions for Quaternion
+///////////////////////////////////////////////////////////////////////////////
+inline Quaternion::Quaternion(const Vector3& axis, float angle) {
+    set(axis, angle);
+}
+
+inline void Quaternion::set(float s, float x, float y, float z) {
+    this->s = s; this->x = x; this->y = y; this->z = z;
+}
+
+inline void Quaternion::set(const Vector3& axis, float angle) {
+    Vector3 v = axis;
+    v.normalize();
+    float sine = sinf(angle * 0.5f);
+    s = cosf(angle * 0.5f);
+    x = v.x * sine;
+    y = v.y * sine;
+    z = v.z * sine;
+}
+
+inline float Quaternion::length() const {
+    return sqrtf(s*s + x*x + y*y + z*z);
+}
+
+inline Quaternion& Quaternion::normalize() {
+    const float EPSILON = 0.00001f;
+    float d = s*s + x*x + y*y + z*z;
+    if(d < EPSILON)
+        return *this; // do nothing if it is zero
+
+    float invLength = 1.0f / sqrtf(d);
+    s *= invLength; x *= invLength; y *= invLength; z *= invLength;
+    return *this;
+}
+
+inline Quaternion& Quaternion::conjugate() {
+    x = -x; y = -y; z = -z;
+    return *this;
+}
+
+inline Quaternion& Quaternion::invert() {
+    const float EPSILON = 0.00001f;
+    float d = s*s + x*x + y*y + z*z;
+    if(d < EPSILON)
+        return *this; // do nothing if it is zero
+
+    Quaternion q = *this;
+    *this = q.conjugate() * (1.0f / d);
+    return *this;
+}
+
+inline float Quaternion::dot(const Quaternion& rhs) const {
+    return s*rhs.s + x*rhs.x + y*rhs.y + z*rhs.z;
+}
+
+inline Vector3 Quaternion::rotate(const Vector3& v) const {
+    // v' = v + 2s(u x v) + 2u x (u x v), u = (x, y, z)
+    Vector3 u(x, y, z);
+    Vector3 t = u.cross(v) * 2.0f;
+    return v + t * s + u.cross(t);
+}
+
+inline Matrix4 Quaternion::getMatrix() const {
+    float x2 = x + x, y2 = y + y, z2 = z + z;
+    float xx = x * x2, xy = x * y2, xz = x * z2;
+    float yy = y * y2, yz = y * z2, zz = z * z2;
+    float sx = s * x2, sy = s * y2, sz = s * z2;
+
+    return Matrix4(1 - (yy + zz), xy - sz,       xz + sy,       0,
+                   xy + sz,       1 - (xx + zz), yz - sx,       0,
+                   xz - sy,       yz + sx,       1 - (xx + yy), 0,
+                   0,             0,             0,             1);
+}
+
+inline Quaternion Quaternion::fromEuler(const Vector3& angles) {
+    Quaternion qx(Vector3(1, 0, 0), angles.x);
+    Quaternion qy(Vector3(0, 1, 0), angles.y);
+    Quaternion qz(Vector3(0, 0, 1), angles.z);
+    return qx * qy * qz;
+}
+
+inline Quaternion Quaternion::slerp(const Quaternion& from, const Quaternion& to, float t) {
+    Quaternion q = to;
+    float cosine = from.dot(to);
+    if(cosine < 0)
+    {
+        // take the shorter arc
+        q = -q;
+        cosine = -cosine;
+    }
+
+    if(cosine > 0.9995f)
+    {
+        // nearly parallel, fall back to normalized lerp
+        Quaternion r = from + (q - from) * t;
+        return r.normalize();
+    }
+
+    float angle = acosf(cosine);
+    float invSine = 1.0f / sinf(angle);
+    return from * (sinf((1 - t) * angle) * invSine) + q * (sinf(t * angle) * invSine);
+}
+
+inline Quaternion Quaternion::operator-() const {
+    return Quaternion(-s, -x, -y, -z);
+}
+
+inline Quaternion Quaternion::operator+(const Quaternion& rhs) const {
+    return Quaternion(s+rhs.s, x+rhs.x, y+rhs.y, z+rhs.z);
+}
+
+inline Quaternion Quaternion::operator-(const Quaternion& rhs) const {
+    return Quaternion(s-rhs.s, x-rhs.x, y-rhs.y, z-rhs.z);
+}
+
+inline Quaternion Quaternion::operator*(float a) const {
+    return Quaternion(s*a, x*a, y*a, z*a);
+}
+
+inline Quaternion Quaternion::operator*(const Quaternion& rhs) const {
+    return Quaternion(s*rhs.s - x*rhs.x - y*rhs.y - z*rhs.z,
+                      s*rhs.x + x*rhs.s + y*rhs.z - z*rhs.y,
+                      s*rhs.y - x*rhs.z + y*rhs.s + z*rhs.x,
+                      s*rhs.z + x*rhs.y - y*rhs.x + z*rhs.s);
+}
+
+inline Quaternion& Quaternion::operator*=(const Quaternion& rhs) {
+    *this = *this * rhs;
+    return *this;
+}
+
+inline bool Quaternion::operator==(const Quaternion& rhs) const {
+    return (s == rhs.s) && (x == rhs.x) && (y == rhs.y) && (z == rhs.z);
+}
+
+inline bool Quaternion::operator!=(const Quaternion& rhs) const {
+    return (s != rhs.s) || (x != rhs.x) || (y != rhs.y) || (z != rhs.z);
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Quaternion& q) {
+    os << "(" << q.s << ", " << q.x << ", " << q.y << ", " << q.z << ")";
+    return os;
+}
+// END OF QUATERNION //////////////////////////////////////////////////////////
+
+#endif
@@ -0,0 +1,114 @@
+///////////////////////////////////////////////////////////////////////////////
+// Scene.h
+// =======
+// Instances of the loaded models. Every instance references a mesh (index
+// into models) and a node of the TransformTree, so many instances can share
+// one set of vertex buffers and be drawn with a single instanced draw call
+// per shape.
+//
+// Instance data is stored as structure of arrays. The per-mesh batches of
+// visible instances are rebuilt lazily when instances are added, removed or
+// hidden.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SCENE_H_DEF
+#define SCENE_H_DEF
+
+#include <vector>
+#include "Transform.h"
+
+class Scene
+{
+public:
+	Scene() : batchesDirty(true) {}
+
+	int addInstance(int mesh, int transform, bool visible = true)
+	{
+		meshes.push_back(mesh);
+		transforms.push_back(transform);
+		visibles.push_back(visible ? 1 : 0);
+		batchesDirty = true;
+		return (int)meshes.size() - 1;
+	}
+
+	// drop every instance created after the first count instances
+	void truncate(size_t count)
+	{
+		if (count >= meshes.size())
+			return;
+		meshes.resize(count);
+		transforms.resize(count);
+		visibles.resize(count);
+		batchesDirty = true;
+	}
+
+	void setVisible(int instance, bool visible)
+	{
+		if (visibles[instance] != (visible ? 1 : 0))
+		{
+			visibles[instance] = visible ? 1 : 0;
+			batchesDirty = true;
+		}
+	}
+
+	size_t size() const { return meshes.size(); }
+	int getMesh(int instance) const { return meshes[instance]; }
+	int getTransform(int instance) const { return transforms[instance]; }
+	bool isVisible(int instance) const { return visibles[instance] != 0; }
+
+	// visible instances grouped by mesh, meshCount is the number of loaded models
+	const std::vector<int>& getBatch(int mesh, size_t meshCount)
+	{
+		if (batchesDirty || batches.size() != meshCount)
+			rebuildBatches(meshCount);
+		return batches[mesh];
+	}
+
+	// write the world matrices of a batch as column-major mat4 for glBufferData
+	static void gatherMatrices(const TransformTree& tree, const std::vector<int>& transformIds, std::vector<float>& out)
+	{
+		out.resize(transformIds.size() * 16);
+		float* dst = out.empty() ? NULL : &out[0];
+		for (size_t i = 0; i < transformIds.size(); i++, dst += 16)
+		{
+			const Matrix4& m = tree.getWorldMatrix(transformIds[i]);
+			dst[0] = m[0];  dst[4] = m[1];  dst[8] = m[2];   dst[12] = m[3];
+			dst[1] = m[4];  dst[5] = m[5];  dst[9] = m[6];   dst[13] = m[7];
+			dst[2] = m[8];  dst[6] = m[9];  dst[10] = m[10]; dst[14] = m[11];
+			dst[3] = m[12]; dst[7] = m[13]; dst[11] = m[14]; dst[15] = m[15];
+		}
+	}
+
+	// transform ids of a batch, in the same order as getBatch()
+	const std::vector<int>& getBatchTransforms(int mesh, size_t meshCount)
+	{
+		getBatch(mesh, meshCount);
+		return batchTransforms[mesh];
+	}
+
+private:
+	void rebuildBatches(size_t meshCount)
+	{
+		batches.assign(meshCount, std::vector<int>());
+		batchTransforms.assign(meshCount, std::vector<int>());
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			if (visibles[i] && meshes[i] >= 0 && meshes[i] < (int)meshCount)
+			{
+				batches[meshes[i]].push_back((int)i);
+				batchTransforms[meshes[i]].push_back(transforms[i]);
+			}
+		}
+		batchesDirty = false;
+	}
+
+	std::vector<int> meshes;
+	std::vector<int> transforms;
+	std::vector<char> visibles;
+
+	std::vector<std::vector<int> > batches;
+	std::vector<std::vector<int> > batchTransforms;
+	bool batchesDirty;
+};
+
+#endif
@@ -0,0 +1,656 @@
+///////////////////////////////////////////////////////////////////////////////
+// SceneManifest.h
+// ===============
+// Scene description read from a JSON file instead of the built-in model list:
+//
+// {
+//     "meshes": [ { "name": "mew", "file": "../TextureModels/Mew.obj",
+//                   "textures": { "<material>": "<texture name>" } } ],
+//     "textures": [ { "name": "grass", "file": "grass.png" } ],
+//     "instances": [ { "mesh": "mew", "position": [0, 0, 0], "rotation": [0, 1, 0, 90],
+//                      "scale": 0.5, "parent": 0, "visible": true } ],
+//     "lights": { "type": "point", "shininess": 64, "spot_cutoff": 30,
+//                 "point": { "position": [0, 2, 1], "intensity": [1, 1, 1] } },
+//     "camera": { "position": [0, 0, 2], "center": [0, 0, 0], "up": [0, 1, 0],
+//                 "projection": "perspective", "fovy": 80 }
+// }
+//
+// Only "meshes" is required. Mesh "textures" replace the diffuse texture of
+// the named materials of the .mtl. Instances refer to meshes by name or
+// index; rotation is an axis and degrees, scale one or three numbers, parent
+// an earlier instance whose transform this one is relative to. Without
+// "instances" every mesh gets one instance and the app shows one at a time.
+// The lights are "directional", "point" and "spot", each with position and
+// intensity. Files are relative to the manifest.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SCENE_MANIFEST_H_DEF
+#define SCENE_MANIFEST_H_DEF
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ManifestMesh
+{
+	std::string name;
+	std::string file;
+	std::vector<std::pair<std::string, std::string> > textures;	// material name, image file
+};
+
+struct ManifestInstance
+{
+	int mesh;
+	int parent;		// instance, -1 for none
+	float position[3];
+	float axis[3], degrees;
+	float scale[3];
+	bool visible;
+};
+
+struct ManifestLight
+{
+	bool set;
+	float position[3];
+	float intensity[3];
+};
+
+struct SceneManifest
+{
+	std::vector<ManifestMesh> meshes;
+	std::vector<ManifestInstance> instances;
+	int lightType = -1;			// 0 directional, 1 point, 2 spot, -1 not given
+	ManifestLight lights[3] = {};	// by type
+	float shininess = -1, spotCutoff = -1;
+	bool hasCamera = false;
+	float cameraPosition[3], cameraCenter[3], cameraUp[3];
+	int projection = -1;		// 0 orthogonal, 1 perspective, -1 not given
+	float fovy = -1;
+	double parseMs = 0;			// reading and parsing the file
+};
+
+namespace manifest_detail
+{
+	struct JsonValue
+	{
+		enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+		Type type = NUL;
+		int line = 0;	// where the value starts in the file
+		bool boolean = false;
+		double number = 0;
+		std::string text;
+		std::vector<JsonValue> items;	// of an array, or the values of an object
+		std::vector<std::string> keys;	// of an object, in file order
+
+		const JsonValue* find(const std::string& key) const
+		{
+			for (size_t i = 0; i < keys.size(); i++)
+			{
+				if (keys[i] == key)
+					return &items[i];
+			}
+			return NULL;
+		}
+	};
+
+	// recursive descent over the whole file, RFC 8259 without surrogate pairs
+	class JsonParser
+	{
+	public:
+		JsonParser(const std::string& text) : s(text), pos(0), line(1) {}
+
+		bool parse(JsonValue* value, std::string* err)
+		{
+			if (!parseValue(value, 0) || (skipSpace(), pos != s.size()))
+			{
+				if (error.empty())
+					error = "unexpected character";
+				*err = "line " + std::to_string(line) + ": " + error;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		void skipSpace()
+		{
+			while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r' || s[pos] == '\n'))
+			{
+				line += s[pos] == '\n' ? 1 : 0;
+				pos++;
+			}
+		}
+
+		bool literal(const char* word)
+		{
+			size_t length = strlen(word);
+			if (s.compare(pos, length, word) != 0)
+				return false;
+			pos += length;
+			return true;
+		}
+
+		bool parseValue(JsonValue* value, int depth)
+		{
+			skipSpace();
+			value->line = line;
+			if (pos >= s.size())
+				return fail("unexpected end of file");
+			if (depth > 64)
+				return fail("nested too deep");
+			char c = s[pos];
+			if (c == '{')
+				return parseObject(value, depth);
+			if (c == '[')
+				return parseArray(value, depth);
+			if (c == '"')
+			{
+				value->type = JsonValue::STRING;
+				return parseString(&value->text);
+			}
+			if (literal("true") || literal("false"))
+			{
+				value->type = JsonValue::BOOLEAN;
+				value->boolean = c == 't';
+				return true;
+			}
+			if (literal("null"))
+				return true;
+			if (c != '-' && (c < '0' || c > '9'))
+				return fail("unexpected character");
+			return parseNumber(value);
+		}
+
+		bool digit(size_t at) const
+		{
+			return at < s.size() && s[at] >= '0' && s[at] <= '9';
+		}
+
+		// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? only, strtod alone would take
+		// nan, inf, hex and a leading +
+		bool parseNumber(JsonValue* value)
+		{
+			size_t end = pos;
+			if (s[end] == '-')
+				end++;
+			if (!digit(end))
+				return fail("bad number");
+			if (s[end] == '0')
+				end++;
+			else
+			{
+				while (digit(end))
+					end++;
+			}
+			if (end < s.size() && s[end] == '.')
+			{
+				if (!digit(++end))
+					return fail("bad number");
+				while (digit(end))
+					end++;
+			}
+			if (end < s.size() && (s[end] == 'e' || s[end] == 'E'))
+			{
+				end++;
+				if (end < s.size() && (s[end] == '+' || s[end] == '-'))
+					end++;
+				if (!digit(end))
+					return fail("bad number");
+				while (digit(end))
+					end++;
+			}
+			value->number = strtod(s.substr(pos, end - pos).c_str(), NULL);
+			value->type = JsonValue::NUMBER;
+			pos = end;
+			return true;
+		}
+
+		bool parseString(std::string* out)
+		{
+			pos++;
+			while (pos < s.size() && s[pos] != '"')
+			{
+				char c = s[pos++];
+				if (c == '\n')
+					return fail("line break in a string");
+				if ((unsigned char)c < 0x20)
+					return fail("control character in a string");
+				if (c != '\\')
+				{
+					out->push_back(c);
+					continue;
+				}
+				if (pos >= s.size())
+					break;
+				char e = s[pos++];
+				switch (e)
+				{
+				case 'n': out->push_back('\n'); break;
+				case 't': out->push_back('\t'); break;
+				case 'r': out->push_back('\r'); break;
+				case 'b': out->push_back('\b'); break;
+				case 'f': out->push_back('\f'); break;
+				case 'u':
+				{
+					unsigned int code = 0;
+					for (int k = 0; k < 4; k++, pos++)
+					{
+						int digit = pos < s.size() ? HexDigit(s[pos]) : -1;
+						if (digit < 0)
+							return fail("\\u needs 4 hex digits");
+						code = code * 16 + digit;
+					}
+					if (code >= 0xd800 && code <= 0xdfff)
+						return fail("surrogate pairs are not supported");
+					// UTF-8
+					if (code < 0x80)
+						out->push_back((char)code);
+					else if (code < 0x800)
+					{
+						out->push_back((char)(0xc0 | (code >> 6)));
+						out->push_back((char)(0x80 | (code & 0x3f)));
+					}
+					else
+					{
+						out->push_back((char)(0xe0 | (code >> 12)));
+						out->push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+						out->push_back((char)(0x80 | (code & 0x3f)));
+					}
+					break;
+				}
+				case '"':
+				case '\\':
+				case '/': out->push_back(e); break;
+				default: return fail("bad escape");
+				}
+			}
+			if (pos >= s.size())
+				return fail("unterminated string");
+			pos++;
+			return true;
+		}
+
+		static int HexDigit(char c)
+		{
+			if (c >= '0' && c <= '9')
+				return c - '0';
+			if (c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F')
+				return c - 'A' + 10;
+			return -1;
+		}
+
+		bool parseArray(JsonValue* value, int depth)
+		{
+			value->type = JsonValue::ARRAY;
+			pos++;
+			skipSpace();
+			if (pos < s.size() && s[pos] == ']')
+			{
+				pos++;
+				return true;
+			}
+			while (true)
+			{
+				value->items.push_back(JsonValue());
+				if (!parseValue(&value->items.back(), depth + 1))
+					return false;
+				skipSpace();
+				if (pos < s.size() && s[pos] == ',')
+				{
+					pos++;
+					continue;
+				}
+				if (pos < s.size() && s[pos] == ']')
+				{
+					pos++;
+					return true;
+				}
+				return fail("expected , or ]");
+			}
+		}
+
+		bool parseObject(JsonValue* value, int depth)
+		{
+			value->type = JsonValue::OBJECT;
+			pos++;
+			skipSpace();
+			if (pos < s.size() && s[pos] == '}')
+			{
+				pos++;
+				return true;
+			}
+			while (true)
+			{
+				skipSpace();
+				if (pos >= s.size() || s[pos] != '"')
+					return fail("expected a key");
+				value->keys.push_back(std::string());
+				if (!parseString(&value->keys.back()))
+					return false;
+				skipSpace();
+				if (pos >= s.size() || s[pos] != ':')
+					return fail("expected :");
+				pos++;
+				value->items.push_back(JsonValue());
+				if (!parseValue(&value->items.back(), depth + 1))
+					return false;
+				skipSpace();
+				if (pos < s.size() && s[pos] == ',')
+				{
+					pos++;
+					continue;
+				}
+				if (pos < s.size() && s[pos] == '}')
+				{
+					pos++;
+					return true;
+				}
+				return fail("expected , or }");
+			}
+		}
+
+		bool fail(const char* message)
+		{
+			if (error.empty())
+				error = message;
+			return false;
+		}
+
+		const std::string& s;
+		size_t pos;
+		int line;
+		std::string error;
+	};
+
+	// file relative to the directory of the manifest, unless it is absolute
+	inline std::string Resolve(const std::string& dir, const std::string& file)
+	{
+		if (dir.empty() || file.empty() || file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':'))
+			return file;
+		return dir + "/" + file;
+	}
+
+	// err = message with the line of value, returns false
+	inline bool Fail(const JsonValue& value, const std::string& message, std::string* err)
+	{
+		*err = "line " + std::to_string(value.line) + ": " + message;
+		return false;
+	}
+
+	// *out = object[key] or NULL when it is missing, false when it has another type
+	inline bool FindTyped(const JsonValue& object, const char* key, JsonValue::Type type, const char* typeName,
+		const std::string& where, const JsonValue** out, std::string* err)
+	{
+		*out = object.find(key);
+		if (*out && (*out)->type != type)
+			return Fail(**out, where + "\"" + key + "\" has to be " + typeName, err);
+		return true;
+	}
+
+	// count floats of an array, or a single number repeated when allowScalar
+	inline bool ReadFloats(const JsonValue* value, int count, float* out, bool allowScalar = false)
+	{
+		if (allowScalar && value->type == JsonValue::NUMBER)
+		{
+			for (int i = 0; i < count; i++)
+				out[i] = (float)value->number;
+			return true;
+		}
+		if (value->type != JsonValue::ARRAY || (int)value->items.size() != count)
+			return false;
+		for (int i = 0; i < count; i++)
+		{
+			if (value->items[i].type != JsonValue::NUMBER)
+				return false;
+			out[i] = (float)value->items[i].number;
+		}
+		return true;
+	}
+
+	inline bool ReadVector(const JsonValue& object, const char* key, float out[3], std::string* err, const std::string& where)
+	{
+		const JsonValue* value = object.find(key);
+		if (value && !ReadFloats(value, 3, out))
+			return Fail(*value, where + ": \"" + key + "\" has to be 3 numbers", err);
+		return true;
+	}
+
+	inline bool ReadNumber(const JsonValue& object, const char* key, float* out, std::string* err, const std::string& where)
+	{
+		const JsonValue* value = object.find(key);
+		if (value && value->type != JsonValue::NUMBER)
+			return Fail(*value, where + ": \"" + key + "\" has to be a number", err);
+		if (value)
+			*out = (float)value->number;
+		return true;
+	}
+
+	inline bool ReadString(const JsonValue& object, const char* key, std::string* out, std::string* err, const std::string& where)
+	{
+		const JsonValue* value = object.find(key);
+		if (!value || value->type != JsonValue::STRING)
+			return Fail(value ? *value : object, where + ": \"" + key + "\" has to be a string", err);
+		*out = value->text;
+		return true;
+	}
+
+	// a whole number in [0, count)
+	inline bool IsIndex(const JsonValue* value, size_t count)
+	{
+		return value && value->type == JsonValue::NUMBER && value->number >= 0 && value->number < count &&
+			value->number == (double)(size_t)value->number;
+	}
+
+	inline int LightIndex(const std::string& name)
+	{
+		static const char* names[3] = { "directional", "point", "spot" };
+		for (int i = 0; i < 3; i++)
+		{
+			if (name == names[i])
+				return i;
+		}
+		return -1;
+	}
+
+	inline bool ReadManifest(const JsonValue& root, const std::string& dir, SceneManifest* manifest, std::string* err)
+	{
+		if (root.type != JsonValue::OBJECT)
+			return Fail(root, "the manifest has to be an object", err);
+
+		std::map<std::string, std::string> textureFiles;
+		const JsonValue* textures;
+		if (!FindTyped(root, "textures", JsonValue::ARRAY, "an array", "", &textures, err))
+			return false;
+		for (size_t i = 0; textures && i < textures->items.size(); i++)
+		{
+			const JsonValue& item = textures->items[i];
+			std::string where = "textures[" + std::to_string(i) + "]", name, file;
+			if (item.type != JsonValue::OBJECT)
+				return Fail(item, where + " has to be an object", err);
+			if (!ReadString(item, "name", &name, err, where) || !ReadString(item, "file", &file, err, where))
+				return false;
+			textureFiles[name] = Resolve(dir, file);
+		}
+
+		const JsonValue* meshes = root.find("meshes");
+		if (!meshes || meshes->type != JsonValue::ARRAY || meshes->items.empty())
+			return Fail(meshes ? *meshes : root, "\"meshes\" has to be a non-empty array", err);
+		std::map<std::string, int> meshIndices;
+		for (size_t i = 0; i < meshes->items.size(); i++)
+		{
+			const JsonValue& item = meshes->items[i];
+			std::string where = "meshes[" + std::to_string(i) + "]";
+			if (item.type != JsonValue::OBJECT)
+				return Fail(item, where + " has to be an object", err);
+			ManifestMesh mesh;
+			if (!ReadString(item, "file", &mesh.file, err, where))
+				return false;
+			mesh.file = Resolve(dir, mesh.file);
+			if (item.find("name") && !ReadString(item, "name", &mesh.name, err, where))
+				return false;
+			if (mesh.name.empty())
+				mesh.name = mesh.file;
+			if (meshIndices.count(mesh.name))
+				return Fail(item, where + ": the name " + mesh.name + " is taken", err);
+			meshIndices[mesh.name] = (int)i;
+			const JsonValue* overrides;
+			if (!FindTyped(item, "textures", JsonValue::OBJECT, "an object", where + ": ", &overrides, err))
+				return false;
+			for (size_t k = 0; overrides && k < overrides->keys.size(); k++)
+			{
+				const JsonValue& texture = overrides->items[k];
+				if (texture.type != JsonValue::STRING || !textureFiles.count(texture.text))
+					return Fail(texture, where + ": no texture is named " + texture.text, err);
+				mesh.textures.push_back(std::make_pair(overrides->keys[k], textureFiles[texture.text]));
+			}
+			manifest->meshes.push_back(mesh);
+		}
+
+		const JsonValue* instances;
+		if (!FindTyped(root, "instances", JsonValue::ARRAY, "an array", "", &instances, err))
+			return false;
+		for (size_t i = 0; instances && i < instances->items.size(); i++)
+		{
+			const JsonValue& item = instances->items[i];
+			std::string where = "instances[" + std::to_string(i) + "]";
+			if (item.type != JsonValue::OBJECT)
+				return Fail(item, where + " has to be an object", err);
+			ManifestInstance instance = { -1, -1, { 0, 0, 0 }, { 0, 1, 0 }, 0, { 1, 1, 1 }, true };
+			const JsonValue* mesh = item.find("mesh");
+			if (mesh && mesh->type == JsonValue::STRING && meshIndices.count(mesh->text))
+				instance.mesh = meshIndices[mesh->text];
+			else if (IsIndex(mesh, manifest->meshes.size()))
+				instance.mesh = (int)mesh->number;
+			if (instance.mesh < 0)
+				return Fail(mesh ? *mesh : item, where + ": \"mesh\" has to be the name or index of a mesh", err);
+			const JsonValue* parent = item.find("parent");
+			if (parent)
+			{
+				if (!IsIndex(parent, i))
+					return Fail(*parent, where + ": \"parent\" has to be the index of an earlier instance", err);
+				instance.parent = (int)parent->number;
+			}
+			float rotation[4] = { 0, 1, 0, 0 };
+			const JsonValue* rotationValue = item.find("rotation");
+			if (rotationValue && !ReadFloats(rotationValue, 4, rotation))
+				return Fail(*rotationValue, where + ": \"rotation\" has to be an axis and degrees", err);
+			memcpy(instance.axis, rotation, sizeof(instance.axis));
+			instance.degrees = rotation[3];
+			const JsonValue* scale = item.find("scale");
+			if (scale && !ReadFloats(scale, 3, instance.scale, true))
+				return Fail(*scale, where + ": \"scale\" has to be 1 or 3 numbers", err);
+			const JsonValue* visible;
+			if (!FindTyped(item, "visible", JsonValue::BOOLEAN, "true or false", where + ": ", &visible, err))
+				return false;
+			instance.visible = !visible || visible->boolean;
+			if (!ReadVector(item, "position", instance.position, err, where))
+				return false;
+			manifest->instances.push_back(instance);
+		}
+
+		const JsonValue* lights;
+		if (!FindTyped(root, "lights", JsonValue::OBJECT, "an object", "", &lights, err))
+			return false;
+		if (lights)
+		{
+			const JsonValue* type = lights->find("type");
+			if (type)
+			{
+				manifest->lightType = type->type == JsonValue::STRING ? LightIndex(type->text) : -1;
+				if (manifest->lightType < 0)
+					return Fail(*type, "lights: \"type\" has to be directional, point or spot", err);
+			}
+			static const char* names[3] = { "directional", "point", "spot" };
+			for (int l = 0; l < 3; l++)
+			{
+				std::string where = std::string("lights.") + names[l];
+				const JsonValue* light;
+				if (!FindTyped(*lights, names[l], JsonValue::OBJECT, "an object", "lights: ", &light, err))
+					return false;
+				ManifestLight& target = manifest->lights[l];
+				target.set = light != NULL;
+				for (int k = 0; k < 3; k++)
+					target.position[k] = target.intensity[k] = 0;
+				if (light && (!ReadVector(*light, "position", target.position, err, where) ||
+					!ReadVector(*light, "intensity", target.intensity, err, where)))
+					return false;
+			}
+			if (!ReadNumber(*lights, "shininess", &manifest->shininess, err, "lights") ||
+				!ReadNumber(*lights, "spot_cutoff", &manifest->spotCutoff, err, "lights"))
+				return false;
+		}
+
+		const JsonValue* camera;
+		if (!FindTyped(root, "camera", JsonValue::OBJECT, "an object", "", &camera, err))
+			return false;
+		if (camera)
+		{
+			float defaults[3][3] = { { 0, 0, 2 }, { 0, 0, 0 }, { 0, 1, 0 } };
+			memcpy(manifest->cameraPosition, defaults[0], sizeof(defaults[0]));
+			memcpy(manifest->cameraCenter, defaults[1], sizeof(defaults[1]));
+			memcpy(manifest->cameraUp, defaults[2], sizeof(defaults[2]));
+			manifest->hasCamera = true;
+			if (!ReadVector(*camera, "position", manifest->cameraPosition, err, "camera") ||
+				!ReadVector(*camera, "center", manifest->cameraCenter, err, "camera") ||
+				!ReadVector(*camera, "up", manifest->cameraUp, err, "camera") ||
+				!ReadNumber(*camera, "fovy", &manifest->fovy, err, "camera"))
+				return false;
+			const JsonValue* projection = camera->find("projection");
+			if (projection)
+			{
+				bool known = projection->type == JsonValue::STRING && (projection->text == "orthogonal" || projection->text == "perspective");
+				if (!known)
+					return Fail(*projection, "camera: \"projection\" has to be orthogonal or perspective", err);
+				manifest->projection = projection->text == "perspective" ? 1 : 0;
+			}
+		}
+		return true;
+	}
+}
+
+// Read the manifest at path; err tells what is wrong when it returns false
+inline bool LoadSceneManifest(const std::string& path, SceneManifest* manifest, std::string* err)
+{
+	using namespace manifest_detail;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	*manifest = SceneManifest();
+
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		*err = "cannot open " + path;
+		return false;
+	}
+	std::string text;
+	char buffer[65536];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		text.append(buffer, read);
+	fclose(file);
+
+	JsonValue root;
+	JsonParser parser(text);
+	if (!parser.parse(&root, err))
+	{
+		*err = path + ", " + *err;
+		return false;
+	}
+	size_t slash = path.find_last_of("/\\");
+	std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash);
+	if (!ReadManifest(root, dir, manifest, err))
+	{
+		*err = path + ", " + *err;
+		return false;
+	}
+	manifest->parseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+#endif
@@ -0,0 +1,827 @@
+///////////////////////////////////////////////////////////////////////////////
+// SoftRasterizer.h
+// ================
+// CPU rendering backend for hosts without a GPU. It draws the same shapes,
+// materials and matrices as the GL path and evaluates the lights of
+// shader.vs.glsl / shader.fs.glsl, per vertex or per pixel.
+//
+// Draws are recorded between beginFrame() and endFrame(), which then
+// 1. shades the vertices of every instance in parallel,
+// 2. clips the triangles against the view volume, sets them up in screen
+//    space and sorts them into 64x64 pixel tiles, in parallel over chunks
+//    of triangles,
+// 3. rasterizes the tiles in parallel. Edge functions (Pineda, "A Parallel
+//    Algorithm for Polygon Rasterization", 1988) and the depth test run on
+//    four pixels at a time with SSE, the covered pixels are interpolated
+//    perspective correct and shaded.
+// Every tile walks its triangles in draw order, so the image does not depend
+// on the number of threads.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef SOFT_RASTERIZER_H_DEF
+#define SOFT_RASTERIZER_H_DEF
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "Matrices.h"
+#include "ParallelFor.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define SOFT_RASTERIZER_SSE
+#include <emmintrin.h>
+#endif
+
+const int SOFT_TILE_SIZE = 64;
+const int SOFT_TRIANGLE_CHUNK = 4096;	// triangles set up by one task
+
+// RGB texels as floats like the GL_RGBA32F textures of the GL path, with the
+// box filtered mip chain of glGenerateMipmap()
+class SoftTexture
+{
+public:
+	SoftTexture() {}
+
+	// rgba: width * height texels, rows as given to glTexImage2D
+	SoftTexture(const unsigned char* rgba, int width, int height)
+	{
+		levels.resize(1);
+		Level& base = levels[0];
+		base.width = width;
+		base.height = height;
+		base.texels.resize((size_t)width * height * 3);
+		for (size_t i = 0; i < (size_t)width * height; i++)
+		{
+			for (int k = 0; k < 3; k++)
+				base.texels[i * 3 + k] = rgba[i * 4 + k] / 255.0f;
+		}
+		while (levels.back().width > 1 || levels.back().height > 1)
+		{
+			const Level& source = levels.back();
+			Level level;
+			level.width = std::max(source.width / 2, 1);
+			level.height = std::max(source.height / 2, 1);
+			level.texels.resize((size_t)level.width * level.height * 3);
+			for (int y = 0; y < level.height; y++)
+			{
+				for (int x = 0; x < level.width; x++)
+				{
+					int x0 = std::min(x * 2, source.width - 1), x1 = std::min(x * 2 + 1, source.width - 1);
+					int y0 = std::min(y * 2, source.height - 1), y1 = std::min(y * 2 + 1, source.height - 1);
+					for (int k = 0; k < 3; k++)
+					{
+						level.texels[((size_t)y * level.width + x) * 3 + k] = 0.25f * (source.at(x0, y0)[k] + source.at(x1, y0)[k] +
+							source.at(x0, y1)[k] + source.at(x1, y1)[k]);
+					}
+				}
+			}
+			levels.push_back(level);
+		}
+	}
+
+	bool empty() const { return levels.empty(); }
+	size_t getBytes() const
+	{
+		size_t bytes = 0;
+		for (size_t i = 0; i < levels.size(); i++)
+			bytes += levels[i].texels.size() * sizeof(float);
+		return bytes;
+	}
+
+	// GL_REPEAT sampling. lod is log2 of texels per pixel, magnification below
+	// zero uses magNearest, minification mipmaps with GL_NEAREST_MIPMAP_LINEAR
+	// or GL_LINEAR_MIPMAP_LINEAR
+	void sample(float u, float v, float lod, bool magNearest, bool minNearest, float out[3]) const
+	{
+		if (lod <= 0)
+		{
+			sampleLevel(0, u, v, magNearest, out);
+			return;
+		}
+		float maxLevel = (float)(levels.size() - 1);
+		lod = std::min(lod, maxLevel);
+		int level = (int)lod;
+		float blend = lod - level;
+		sampleLevel(level, u, v, minNearest, out);
+		if (blend > 0 && level + 1 < (int)levels.size())
+		{
+			float upper[3];
+			sampleLevel(level + 1, u, v, minNearest, upper);
+			for (int k = 0; k < 3; k++)
+				out[k] += (upper[k] - out[k]) * blend;
+		}
+	}
+
+	int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+	int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+	// RGB of the base level, rows as given to the constructor
+	const float* getTexels() const { return levels.empty() ? NULL : &levels[0].texels[0]; }
+
+private:
+	struct Level
+	{
+		int width, height;
+		std::vector<float> texels;
+
+		const float* at(int x, int y) const { return &texels[((size_t)y * width + x) * 3]; }
+	};
+
+	static int wrap(int i, int size)
+	{
+		i %= size;
+		return (i < 0) ? i + size : i;
+	}
+
+	void sampleLevel(int index, float u, float v, bool nearest, float out[3]) const
+	{
+		const Level& level = levels[index];
+		float x = (u - floorf(u)) * level.width;
+		float y = (v - floorf(v)) * level.height;
+		if (nearest)
+		{
+			const float* t = level.at(wrap((int)x, level.width), wrap((int)y, level.height));
+			out[0] = t[0];
+			out[1] = t[1];
+			out[2] = t[2];
+			return;
+		}
+		x -= 0.5f;
+		y -= 0.5f;
+		float fx = floorf(x), fy = floorf(y);
+		float ax = x - fx, ay = y - fy;
+		int x0 = wrap((int)fx, level.width), x1 = wrap((int)fx + 1, level.width);
+		int y0 = wrap((int)fy, level.height), y1 = wrap((int)fy + 1, level.height);
+		const float* t00 = level.at(x0, y0);
+		const float* t10 = level.at(x1, y0);
+		const float* t01 = level.at(x0, y1);
+		const float* t11 = level.at(x1, y1);
+		for (int k = 0; k < 3; k++)
+		{
+			float top = t00[k] + (t10[k] - t00[k]) * ax;
+			float bottom = t01[k] + (t11[k] - t01[k]) * ax;
+			out[k] = top + (bottom - top) * ay;
+		}
+	}
+
+	std::vector<Level> levels;
+};
+
+// CPU copy of the buffers of a Shape
+struct SoftMesh
+{
+	std::vector<float> positions;	// xyz
+	std::vector<float> normals;		// xyz
+	std::vector<float> texcoords;	// uv
+	std::vector<unsigned int> indices;
+};
+
+struct SoftMaterial
+{
+	float Ka[3], Kd[3], Ks[3];
+	const SoftTexture* texture;	// NULL samples black, like an incomplete GL texture
+	bool isEye;
+};
+
+// the uniforms of shader.vs.glsl / shader.fs.glsl
+struct SoftLighting
+{
+	float Ia[3];
+	float I_d[3], I_p[3], I_s[3];
+	float lightPos_d[3], lightPos_p[3], lightPos_s[3];
+	int lightId;			// 0 directional, 1 point, 2 spot
+	float shininess;
+	float spotCutoff;		// degrees
+	float spotDirection[3];	// world space direction of the spot light
+	float cameraPos[3];
+	bool perPixel;			// per_vertex == 1 in the shaders
+	float offsetX, offsetY;	// texture coordinate offset of eye materials
+	bool magNearest, minNearest;
+};
+
+struct SoftRenderStats
+{
+	size_t triangles;		// submitted, instances included
+	size_t rasterized;		// set up after clipping, zero area triangles dropped
+	size_t pixels;			// shaded, passed the depth test
+	double vertexMs, setupMs, rasterMs, totalMs;
+
+	SoftRenderStats() : triangles(0), rasterized(0), pixels(0), vertexMs(0), setupMs(0), rasterMs(0), totalMs(0) {}
+};
+
+namespace softraster_detail
+{
+	// attributes interpolated over a triangle: world position or lit color, normal, uv
+	const int ATTRIBUTES = 8;
+
+	struct Vertex
+	{
+		float clip[4];
+		float attr[ATTRIBUTES];
+	};
+
+	struct Triangle
+	{
+		float edgeA[3], edgeB[3], edgeC[3];	// E(x, y) = A x + B y + C at pixel centers, >= 0 inside
+		int topLeft[3];						// edges which own the pixels exactly on them
+		float invArea;
+		float z[3];							// window depth of the vertices
+		float invW[3];
+		float attr[3][ATTRIBUTES];
+		int minX, minY, maxX, maxY;			// pixel bounds inside the viewport
+		int draw;
+	};
+
+	inline float Dot(const float a[3], const float b[3])
+	{
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	inline void Normalize(float v[3])
+	{
+		float length = sqrtf(Dot(v, v));
+		if (length > 0)
+		{
+			v[0] /= length;
+			v[1] /= length;
+			v[2] /= length;
+		}
+	}
+
+	// the light functions of the shaders
+	inline void Shade(const SoftLighting& l, const SoftMaterial& m, const float position[3], const float normal[3], float out[3])
+	{
+		float N[3] = { normal[0], normal[1], normal[2] };
+		Normalize(N);
+		float V[3] = { l.cameraPos[0] - position[0], l.cameraPos[1] - position[1], l.cameraPos[2] - position[2] };
+		Normalize(V);
+		for (int k = 0; k < 3; k++)
+			out[k] = l.Ia[k] * m.Ka[k];
+
+		if (l.lightId == 0)
+		{
+			float L[3] = { l.lightPos_d[0], l.lightPos_d[1], l.lightPos_d[2] };
+			Normalize(L);
+			float NdotL = Dot(N, L);
+			float R[3] = { 2 * NdotL * N[0] - L[0], 2 * NdotL * N[1] - L[1], 2 * NdotL * N[2] - L[2] };
+			float diffuse = std::max(NdotL, 0.0f);
+			float specular = powf(std::max(Dot(R, V), 0.0f), l.shininess);
+			for (int k = 0; k < 3; k++)
+				out[k] += l.I_d[k] * m.Kd[k] * diffuse + m.Ks[k] * specular;
+			return;
+		}
+
+		const float* lightPos = (l.lightId == 1) ? l.lightPos_p : l.lightPos_s;
+		const float* intensity = (l.lightId == 1) ? l.I_p : l.I_s;
+		float L[3] = { lightPos[0] - position[0], lightPos[1] - position[1], lightPos[2] - position[2] };
+		float d = sqrtf(Dot(L, L));
+		Normalize(L);
+		float H[3] = { L[0] + V[0], L[1] + V[1], L[2] + V[2] };
+		Normalize(H);
+		float attenuation = (l.lightId == 1) ? 1.0f / (0.01f + 0.8f * d + 0.1f * d * d) : 1.0f / (0.05f + 0.3f * d + 0.6f * d * d);
+		attenuation = std::min(attenuation, 1.0f);
+
+		if (l.lightId == 2)
+		{
+			float arc = -Dot(L, l.spotDirection);
+			float angle = acosf(std::min(std::max(arc, -1.0f), 1.0f)) * 57.2957795f;
+			if (l.spotCutoff <= angle)
+				return;
+			attenuation *= powf(std::max(arc, 0.0f), 50.0f);
+		}
+		float diffuse = std::max(Dot(N, L), 0.0f);
+		float specular = powf(std::max(Dot(N, H), 0.0f), l.shininess);
+		for (int k = 0; k < 3; k++)
+			out[k] += attenuation * (intensity[k] * m.Kd[k] * diffuse + m.Ks[k] * specular);
+	}
+
+	// Sutherland-Hodgman against one clip plane, dot(plane, clip) >= 0 inside
+	inline int ClipPolygon(const Vertex* in, int count, const float plane[4], Vertex* out)
+	{
+		int outCount = 0;
+		for (int i = 0; i < count; i++)
+		{
+			const Vertex& a = in[i];
+			const Vertex& b = in[(i + 1) % count];
+			float da = plane[0] * a.clip[0] + plane[1] * a.clip[1] + plane[2] * a.clip[2] + plane[3] * a.clip[3];
+			float db = plane[0] * b.clip[0] + plane[1] * b.clip[1] + plane[2] * b.clip[2] + plane[3] * b.clip[3];
+			if (da >= 0)
+				out[outCount++] = a;
+			if ((da >= 0) != (db >= 0))
+			{
+				float t = da / (da - db);
+				Vertex& v = out[outCount++];
+				for (int k = 0; k < 4; k++)
+					v.clip[k] = a.clip[k] + (b.clip[k] - a.clip[k]) * t;
+				for (int k = 0; k < ATTRIBUTES; k++)
+					v.attr[k] = a.attr[k] + (b.attr[k] - a.attr[k]) * t;
+			}
+		}
+		return outCount;
+	}
+
+	// outside bits of the six planes -w <= x, y, z <= w
+	inline int Outcode(const float clip[4])
+	{
+		int code = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			code |= (clip[k] < -clip[3]) ? (1 << (k * 2)) : 0;
+			code |= (clip[k] > clip[3]) ? (2 << (k * 2)) : 0;
+		}
+		return code;
+	}
+}
+
+class SoftRasterizer
+{
+public:
+	SoftRasterizer() : width(0), height(0), threadCount(0)
+	{
+		viewport[0] = viewport[1] = viewport[2] = viewport[3] = 0;
+	}
+
+	// 0 uses the hardware threads
+	void setThreadCount(unsigned int count) { threadCount = count; }
+
+	// clear the frame to color and depth 1, drops the draws of the last frame
+	void beginFrame(int frameWidth, int frameHeight, const float clearColor[3])
+	{
+		width = frameWidth;
+		height = frameHeight;
+		unsigned char clear[4];
+		for (int k = 0; k < 3; k++)
+			clear[k] = toByte(clearColor[k]);
+		clear[3] = 255;
+		color.resize((size_t)width * height * 4);
+		for (size_t i = 0; i < (size_t)width * height; i++)
+			memcpy(&color[i * 4], clear, 4);
+		depth.assign((size_t)width * height, 1.0f);
+		draws.clear();
+		setViewport(0, 0, width, height);
+	}
+
+	// like glViewport, x and y from the bottom left corner
+	void setViewport(int x, int y, int viewportWidth, int viewportHeight)
+	{
+		viewport[0] = x;
+		viewport[1] = y;
+		viewport[2] = viewportWidth;
+		viewport[3] = viewportHeight;
+	}
+
+	// record instanceCount instances of mesh, mesh, material and lighting have to live until endFrame()
+	void draw(const SoftMesh& mesh, const SoftMaterial& material, const Matrix4* worlds, size_t instanceCount,
+		const Matrix4& viewProjection, const SoftLighting& lighting)
+	{
+		for (size_t i = 0; i < instanceCount; i++)
+		{
+			Draw d;
+			d.mesh = &mesh;
+			d.material = &material;
+			d.lighting = &lighting;
+			d.world = worlds[i];
+			d.clip = viewProjection * worlds[i];
+			// mat3(transpose(inverse(aModel)))
+			d.normal = worlds[i];
+			d.normal.invert();
+			d.normal.transpose();
+			for (int k = 0; k < 4; k++)
+				d.viewport[k] = viewport[k];
+			draws.push_back(d);
+		}
+	}
+
+	// rasterize all draws of the frame
+	void endFrame(SoftRenderStats* stats = NULL)
+	{
+		using namespace softraster_detail;
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point start = Clock::now();
+		unsigned int threads = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+
+		// 1. vertices of every instance
+		size_t vertexCount = 0;
+		for (size_t i = 0; i < draws.size(); i++)
+		{
+			draws[i].firstVertex = vertexCount;
+			vertexCount += draws[i].mesh->positions.size() / 3;
+		}
+		vertices.resize(vertexCount);
+		ParallelFor(draws.size(), threads, [&](size_t i) { shadeVertices(draws[i]); });
+		Clock::time_point vertexEnd = Clock::now();
+
+		// 2. triangles, binned per chunk so every tile can walk them in draw order
+		tilesX = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+		tilesY = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+		chunks.clear();
+		size_t triangleCount = 0;
+		for (size_t i = 0; i < draws.size(); i++)
+		{
+			size_t drawTriangles = draws[i].mesh->indices.size() / 3;
+			triangleCount += drawTriangles;
+			for (size_t first = 0; first < drawTriangles; first += SOFT_TRIANGLE_CHUNK)
+			{
+				Chunk chunk;
+				chunk.draw = (int)i;
+				chunk.first = first;
+				chunk.count = std::min((size_t)SOFT_TRIANGLE_CHUNK, drawTriangles - first);
+				chunks.push_back(chunk);
+			}
+		}
+		if (chunkData.size() < chunks.size())
+			chunkData.resize(chunks.size());
+		ParallelFor(chunks.size(), threads, [&](size_t i) { setupChunk(chunks[i], &chunkData[i]); });
+		Clock::time_point setupEnd = Clock::now();
+
+		// 3. tiles
+		size_t tileCount = (size_t)tilesX * tilesY;
+		std::vector<size_t> tilePixels(tileCount, 0);
+		ParallelFor(tileCount, threads, [&](size_t i) { tilePixels[i] = rasterizeTile((int)i); });
+		Clock::time_point end = Clock::now();
+
+		if (stats)
+		{
+			*stats = SoftRenderStats();
+			stats->triangles = triangleCount;
+			for (size_t i = 0; i < chunks.size(); i++)
+				stats->rasterized += chunkData[i].triangles.size();
+			for (size_t i = 0; i < tileCount; i++)
+				stats->pixels += tilePixels[i];
+			stats->vertexMs = std::chrono::duration<double, std::milli>(vertexEnd - start).count();
+			stats->setupMs = std::chrono::duration<double, std::milli>(setupEnd - vertexEnd).count();
+			stats->rasterMs = std::chrono::duration<double, std::milli>(end - setupEnd).count();
+			stats->totalMs = std::chrono::duration<double, std::milli>(end - start).count();
+		}
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	// RGBA8, top row first
+	const std::vector<unsigned char>& getColor() const { return color; }
+
+private:
+	struct Draw
+	{
+		const SoftMesh* mesh;
+		const SoftMaterial* material;
+		const SoftLighting* lighting;
+		Matrix4 world, clip, normal;
+		int viewport[4];
+		size_t firstVertex;
+	};
+
+	struct Chunk
+	{
+		int draw;
+		size_t first, count;
+	};
+
+	// triangles of a chunk, counting sorted by tile
+	struct ChunkData
+	{
+		std::vector<softraster_detail::Triangle> triangles;
+		std::vector<unsigned int> tileStart;	// tile t owns tileTriangles[tileStart[t], tileStart[t + 1])
+		std::vector<unsigned int> tileTriangles;
+	};
+
+	static unsigned char toByte(float c)
+	{
+		c = std::min(std::max(c, 0.0f), 1.0f);
+		return (unsigned char)(c * 255.0f + 0.5f);
+	}
+
+	// the vertex shader
+	void shadeVertices(const Draw& d)
+	{
+		using namespace softraster_detail;
+		const SoftMesh& mesh = *d.mesh;
+		size_t count = mesh.positions.size() / 3;
+		bool hasNormals = mesh.normals.size() >= count * 3;
+		bool hasTexcoords = mesh.texcoords.size() >= count * 2;
+		for (size_t i = 0; i < count; i++)
+		{
+			const float* p = &mesh.positions[i * 3];
+			Vertex& v = vertices[d.firstVertex + i];
+			for (int r = 0; r < 4; r++)
+				v.clip[r] = d.clip[r * 4] * p[0] + d.clip[r * 4 + 1] * p[1] + d.clip[r * 4 + 2] * p[2] + d.clip[r * 4 + 3];
+			float world[3], normal[3] = { 0, 0, 0 };
+			for (int r = 0; r < 3; r++)
+			{
+				world[r] = d.world[r * 4] * p[0] + d.world[r * 4 + 1] * p[1] + d.world[r * 4 + 2] * p[2] + d.world[r * 4 + 3];
+				if (hasNormals)
+				{
+					const float* n = &mesh.normals[i * 3];
+					normal[r] = d.normal[r * 4] * n[0] + d.normal[r * 4 + 1] * n[1] + d.normal[r * 4 + 2] * n[2];
+				}
+			}
+			if (d.lighting->perPixel)
+			{
+				for (int k = 0; k < 3; k++)
+					v.attr[k] = world[k];
+			}
+			else
+			{
+				Shade(*d.lighting, *d.material, world, normal, v.attr);
+			}
+			for (int k = 0; k < 3; k++)
+				v.attr[3 + k] = normal[k];
+			v.attr[6] = hasTexcoords ? mesh.texcoords[i * 2] : 0.0f;
+			v.attr[7] = hasTexcoords ? mesh.texcoords[i * 2 + 1] : 0.0f;
+		}
+	}
+
+	void setupChunk(const Chunk& chunk, ChunkData* data)
+	{
+		using namespace softraster_detail;
+		const Draw& d = draws[chunk.draw];
+		const unsigned int* indices = &d.mesh->indices[chunk.first * 3];
+		data->triangles.clear();
+		static const float planes[6][4] = { { 1, 0, 0, 1 }, { -1, 0, 0, 1 }, { 0, 1, 0, 1 }, { 0, -1, 0, 1 }, { 0, 0, 1, 1 }, { 0, 0, -1, 1 } };
+
+		for (size_t t = 0; t < chunk.count; t++)
+		{
+			const Vertex* v[3];
+			int codes[3];
+			for (int k = 0; k < 3; k++)
+			{
+				v[k] = &vertices[d.firstVertex + indices[t * 3 + k]];
+				codes[k] = Outcode(v[k]->clip);
+			}
+			if (codes[0] & codes[1] & codes[2])
+				continue;
+			if ((codes[0] | codes[1] | codes[2]) == 0)
+			{
+				addTriangle(d, chunk.draw, *v[0], *v[1], *v[2], data);
+				continue;
+			}
+			// up to 3 + 6 vertices after six planes
+			Vertex polygon[2][9];
+			int count = 3;
+			for (int k = 0; k < 3; k++)
+				polygon[0][k] = *v[k];
+			int current = 0;
+			for (int p = 0; p < 6 && count > 0; p++)
+			{
+				if (((codes[0] | codes[1] | codes[2]) >> p) & 1)
+				{
+					count = ClipPolygon(polygon[current], count, planes[p], polygon[1 - current]);
+					current = 1 - current;
+				}
+			}
+			for (int k = 1; k + 1 < count; k++)
+				addTriangle(d, chunk.draw, polygon[current][0], polygon[current][k], polygon[current][k + 1], data);
+		}
+
+		// counting sort by tile
+		size_t tileCount = (size_t)tilesX * tilesY;
+		data->tileStart.assign(tileCount + 1, 0);
+		for (size_t i = 0; i < data->triangles.size(); i++)
+		{
+			const Triangle& tri = data->triangles[i];
+			for (int ty = tri.minY / SOFT_TILE_SIZE; ty <= tri.maxY / SOFT_TILE_SIZE; ty++)
+			{
+				for (int tx = tri.minX / SOFT_TILE_SIZE; tx <= tri.maxX / SOFT_TILE_SIZE; tx++)
+					data->tileStart[ty * tilesX + tx + 1]++;
+			}
+		}
+		for (size_t i = 0; i < tileCount; i++)
+			data->tileStart[i + 1] += data->tileStart[i];
+		data->tileTriangles.resize(data->tileStart[tileCount]);
+		std::vector<unsigned int> next(data->tileStart.begin(), data->tileStart.end() - 1);
+		for (size_t i = 0; i < data->triangles.size(); i++)
+		{
+			const Triangle& tri = data->triangles[i];
+			for (int ty = tri.minY / SOFT_TILE_SIZE; ty <= tri.maxY / SOFT_TILE_SIZE; ty++)
+			{
+				for (int tx = tri.minX / SOFT_TILE_SIZE; tx <= tri.maxX / SOFT_TILE_SIZE; tx++)
+					data->tileTriangles[next[ty * tilesX + tx]++] = (unsigned int)i;
+			}
+		}
+	}
+
+	// screen space setup of a clipped triangle
+	void addTriangle(const Draw& d, int drawIndex, const softraster_detail::Vertex& a, const softraster_detail::Vertex& b,
+		const softraster_detail::Vertex& c, ChunkData* data)
+	{
+		using namespace softraster_detail;
+		const Vertex* v[3] = { &a, &b, &c };
+		Triangle tri;
+		float x[3], y[3];
+		for (int k = 0; k < 3; k++)
+		{
+			float invW = 1.0f / v[k]->clip[3];
+			// window coordinates with y down, snapped to 1/256 pixel like the sub-pixel grid of a GPU
+			float wx = d.viewport[0] + (v[k]->clip[0] * invW * 0.5f + 0.5f) * d.viewport[2];
+			float wy = height - (d.viewport[1] + (v[k]->clip[1] * invW * 0.5f + 0.5f) * d.viewport[3]);
+			x[k] = floorf(wx * 256.0f + 0.5f) / 256.0f;
+			y[k] = floorf(wy * 256.0f + 0.5f) / 256.0f;
+			tri.z[k] = v[k]->clip[2] * invW * 0.5f + 0.5f;
+			tri.invW[k] = invW;
+			for (int i = 0; i < ATTRIBUTES; i++)
+				tri.attr[k][i] = v[k]->attr[i];
+		}
+
+		// edge k is opposite to vertex k
+		for (int k = 0; k < 3; k++)
+		{
+			int i = (k + 1) % 3, j = (k + 2) % 3;
+			tri.edgeA[k] = y[i] - y[j];
+			tri.edgeB[k] = x[j] - x[i];
+			tri.edgeC[k] = x[i] * y[j] - x[j] * y[i];
+		}
+		float area = tri.edgeA[0] * x[0] + tri.edgeB[0] * y[0] + tri.edgeC[0];
+		if (area == 0)
+			return;
+		float sign = (area < 0) ? -1.0f : 1.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			tri.edgeA[k] *= sign;
+			tri.edgeB[k] *= sign;
+			tri.edgeC[k] *= sign;
+			// pixel centers are at + 0.5
+			tri.edgeC[k] += (tri.edgeA[k] + tri.edgeB[k]) * 0.5f;
+			tri.topLeft[k] = (tri.edgeA[k] > 0 || (tri.edgeA[k] == 0 && tri.edgeB[k] > 0)) ? 1 : 0;
+		}
+		tri.invArea = 1.0f / (area * sign);
+
+		// pixels whose centers may be covered, inside the viewport
+		int viewportTop = height - d.viewport[1] - d.viewport[3];
+		tri.minX = std::max((int)floorf(std::min(std::min(x[0], x[1]), x[2])), std::max(d.viewport[0], 0));
+		tri.maxX = std::min((int)ceilf(std::max(std::max(x[0], x[1]), x[2])), std::min(d.viewport[0] + d.viewport[2], width) - 1);
+		tri.minY = std::max((int)floorf(std::min(std::min(y[0], y[1]), y[2])), std::max(viewportTop, 0));
+		tri.maxY = std::min((int)ceilf(std::max(std::max(y[0], y[1]), y[2])), std::min(viewportTop + d.viewport[3], height) - 1);
+		if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+			return;
+		tri.draw = drawIndex;
+		data->triangles.push_back(tri);
+	}
+
+	size_t rasterizeTile(int tile)
+	{
+		using namespace softraster_detail;
+		int tileX = (tile % tilesX) * SOFT_TILE_SIZE, tileY = (tile / tilesX) * SOFT_TILE_SIZE;
+		int tileMaxX = std::min(tileX + SOFT_TILE_SIZE, width) - 1, tileMaxY = std::min(tileY + SOFT_TILE_SIZE, height) - 1;
+		size_t shaded = 0;
+		for (size_t c = 0; c < chunks.size(); c++)
+		{
+			const ChunkData& data = chunkData[c];
+			for (unsigned int n = data.tileStart[tile]; n < data.tileStart[tile + 1]; n++)
+			{
+				const Triangle& tri = data.triangles[data.tileTriangles[n]];
+				int minX = std::max(tri.minX, tileX), maxX = std::min(tri.maxX, tileMaxX);
+				int minY = std::max(tri.minY, tileY), maxY = std::min(tri.maxY, tileMaxY);
+				for (int y = minY; y <= maxY; y++)
+					shaded += rasterizeSpan(tri, y, minX, maxX);
+			}
+		}
+		return shaded;
+	}
+
+	// covered pixels of a row that pass the depth test get shaded, returns their number
+	size_t rasterizeSpan(const softraster_detail::Triangle& tri, int y, int minX, int maxX)
+	{
+		using namespace softraster_detail;
+		size_t shaded = 0;
+		float* depthRow = &depth[(size_t)y * width];
+		float rowC[3];
+		for (int k = 0; k < 3; k++)
+			rowC[k] = tri.edgeB[k] * y + tri.edgeC[k];
+#ifdef SOFT_RASTERIZER_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 a[3], c[3], topLeft[3];
+		for (int k = 0; k < 3; k++)
+		{
+			a[k] = _mm_set1_ps(tri.edgeA[k]);
+			c[k] = _mm_set1_ps(rowC[k]);
+			topLeft[k] = _mm_castsi128_ps(_mm_set1_epi32(tri.topLeft[k] ? -1 : 0));
+		}
+		// depth relative to vertex 0, the edge values of big triangles carry large absolute errors
+		__m128 z0 = _mm_set1_ps(tri.z[0]), dz1 = _mm_set1_ps((tri.z[1] - tri.z[0]) * tri.invArea), dz2 = _mm_set1_ps((tri.z[2] - tri.z[0]) * tri.invArea);
+		for (int x = minX; x <= maxX; x += 4)
+		{
+			__m128 px = _mm_setr_ps((float)x, (float)(x + 1), (float)(x + 2), (float)(x + 3));
+			__m128 e[3];
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (int k = 0; k < 3; k++)
+			{
+				e[k] = _mm_add_ps(_mm_mul_ps(a[k], px), c[k]);
+				__m128 covered = _mm_or_ps(_mm_cmpgt_ps(e[k], zero), _mm_and_ps(_mm_cmpeq_ps(e[k], zero), topLeft[k]));
+				inside = _mm_and_ps(inside, covered);
+			}
+			int mask = _mm_movemask_ps(inside);
+			if (maxX - x < 3)
+				mask &= (1 << (maxX - x + 1)) - 1;
+			if (mask == 0)
+				continue;
+			__m128 z = _mm_add_ps(z0, _mm_add_ps(_mm_mul_ps(e[1], dz1), _mm_mul_ps(e[2], dz2)));
+			float zs[4], es[3][4];
+			_mm_storeu_ps(zs, z);
+			for (int k = 0; k < 3; k++)
+				_mm_storeu_ps(es[k], e[k]);
+			for (int i = 0; i < 4; i++)
+			{
+				if (!((mask >> i) & 1) || !(zs[i] < depthRow[x + i]) || zs[i] > 1.0f)
+					continue;
+				depthRow[x + i] = zs[i];
+				float edge[3] = { es[0][i], es[1][i], es[2][i] };
+				shadePixel(tri, x + i, y, edge);
+				shaded++;
+			}
+		}
+#else
+		for (int x = minX; x <= maxX; x++)
+		{
+			float edge[3];
+			bool inside = true;
+			for (int k = 0; k < 3; k++)
+			{
+				edge[k] = tri.edgeA[k] * x + rowC[k];
+				inside = inside && (edge[k] > 0 || (edge[k] == 0 && tri.topLeft[k]));
+			}
+			if (!inside)
+				continue;
+			float z = tri.z[0] + (edge[1] * (tri.z[1] - tri.z[0]) + edge[2] * (tri.z[2] - tri.z[0])) * tri.invArea;
+			if (!(z < depthRow[x]) || z > 1.0f)
+				continue;
+			depthRow[x] = z;
+			shadePixel(tri, x, y, edge);
+			shaded++;
+		}
+#endif
+		return shaded;
+	}
+
+	// perspective correct attributes at edge values e
+	static void interpolate(const softraster_detail::Triangle& tri, const float e[3], float* attr, int count)
+	{
+		float w[3] = { e[0] * tri.invW[0], e[1] * tri.invW[1], e[2] * tri.invW[2] };
+		float sum = w[0] + w[1] + w[2];
+		float scale = (sum != 0) ? 1.0f / sum : 0.0f;
+		for (int i = 0; i < count; i++)
+			attr[i] = (w[0] * tri.attr[0][i] + w[1] * tri.attr[1][i] + w[2] * tri.attr[2][i]) * scale;
+	}
+
+	// the fragment shader
+	void shadePixel(const softraster_detail::Triangle& tri, int x, int y, const float e[3])
+	{
+		using namespace softraster_detail;
+		const Draw& d = draws[tri.draw];
+		const SoftLighting& l = *d.lighting;
+		const SoftMaterial& m = *d.material;
+		float attr[ATTRIBUTES];
+		interpolate(tri, e, attr, ATTRIBUTES);
+
+		float light[3];
+		if (l.perPixel)
+			Shade(l, m, attr, attr + 3, light);
+		else
+		{
+			light[0] = attr[0];
+			light[1] = attr[1];
+			light[2] = attr[2];
+		}
+
+		float texel[3] = { 0, 0, 0 };
+		if (m.texture && !m.texture->empty())
+		{
+			// texture coordinates one pixel to the right and below for the mip level
+			float right[3] = { e[0] + tri.edgeA[0], e[1] + tri.edgeA[1], e[2] + tri.edgeA[2] };
+			float below[3] = { e[0] + tri.edgeB[0], e[1] + tri.edgeB[1], e[2] + tri.edgeB[2] };
+			float uvRight[ATTRIBUTES], uvBelow[ATTRIBUTES];
+			interpolate(tri, right, uvRight, ATTRIBUTES);
+			interpolate(tri, below, uvBelow, ATTRIBUTES);
+			float tw = (float)m.texture->getWidth(), th = (float)m.texture->getHeight();
+			float dx = std::max(sqrtf((uvRight[6] - attr[6]) * (uvRight[6] - attr[6]) * tw * tw + (uvRight[7] - attr[7]) * (uvRight[7] - attr[7]) * th * th),
+				sqrtf((uvBelow[6] - attr[6]) * (uvBelow[6] - attr[6]) * tw * tw + (uvBelow[7] - attr[7]) * (uvBelow[7] - attr[7]) * th * th));
+			float lod = (dx > 0) ? log2f(dx) : 0.0f;
+			float u = attr[6], v = attr[7];
+			if (m.isEye)
+			{
+				u += l.offsetX;
+				v += l.offsetY;
+			}
+			m.texture->sample(u, v, lod, l.magNearest, l.minNearest, texel);
+		}
+
+		unsigned char* pixel = &color[((size_t)y * width + x) * 4];
+		for (int k = 0; k < 3; k++)
+			pixel[k] = toByte(texel[k] * light[k]);
+		pixel[3] = 255;
+	}
+
+	int width, height;
+	int viewport[4];
+	unsigned int threadCount;
+	int tilesX, tilesY;
+	std::vector<unsigned char> color;
+	std::vector<float> depth;
+	std::vector<Draw> draws;
+	std::vector<softraster_detail::Vertex> vertices;
+	std::vector<Chunk> chunks;
+	std::vector<ChunkData> chunkData;
+};
+
+#endif
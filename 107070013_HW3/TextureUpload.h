@@ -0,0 +1,529 @@
+///////////////////////////////////////////////////////////////////////////////
+// TextureUpload.h
+// ===============
+// Texture uploads spread over frames through pixel buffer objects.
+//
+// glTexImage2D from client memory copies the whole image before it returns,
+// on the thread drawing the frame. TextureUploadQueue only allocates the
+// texture and cuts the image into bands of rows, each the size of one slot
+// of a ring of pixel unpack buffers. Worker threads copy the bands into the
+// mapped slots; pump(), once per frame on the GL thread, issues
+// glTexSubImage2D from the slots written, up to a byte budget per frame, and
+// fences each slot, which is handed out again once the GPU has read it.
+// The mipmaps are generated after the last band; until then isPending() is
+// true and the app draws something else in place of the texture.
+//
+// With GL 4.4 or ARB_buffer_storage every slot is mapped once, persistent and
+// coherent. Otherwise the GL thread maps a slot before it goes to a worker
+// and unmaps it before its glTexSubImage2D.
+//
+// Include after glad and GLFW. Call everything from the thread owning the
+// context, except busy() and report().
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TEXTURE_UPLOAD_H_DEF
+#define TEXTURE_UPLOAD_H_DEF
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FrameSync.h"
+
+const int TEXTURE_UPLOAD_SLOTS = 8;
+const size_t TEXTURE_UPLOAD_SLOT_SIZE = 2 << 20;	// bytes per slot, the largest band
+const int TEXTURE_UPLOAD_MAX_WORKERS = 2;
+
+struct TextureUploadReport
+{
+	size_t textures, pending;	// queued in total, not complete yet
+	size_t budget;				// bytes per frame, 0 = none
+	size_t bytes;				// texel bytes issued
+	unsigned long long bands;	// through the slots
+	unsigned long long direct;	// textures with rows wider than a slot, uploaded at once
+	unsigned long long frames;	// frames issuing uploads
+	unsigned long long deferredFrames;	// bands were written but over the budget
+	unsigned long long slotWaits;	// frames with bands left and every slot in use
+	double issueMs, issueMaxMs;	// GL calls of pump(), mean over the frames issuing uploads and largest
+	double latencyMs, latencyMaxMs;	// from upload() to the mipmaps, mean and largest
+	bool persistent;
+	int workers;
+};
+
+class TextureUploadQueue
+{
+public:
+	// frees the pixels given to upload() once every band is copied
+	typedef void (*FreePixels)(void*);
+
+	TextureUploadQueue() : budget(8 << 20), ready(false), persistent(false), sequence(0), pendingCount(0), stopping(false), latencies(0)
+	{
+		memset(&stats, 0, sizeof(stats));
+		stats.budget = budget;
+	}
+
+	~TextureUploadQueue()
+	{
+		stopWorkers();
+	}
+
+	// texel bytes issued per frame, 0 = no limit; a frame issues at least one band
+	void setBudget(size_t bytesPerFrame)
+	{
+		budget = bytesPerFrame;
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.budget = budget;
+	}
+	size_t getBudget() const { return budget; }
+
+	// Allocate level 0 of texture as width * height GL_RGBA32F texels and queue the
+	// pixels, rows of format / type, which have to stay alive until freePixels(pixels)
+	// is called, or as long as the texture is pending when freePixels is NULL
+	void upload(GLuint texture, GLenum format, GLenum type, const void* pixels, int width, int height, FreePixels freePixels)
+	{
+		if (!ready)
+			init();
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, format, type, NULL);
+
+		std::shared_ptr<Job> job(new Job());
+		job->texture = texture;
+		job->format = format;
+		job->type = type;
+		job->pixels = (const unsigned char*)pixels;
+		job->freePixels = freePixels;
+		job->width = width;
+		job->height = height;
+		job->rowBytes = (size_t)width * texelBytes(format, type);
+		job->queued = Clock::now();
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.textures++;
+		}
+		if (job->rowBytes > TEXTURE_UPLOAD_SLOT_SIZE)
+		{
+			// no band fits a slot
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, pixels);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.direct++;
+			stats.bytes += job->rowBytes * height;
+			return;
+		}
+		job->rowsPerBand = (int)std::min((size_t)height, TEXTURE_UPLOAD_SLOT_SIZE / job->rowBytes);
+		job->bands = (height + job->rowsPerBand - 1) / job->rowsPerBand;
+		jobs.push_back(job);
+		pendingCount++;
+	}
+
+	// forget the uploads of texture, before it is deleted
+	void cancel(GLuint texture)
+	{
+		for (size_t i = 0; i < jobs.size(); )
+		{
+			if (jobs[i]->texture == texture)
+			{
+				jobs[i]->cancelled = true;
+				jobs.erase(jobs.begin() + i);
+				pendingCount--;
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	// texture is queued and not complete yet
+	bool isPending(GLuint texture) const
+	{
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			if (jobs[i]->texture == texture)
+				return true;
+		}
+		return false;
+	}
+
+	// textures are queued, frames have to be drawn for them
+	bool busy() const { return pendingCount.load() > 0; }
+
+	// once per frame before drawing, returns true if a texture was completed
+	bool pump()
+	{
+		return step(budget);
+	}
+
+	// complete every texture queued, ignoring the budget
+	void finish()
+	{
+		while (!jobs.empty())
+		{
+			step(0);
+			if (jobs.empty())
+				break;
+			// wait for the bands being copied, or for the GPU when every slot is in flight
+			bool freeSlot = false;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				bool writing = false;
+				for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+				{
+					writing = writing || slots[i].state == Slot::WRITING;
+					freeSlot = freeSlot || slots[i].state == Slot::FREE;
+				}
+				if (writing)
+				{
+					written.wait(lock);
+					continue;
+				}
+			}
+			if (!freeSlot)
+			{
+				for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+				{
+					if (slotState(i) == Slot::IN_FLIGHT)
+						retire(slots[i], true);
+				}
+			}
+		}
+	}
+
+	// stop the workers and delete the slots while the context is current
+	void release()
+	{
+		stopWorkers();
+		jobs.clear();
+		pendingCount = 0;
+		if (!ready)
+			return;
+		for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+		{
+			Slot& slot = slots[i];
+			if (slot.fence)
+				glDeleteSync(slot.fence);
+			if (slot.memory || persistent)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			glDeleteBuffers(1, &slot.buffer);
+			slot = Slot();
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		ready = false;
+	}
+
+	TextureUploadReport report()
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		TextureUploadReport r = stats;
+		r.pending = pendingCount.load();
+		r.issueMs = stats.frames ? stats.issueMs / stats.frames : 0;
+		r.latencyMs = latencies ? stats.latencyMs / latencies : 0;
+		return r;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Job
+	{
+		Job() : texture(0), format(0), type(0), pixels(NULL), freePixels(NULL), width(0), height(0), rowBytes(0), rowsPerBand(0), bands(0),
+			nextBand(0), bandsIssued(0), cancelled(false) {}
+		~Job()
+		{
+			if (freePixels)
+				freePixels((void*)pixels);
+		}
+		GLuint texture;
+		GLenum format, type;
+		const unsigned char* pixels;
+		FreePixels freePixels;
+		int width, height;
+		size_t rowBytes;
+		int rowsPerBand, bands;
+		int nextBand;		// next one handed to a worker
+		int bandsIssued;
+		std::atomic<bool> cancelled;
+		Clock::time_point queued;
+	};
+
+	struct Slot
+	{
+		enum State { FREE, WRITING, WRITTEN, IN_FLIGHT };
+		Slot() : buffer(0), memory(NULL), state(FREE), band(0), order(0), fence(0) {}
+		GLuint buffer;
+		void* memory;		// mapped, always with persistent slots
+		State state;		// WRITING -> WRITTEN by the worker, under mutex
+		std::shared_ptr<Job> job;
+		int band;
+		unsigned long long order;	// slots are issued in the order they were handed out
+		GLsync fence;
+	};
+
+	static size_t texelBytes(GLenum format, GLenum type)
+	{
+		size_t components = format == GL_RGBA ? 4 : format == GL_RGB ? 3 : format == GL_RG ? 2 : 1;
+		return components * (type == GL_FLOAT ? sizeof(GLfloat) : 1);
+	}
+
+	void init()
+	{
+		framesync_detail::BufferStorageProc bufferStorage = framesync_detail::GetBufferStorage();
+		persistent = bufferStorage != NULL;
+		for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+		{
+			Slot& slot = slots[i];
+			glGenBuffers(1, &slot.buffer);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+			if (persistent)
+			{
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				bufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_SLOT_SIZE, NULL, flags);
+				slot.memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_UPLOAD_SLOT_SIZE, flags);
+				persistent = slot.memory != NULL;
+			}
+			if (!persistent)
+			{
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_SLOT_SIZE, NULL, GL_STREAM_DRAW);
+				slot.memory = NULL;
+			}
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		int count = (int)std::max(1u, std::min(std::thread::hardware_concurrency() - 1, (unsigned int)TEXTURE_UPLOAD_MAX_WORKERS));
+		stopping = false;
+		for (int i = 0; i < count; i++)
+			workers.push_back(std::thread(&TextureUploadQueue::workerLoop, this));
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.persistent = persistent;
+		stats.workers = count;
+		ready = true;
+	}
+
+	void stopWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+		tasks.clear();
+	}
+
+	// copy the bands handed out into their slots
+	void workerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (stopping)
+				return;
+			Slot& slot = slots[tasks.front()];
+			tasks.pop_front();
+			const Job& job = *slot.job;
+			lock.unlock();
+
+			if (!job.cancelled)
+			{
+				int firstRow = slot.band * job.rowsPerBand;
+				int rows = std::min(job.rowsPerBand, job.height - firstRow);
+				memcpy(slot.memory, job.pixels + (size_t)firstRow * job.rowBytes, (size_t)rows * job.rowBytes);
+			}
+
+			lock.lock();
+			slot.state = Slot::WRITTEN;
+			written.notify_all();
+		}
+	}
+
+	// the state of slot i, which the workers write under mutex
+	Slot::State slotState(int i)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return slots[i].state;
+	}
+
+	// free the slot once the GPU read it, waiting for that with wait
+	bool retire(Slot& slot, bool wait)
+	{
+		GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+		while (wait && result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		if (result == GL_TIMEOUT_EXPIRED)
+			return false;
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		slot.job.reset();
+		slot.state = Slot::FREE;
+		return true;
+	}
+
+	// one frame of uploads with budget bytes, 0 = no limit
+	bool step(size_t budget)
+	{
+		if (!ready)
+			return false;
+		Clock::time_point start = Clock::now();
+		bool completed = false;
+		size_t issued = 0;
+		bool deferred = false, slotWait = false;
+
+		for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+		{
+			if (slotState(i) == Slot::IN_FLIGHT)
+				retire(slots[i], false);
+		}
+
+		// the bands written, oldest first
+		std::vector<int> order;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; i++)
+			{
+				if (slots[i].state == Slot::WRITTEN)
+					order.push_back(i);
+			}
+		}
+		std::sort(order.begin(), order.end(), [this](int a, int b) { return slots[a].order < slots[b].order; });
+		for (size_t k = 0; k < order.size(); k++)
+		{
+			Slot& slot = slots[order[k]];
+			Job& job = *slot.job;
+			int firstRow = slot.band * job.rowsPerBand;
+			int rows = std::min(job.rowsPerBand, job.height - firstRow);
+			size_t bytes = (size_t)rows * job.rowBytes;
+			if (!job.cancelled && budget > 0 && issued > 0 && issued + bytes > budget)
+			{
+				deferred = true;
+				break;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+			if (!persistent)
+			{
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				slot.memory = NULL;
+			}
+			if (job.cancelled)
+			{
+				slot.job.reset();
+				slot.state = Slot::FREE;
+				continue;
+			}
+			glBindTexture(GL_TEXTURE_2D, job.texture);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, firstRow, job.width, rows, job.format, job.type, (void*)0);
+			slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			slot.state = Slot::IN_FLIGHT;
+			issued += bytes;
+			if (++job.bandsIssued == job.bands)
+			{
+				glGenerateMipmap(GL_TEXTURE_2D);
+				complete(slot.job);
+				completed = true;
+			}
+		}
+
+		// bands left go to the free slots
+		for (size_t j = 0; j < jobs.size(); j++)
+		{
+			std::shared_ptr<Job>& job = jobs[j];
+			while (job->nextBand < job->bands)
+			{
+				int free = -1;
+				for (int i = 0; i < TEXTURE_UPLOAD_SLOTS && free < 0; i++)
+				{
+					if (slotState(i) == Slot::FREE)
+						free = i;
+				}
+				if (free < 0)
+				{
+					slotWait = true;
+					break;
+				}
+				Slot& slot = slots[free];
+				if (!persistent)
+				{
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+					slot.memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_UPLOAD_SLOT_SIZE,
+						GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				slot.job = job;
+				slot.band = job->nextBand++;
+				slot.order = sequence++;
+				slot.state = Slot::WRITING;
+				tasks.push_back(free);
+				wake.notify_one();
+			}
+			if (slotWait)
+				break;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		std::lock_guard<std::mutex> lock(statsMutex);
+		if (issued > 0)
+		{
+			stats.frames++;
+			stats.bytes += issued;
+			stats.issueMs += ms;
+			stats.issueMaxMs = std::max(stats.issueMaxMs, ms);
+		}
+		stats.deferredFrames += deferred ? 1 : 0;
+		stats.slotWaits += slotWait ? 1 : 0;
+		return completed;
+	}
+
+	// every band of job is issued
+	void complete(const std::shared_ptr<Job>& job)
+	{
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - job->queued).count();
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			if (jobs[i] == job)
+			{
+				jobs.erase(jobs.begin() + i);
+				pendingCount--;
+				break;
+			}
+		}
+		std::lock_guard<std::mutex> lock(statsMutex);
+		stats.bands += job->bands;
+		stats.latencyMs += ms;
+		stats.latencyMaxMs = std::max(stats.latencyMaxMs, ms);
+		latencies++;
+	}
+
+	size_t budget;
+	bool ready;
+	bool persistent;
+	Slot slots[TEXTURE_UPLOAD_SLOTS];
+	std::vector<std::shared_ptr<Job> > jobs;	// queued and not complete, oldest first
+	unsigned long long sequence;
+	std::atomic<int> pendingCount;
+
+	std::mutex mutex;					// slot states and tasks, with the workers
+	std::condition_variable wake;		// tasks for the workers
+	std::condition_variable written;	// a worker finished a band
+	std::deque<int> tasks;				// slots to copy into
+	std::vector<std::thread> workers;
+	bool stopping;
+
+	std::mutex statsMutex;				// for report() from another thread
+	TextureUploadReport stats;
+	unsigned long long latencies;
+};
+
+#endif
@@ -0,0 +1,137 @@
+///////////////////////////////////////////////////////////////////////////////
+// Transform.h
+// ===========
+// Translation / rotation / scaling of scene nodes, arranged in a parent/child
+// hierarchy. Each node caches its local (T * R * S) and world matrix, and
+// update() only rebuilds the nodes that were edited since the last frame
+// (and the children below them).
+//
+// Nodes are referenced by index and stored as structure of arrays, so a scene
+// with thousands of instances keeps each component contiguous. A parent is
+// always created before its children, so a single forward pass over the
+// arrays visits parents first.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRANSFORM_H_DEF
+#define TRANSFORM_H_DEF
+
+#include <vector>
+#include "Vectors.h"
+#include "Matrices.h"
+#include "Quaternion.h"
+
+class TransformTree
+{
+public:
+	TransformTree() : recomputed(0), totalRecomputed(0) {}
+
+	// add a node, parent = -1 for a root node
+	int create(int parent = -1)
+	{
+		int id = (int)parents.size();
+		parents.push_back((parent < id) ? parent : -1);
+		posX.push_back(0); posY.push_back(0); posZ.push_back(0);
+		rotS.push_back(1); rotX.push_back(0); rotY.push_back(0); rotZ.push_back(0);
+		scaleX.push_back(1); scaleY.push_back(1); scaleZ.push_back(1);
+		local.push_back(Matrix4());
+		world.push_back(Matrix4());
+		localDirty.push_back(1);
+		return id;
+	}
+
+	// drop every node created after the first count nodes
+	void truncate(size_t count)
+	{
+		if (count >= parents.size())
+			return;
+		parents.resize(count);
+		posX.resize(count); posY.resize(count); posZ.resize(count);
+		rotS.resize(count); rotX.resize(count); rotY.resize(count); rotZ.resize(count);
+		scaleX.resize(count); scaleY.resize(count); scaleZ.resize(count);
+		local.resize(count);
+		world.resize(count);
+		localDirty.resize(count);
+	}
+
+	void setPosition(int id, const Vector3& p) { posX[id] = p.x; posY[id] = p.y; posZ[id] = p.z; localDirty[id] = 1; }
+	void setRotation(int id, const Quaternion& q) { rotS[id] = q.s; rotX[id] = q.x; rotY[id] = q.y; rotZ[id] = q.z; localDirty[id] = 1; }
+	void setScale(int id, const Vector3& s) { scaleX[id] = s.x; scaleY[id] = s.y; scaleZ[id] = s.z; localDirty[id] = 1; }
+
+	void translate(int id, const Vector3& delta) { setPosition(id, getPosition(id) + delta); }
+	void addScale(int id, const Vector3& delta) { setScale(id, getScale(id) + delta); }
+	// apply delta after the current rotation, i.e. rotate around the parent's axes
+	void rotate(int id, const Quaternion& delta)
+	{
+		Quaternion q = delta * getRotation(id);
+		setRotation(id, q.normalize());
+	}
+
+	Vector3 getPosition(int id) const { return Vector3(posX[id], posY[id], posZ[id]); }
+	Quaternion getRotation(int id) const { return Quaternion(rotS[id], rotX[id], rotY[id], rotZ[id]); }
+	Vector3 getScale(int id) const { return Vector3(scaleX[id], scaleY[id], scaleZ[id]); }
+	int getParent(int id) const { return parents[id]; }
+
+	// cached matrices, valid after update()
+	const Matrix4& getLocalMatrix(int id) const { return local[id]; }
+	const Matrix4& getWorldMatrix(int id) const { return world[id]; }
+
+	// rebuild dirty local matrices and the world matrices depending on them
+	void update()
+	{
+		recomputed = 0;
+		worldChanged.assign(parents.size(), 0);
+		for (size_t i = 0; i < parents.size(); i++)
+		{
+			int parent = parents[i];
+			if (localDirty[i])
+			{
+				local[i] = compose(i);
+				localDirty[i] = 0;
+				worldChanged[i] = 1;
+			}
+			if (parent >= 0 && worldChanged[parent])
+			{
+				worldChanged[i] = 1;
+			}
+			if (worldChanged[i])
+			{
+				world[i] = (parent >= 0) ? world[parent] * local[i] : local[i];
+				recomputed++;
+			}
+		}
+		totalRecomputed += recomputed;
+	}
+
+	size_t size() const { return parents.size(); }
+	// number of nodes rebuilt by the last update()
+	unsigned int getRecomputeCount() const { return recomputed; }
+	unsigned long long getTotalRecomputeCount() const { return totalRecomputed; }
+
+private:
+	// T * R * S without the two full 4x4 multiplications
+	Matrix4 compose(size_t i) const
+	{
+		Matrix4 r = Quaternion(rotS[i], rotX[i], rotY[i], rotZ[i]).getMatrix();
+		return Matrix4(
+			r[0] * scaleX[i], r[1] * scaleY[i], r[2] * scaleZ[i], posX[i],
+			r[4] * scaleX[i], r[5] * scaleY[i], r[6] * scaleZ[i], posY[i],
+			r[8] * scaleX[i], r[9] * scaleY[i], r[10] * scaleZ[i], posZ[i],
+			0.0f, 0.0f, 0.0f, 1.0f
+		);
+	}
+
+	std::vector<int> parents;
+	std::vector<float> posX, posY, posZ;
+	std::vector<float> rotS, rotX, rotY, rotZ;
+	std::vector<float> scaleX, scaleY, scaleZ;
+
+	std::vector<Matrix4> local;
+	std::vector<Matrix4> world;
+	std::vector<char> localDirty;
+	std::vector<char> worldChanged;
+
+	unsigned int recomputed;
+	unsigned long long totalRecomputed;
+};
+
+#endif
@@ -2,6 +2,11 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
 #include<math.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -12,8 +17,33 @@
 
 #include "Vectors.h"
 #include "Matrices.h"
+#include "Quaternion.h"
+#include "Transform.h"
+#include "Scene.h"
+#include "Culling.h"
+#include "Bvh.h"
+#include "SoftRasterizer.h"
+#include "PathTracer.h"
+#include "ImageWriter.h"
+#include "InputQueue.h"
+#include "FramePacing.h"
+#include "FrameExchange.h"
+#include "FrameSync.h"
+#include "GpuResources.h"
+#include "TextureUpload.h"
+#include "FrameCapture.h"
+#include "AssetLoader.h"
+#include "SceneManifest.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
+#include "ObjMesh.h"
+#include "ObjMeshParallel.h"
+#include "MeshOptimizer.h"
+#include "MeshNormals.h"
+#include "LoaderBenchmark.h"
+#include "NormalsBenchmark.h"
+#include "ImageBenchmark.h"
+#include "BvhBenchmark.h"
 
 #ifndef max
 # define max(a,b) (((a)>(b))?(a):(b))
@@ -35,6 +65,26 @@ bool mouse_pressed = false;
 int starting_press_x = -1;
 int starting_press_y = -1;
 
+// input events of the GLFW callbacks, applied once per frame by ProcessInput()
+struct input_setting
+{
+	InputQueue queue;
+	vector<InputEvent> events;	// of the frame being processed
+	int dirty = 0;				// DirtyFlag bits not applied yet
+	int changed = 0;			// DirtyFlag bits applied since the last frame was shown
+	double changeTime = -1;		// callback time of the first event changing the frame being drawn
+	float dragX = 0, dragY = 0;	// cursor movement not applied yet
+	unsigned long long eventCount = 0, cursorEvents = 0, scrollEvents = 0;
+	unsigned long long viewRequests = 0;	// view matrix rebuilds the events asked for
+	unsigned long long viewRebuilds = 0;
+	LatencyStats latency;		// input to swap of the frame showing it
+};
+input_setting input;
+
+// frames are drawn when the input changed something or the stress test runs,
+// or continuously with --continuous / V
+FramePacer pacer;
+
 enum TransMode
 {
 	GeoTranslation = 0,
@@ -49,6 +99,7 @@ enum TransMode
 
 
 vector<string> filenames; // .obj filename list
+GpuResources gpuResources; // owns the GL objects of the models and the program, --vram-budget
 
 typedef struct _Offset {
 	GLfloat x;
@@ -65,41 +116,115 @@ typedef struct
 	Vector3 Kd;
 	Vector3 Ks;
 
-	GLuint diffuseTexture;
+	GLuint diffuseTexture;	// owned by model::textures
 
 	// eye texture coordinate 
 	GLuint isEye;
 	vector<Offset> offsets;
 
+	int softTexture;	// in soft_textures, -1 if the image did not load
+
 } PhongMaterial;
 
 typedef struct
 {
-	GLuint vao;
-	GLuint vbo;
-	GLuint vboTex;
-	GLuint ebo;
-	GLuint p_color;
+	GpuHandle vao;
+	GpuHandle vbo;
+	GpuHandle ebo;
+	GpuHandle p_color;
 	int vertex_count;
-	GLuint p_normal;
-	GLuint p_texCoord;
+	GpuHandle p_normal;
+	GpuHandle p_texCoord;
 	PhongMaterial material;
+	int materialIndex;	// in model::textures
+	vector<GLfloat> colors;	// with soft, the buffers above, see KeepShapeCopies()
 	int indexCount;
+	Bounds bounds;	// model space
+	bool culled;	// no drawn instance sees the shape this frame
+	SoftMesh soft;	// the buffers above for the CPU rasterizer
 } Shape;
 
 struct model
 {
-	Vector3 position = Vector3(0, 0, 0);
-	Vector3 scale = Vector3(1, 1, 1);
-	Vector3 rotation = Vector3(0, 0, 0);	// Euler form
+	int transform = -1;	// node in transforms
+	int instance = -1;	// instance of this model in scene
+	GpuHandle instanceVbo;	// per-instance model matrices
+	vector<int> drawnTransforms;	// instances inside the view frustum, as in instanceVbo
+	bool drawnChanged = true;
+	unsigned long long matricesVersion = 0;	// bumped when drawnTransforms or their matrices change
+	unsigned long long uploadedVersion = 0;	// in instanceVbo, touched only by the thread drawing
+	GLuint boundInstanceBuffer = 0;	// the shape VAOs read the matrices from here
+	size_t boundInstanceOffset = 0;
 
 	vector<Shape> shapes;
+	vector<GpuHandle> textures;	// by material
+	bool loaded = true;	// false until AdoptModel() takes in the shapes
+	bool resident = true;	// shapes and textures are on the GPU, see EvictModel()
+	bool firstUpload = false;	// not resident because it was loaded on first use, not evicted
+	Bounds bounds;	// of all shapes
+	MeshBvh bvh;		// over the drawn triangles of the model, id = face in the obj file
+	vector<int> faceShapes;	// shape of every face, -1 if it is not drawn
 
 	bool hasEye;
 	GLint max_eye_offset = 7;
 	GLint cur_eye_offset_idx = 0;
 };
 vector<model> models;
+TransformTree transforms;
+Scene scene;
+
+// stress test: ramp the number of instances and report frame rate
+struct stress_setting
+{
+	bool enabled = false;
+	int instanceCount = 0;
+	int maxInstanceCount = 65536;
+	int framesPerStep = 120;
+	int frame = 0;
+	size_t baseTransformCount = 0;
+	size_t baseInstanceCount = 0;
+	double stepStartTime = 0;
+	double submitTime = 0;
+	double updateTime = 0;
+};
+stress_setting stress;
+
+// view frustum culling, counts of the last frame
+struct cull_setting
+{
+	bool enabled = true;
+	SphereBatch spheres;	// instances of one model
+	vector<char> visible;
+	vector<int> drawn;
+	int drawnInstances = 0, culledInstances = 0;
+	int drawnShapes = 0, culledShapes = 0;	// instanced draw calls issued / skipped
+	double cullTime = 0;
+	char title[256] = "";
+};
+cull_setting culling;
+
+// mouse picking against the drawn instances, the top level BVH is rebuilt on the
+// first pick after they moved
+struct pick_setting
+{
+	SceneBvh bvh;
+	vector<BvhInstance> instances;
+	vector<int> instanceModels;	// by BvhInstance::id
+	vector<int> instanceTransforms;
+	int drawnVersion = 0;	// bumped when the drawn instances change
+	int builtVersion = -1;
+	unsigned long long builtRecomputeCount = 0;
+	double buildTime = 0;
+	double pickTime = 0;
+	int dragTransform = -1;	// picked instance, moved by the mouse until release
+};
+pick_setting picking;
+
+struct pick_result
+{
+	int model, shape, triangle, transform;	// -1 for a miss
+	Vector3 point;	// world space
+};
 
 struct camera
 {
@@ -176,7 +301,6 @@ Shape m_shpae;
 
 int cur_idx = 0; // represent which model should be rendered now
 int cur_light_id = 0; //0:directional,1:point,2:spot
-int per_vertex = 0; //per-vertex shading
 float shininess = 64.0f;
 float spot_cutoff = 30;
 float offset_x = 0;
@@ -184,17 +308,90 @@ float offset_y = 0;
 
 bool mag = 1; //magnification texture filtering mode(1:nearest, 0:linear)
 bool mini = 1; //minification texture filtering mode(1:nearest, 0:linear_mipmap_linear)
+LoadArena loadArena; // temporaries of the model being loaded
 vector<string> model_list{ "../TextureModels/Fushigidane.obj", "../TextureModels/Mew.obj","../TextureModels/Nyarth.obj","../TextureModels/Zenigame.obj", "../TextureModels/laurana500.obj", "../TextureModels/Nala.obj", "../TextureModels/Square.obj" };
 
 GLuint program;
+GpuHandle programObject;	// owns program
+TextureUploadQueue textureUploads;	// textures streamed in over the frames, --upload-budget
+GpuHandle placeholderTexture;	// 1x1 white, drawn while a texture is pending in textureUploads
+
+// W or --capture records the frames drawn
+struct capture_setting
+{
+	string prefix = "capture";	// --capture <prefix>: <prefix>_000000.png ... or <prefix>.y4m
+	CaptureFormat format = CAPTURE_PNG;	// --capture-format png|qoi|y4m
+	int fps = 60;	// --capture-fps, for the y4m header
+	bool synchronous = false;	// --capture-sync reads with a plain glReadPixels, to compare with
+	atomic<bool> toggle{ false };	// start or stop, taken by the thread drawing
+	int recordings = 0;	// the ones after the first get _2, _3, ... after the prefix
+};
+capture_setting capture;
+FrameCapture frameCapture;
 
 
 // uniforms location
 GLuint iLocP;
 GLuint iLocV;
-GLuint iLocM;
 
 GLuint iLocTex;
+
+// CPU rendering backend (--soft-render), the loaders skip GL calls when it runs without a context
+bool gl_enabled = true;
+vector<SoftTexture> soft_textures;
+
+// An image decoded on a loader thread; rgba is freed once it is uploaded or not needed
+struct texture_asset
+{
+	SoftTexture soft;	// moved into soft_textures by the first model using it
+	stbi_uc* rgba = NULL;
+	int width = 0, height = 0;
+	int softIndex = -1;	// in soft_textures, set on the main thread
+	~texture_asset()
+	{
+		if (rgba)
+			stbi_image_free(rgba);
+	}
+};
+
+// A model read and prepared on the CPU, without GL objects or a place in the scene
+struct model_asset
+{
+	model data;
+	vector<shared_ptr<texture_asset> > textures;	// by material, NULL if the image did not load
+	vector<string> texturePaths;	// by material, for the report of the images which did not load
+};
+
+// --scene <manifest.json>: the models of a manifest are loaded once an instance of them
+// is shown, on the loader threads, and taken in by the main thread (ResolveSceneAssets)
+struct scene_asset_setting
+{
+	bool lazy = false;	// --scene without --scene-eager
+	SceneManifest manifest;
+	AssetLoader<model_asset> meshes;	// by mesh name, or by file without a manifest
+	AssetLoader<texture_asset> textures;	// by file
+	vector<AssetLoader<model_asset>::Future> pending;	// by model, valid from the request until taken in
+	vector<double> requestTime;
+	int waiting = 0;	// requested, not taken in yet
+	mutex modelsMutex;	// held by the render thread while drawing and while a model is taken in
+};
+scene_asset_setting sceneAssets;
+
+// time to the first frame, since the app started
+struct startup_setting
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	double manifestMs = -1;	// --scene parsed
+	double firstFrameMs = -1;	// first frame swapped
+	double sceneMs = -1;	// the models requested by the first frames are taken in
+	atomic<bool> firstFrame{ false };
+};
+startup_setting startup;
+
+double StartupMs()
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - startup.start).count();
+}
 //GLuint iLocTexEye;
 
 static GLvoid Normalize(GLfloat v[3])
@@ -229,67 +426,6 @@ Matrix4 translate(Vector3 vec)
 	return mat;
 }
 
-Matrix4 scaling(Vector3 vec)
-{
-	Matrix4 mat;
-
-	mat = Matrix4(
-		vec.x, 0.0f, 0.0f, 0.0f,
-		0.0f, vec.y, 0.0f, 0.0f,
-		0.0f, 0.0f, vec.z, 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f
-	);
-
-	return mat;
-}
-
-Matrix4 rotateX(GLfloat val)
-{
-	Matrix4 mat;
-
-	mat = Matrix4(
-		1.0f, 0.0f, 0.0f, 0.0f,
-		0.0f, cosf(val), -sinf(val), 0.0f,
-		0.0f, sinf(val), cosf(val), 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f
-	);
-
-	return mat;
-}
-
-Matrix4 rotateY(GLfloat val)
-{
-	Matrix4 mat;
-
-	mat = Matrix4(
-		cosf(val), 0.0f, sinf(val), 0.0f,
-		0.0f, 1.0f, 0.0f, 0.0f,
-		-sinf(val), 0.0f, cosf(val), 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f
-	);
-
-	return mat;
-}
-
-Matrix4 rotateZ(GLfloat val)
-{
-	Matrix4 mat;
-
-	mat = Matrix4(
-		cosf(val), -sinf(val), 0.0f, 0.0f,
-		sinf(val), cosf(val), 0.0f, 0.0f,
-		0.0f, 0.0f, 1.0f, 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f
-	);
-
-	return mat;
-}
-
-Matrix4 rotate(Vector3 vec)
-{
-	return rotateX(vec.x)*rotateY(vec.y)*rotateZ(vec.z);
-}
-
 void setViewingMatrix()
 {
 	float F[3] = { main_camera.position.x - main_camera.center.x, main_camera.position.y - main_camera.center.y, main_camera.position.z - main_camera.center.z };
@@ -379,6 +515,14 @@ void ChangeSize(GLFWwindow* window, int width, int height)
 
 	screenWidth = width;
 	screenHeight = height;
+	pacer.requestFrame();
+}
+
+// Call back function for an exposed or damaged window, its contents have to be drawn
+// again even when nothing changed
+void RefreshWindow(GLFWwindow* window)
+{
+	pacer.requestFrame();
 }
 
 void Vector3ToFloat4(Vector3 v, GLfloat res[4])
@@ -389,92 +533,456 @@ void Vector3ToFloat4(Vector3 v, GLfloat res[4])
 	res[3] = 1;
 }
 
-// Render function for display rendering
-void RenderScene(int per_vertex_or_per_pixel) {	
-	Vector3 modelPos = models[cur_idx].position;
+// Keep the instances and shapes which touch the view frustum, runs before RenderScene draws
+void CullScene()
+{
+	double start = glfwGetTime();
+	Frustum frustum = ExtractFrustum(project_matrix * view_matrix);
+	culling.drawnInstances = culling.culledInstances = 0;
+	culling.drawnShapes = culling.culledShapes = 0;
 
-	Matrix4 T, R, S;
-	T = translate(models[cur_idx].position);
-	R = rotate(models[cur_idx].rotation);
-	S = scaling(models[cur_idx].scale);
+	for (int m = 0; m < models.size(); m++)
+	{
+		// instances: bounding spheres, four at a time; models still loading have none to draw
+		static const vector<int> loading;
+		const vector<int>& batch = models[m].loaded ? scene.getBatchTransforms(m, models.size()) : loading;
+		culling.drawn.clear();
+		if (culling.enabled)
+		{
+			culling.spheres.clear();
+			for (int i = 0; i < batch.size(); i++)
+			{
+				culling.spheres.add(models[m].bounds, transforms.getWorldMatrix(batch[i]));
+			}
+			culling.spheres.cull(frustum, &culling.visible);
+			for (int i = 0; i < batch.size(); i++)
+			{
+				if (culling.visible[i])
+					culling.drawn.push_back(batch[i]);
+			}
+		}
+		else
+		{
+			culling.drawn = batch;
+		}
+		if (culling.drawn != models[m].drawnTransforms)
+		{
+			models[m].drawnTransforms.swap(culling.drawn);
+			models[m].drawnChanged = true;
+			picking.drawnVersion++;
+		}
+		const vector<int>& drawn = models[m].drawnTransforms;
+		culling.drawnInstances += (int)drawn.size();
+		culling.culledInstances += (int)(batch.size() - drawn.size());
 
-	// render object
-	Matrix4 model_matrix = T * R * S;
-	glUniformMatrix4fv(iLocM, 1, GL_FALSE, model_matrix.getTranspose());
-	glUniformMatrix4fv(iLocV, 1, GL_FALSE, view_matrix.getTranspose());
-	glUniformMatrix4fv(iLocP, 1, GL_FALSE, project_matrix.getTranspose());
+		// shapes: boxes, skipped when no drawn instance sees them
+		for (int i = 0; i < models[m].shapes.size(); i++)
+		{
+			Shape& shape = models[m].shapes[i];
+			shape.culled = true;
+			for (int t = 0; t < drawn.size() && shape.culled; t++)
+			{
+				if (!culling.enabled || BoxInFrustum(frustum, shape.bounds, transforms.getWorldMatrix(drawn[t])))
+					shape.culled = false;
+			}
+			if (batch.empty())
+				continue;
+			if (shape.culled)
+				culling.culledShapes++;
+			else
+				culling.drawnShapes++;
+		}
+	}
+	culling.cullTime = glfwGetTime() - start;
+}
 
-	glUniform3f(uniform.iLocI_d, I_d.x, I_d.y, I_d.z);
-	glUniform3f(uniform.iLocI_p, I_p.x, I_p.y, I_p.z);
-	glUniform3f(uniform.iLocI_s, I_s.x, I_s.y, I_s.z);
+// Show the culling counts of the frame in the window title when they change
+void ShowCullingStats(GLFWwindow* window)
+{
+	char title[256];
+	snprintf(title, sizeof(title), "107070013 HW3 | shapes: %d drawn, %d culled | instances: %d drawn, %d culled%s", culling.drawnShapes, culling.culledShapes,
+		culling.drawnInstances, culling.culledInstances, culling.enabled ? "" : " | culling off");
+	if (strcmp(title, culling.title) != 0)
+	{
+		glfwSetWindowTitle(window, title);
+		memcpy(culling.title, title, sizeof(title));
+	}
+}
 
-	glUniform3f(uniform.iLocPos_d, lightPos_d.x, lightPos_d.y, lightPos_d.z);
-	glUniform3f(uniform.iLocPos_p, lightPos_p.x, lightPos_p.y, lightPos_p.z);
-	glUniform3f(uniform.iLocPos_s, lightPos_s.x, lightPos_s.y, lightPos_s.z);
+// Drawn instances of one model in a frame_snapshot
+struct snapshot_batch
+{
+	unsigned long long version = 0;	// matricesVersion of the model the matrices were gathered at
+	int instanceCount = 0;
+	vector<GLfloat> matrices;	// column-major mat4 per drawn instance
+	vector<int> shapes;			// not culled
+};
 
-	glUniform1f(uniform.iLocShininess, shininess);
-	glUniform1i(uniform.iLocLight_id, cur_light_id);
-	glUniform1f(uniform.iLocSpot_cutoff, spot_cutoff);
+// Everything RenderScene() reads, so a frame can be drawn while the next one is updated
+struct frame_snapshot
+{
+	GLfloat view[16], projection[16];	// transposed, as glUniformMatrix4fv takes them
+	Vector3 I_d, I_p, I_s;
+	Vector3 lightPos_d, lightPos_p, lightPos_s;
+	float shininess = 0, spot_cutoff = 0;
+	int light_id = 0;
+	float offset_x = 0, offset_y = 0;
+	bool mag = true, mini = true;
+	int width = 0, height = 0;
+	vector<snapshot_batch> batches;	// by model
+	double publishTime = 0;
+	double changeTime = -1;	// of the first input event the frame shows, -1 if none
+};
+frame_snapshot mainFrame;	// drawn on the main thread without --render-thread
 
-	//glUniform1i(iLocTexEye, 1);
+// --render-thread: the main thread takes the input and updates the scene, the render
+// thread owns the GL context and draws the latest snapshot the main thread published
+struct render_thread_setting
+{
+	bool enabled = false;
+	TripleBuffer<frame_snapshot> frames;
+	ThreadActivity activity;
+	mutex wakeMutex;	// only for sleeping on wake, the snapshots do not need it
+	condition_variable wake;
+	atomic<bool> running{ true };
+};
+render_thread_setting renderThread;
 
-	if(!per_vertex_or_per_pixel)
+// Copy the state of the frame into snapshot, after CullScene(). The matrices of a model
+// are gathered only when they changed since the snapshot last held them.
+void CaptureFrame(frame_snapshot* snapshot)
+{
+	memcpy(snapshot->view, view_matrix.getTranspose(), sizeof(snapshot->view));
+	memcpy(snapshot->projection, project_matrix.getTranspose(), sizeof(snapshot->projection));
+	snapshot->I_d = I_d;
+	snapshot->I_p = I_p;
+	snapshot->I_s = I_s;
+	snapshot->lightPos_d = lightPos_d;
+	snapshot->lightPos_p = lightPos_p;
+	snapshot->lightPos_s = lightPos_s;
+	snapshot->shininess = shininess;
+	snapshot->spot_cutoff = spot_cutoff;
+	snapshot->light_id = cur_light_id;
+	snapshot->offset_x = offset_x;
+	snapshot->offset_y = offset_y;
+	snapshot->mag = mag;
+	snapshot->mini = mini;
+	snapshot->width = screenWidth;
+	snapshot->height = screenHeight;
+	snapshot->changeTime = input.changed ? input.changeTime : -1;
+
+	bool transformsChanged = transforms.getRecomputeCount() != 0;
+	snapshot->batches.resize(models.size());
+	for (int m = 0; m < models.size(); m++)
 	{
-		for (int i = 0; i < models[cur_idx].shapes.size(); i++)
+		if (models[m].drawnChanged || transformsChanged)
+		{
+			models[m].matricesVersion++;
+			models[m].drawnChanged = false;
+		}
+		snapshot_batch& batch = snapshot->batches[m];
+		batch.instanceCount = (int)models[m].drawnTransforms.size();
+		if (batch.version != models[m].matricesVersion)
+		{
+			Scene::gatherMatrices(transforms, models[m].drawnTransforms, batch.matrices);
+			batch.version = models[m].matricesVersion;
+		}
+		batch.shapes.clear();
+		for (int i = 0; i < models[m].shapes.size(); i++)
 		{
-			per_vertex = 1;
-			glUniform1i(uniform.iLocper_vertex, per_vertex);
-			glUniform1ui(uniform.iLocIsEye, models[cur_idx].shapes[i].material.isEye);
-			glUniform1f(uniform.iLocOffset_x, offset_x);
-			glUniform1f(uniform.iLocOffset_y, offset_y);
-			glBindVertexArray(models[cur_idx].shapes[i].vao);
+			if (!models[m].shapes[i].culled)
+				batch.shapes.push_back(i);
+		}
+	}
+}
 
-			// [TODO] Bind texture and modify texture filtering & wrapping mode
-			// Hint: glActiveTexture, glBindTexture, glTexParameteri
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, models[cur_idx].shapes[i].material.diffuseTexture);
+// Point the mat4 at locations 4-7 of every shape VAO of the model to buffer at offset
+void BindInstanceBuffer(model& m, GLuint buffer, size_t offset)
+{
+	if (m.boundInstanceBuffer == buffer && m.boundInstanceOffset == offset)
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	for (int i = 0; i < m.shapes.size(); i++)
+	{
+		glBindVertexArray(m.shapes[i].vao.get());
+		for (int column = 0; column < 4; column++)
+		{
+			glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(GLfloat), (void*)(offset + column * 4 * sizeof(GLfloat)));
+			glEnableVertexAttribArray(4 + column);
+			glVertexAttribDivisor(4 + column, 1);
+		}
+	}
+	glBindVertexArray(0);
+	m.boundInstanceBuffer = buffer;
+	m.boundInstanceOffset = offset;
+}
 
-			if (mag)
-			{
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			}
-			else
-			{
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			}
+// Refill the instance buffer of every model whose matrices in the snapshot are newer
+void UploadInstanceBuffers(const frame_snapshot& frame)
+{
+	for (int m = 0; m < frame.batches.size(); m++)
+	{
+		const snapshot_batch& batch = frame.batches[m];
+		BindInstanceBuffer(models[m], models[m].instanceVbo.get(), 0);
+		if (batch.version == models[m].uploadedVersion)
+			continue;
+		GpuBufferData(GL_ARRAY_BUFFER, models[m].instanceVbo, batch.matrices.size() * sizeof(GLfloat),
+			batch.matrices.empty() ? NULL : &batch.matrices[0], GL_STREAM_DRAW);
+		models[m].uploadedVersion = batch.version;
+	}
+}
 
-			if (mini)
-			{
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
-			}
-			else
+FrameSync frameSync;	// caps the frames queued by the loop drawing, --frames-in-flight
+FrameRing instanceRing;	// instance matrices, one segment per frame in flight
+
+void UpdateResidency(const frame_snapshot& frame);
+
+// Instance matrices of the frame: into its segment of instanceRing while frames in
+// flight are capped, into the buffers of the models otherwise
+void UploadFrameInstances(const frame_snapshot& frame, int slot)
+{
+	UpdateResidency(frame);
+	textureUploads.pump();
+	if (slot < 0)
+	{
+		UploadInstanceBuffers(frame);
+		return;
+	}
+	size_t size = 0;
+	for (int m = 0; m < frame.batches.size(); m++)
+	{
+		size += frame.batches[m].matrices.size() * sizeof(GLfloat);
+	}
+	// also before the first frame with instances, when models are still loading
+	if (size > instanceRing.getSegmentSize() || !instanceRing.getBuffer())
+	{
+		// the frames in flight still read the buffer being replaced
+		frameSync.drain();
+		instanceRing.reserve(size, MAX_FRAMES_IN_FLIGHT);
+		printf("Instance ring: %d x %.1f KB, %s\n", MAX_FRAMES_IN_FLIGHT, instanceRing.getSegmentSize() / 1024.0,
+			instanceRing.isPersistent() ? "persistently mapped" : "mapped every frame");
+	}
+
+	char* segment = (char*)instanceRing.map(slot);
+	if (!segment)
+		return;
+	size_t offset = 0;
+	for (int m = 0; m < frame.batches.size(); m++)
+	{
+		const snapshot_batch& batch = frame.batches[m];
+		size_t bytes = batch.matrices.size() * sizeof(GLfloat);
+		if (bytes)
+			memcpy(segment + offset, &batch.matrices[0], bytes);
+		BindInstanceBuffer(models[m], instanceRing.getBuffer(), instanceRing.getOffset(slot) + offset);
+		models[m].uploadedVersion = 0;	// instanceVbo is stale from now on
+		offset += bytes;
+	}
+	instanceRing.unmap();
+}
+
+// Top level BVH over the drawn instances, rebuilt only when they changed since the last pick
+void UpdatePickBvh()
+{
+	if (picking.builtVersion == picking.drawnVersion && picking.builtRecomputeCount == transforms.getTotalRecomputeCount())
+		return;
+	double start = glfwGetTime();
+	picking.instances.clear();
+	picking.instanceModels.clear();
+	picking.instanceTransforms.clear();
+	for (int m = 0; m < models.size(); m++)
+	{
+		const vector<int>& drawn = models[m].drawnTransforms;
+		for (int i = 0; i < drawn.size(); i++)
+		{
+			if (drawn[i] >= transforms.size())
+				continue;
+			BvhInstance instance = { &models[m].bvh, transforms.getWorldMatrix(drawn[i]), (int)picking.instances.size() };
+			picking.instances.push_back(instance);
+			picking.instanceModels.push_back(m);
+			picking.instanceTransforms.push_back(drawn[i]);
+		}
+	}
+	picking.bvh.build(picking.instances);
+	picking.builtVersion = picking.drawnVersion;
+	picking.builtRecomputeCount = transforms.getTotalRecomputeCount();
+	picking.buildTime = glfwGetTime() - start;
+}
+
+// World space ray under the cursor, both viewports show the same scene
+void CursorRay(GLFWwindow* window, double xpos, double ypos, float origin[3], float direction[3])
+{
+	int width, height;
+	glfwGetWindowSize(window, &width, &height);
+	float halfWidth = max(width / 2, 1);
+	float x = (float)fmod(xpos, (double)halfWidth);
+	float ndcX = x / halfWidth * 2.0f - 1.0f;
+	float ndcY = 1.0f - (float)ypos / max(height, 1) * 2.0f;
+	ScreenRay(project_matrix * view_matrix, ndcX, ndcY, origin, direction);
+}
+
+// Closest drawn triangle along the ray, up to the far plane at t = 1
+pick_result Pick(const float origin[3], const float direction[3])
+{
+	pick_result result = { -1, -1, -1, -1, Vector3(0, 0, 0) };
+	RayHit hit;
+	if (picking.bvh.intersect(origin, direction, 1.0f, &hit))
+	{
+		result.model = picking.instanceModels[hit.instance];
+		result.transform = picking.instanceTransforms[hit.instance];
+		result.shape = models[result.model].faceShapes[hit.triangle];
+		result.triangle = hit.triangle;
+		result.point = Vector3(origin[0] + direction[0] * hit.t, origin[1] + direction[1] * hit.t, origin[2] + direction[2] * hit.t);
+	}
+	return result;
+}
+
+// Pick on mouse press, a hit instance is the one moved by the following drag
+void PickUnderCursor(GLFWwindow* window)
+{
+	double xpos, ypos;
+	glfwGetCursorPos(window, &xpos, &ypos);
+	double start = glfwGetTime();
+	UpdatePickBvh();
+	float origin[3], direction[3];
+	CursorRay(window, xpos, ypos, origin, direction);
+	pick_result result = Pick(origin, direction);
+	picking.pickTime = glfwGetTime() - start;
+
+	if (result.model >= 0)
+	{
+		printf("Pick: model %d (%s), shape %d, triangle %d, instance transform %d, at ( %f , %f , %f ), %.3f ms\n", result.model,
+			model_list[result.model].c_str(), result.shape, result.triangle, result.transform, result.point.x, result.point.y, result.point.z,
+			picking.pickTime * 1000.0);
+	}
+	else
+	{
+		printf("Pick: nothing, %.3f ms\n", picking.pickTime * 1000.0);
+	}
+	picking.dragTransform = result.transform;
+}
+
+// Transform moved by mouse drags: the picked instance, otherwise the current model
+int DragTransform()
+{
+	if (picking.dragTransform >= 0 && picking.dragTransform < transforms.size())
+		return picking.dragTransform;
+	return models[cur_idx].transform;
+}
+
+// Pick latency over random cursor positions, checked against testing every drawn instance
+void RunPickBenchmark(GLFWwindow* window)
+{
+	const int pickCount = 10000;
+	picking.builtVersion = -1;
+	UpdatePickBvh();
+
+	vector<Matrix4> inverses(picking.instances.size());
+	for (int i = 0; i < picking.instances.size(); i++)
+	{
+		inverses[i] = picking.instances[i].world;
+		inverses[i].invertAffine();
+	}
+
+	int width, height;
+	glfwGetWindowSize(window, &width, &height);
+	mt19937 random(42);
+	uniform_real_distribution<double> randomX(0, width), randomY(0, height);
+	vector<double> times(pickCount);
+	double scanTime = 0;
+	int hits = 0, differences = 0;
+	for (int i = 0; i < pickCount; i++)
+	{
+		double xpos = randomX(random), ypos = randomY(random);
+		double start = glfwGetTime();
+		float origin[3], direction[3];
+		CursorRay(window, xpos, ypos, origin, direction);
+		pick_result result = Pick(origin, direction);
+		times[i] = glfwGetTime() - start;
+		hits += (result.model >= 0) ? 1 : 0;
+
+		// every instance with its own bottom level
+		start = glfwGetTime();
+		float closest = 1.0f;
+		int scanTransform = -1;
+		for (int n = 0; n < picking.instances.size(); n++)
+		{
+			float localOrigin[3], localDirection[3];
+			bvh_detail::TransformPoint(inverses[n], origin, localOrigin);
+			bvh_detail::TransformVector(inverses[n], direction, localDirection);
+			RayHit hit;
+			if (picking.instances[n].mesh->intersect(localOrigin, localDirection, closest, &hit))
 			{
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+				closest = hit.t;
+				scanTransform = picking.instanceTransforms[n];
 			}
-			glDrawArrays(GL_TRIANGLES, 0, models[cur_idx].shapes[i].vertex_count);
-			glUniform3fv(uniform.iLocKa, 1, &(models[cur_idx].shapes[i].material.Ka[0]));
-			glUniform3fv(uniform.iLocKd, 1, &(models[cur_idx].shapes[i].material.Kd[0]));
-			glUniform3fv(uniform.iLocKs, 1, &(models[cur_idx].shapes[i].material.Ks[0]));
 		}
+		scanTime += glfwGetTime() - start;
+		differences += (scanTransform != result.transform) ? 1 : 0;
 	}
-	
-	if (per_vertex_or_per_pixel)
+
+	double total = 0;
+	for (int i = 0; i < pickCount; i++)
+	{
+		total += times[i];
+	}
+	sort(times.begin(), times.end());
+	printf("Pick benchmark: %d random cursor positions, %d drawn instances, top level build %.3f ms\n", pickCount,
+		(int)picking.instances.size(), picking.buildTime * 1000.0);
+	printf("  BVH:  mean %.4f ms, median %.4f ms, 99%% %.4f ms, max %.4f ms, %.1f%% hit\n", total * 1000.0 / pickCount,
+		times[pickCount / 2] * 1000.0, times[pickCount * 99 / 100] * 1000.0, times[pickCount - 1] * 1000.0, hits * 100.0 / pickCount);
+	printf("  scan: mean %.4f ms testing every instance, %d picks differ\n", scanTime * 1000.0 / pickCount, differences);
+}
+
+// Render function for display rendering
+void RenderScene(const frame_snapshot& frame, int per_vertex_or_per_pixel) {	
+	glUniformMatrix4fv(iLocV, 1, GL_FALSE, frame.view);
+	glUniformMatrix4fv(iLocP, 1, GL_FALSE, frame.projection);
+
+	glUniform3f(uniform.iLocI_d, frame.I_d.x, frame.I_d.y, frame.I_d.z);
+	glUniform3f(uniform.iLocI_p, frame.I_p.x, frame.I_p.y, frame.I_p.z);
+	glUniform3f(uniform.iLocI_s, frame.I_s.x, frame.I_s.y, frame.I_s.z);
+
+	glUniform3f(uniform.iLocPos_d, frame.lightPos_d.x, frame.lightPos_d.y, frame.lightPos_d.z);
+	glUniform3f(uniform.iLocPos_p, frame.lightPos_p.x, frame.lightPos_p.y, frame.lightPos_p.z);
+	glUniform3f(uniform.iLocPos_s, frame.lightPos_s.x, frame.lightPos_s.y, frame.lightPos_s.z);
+
+	glUniform1f(uniform.iLocShininess, frame.shininess);
+	glUniform1i(uniform.iLocLight_id, frame.light_id);
+	glUniform1f(uniform.iLocSpot_cutoff, frame.spot_cutoff);
+
+	//glUniform1i(iLocTexEye, 1);
+
+	glUniform1i(uniform.iLocper_vertex, per_vertex_or_per_pixel ? 0 : 1);
+	glUniform1f(uniform.iLocOffset_x, frame.offset_x);
+	glUniform1f(uniform.iLocOffset_y, frame.offset_y);
+
+	// one instanced draw per shape of every model that has instances in the view frustum
+	for (int m = 0; m < frame.batches.size(); m++)
 	{
-		for (int i = 0; i < models[cur_idx].shapes.size(); i++)
+		const snapshot_batch& batch = frame.batches[m];
+		if (batch.instanceCount == 0)
+			continue;
+
+		for (int i = 0; i < batch.shapes.size(); i++)
 		{
-			per_vertex = 0;
-			glUniform1i(uniform.iLocper_vertex, per_vertex);
-			glUniform1ui(uniform.iLocIsEye, models[cur_idx].shapes[i].material.isEye);
-			glUniform1f(uniform.iLocOffset_x, offset_x);
-			glUniform1f(uniform.iLocOffset_y, offset_y);
-			glBindVertexArray(models[cur_idx].shapes[i].vao);
+			Shape& shape = models[m].shapes[batch.shapes[i]];
+			glUniform1ui(uniform.iLocIsEye, shape.material.isEye);
+			glUniform3fv(uniform.iLocKa, 1, &(shape.material.Ka[0]));
+			glUniform3fv(uniform.iLocKd, 1, &(shape.material.Kd[0]));
+			glUniform3fv(uniform.iLocKs, 1, &(shape.material.Ks[0]));
+			glBindVertexArray(shape.vao.get());
 
 			// [TODO] Bind texture and modify texture filtering & wrapping mode
 			// Hint: glActiveTexture, glBindTexture, glTexParameteri
 			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, models[cur_idx].shapes[i].material.diffuseTexture);
+			GLuint texture = shape.material.diffuseTexture;
+			if (textureUploads.isPending(texture))
+			{
+				texture = placeholderTexture.get();
+			}
+			glBindTexture(GL_TEXTURE_2D, texture);
 
-			if (mag)
+			if (frame.mag)
 			{
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 			}
@@ -483,7 +991,7 @@ void RenderScene(int per_vertex_or_per_pixel) {
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 			}
 
-			if (mini)
+			if (frame.mini)
 			{
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
 			}
@@ -491,72 +999,468 @@ void RenderScene(int per_vertex_or_per_pixel) {
 			{
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 			}
-			glDrawArrays(GL_TRIANGLES, 0, models[cur_idx].shapes[i].vertex_count);
-			glUniform3fv(uniform.iLocKa, 1, &(models[cur_idx].shapes[i].material.Ka[0]));
-			glUniform3fv(uniform.iLocKd, 1, &(models[cur_idx].shapes[i].material.Kd[0]));
-			glUniform3fv(uniform.iLocKs, 1, &(models[cur_idx].shapes[i].material.Ks[0]));
+			glDrawElementsInstanced(GL_TRIANGLES, shape.indexCount, GL_UNSIGNED_INT, 0, batch.instanceCount);
 		}
 	}
-	
 }
 
-// Call back function for keyboard
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+void PrintFrameCapture();
+
+// Start or stop recording on W, then read the frame just drawn back for it
+void CaptureDrawnFrame(const frame_snapshot& frame)
 {
-	if (action == GLFW_PRESS) {
-		switch (key)
+	if (capture.toggle.exchange(false))
+	{
+		if (frameCapture.isRecording())
 		{
-		case GLFW_KEY_ESCAPE:
-			exit(0);
-			break;
-		case GLFW_KEY_Z:
-			cur_idx = (cur_idx + 1) % model_list.size();
-			break;
-		case GLFW_KEY_X:
-			cur_idx = (cur_idx - 1 + model_list.size()) % model_list.size();
-			break;
-		case GLFW_KEY_O:
-			if (cur_proj_mode == Perspective)
-			{
-				proj.farClip -= 3.0f;
-				setViewingMatrix();
-				setOrthogonal();
-			}
-			break;
-		case GLFW_KEY_P:
-			if (cur_proj_mode == Orthogonal)
-			{
-				proj.farClip += 3.0f;
-				setViewingMatrix();
-				setPerspective();
-			}
-			break;
-		case GLFW_KEY_T:
-			cur_trans_mode = GeoTranslation;
-			break;
-		case GLFW_KEY_S:
-			cur_trans_mode = GeoScaling;
-			break;
-		case GLFW_KEY_R:
-			cur_trans_mode = GeoRotation;
-			break;
-		case GLFW_KEY_E:
-			cur_trans_mode = ViewEye;
-			break;
-		case GLFW_KEY_C:
-			cur_trans_mode = ViewCenter;
-			break;
-		case GLFW_KEY_U:
-			cur_trans_mode = ViewUp;
+			frameCapture.stop();
+			PrintFrameCapture();
+		}
+		else
+		{
+			string prefix = capture.prefix;
+			if (++capture.recordings > 1)
+				prefix += "_" + to_string(capture.recordings);
+			frameCapture.start(prefix, capture.format, capture.fps, capture.synchronous);
+			printf("Recording to %s%s\n", prefix.c_str(), capture.format == CAPTURE_Y4M ? ".y4m" :
+				(string("_*.") + FrameCapture::formatName(capture.format)).c_str());
+		}
+	}
+	frameCapture.capture(0, frame.width, frame.height);
+}
+
+// Both viewports: per-vertex lighting on the left, per-pixel on the right
+void DrawFrame(const frame_snapshot& frame)
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	// render left view
+	glViewport(0, 0, frame.width / 2, frame.height);
+	RenderScene(frame, 1);
+	// render right view
+	glViewport(frame.width / 2, 0, frame.width / 2, frame.height);
+	RenderScene(frame, 0);
+}
+
+// The uniforms of RenderScene() for the CPU rasterizer
+SoftLighting GetSoftLighting(int per_vertex_or_per_pixel)
+{
+	SoftLighting l;
+	Vector3 vectors[] = { Vector3(0.15f, 0.15f, 0.15f), I_d, I_p, I_s, lightPos_d, lightPos_p, lightPos_s };
+	float* targets[] = { l.Ia, l.I_d, l.I_p, l.I_s, l.lightPos_d, l.lightPos_p, l.lightPos_s };
+	for (int i = 0; i < 7; i++)
+	{
+		targets[i][0] = vectors[i].x;
+		targets[i][1] = vectors[i].y;
+		targets[i][2] = vectors[i].z;
+	}
+	l.lightId = cur_light_id;
+	l.shininess = shininess;
+	l.spotCutoff = spot_cutoff;
+	// what the shaders compute from view_matrix: the -z axis of the camera
+	Matrix4 inverseTranspose = view_matrix;
+	inverseTranspose.invert();
+	inverseTranspose.transpose();
+	Vector4 direction = inverseTranspose * Vector4(0.0f, 0.0f, -1.0f, 1.0f);
+	l.spotDirection[0] = direction.x;
+	l.spotDirection[1] = direction.y;
+	l.spotDirection[2] = direction.z;
+	softraster_detail::Normalize(l.spotDirection);
+	// cameraPos is never set by the GL path either, so it stays at the origin
+	l.cameraPos[0] = l.cameraPos[1] = l.cameraPos[2] = 0;
+	l.perPixel = per_vertex_or_per_pixel == 0;
+	l.offsetX = offset_x;
+	l.offsetY = offset_y;
+	l.magNearest = mag;
+	l.minNearest = mini;
+	return l;
+}
+
+// Material of a shape for the CPU renderers
+SoftMaterial GetSoftMaterial(const PhongMaterial& phong)
+{
+	SoftMaterial material;
+	for (int k = 0; k < 3; k++)
+	{
+		material.Ka[k] = phong.Ka[k];
+		material.Kd[k] = phong.Kd[k];
+		material.Ks[k] = phong.Ks[k];
+	}
+	material.texture = (phong.softTexture >= 0) ? &soft_textures[phong.softTexture] : NULL;
+	material.isEye = phong.isEye != 0;
+	return material;
+}
+
+// RenderScene() of both viewports on the CPU, run CullScene() first
+void SoftRenderScene(SoftRasterizer& rasterizer, int width, int height, SoftRenderStats* stats)
+{
+	// everything referenced by the draws lives until endFrame()
+	SoftLighting lighting[2] = { GetSoftLighting(1), GetSoftLighting(0) };
+	vector<vector<Matrix4> > worlds(models.size());
+	vector<vector<SoftMaterial> > materials(models.size());
+	for (int m = 0; m < models.size(); m++)
+	{
+		for (int i = 0; i < models[m].drawnTransforms.size(); i++)
+		{
+			worlds[m].push_back(transforms.getWorldMatrix(models[m].drawnTransforms[i]));
+		}
+		for (int i = 0; i < models[m].shapes.size(); i++)
+		{
+			materials[m].push_back(GetSoftMaterial(models[m].shapes[i].material));
+		}
+	}
+
+	float clearColor[3] = { 0.2f, 0.2f, 0.2f };
+	rasterizer.beginFrame(width, height, clearColor);
+	Matrix4 viewProjection = project_matrix * view_matrix;
+	for (int view = 0; view < 2; view++)
+	{
+		rasterizer.setViewport(view * (width / 2), 0, width / 2, height);
+		for (int m = 0; m < models.size(); m++)
+		{
+			if (worlds[m].empty())
+				continue;
+			for (int i = 0; i < models[m].shapes.size(); i++)
+			{
+				if (models[m].shapes[i].culled)
+					continue;
+				rasterizer.draw(models[m].shapes[i].soft, materials[m][i], &worlds[m][0], worlds[m].size(), viewProjection, lighting[view]);
+			}
+		}
+	}
+	rasterizer.endFrame(stats);
+}
+
+// Binary PPM of an RGBA8 image, top row first
+bool WritePpm(const string& path, const vector<unsigned char>& rgba, int width, int height)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	vector<unsigned char> rgb((size_t)width * height * 3);
+	for (size_t i = 0; i < (size_t)width * height; i++)
+	{
+		rgb[i * 3] = rgba[i * 4];
+		rgb[i * 3 + 1] = rgba[i * 4 + 1];
+		rgb[i * 3 + 2] = rgba[i * 4 + 2];
+	}
+	bool written = fwrite(&rgb[0], 1, rgb.size(), file) == rgb.size();
+	fclose(file);
+	return written;
+}
+
+// Show only the instance of models[idx], as before the scene supported many models
+void SelectModel(int idx)
+{
+	const vector<ManifestInstance>& instances = sceneAssets.manifest.instances;
+	if (!instances.empty())
+	{
+		// the instances of a --scene manifest stay as it shows them
+		for (int i = 0; i < instances.size(); i++)
+		{
+			scene.setVisible(i, instances[i].visible && !stress.enabled);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < models.size(); i++)
+		{
+			scene.setVisible(models[i].instance, i == idx && !stress.enabled);
+		}
+	}
+	cur_idx = idx;
+}
+
+// Grow the stress instances to count, placed on a grid and cycling through the models
+void SetStressInstanceCount(int count)
+{
+	transforms.truncate(stress.baseTransformCount);
+	scene.truncate(stress.baseInstanceCount);
+
+	int side = (int)ceil(cbrt((double)count));
+	float spacing = 2.0f / side;
+	for (int i = 0; i < count; i++)
+	{
+		int t = transforms.create();
+		int x = i % side, y = (i / side) % side, z = i / (side * side);
+		transforms.setPosition(t, Vector3(-1.0f + spacing * (x + 0.5f), -1.0f + spacing * (y + 0.5f), -spacing * z));
+		transforms.setScale(t, Vector3(1, 1, 1) * (spacing * 0.4f));
+		transforms.setRotation(t, Quaternion(Vector3(0, 1, 0), 0.37f * i));
+		scene.addInstance(i % models.size(), t);
+	}
+	stress.instanceCount = count;
+}
+
+void StartStressTest()
+{
+	stress.enabled = true;
+	stress.baseTransformCount = transforms.size();
+	stress.baseInstanceCount = scene.size();
+	SelectModel(cur_idx);	// hides the instances shown while the stress test runs
+	SetStressInstanceCount(16);
+	stress.frame = 0;
+	stress.submitTime = 0;
+	stress.updateTime = 0;
+	stress.stepStartTime = glfwGetTime();
+	printf("Stress test: %-8s %10s %10s %14s %14s\n", "instances", "drawn", "fps", "submit(ms)", "update(ms)");
+}
+
+void StopStressTest()
+{
+	stress.enabled = false;
+	transforms.truncate(stress.baseTransformCount);
+	scene.truncate(stress.baseInstanceCount);
+	SelectModel(cur_idx);
+	pacer.requestFrame();
+}
+
+// Spin every stress instance so all transforms are dirty, like a fully animated scene
+void AnimateStressTest()
+{
+	Quaternion spin(Vector3(0, 1, 0), 0.02f);
+	for (size_t t = stress.baseTransformCount; t < transforms.size(); t++)
+	{
+		transforms.rotate((int)t, spin);
+	}
+}
+
+// Report the last step and double the instance count every stress.framesPerStep frames
+void StepStressTest(double submitTime, double updateTime)
+{
+	stress.submitTime += submitTime;
+	stress.updateTime += updateTime;
+	if (++stress.frame < stress.framesPerStep)
+		return;
+
+	double elapsed = glfwGetTime() - stress.stepStartTime;
+	double fps = stress.frame / elapsed;
+	printf("Stress test: %-8d %10d %10.1f %14.3f %14.3f\n", stress.instanceCount, culling.drawnInstances, fps,
+		stress.submitTime * 1000.0 / stress.frame, stress.updateTime * 1000.0 / stress.frame);
+
+	if (stress.instanceCount * 2 > stress.maxInstanceCount || fps < 5.0)
+	{
+		printf("Stress test finished\n");
+		StopStressTest();
+		return;
+	}
+	SetStressInstanceCount(stress.instanceCount * 2);
+	stress.frame = 0;
+	stress.submitTime = 0;
+	stress.updateTime = 0;
+	stress.stepStartTime = glfwGetTime();
+}
+
+void PrintFramePacing()
+{
+	FramePacingReport r = pacer.report(glfwGetTime());
+	printf("Frame pacing (%s): %.1f s, %llu frames, %llu idle wakeups, %.1f s waiting (%.0f frames skipped), CPU %.1f%%\n",
+		pacer.isContinuous() ? "continuous" : "on demand", r.seconds, r.frames, r.idleWakeups, r.waitSeconds, r.skippedFrames, r.cpuPercent);
+}
+
+void PrintThreadActivity()
+{
+	ThreadActivityReport r = renderThread.activity.report(glfwGetTime());
+	printf("Render thread over %.1f s: both threads busy %.2f s\n", r.seconds, r.overlap);
+	printf("  main:   %llu snapshots published (%llu never drawn), busy %.2f s, waited %.2f s for the render thread\n",
+		r.frames[MAIN_THREAD], r.dropped, r.busy[MAIN_THREAD], r.waiting[MAIN_THREAD]);
+	printf("  render: %llu frames drawn, busy %.2f s, waited %.2f s for snapshots, submit %.3f ms per frame\n",
+		r.frames[RENDER_THREAD], r.busy[RENDER_THREAD], r.waiting[RENDER_THREAD], r.submitMs);
+	printf("  snapshot age at swap: mean %.2f ms, max %.2f ms; input to swap: mean %.2f ms, 95%% %.2f ms, max %.2f ms (%d frames)\n",
+		r.ageMean, r.ageMax, r.inputMean, r.input95, r.inputMax, (int)r.inputFrames);
+}
+
+void PrintGpuResources()
+{
+	GpuResourceReport r = gpuResources.report();
+	char budget[32] = "none";
+	if (r.budget)
+		snprintf(budget, sizeof(budget), "%.2f MB", r.budget / 1048576.0);
+	printf("GPU memory: %.2f MB, peak %.2f MB, budget %s\n", r.totalBytes / 1048576.0, r.peakBytes / 1048576.0, budget);
+	for (int i = 0; i < GPU_CATEGORIES; i++)
+	{
+		printf("  %-14s %5d objects %9.2f MB\n", GpuResources::categoryName(i), (int)r.count[i], r.bytes[i] / 1048576.0);
+	}
+	printf("  models: %d resident, %d evicted; %llu evictions freed %.2f MB, %llu restores took %.2f ms, %llu frames over budget\n",
+		(int)r.residentGroups, (int)r.evictedGroups, r.evictions, r.evictedBytes / 1048576.0, r.restores, r.restoreMs, r.overBudgetFrames);
+}
+
+void PrintTextureUploads()
+{
+	TextureUploadReport r = textureUploads.report();
+	char budget[32] = "none";
+	if (r.budget)
+		snprintf(budget, sizeof(budget), "%.2f MB", r.budget / 1048576.0);
+	printf("Texture uploads (%d slots of %.1f MB, %s, %d workers, budget %s per frame): %d textures, %d pending, %.2f MB in %llu bands, %llu direct\n",
+		TEXTURE_UPLOAD_SLOTS, TEXTURE_UPLOAD_SLOT_SIZE / 1048576.0, r.persistent ? "persistently mapped" : "mapped per band", r.workers, budget,
+		(int)r.textures, (int)r.pending, r.bytes / 1048576.0, r.bands, r.direct);
+	printf("  %llu frames uploading, %.3f ms mean, %.3f ms max; %llu over the budget, %llu waiting for a slot; queued to ready %.2f ms mean, %.2f ms max\n",
+		r.frames, r.issueMs, r.issueMaxMs, r.deferredFrames, r.slotWaits, r.latencyMs, r.latencyMaxMs);
+}
+
+void PrintFrameCapture()
+{
+	FrameCaptureReport r = frameCapture.report();
+	if (r.frames == 0)
+		return;
+	printf("Frame capture (%s, %s, %d workers)%s: %llu frames of %dx%d in %.1f s, %llu written, %llu failed, %llu skipped, %.2f MB\n",
+		FrameCapture::formatName(r.format), r.synchronous ? "glReadPixels" : "pixel buffer ring", r.workers, r.recording ? " recording" : "",
+		r.frames, r.width, r.height, r.seconds, r.written, r.failed, r.skipped, r.bytes / 1048576.0);
+	printf("  GL thread %.3f ms/frame (max %.3f ms), %.2f ms waiting in %llu frames; copied out %.1f frames late; encoding %.2f ms/frame per worker\n",
+		r.glMs, r.glMaxMs, r.stallMs, r.stalls, r.lag, r.encodeMs);
+}
+
+void PrintSceneAssets()
+{
+	AssetLoaderReport meshes = sceneAssets.meshes.report(), textures = sceneAssets.textures.report();
+	int loaded = 0;
+	for (int m = 0; m < models.size(); m++)
+	{
+		loaded += models[m].loaded ? 1 : 0;
+	}
+	printf("Assets (%s): %d of %d models loaded; meshes %d loaded, %d failed, %d queued in %.2f ms (%.2f ms queued); textures %d loaded, %d failed in %.2f ms (%.2f ms queued)\n",
+		sceneAssets.lazy ? "on first use" : "at startup", loaded, (int)models.size(), (int)meshes.loaded, (int)meshes.failed, (int)meshes.queued,
+		meshes.loadMs, meshes.waitMs, (int)textures.loaded, (int)textures.failed, textures.loadMs, textures.waitMs);
+	printf("  startup: manifest parsed %.2f ms, first frame drawn %.2f ms, models shown first taken in %.2f ms after start\n",
+		startup.manifestMs, startup.firstFrameMs, startup.sceneMs);
+}
+
+// The time from the start of the app to the first frame swapped, once
+void StartupFrameShown()
+{
+	if (startup.firstFrame.exchange(true))
+		return;
+	startup.firstFrameMs = StartupMs();
+	if (startup.manifestMs >= 0)
+		printf("Startup: manifest parsed %.2f ms, first frame drawn %.2f ms after start\n", startup.manifestMs, startup.firstFrameMs);
+	else
+		printf("Startup: first frame drawn %.2f ms after start\n", startup.firstFrameMs);
+}
+
+void PrintFrameSync()
+{
+	FrameSyncReport r = frameSync.report(8);
+	if (r.framesInFlight == 0)
+	{
+		printf("Frames in flight: not capped, queued by the driver\n");
+		return;
+	}
+	printf("Frames in flight: at most %d, %llu frames finished: %llu GPU bound, %llu CPU bound\n", r.framesInFlight, r.frames, r.gpuBound, r.cpuBound);
+	printf("  mean over the last %d: fence wait %.3f ms, CPU %.3f ms, swap %.3f ms, GPU %.3f ms\n",
+		(int)min(r.frames, (unsigned long long)FRAME_SYNC_HISTORY), r.waitMs, r.cpuMs, r.swapMs, r.gpuMs);
+	for (size_t i = 0; i < r.last.size(); i++)
+	{
+		const FrameTiming& t = r.last[i];
+		printf("  frame %llu: fence wait %.3f ms, CPU %.3f ms, swap %.3f ms, GPU %.3f ms, %s bound\n", t.frame, t.waitMs, t.cpuMs,
+			t.swapMs, t.gpuMs, t.gpuBound ? "GPU" : "CPU");
+	}
+}
+
+// Keyboard input, applied by ProcessInput()
+void HandleKey(GLFWwindow* window, int key, int action)
+{
+	if (action == GLFW_PRESS) {
+		switch (key)
+		{
+		case GLFW_KEY_ESCAPE:
+			glfwSetWindowShouldClose(window, GLFW_TRUE);
+			break;
+		case GLFW_KEY_Z:
+			SelectModel((cur_idx + 1) % model_list.size());
+			input.dirty |= DIRTY_SCENE;
+			break;
+		case GLFW_KEY_X:
+			SelectModel((cur_idx - 1 + model_list.size()) % model_list.size());
+			input.dirty |= DIRTY_SCENE;
+			break;
+		case GLFW_KEY_M:
+			if (stress.enabled)
+				StopStressTest();
+			else
+				StartStressTest();
+			input.dirty |= DIRTY_SCENE;
+			break;
+		case GLFW_KEY_O:
+			if (cur_proj_mode == Perspective)
+			{
+				proj.farClip -= 3.0f;
+				cur_proj_mode = Orthogonal;
+				input.dirty |= DIRTY_VIEW | DIRTY_PROJECTION;
+			}
+			break;
+		case GLFW_KEY_P:
+			if (cur_proj_mode == Orthogonal)
+			{
+				proj.farClip += 3.0f;
+				cur_proj_mode = Perspective;
+				input.dirty |= DIRTY_VIEW | DIRTY_PROJECTION;
+			}
+			break;
+		case GLFW_KEY_T:
+			cur_trans_mode = GeoTranslation;
+			break;
+		case GLFW_KEY_S:
+			cur_trans_mode = GeoScaling;
+			break;
+		case GLFW_KEY_R:
+			cur_trans_mode = GeoRotation;
+			break;
+		case GLFW_KEY_E:
+			cur_trans_mode = ViewEye;
+			break;
+		case GLFW_KEY_C:
+			cur_trans_mode = ViewCenter;
+			break;
+		case GLFW_KEY_U:
+			cur_trans_mode = ViewUp;
 			break;
 		case GLFW_KEY_I:
-			cout << endl;
+			printf("Transforms: %d nodes, %u recomputed last frame, %llu recomputed in total\n", (int)transforms.size(), transforms.getRecomputeCount(), transforms.getTotalRecomputeCount());
+			printf("Culling %s: shapes %d drawn, %d culled, instances %d drawn, %d culled, %.3f ms\n", culling.enabled ? "on" : "off",
+				culling.drawnShapes, culling.culledShapes, culling.drawnInstances, culling.culledInstances, culling.cullTime * 1000.0);
+			printf("Picking: %d instances, top level build %.3f ms, last pick %.3f ms\n", (int)picking.instances.size(),
+				picking.buildTime * 1000.0, picking.pickTime * 1000.0);
+			printf("Input: %llu events (%llu cursor, %llu scroll), view matrix rebuilt %llu times for %llu requests\n", input.eventCount,
+				input.cursorEvents, input.scrollEvents, input.viewRebuilds, input.viewRequests);
+			printf("Input to swap latency over the last %d changed frames: mean %.2f ms, 95%% %.2f ms, max %.2f ms (%d frames in total)\n",
+				(int)min(input.latency.count(), (size_t)LATENCY_SAMPLES), input.latency.mean(), input.latency.percentile(0.95),
+				input.latency.maximum(), (int)input.latency.count());
+			PrintFramePacing();
+			PrintFrameSync();
+			PrintGpuResources();
+			PrintTextureUploads();
+			PrintFrameCapture();
+			PrintSceneAssets();
+			if (renderThread.enabled)
+				PrintThreadActivity();
+			break;
+		case GLFW_KEY_N:
+			frameSync.setFramesInFlight((frameSync.getFramesInFlight() + 1) % (MAX_FRAMES_IN_FLIGHT + 1));
+			printf("Frames in flight: %d%s\n", frameSync.getFramesInFlight(), frameSync.getFramesInFlight() ? "" : " (not capped)");
+			pacer.requestFrame();
+			break;
+		case GLFW_KEY_V:
+			PrintFramePacing();
+			pacer.setContinuous(!pacer.isContinuous());
+			pacer.startPeriod(glfwGetTime());
+			printf("Rendering %s\n", pacer.isContinuous() ? "continuously" : "on demand");
+			break;
+		case GLFW_KEY_H:
+			RunPickBenchmark(window);
+			break;
+		case GLFW_KEY_W:
+			capture.toggle = true;
+			pacer.requestFrame();
+			break;
+		case GLFW_KEY_F:
+			culling.enabled = !culling.enabled;
+			input.dirty |= DIRTY_SCENE;
 			break;
 		case GLFW_KEY_L:
 			cur_light_id += 1;
 			if (cur_light_id > 2) {
 				cur_light_id = 0;
 			}
+			input.dirty |= DIRTY_SHADING;
 			break;
 		case GLFW_KEY_K:
 			cur_trans_mode = LightEdit;
@@ -566,11 +1470,14 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 			break;
 		case GLFW_KEY_G:
 			mag = !mag;
+			input.dirty |= DIRTY_SHADING;
 			break;
 		case GLFW_KEY_B:
 			mini = !mini;
+			input.dirty |= DIRTY_SHADING;
 			break;
 		case GLFW_KEY_RIGHT:
+			input.dirty |= DIRTY_SHADING;
 			for (int i = 0; i < models.size();i++)
 			{
 				models[i].cur_eye_offset_idx = (models[i].cur_eye_offset_idx + 1) % models[i].max_eye_offset;
@@ -598,6 +1505,7 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 			}
 			break;
 		case GLFW_KEY_LEFT:
+			input.dirty |= DIRTY_SHADING;
 			for (int i = 0; i < models.size(); i++)
 			{
 				models[i].cur_eye_offset_idx = (models[i].cur_eye_offset_idx - 1 + models[i].max_eye_offset) % models[i].max_eye_offset;
@@ -630,36 +1538,38 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 	}
 }
 
-void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+// Scrolling, the offsets of all scroll events of a frame summed up
+void HandleScroll(double yoffset)
 {
 	// scroll up positive, otherwise it would be negtive
 	switch (cur_trans_mode)
 	{
 	case ViewEye:
 		main_camera.position.z -= 0.025 * (float)yoffset;
-		setViewingMatrix();
-		printf("Camera Position = ( %f , %f , %f )\n", main_camera.position.x, main_camera.position.y, main_camera.position.z);
+		input.dirty |= DIRTY_VIEW;
 		break;
 	case ViewCenter:
 		main_camera.center.z += 0.1 * (float)yoffset;
-		setViewingMatrix();
-		printf("Camera Viewing Direction = ( %f , %f , %f )\n", main_camera.center.x, main_camera.center.y, main_camera.center.z);
+		input.dirty |= DIRTY_VIEW;
 		break;
 	case ViewUp:
 		main_camera.up_vector.z += 0.33 * (float)yoffset;
-		setViewingMatrix();
-		printf("Camera Up Vector = ( %f , %f , %f )\n", main_camera.up_vector.x, main_camera.up_vector.y, main_camera.up_vector.z);
+		input.dirty |= DIRTY_VIEW;
 		break;
 	case GeoTranslation:
-		models[cur_idx].position.z += 0.1 * (float)yoffset;
+		transforms.translate(models[cur_idx].transform, Vector3(0, 0, 0.1f * (float)yoffset));
+		input.dirty |= DIRTY_SCENE;
 		break;
 	case GeoScaling:
-		models[cur_idx].scale.z += 0.01 * (float)yoffset;
+		transforms.addScale(models[cur_idx].transform, Vector3(0, 0, 0.01f * (float)yoffset));
+		input.dirty |= DIRTY_SCENE;
 		break;
 	case GeoRotation:
-		models[cur_idx].rotation.z += (acosf(-1.0f) / 180.0) * 5 * (float)yoffset;
+		transforms.rotate(models[cur_idx].transform, Quaternion(Vector3(0, 0, 1), (acosf(-1.0f) / 180.0) * 5 * (float)yoffset));
+		input.dirty |= DIRTY_SCENE;
 		break;
 	case LightEdit:
+		input.dirty |= DIRTY_SHADING;
 		if (cur_light_id == 0)
 		{
 			I_d = I_d + Vector3(1, 1, 1)*0.5*yoffset;
@@ -675,85 +1585,203 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 		break;
 	case ShininessEdit:
 		shininess += 1.5*yoffset;
+		input.dirty |= DIRTY_SHADING;
+		break;
 	}
 }
 
-void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+// Apply the camera and projection changes once, before picking and before the frame is drawn
+void ApplyDirtyState()
+{
+	if (input.dirty & DIRTY_VIEW)
+	{
+		setViewingMatrix();
+		input.viewRebuilds++;
+		if (cur_trans_mode == ViewEye)
+			printf("Camera Position = ( %f , %f , %f )\n", main_camera.position.x, main_camera.position.y, main_camera.position.z);
+		else if (cur_trans_mode == ViewCenter)
+			printf("Camera Viewing Direction = ( %f , %f , %f )\n", main_camera.center.x, main_camera.center.y, main_camera.center.z);
+		else if (cur_trans_mode == ViewUp)
+			printf("Camera Up Vector = ( %f , %f , %f )\n", main_camera.up_vector.x, main_camera.up_vector.y, main_camera.up_vector.z);
+	}
+	if (input.dirty & DIRTY_PROJECTION)
+	{
+		if (cur_proj_mode == Perspective)
+			setPerspective();
+		else
+			setOrthogonal();
+	}
+	input.changed |= input.dirty;
+	input.dirty = 0;
+}
+
+void HandleMouseButton(GLFWwindow* window, int button, int action)
 {
-	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
 		mouse_pressed = true;
+		ApplyDirtyState();
+		PickUnderCursor(window);
+	}
 	else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
 		mouse_pressed = false;
 		starting_press_x = -1;
 		starting_press_y = -1;
+		picking.dragTransform = -1;
 	}
 		
 }
 
+// Cursor movement while the button is held, all moves between two other events summed up
+void HandleDrag(float diff_x, float diff_y)
+{
+	switch (cur_trans_mode)
+	{
+	case ViewEye:
+		main_camera.position.x += diff_x * (1.0 / 400.0);
+		main_camera.position.y += diff_y * (1.0 / 400.0);
+		input.dirty |= DIRTY_VIEW;
+		break;
+	case ViewCenter:
+		main_camera.center.x += diff_x * (1.0 / 400.0);
+		main_camera.center.y -= diff_y * (1.0 / 400.0);
+		input.dirty |= DIRTY_VIEW;
+		break;
+	case ViewUp:
+		main_camera.up_vector.x += diff_x * 0.1;
+		main_camera.up_vector.y += diff_y * 0.1;
+		input.dirty |= DIRTY_VIEW;
+		break;
+	case GeoTranslation:
+		transforms.translate(DragTransform(), Vector3(-diff_x * (1.0 / 400.0), diff_y * (1.0 / 400.0), 0));
+		input.dirty |= DIRTY_SCENE;
+		break;
+	case GeoScaling:
+		transforms.addScale(DragTransform(), Vector3(diff_x * 0.001, diff_y * 0.001, 0));
+		input.dirty |= DIRTY_SCENE;
+		break;
+	case GeoRotation:
+		transforms.rotate(DragTransform(),
+			Quaternion(Vector3(1, 0, 0), acosf(-1.0f) / 180.0*diff_y*(45.0 / 400.0)) *
+			Quaternion(Vector3(0, 1, 0), acosf(-1.0f) / 180.0*diff_x*(45.0 / 400.0)));
+		input.dirty |= DIRTY_SCENE;
+		break;
+	case LightEdit:
+		if (cur_light_id == 0)
+		{
+			lightPos_d.x += 0.01*diff_x;
+			lightPos_d.y += 0.01*diff_y;
+		}
+		else if (cur_light_id == 1)
+		{
+			lightPos_p.x += 0.01*diff_x;
+			lightPos_p.y += 0.01*diff_y;
+		}
+		else if (cur_light_id == 2)
+		{
+			lightPos_s.x += 0.01*diff_x;
+			lightPos_s.y += 0.01*diff_y;
+		}
+		input.dirty |= DIRTY_SHADING;
+		break;
+	default:
+		break;
+	}
+}
+
+// The GLFW callbacks only queue their events for ProcessInput()
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	InputEvent event = { INPUT_KEY, key, action, mods, 0, 0, glfwGetTime() };
+	input.queue.push(event);
+}
+
+void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+{
+	InputEvent event = { INPUT_SCROLL, 0, 0, 0, xoffset, yoffset, glfwGetTime() };
+	input.queue.push(event);
+}
+
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	InputEvent event = { INPUT_MOUSE_BUTTON, button, action, mods, 0, 0, glfwGetTime() };
+	input.queue.push(event);
+}
+
 static void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos)
 {
-	if (mouse_pressed) {
-		if (starting_press_x < 0 || starting_press_y < 0) {
-			starting_press_x = (int)xpos;
-			starting_press_y = (int)ypos;
-		}
-		else {
-			float diff_x = starting_press_x - (int)xpos;
-			float diff_y = starting_press_y - (int)ypos;
-			starting_press_x = (int)xpos;
-			starting_press_y = (int)ypos;
-			switch (cur_trans_mode)
+	InputEvent event = { INPUT_CURSOR, 0, 0, 0, xpos, ypos, glfwGetTime() };
+	input.queue.push(event);
+}
+
+bool IsViewMode(TransMode mode)
+{
+	return mode == ViewEye || mode == ViewCenter || mode == ViewUp;
+}
+
+// Apply the events queued since the last frame, once per frame before it is drawn.
+// Cursor moves and scroll offsets are summed up until a key or button event, which
+// sees the state of all events before it. The view and projection matrices are
+// rebuilt once at the end.
+void ProcessInput(GLFWwindow* window)
+{
+	input.queue.drain(&input.events);
+	float dragX = 0, dragY = 0;
+	double scroll = 0;
+	for (int i = 0; i <= input.events.size(); i++)
+	{
+		if (i < input.events.size())
+		{
+			const InputEvent& event = input.events[i];
+			input.eventCount++;
+			if (event.type == INPUT_CURSOR)
 			{
-			case ViewEye:
-				main_camera.position.x += diff_x * (1.0 / 400.0);
-				main_camera.position.y += diff_y * (1.0 / 400.0);
-				setViewingMatrix();
-				printf("Camera Position = ( %f , %f , %f )\n", main_camera.position.x, main_camera.position.y, main_camera.position.z);
-				break;
-			case ViewCenter:
-				main_camera.center.x += diff_x * (1.0 / 400.0);
-				main_camera.center.y -= diff_y * (1.0 / 400.0);
-				setViewingMatrix();
-				printf("Camera Viewing Direction = ( %f , %f , %f )\n", main_camera.center.x, main_camera.center.y, main_camera.center.z);
-				break;
-			case ViewUp:
-				main_camera.up_vector.x += diff_x * 0.1;
-				main_camera.up_vector.y += diff_y * 0.1;
-				setViewingMatrix();
-				printf("Camera Up Vector = ( %f , %f , %f )\n", main_camera.up_vector.x, main_camera.up_vector.y, main_camera.up_vector.z);
-				break;
-			case GeoTranslation:
-				models[cur_idx].position.x += -diff_x * (1.0 / 400.0);
-				models[cur_idx].position.y += diff_y * (1.0 / 400.0);
-				break;
-			case GeoScaling:
-				models[cur_idx].scale.x += diff_x * 0.001;
-				models[cur_idx].scale.y += diff_y * 0.001;
-				break;
-			case GeoRotation:
-				models[cur_idx].rotation.x += acosf(-1.0f) / 180.0*diff_y*(45.0 / 400.0);
-				models[cur_idx].rotation.y += acosf(-1.0f) / 180.0*diff_x*(45.0 / 400.0);
-				break;
-			case LightEdit:
-				if (cur_light_id == 0)
-				{
-					lightPos_d.x += 0.01*diff_x;
-					lightPos_d.y += 0.01*diff_y;
-				}
-				else if (cur_light_id == 1)
+				input.cursorEvents++;
+				if (!mouse_pressed)
+					continue;
+				if (starting_press_x >= 0 && starting_press_y >= 0)
 				{
-					lightPos_p.x += 0.01*diff_x;
-					lightPos_p.y += 0.01*diff_y;
+					dragX += starting_press_x - (int)event.x;
+					dragY += starting_press_y - (int)event.y;
+					input.viewRequests += IsViewMode(cur_trans_mode) ? 1 : 0;
 				}
-				else if (cur_light_id == 2)
-				{
-					lightPos_s.x += 0.01*diff_x;
-					lightPos_s.y += 0.01*diff_y;
-				}
-				break;
+				starting_press_x = (int)event.x;
+				starting_press_y = (int)event.y;
+				continue;
+			}
+			if (event.type == INPUT_SCROLL)
+			{
+				input.scrollEvents++;
+				scroll += event.y;
+				input.viewRequests += IsViewMode(cur_trans_mode) ? 1 : 0;
+				continue;
 			}
 		}
+
+		if (dragX != 0 || dragY != 0)
+			HandleDrag(dragX, dragY);
+		if (scroll != 0)
+			HandleScroll(scroll);
+		dragX = dragY = 0;
+		scroll = 0;
+		if (i == input.events.size())
+			break;
+		if (input.events[i].type == INPUT_KEY)
+			HandleKey(window, input.events[i].code, input.events[i].action);
+		else
+			HandleMouseButton(window, input.events[i].code, input.events[i].action);
 	}
+	if ((input.dirty || input.changed) && input.changeTime < 0 && !input.events.empty())
+		input.changeTime = input.events[0].time;
+	ApplyDirtyState();
+}
+
+// After the swap of a frame: latency of the input it showed
+void FrameShown()
+{
+	if (input.changed && input.changeTime >= 0)
+		input.latency.add((glfwGetTime() - input.changeTime) * 1000.0);
+	input.changed = 0;
+	input.changeTime = -1;
 }
 
 void setShaders()
@@ -825,172 +1853,152 @@ void setShaders()
     }
 
 	program = p;
+	programObject = gpuResources.adoptProgram(p);
+}
+
+static string GetBaseDir(const string& filepath) {
+	if (filepath.find_last_of("/\\") != std::string::npos)
+		return filepath.substr(0, filepath.find_last_of("/\\"));
+	return "";
 }
 
-void normalization(tinyobj::attrib_t* attrib, vector<GLfloat>& vertices, vector<GLfloat>& colors, vector<GLfloat>& normals, vector<GLfloat>& textureCoords, vector<int>& material_id, tinyobj::shape_t* shape)
+// GL_RGBA32F texture with mipmaps of width * height texels in format / type, for group. The
+// texels are queued in textureUploads, freeTexels(texels) is called once they are copied
+GpuHandle UploadTexture(int group, GLenum format, GLenum type, const void* texels, int width, int height, TextureUploadQueue::FreePixels freeTexels)
 {
-	vector<float> xVector, yVector, zVector;
-	float minX = 10000, maxX = -10000, minY = 10000, maxY = -10000, minZ = 10000, maxZ = -10000;
+	GpuHandle tex = gpuResources.createTexture(group);
+	textureUploads.upload(tex.get(), format, type, texels, width, height, freeTexels);
+	tex.setBytes(GpuResources::textureBytes(width, height, 4 * sizeof(GLfloat), true));
+	return tex;
+}
 
-	// find out min and max value of X, Y and Z axis
-	for (int i = 0; i < attrib->vertices.size(); i++)
+// Decode an image on the texture loader thread, with its texels for the CPU renderers
+shared_ptr<texture_asset> LoadTextureImage(string image_path)
+{
+	int channel, width, height;
+	int require_channel = 4;
+	stbi_set_flip_vertically_on_load(true);
+	stbi_uc *data = stbi_load(image_path.c_str(), &width, &height, &channel, require_channel);
+	if (data != NULL)
 	{
-		//maxs = max(maxs, attrib->vertices.at(i));
-		if (i % 3 == 0)
-		{
+		shared_ptr<texture_asset> texture(new texture_asset());
+		texture->soft = SoftTexture(data, width, height);
+		texture->rgba = data;
+		texture->width = width;
+		texture->height = height;
+		return texture;
+	}
+	else
+	{
+		// reported by AdoptModel() on the main thread
+		return shared_ptr<texture_asset>();
+	}
+}
 
-			xVector.push_back(attrib->vertices.at(i));
+// The image of image_path, decoded once for all models using it
+AssetLoader<texture_asset>::Future RequestTextureImage(const string& image_path)
+{
+	return sceneAssets.textures.request(image_path, [image_path] { return LoadTextureImage(image_path); });
+}
 
-			if (attrib->vertices.at(i) < minX)
-			{
-				minX = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxX)
-			{
-				maxX = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 1)
-		{
-			yVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minY)
-			{
-				minY = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxY)
-			{
-				maxY = attrib->vertices.at(i);
-			}
-		}
-		else if (i % 3 == 2)
-		{
-			zVector.push_back(attrib->vertices.at(i));
-
-			if (attrib->vertices.at(i) < minZ)
-			{
-				minZ = attrib->vertices.at(i);
-			}
-
-			if (attrib->vertices.at(i) > maxZ)
-			{
-				maxZ = attrib->vertices.at(i);
-			}
-		}
-	}
-	
-	float offsetX = (maxX + minX) / 2;
-	float offsetY = (maxY + minY) / 2;
-	float offsetZ = (maxZ + minZ) / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
+// The texture of a decoded image for group. soft_textures gets the texels once; with
+// upload, the GL texture is queued from the RGBA8 image the first time and from the
+// texels after that, without, the image is dropped and RestoreModel() uploads the texels
+GpuHandle AdoptTexture(texture_asset& texture, int group, bool upload, int* soft_texture)
+{
+	if (texture.softIndex < 0)
 	{
-		if (offsetX != 0 && i % 3 == 0)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetX;
-		}
-		else if (offsetY != 0 && i % 3 == 1)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetY;
-		}
-		else if (offsetZ != 0 && i % 3 == 2)
-		{
-			attrib->vertices.at(i) = attrib->vertices.at(i) - offsetZ;
-		}
+		soft_textures.push_back(std::move(texture.soft));
+		texture.softIndex = (int)soft_textures.size() - 1;
 	}
+	*soft_texture = texture.softIndex;
 
-	float greatestAxis = maxX - minX;
-	float distanceOfYAxis = maxY - minY;
-	float distanceOfZAxis = maxZ - minZ;
-
-	if (distanceOfYAxis > greatestAxis)
+	// [TODO] Bind the image to texture
+	// Hint: glGenTextures, glBindTexture, glTexImage2D, glGenerateMipmap
+	// the image is freed once it is copied for the upload
+	GpuHandle tex;
+	if (upload && texture.rgba)
 	{
-		greatestAxis = distanceOfYAxis;
+		tex = UploadTexture(group, GL_RGBA, GL_UNSIGNED_BYTE, texture.rgba, texture.width, texture.height, stbi_image_free);
 	}
-
-	if (distanceOfZAxis > greatestAxis)
+	else if (upload)
 	{
-		greatestAxis = distanceOfZAxis;
+		const SoftTexture& texels = soft_textures[texture.softIndex];
+		tex = UploadTexture(group, GL_RGB, GL_FLOAT, texels.getTexels(), texels.getWidth(), texels.getHeight(), NULL);
 	}
-
-	float scale = greatestAxis / 2;
-
-	for (int i = 0; i < attrib->vertices.size(); i++)
+	else if (texture.rgba)
 	{
-		//std::cout << i << " = " << (double)(attrib.vertices.at(i) / greatestAxis) << std::endl;
-		attrib->vertices.at(i) = attrib->vertices.at(i)/ scale;
+		stbi_image_free(texture.rgba);
 	}
-	size_t index_offset = 0;
-	for (size_t f = 0; f < shape->mesh.num_face_vertices.size(); f++) {
-		int fv = shape->mesh.num_face_vertices[f];
+	texture.rgba = NULL;
+	return tex;
+}
 
-		// Loop over vertices in the face.
-		for (size_t v = 0; v < fv; v++) {
-			// access to vertex
-			tinyobj::index_t idx = shape->mesh.indices[index_offset + v];
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 0]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 1]);
-			vertices.push_back(attrib->vertices[3 * idx.vertex_index + 2]);
-			// Optional: vertex colors
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 0]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 1]);
-			colors.push_back(attrib->colors[3 * idx.vertex_index + 2]);
-			// Optional: vertex normals
-			normals.push_back(attrib->normals[3 * idx.normal_index + 0]);
-			normals.push_back(attrib->normals[3 * idx.normal_index + 1]);
-			normals.push_back(attrib->normals[3 * idx.normal_index + 2]);
-			// Optional: texture coordinate
-			textureCoords.push_back(attrib->texcoords[2 * idx.texcoord_index + 0]);
-			textureCoords.push_back(attrib->texcoords[2 * idx.texcoord_index + 1]);
-			// The material of this vertex
-			material_id.push_back(shape->mesh.material_ids[f]);
-		}
-		index_offset += fv;
-	}
+// The CPU copies of the shapes are needed by the CPU renderers and to upload a model again
+// after an eviction, otherwise they go once the shape is uploaded
+bool KeepShapeCopies()
+{
+	return !gl_enabled || gpuResources.getBudget() > 0;
 }
 
-static string GetBaseDir(const string& filepath) {
-	if (filepath.find_last_of("/\\") != std::string::npos)
-		return filepath.substr(0, filepath.find_last_of("/\\"));
-	return "";
+void ReleaseShapeCopies(Shape& shape)
+{
+	if (KeepShapeCopies())
+		return;
+	shape.soft = SoftMesh();
+	vector<GLfloat>().swap(shape.colors);
 }
 
-GLuint LoadTextureImage(string image_path)
+// Vertex and index buffers of the shape from its CPU copy, in a new VAO of group
+void UploadShape(Shape& shape, int group)
 {
-	int channel, width, height;
-	int require_channel = 4;
-	stbi_set_flip_vertically_on_load(true);
-	stbi_uc *data = stbi_load(image_path.c_str(), &width, &height, &channel, require_channel);
-	if (data != NULL)
-	{
-		GLuint tex = 0;
+	const SoftMesh& soft = shape.soft;
+	shape.vao = gpuResources.createVertexArray(group);
+	glBindVertexArray(shape.vao.get());
 
-		// [TODO] Bind the image to texture
-		// Hint: glGenTextures, glBindTexture, glTexImage2D, glGenerateMipmap
-		glGenTextures(1, &tex);
-		glBindTexture(GL_TEXTURE_2D, tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
+	shape.vbo = gpuResources.createBuffer(GPU_GEOMETRY, group);
+	GpuBufferData(GL_ARRAY_BUFFER, shape.vbo, soft.positions.size() * sizeof(GLfloat), &soft.positions[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-		// free the image from memory after binding to texture
-		stbi_image_free(data);
-		return tex;
-	}
-	else
-	{
-		cout << "LoadTextureImage: Cannot load image from " << image_path << endl;
-		return -1;
-	}
+	shape.p_color = gpuResources.createBuffer(GPU_GEOMETRY, group);
+	GpuBufferData(GL_ARRAY_BUFFER, shape.p_color, shape.colors.size() * sizeof(GLfloat), &shape.colors[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	shape.p_normal = gpuResources.createBuffer(GPU_GEOMETRY, group);
+	GpuBufferData(GL_ARRAY_BUFFER, shape.p_normal, soft.normals.size() * sizeof(GLfloat), &soft.normals[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	shape.p_texCoord = gpuResources.createBuffer(GPU_GEOMETRY, group);
+	GpuBufferData(GL_ARRAY_BUFFER, shape.p_texCoord, soft.texcoords.size() * sizeof(GLfloat), &soft.texcoords[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+	shape.ebo = gpuResources.createBuffer(GPU_GEOMETRY, group);
+	GpuBufferData(GL_ELEMENT_ARRAY_BUFFER, shape.ebo, soft.indices.size() * sizeof(GLuint), &soft.indices[0], GL_STATIC_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
 }
 
-vector<Shape> SplitShapeByMaterial(vector<GLfloat>& vertices, vector<GLfloat>& colors, vector<GLfloat>& normals, vector<GLfloat>& textureCoords, vector<int>& material_id, vector<PhongMaterial>& materials)
+vector<Shape> SplitShapeByMaterial(LoadArenaVector<GLfloat>& vertices, LoadArenaVector<GLfloat>& colors, LoadArenaVector<GLfloat>& normals, LoadArenaVector<GLfloat>& textureCoords, LoadArenaVector<int>& material_id, vector<PhongMaterial>& materials, MeshOptimizeStats& optimizeStats)
 {
 	vector<Shape> res;
+	// count the vertices of every material first, so each split is allocated only once
+	LoadArenaVector<int> material_count(materials.size(), 0, &loadArena);
+	for (int v = 0; v < material_id.size(); v++)
+	{
+		if (material_id[v] >= 0 && material_id[v] < materials.size())
+			material_count[material_id[v]]++;
+	}
+
 	for (int m = 0; m < materials.size(); m++)
 	{
-		vector<GLfloat> m_vertices, m_colors, m_normals, m_textureCoords;
+		LoadArenaVector<GLfloat> m_vertices(&loadArena), m_colors(&loadArena), m_normals(&loadArena), m_textureCoords(&loadArena);
+		m_vertices.reserve(material_count[m] * 3);
+		m_colors.reserve(material_count[m] * 3);
+		m_normals.reserve(material_count[m] * 3);
+		m_textureCoords.reserve(material_count[m] * 2);
 		//cout << "material id size" << material_id.size() << endl;
 		for (int v = 0; v < material_id.size(); v++) 
 		{	
@@ -1019,54 +2027,140 @@ vector<Shape> SplitShapeByMaterial(vector<GLfloat>& vertices, vector<GLfloat>& c
 
 		if (!m_vertices.empty())
 		{
-			Shape tmp_shape;
-			glGenVertexArrays(1, &tmp_shape.vao);
-			glBindVertexArray(tmp_shape.vao);
+			// indexed and reordered for the vertex cache, overdraw and vertex fetch
+			LoadArenaVector<GLuint> m_indices(&loadArena);
+			optimizeStats.add(OptimizeTriangleList(&m_vertices, &m_colors, &m_normals, &m_textureCoords, &m_indices));
 
-			glGenBuffers(1, &tmp_shape.vbo);
-			glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.vbo);
-			glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(GL_FLOAT), &m_vertices.at(0), GL_STATIC_DRAW);
-			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			Shape tmp_shape;
 			tmp_shape.vertex_count = m_vertices.size() / 3;
+			tmp_shape.indexCount = m_indices.size();
+			tmp_shape.bounds = ComputeBounds(&m_vertices[0], m_vertices.size() / 3);
+			tmp_shape.culled = false;
+			tmp_shape.soft.positions.assign(m_vertices.begin(), m_vertices.end());
+			tmp_shape.soft.normals.assign(m_normals.begin(), m_normals.end());
+			tmp_shape.soft.texcoords.assign(m_textureCoords.begin(), m_textureCoords.end());
+			tmp_shape.soft.indices.assign(m_indices.begin(), m_indices.end());
+			tmp_shape.colors.assign(m_colors.begin(), m_colors.end());
+
+			tmp_shape.material = materials[m];
+			tmp_shape.materialIndex = m;
+			res.push_back(std::move(tmp_shape));
+		}
+	}
 
-			glGenBuffers(1, &tmp_shape.p_color);
-			glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_color);
-			glBufferData(GL_ARRAY_BUFFER, m_colors.size() * sizeof(GL_FLOAT), &m_colors.at(0), GL_STATIC_DRAW);
-			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	return res;
+}
 
-			glGenBuffers(1, &tmp_shape.p_normal);
-			glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_normal);
-			glBufferData(GL_ARRAY_BUFFER, m_normals.size() * sizeof(GL_FLOAT), &m_normals.at(0), GL_STATIC_DRAW);
-			glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+// Attach the model's instance buffer to every shape VAO as a mat4 at locations 4-7
+void SetupInstanceBuffer(model& m)
+{
+	if (!gl_enabled)
+		return;
+	m.instanceVbo = gpuResources.createBuffer(GPU_STREAM);
+	BindInstanceBuffer(m, m.instanceVbo.get(), 0);
+}
 
-			glGenBuffers(1, &tmp_shape.p_texCoord);
-			glBindBuffer(GL_ARRAY_BUFFER, tmp_shape.p_texCoord);
-			glBufferData(GL_ARRAY_BUFFER, m_textureCoords.size() * sizeof(GL_FLOAT), &m_textureCoords.at(0), GL_STATIC_DRAW);
-			glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, 0);
+// Free the shapes and textures of a model for the budget, the CPU copies stay for RestoreModel()
+void EvictModel(int m)
+{
+	model& target = models[m];
+	for (int i = 0; i < target.shapes.size(); i++)
+	{
+		Shape& shape = target.shapes[i];
+		shape.vao.reset();
+		shape.vbo.reset();
+		shape.p_color.reset();
+		shape.p_normal.reset();
+		shape.p_texCoord.reset();
+		shape.ebo.reset();
+	}
+	for (int i = 0; i < target.textures.size(); i++)
+	{
+		textureUploads.cancel(target.textures[i].get());
+		target.textures[i].reset();
+	}
+	target.boundInstanceBuffer = 0;
+	target.resident = false;
+}
 
-			glEnableVertexAttribArray(0);
-			glEnableVertexAttribArray(1);
-			glEnableVertexAttribArray(2);
-			glEnableVertexAttribArray(3);
+// Upload an evicted model again, or a model loaded on first use, textures from the texels
+// kept for the CPU renderers
+void RestoreModel(int m)
+{
+	double start = glfwGetTime();
+	model& target = models[m];
+	for (int i = 0; i < target.shapes.size(); i++)
+	{
+		Shape& shape = target.shapes[i];
+		UploadShape(shape, m);
+		ReleaseShapeCopies(shape);
+		GpuHandle& texture = target.textures[shape.materialIndex];
+		if (!texture.valid() && shape.material.softTexture >= 0)
+		{
+			const SoftTexture& texels = soft_textures[shape.material.softTexture];
+			texture = UploadTexture(m, GL_RGB, GL_FLOAT, texels.getTexels(), texels.getWidth(), texels.getHeight(), NULL);
+		}
+		shape.material.diffuseTexture = texture.get();
+	}
+	target.boundInstanceBuffer = 0;
+	target.resident = true;
+	if (target.firstUpload)
+		target.firstUpload = false;
+	else
+		gpuResources.restored(m, (glfwGetTime() - start) * 1000.0);
+}
 
-			tmp_shape.material = materials[m];
-			res.push_back(tmp_shape);
+// Models drawn by the frame are brought back if they were evicted, then the ones drawn
+// least recently are evicted while the total is over --vram-budget
+void UpdateResidency(const frame_snapshot& frame)
+{
+	gpuResources.beginFrame();
+	for (int m = 0; m < frame.batches.size(); m++)
+	{
+		if (frame.batches[m].instanceCount == 0 || frame.batches[m].shapes.empty())
+			continue;
+		if (!models[m].resident)
+		{
+			RestoreModel(m);
 		}
+		gpuResources.touch(m);
 	}
+	gpuResources.enforceBudget(EvictModel);
+}
 
-	return res;
+// Delete every GL object while the context is still current
+void ReleaseGpuResources()
+{
+	// no load writes to the models from here on
+	sceneAssets.meshes.stop();
+	sceneAssets.textures.stop();
+	if (frameCapture.isRecording())
+	{
+		frameCapture.stop();
+		PrintFrameCapture();
+	}
+	textureUploads.release();
+	models.clear();
+	placeholderTexture.reset();
+	programObject.reset();
+	instanceRing.release();
+	gpuResources.closeContext();
 }
 
-void LoadTexturedModels(string model_path)
+// Read an OBJ file into asset: shapes with their CPU copies, textures and the BVH.
+// textureFiles replace the diffuse texture of the materials named. No GL objects and
+// no scene state are touched, so it runs on the mesh loader thread as well
+bool LoadTexturedModels(const string& model_path, const vector<pair<string, string> >& textureFiles, model_asset* asset)
 {
-	vector<tinyobj::shape_t> shapes;
-	vector<tinyobj::material_t> materials;
-	tinyobj::attrib_t attrib;
-	vector<GLfloat> vertices;
-	vector<GLfloat> colors;
-	vector<GLfloat> normals;
-	vector<GLfloat> textureCoords;
-	vector<int> material_id;
+	ObjMesh mesh;
+	ObjLoadStats stats;
+	// temporaries live in loadArena, which is reset after the load
+	LoadArenaVector<GLfloat> vertices(&loadArena);
+	LoadArenaVector<GLfloat> colors(&loadArena);
+	LoadArenaVector<GLfloat> normals(&loadArena);
+	LoadArenaVector<GLfloat> textureCoords(&loadArena);
+	LoadArenaVector<int> material_id(&loadArena);
+	MeshOptimizeStats optimizeStats;
 
 	string err;
 	string warn;
@@ -1079,7 +2173,8 @@ void LoadTexturedModels(string model_path)
 	base_dir += "/";
 #endif
 
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, model_path.c_str(), base_dir.c_str());
+	// parse, find the bounding box and normalize in one go
+	bool ret = LoadObjMeshParallel(model_path, base_dir, &mesh, &warn, &err, &stats);
 
 	if (!warn.empty()) {
 		cout << warn << std::endl;
@@ -1090,13 +2185,24 @@ void LoadTexturedModels(string model_path)
 	}
 
 	if (!ret) {
-		exit(1);
+		return false;
 	}
 
-	printf("Load Models Success ! Shapes size %d Material size %d\n", shapes.size(), materials.size());
-	model tmp_model;
+	printf("Load Models Success ! Shapes size %d Material size %d\n", int(mesh.groups.size()), int(mesh.materials.size()));
+	printf("  %.2f MB, parse %.2f ms, normalize %.2f ms, peak memory %.2f MB\n", stats.fileBytes / 1048576.0,
+		stats.parseMs, stats.normalizeMs, stats.peakMemoryBytes / 1048576.0);
+
+	// smooth normals for the faces without, no tangents as the shaders have no normal maps
+	MeshNormalStats normalStats;
+	if (GenerateMeshNormals(&mesh, 0, &normalStats))
+		printf("  %d normals for %d corners: adjacency %.2f ms, normals %.2f ms\n",
+			int(normalStats.generatedNormals), int(normalStats.missingCorners), normalStats.adjacencyMs, normalStats.normalsMs);
+	model& tmp_model = asset->data;
 
+	const vector<tinyobj::material_t>& materials = mesh.materials;
 	vector<PhongMaterial> allMaterial;
+	// decoded on the texture loader thread while the shapes are built
+	vector<AssetLoader<texture_asset>::Future> textureImages;
 	
 	for (int i = 0; i < materials.size(); i++)
 	{
@@ -1120,37 +2226,182 @@ void LoadTexturedModels(string model_path)
 			tmp_model.hasEye = true;
 		}
 
-		material.diffuseTexture = LoadTextureImage(base_dir + string(materials[i].diffuse_texname));
-		if (material.diffuseTexture == -1)
+		string texturePath = base_dir + string(materials[i].diffuse_texname);
+		for (int k = 0; k < textureFiles.size(); k++)
 		{
-			cout << "LoadTexturedModels: Fail to load model's material " << i << endl;
-			system("pause");
-			
+			if (textureFiles[k].first == materials[i].name)
+				texturePath = textureFiles[k].second;
 		}
+		textureImages.push_back(RequestTextureImage(texturePath));
+		asset->texturePaths.push_back(texturePath);
+		// set by AdoptModel()
+		material.diffuseTexture = 0;
+		material.softTexture = -1;
 		
 		allMaterial.push_back(material);
 		//cout << "material diffuse" << material.diffuseTexture << endl;
 	}
 	
-	for (int i = 0; i < shapes.size(); i++)
+	tmp_model.faceShapes.assign(mesh.triangleCount(), -1);
+	for (int i = 0; i < mesh.groups.size(); i++)
 	{
+		// SplitShapeByMaterial() appends one shape per used material, in material order
+		const ObjGroup& group = mesh.groups[i];
+		vector<int> materialShapes(allMaterial.size(), -1);
+		for (size_t f = group.firstFace; f < group.firstFace + group.faceCount; f++)
+		{
+			if (mesh.faceMaterials[f] >= 0 && mesh.faceMaterials[f] < allMaterial.size())
+				materialShapes[mesh.faceMaterials[f]] = 0;
+		}
+		int shapeCount = (int)tmp_model.shapes.size();
+		for (int m = 0; m < materialShapes.size(); m++)
+		{
+			if (materialShapes[m] == 0)
+				materialShapes[m] = shapeCount++;
+		}
+		for (size_t f = group.firstFace; f < group.firstFace + group.faceCount; f++)
+		{
+			if (mesh.faceMaterials[f] >= 0 && mesh.faceMaterials[f] < allMaterial.size())
+				tmp_model.faceShapes[f] = materialShapes[mesh.faceMaterials[f]];
+		}
+
 		vertices.clear();
 		colors.clear();
 		normals.clear();
 		textureCoords.clear();
 		material_id.clear();
 
-		normalization(&attrib, vertices, colors, normals, textureCoords, material_id, &shapes[i]);
+		FlattenObjGroup(mesh, i, &vertices, &colors, &normals, &textureCoords, &material_id);
 		// printf("Vertices size: %d", vertices.size() / 3);
 
 		// split current shape into multiple shapes base on material_id.
-		vector<Shape> splitedShapeByMaterial = SplitShapeByMaterial(vertices, colors, normals, textureCoords, material_id, allMaterial);
+		vector<Shape> splitedShapeByMaterial = SplitShapeByMaterial(vertices, colors, normals, textureCoords, material_id, allMaterial, optimizeStats);
 		// concatenate splited shape to model's shape list
-		tmp_model.shapes.insert(tmp_model.shapes.end(), splitedShapeByMaterial.begin(), splitedShapeByMaterial.end());
+		tmp_model.shapes.insert(tmp_model.shapes.end(), make_move_iterator(splitedShapeByMaterial.begin()), make_move_iterator(splitedShapeByMaterial.end()));
+	}
+	tmp_model.bounds = tmp_model.shapes.empty() ? ComputeBounds(NULL, 0) : tmp_model.shapes[0].bounds;
+	for (int i = 1; i < tmp_model.shapes.size(); i++)
+	{
+		tmp_model.bounds = MergeBounds(tmp_model.bounds, tmp_model.shapes[i].bounds);
+	}
+	printf("  vertex cache (%d entry FIFO): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %d vertices welded to %d, %d clusters, %.2f ms\n",
+		VERTEX_CACHE_SIZE, optimizeStats.acmrBefore(), optimizeStats.acmrAfter(), optimizeStats.atvrBefore(), optimizeStats.atvrAfter(),
+		(int)optimizeStats.triangles * 3, (int)optimizeStats.vertices, (int)optimizeStats.clusters, optimizeStats.optimizeMs);
+	// BVH over the normalized positions of the drawn faces
+	vector<unsigned int> vertexIndices;
+	vector<int> faces;
+	for (size_t f = 0; f < mesh.triangleCount(); f++)
+	{
+		if (tmp_model.faceShapes[f] < 0)
+			continue;
+		for (int v = 0; v < 3; v++)
+		{
+			vertexIndices.push_back((unsigned int)mesh.indices[f * 3 + v].vertex_index);
+		}
+		faces.push_back((int)f);
+	}
+	BvhBuildStats bvhStats;
+	if (!faces.empty())
+	{
+		tmp_model.bvh.build(&mesh.positions[0], &vertexIndices[0], faces.size(), &faces[0], 0, &bvhStats);
+	}
+	printf("  BVH: %d nodes, %d leaves, depth %d, SAH cost %.2f, %.2f ms\n", (int)bvhStats.nodes, (int)bvhStats.leaves,
+		bvhStats.depth, bvhStats.sahCost, bvhStats.buildMs);
+
+	// an image which did not load stays NULL, AdoptModel() reports it
+	for (int i = 0; i < textureImages.size(); i++)
+	{
+		asset->textures.push_back(textureImages[i].get());
+	}
+	return true;
+}
+
+// LoadTexturedModels() with the temporaries dropped, NULL if the file did not load
+shared_ptr<model_asset> LoadModelAsset(const string& model_path, const vector<pair<string, string> >& textureFiles)
+{
+	shared_ptr<model_asset> asset(new model_asset());
+	bool loaded = LoadTexturedModels(model_path, textureFiles, asset.get());
+	// the temporaries of the load are dead now, drop them all at once
+	const LoadArenaStats& arenaStats = loadArena.getStats();
+	printf("  temporaries: %d allocations, %.2f MB, %d heap blocks\n", (int)arenaStats.allocations,
+		arenaStats.bytes / 1048576.0, (int)arenaStats.heapBlocks);
+	loadArena.reset();
+	return loaded ? asset : shared_ptr<model_asset>();
+}
+
+// Append model_list[models.size()] to models, not loaded yet: its transform, instance
+// buffer and, without instances in a --scene manifest, its instance in scene, shown
+// when it is cur_idx. Otherwise it is moved by the first instance of the manifest using it
+void AddModelSlot()
+{
+	model slot;
+	slot.loaded = false;
+	int index = (int)models.size();
+	const vector<ManifestInstance>& instances = sceneAssets.manifest.instances;
+	for (int i = 0; i < instances.size() && slot.instance < 0; i++)
+	{
+		if (instances[i].mesh == index)
+		{
+			slot.instance = i;
+			slot.transform = scene.getTransform(i);
+		}
+	}
+	if (slot.transform < 0)
+	{
+		slot.transform = transforms.create();
+	}
+	if (instances.empty())
+	{
+		slot.instance = scene.addInstance(index, slot.transform, index == cur_idx);
+	}
+	SetupInstanceBuffer(slot);
+	models.push_back(std::move(slot));
+}
+
+// Take a loaded model into models[m], keeping its place in the scene. With upload its
+// GL objects are created now, otherwise the thread drawing uploads it when it is first
+// drawn, as after an eviction
+void AdoptModel(int m, model_asset& asset, bool upload)
+{
+	model& target = models[m];
+	model& data = asset.data;
+	data.transform = target.transform;
+	data.instance = target.instance;
+	data.instanceVbo = std::move(target.instanceVbo);
+	data.matricesVersion = target.matricesVersion;
+	data.uploadedVersion = target.uploadedVersion;
+
+	upload = upload && gl_enabled;
+	vector<int> softTextures(asset.textures.size(), -1);
+	data.textures.resize(asset.textures.size());
+	for (int i = 0; i < asset.textures.size(); i++)
+	{
+		if (asset.textures[i])
+			data.textures[i] = AdoptTexture(*asset.textures[i], m, upload, &softTextures[i]);
+		else
+			printf("LoadTexturedModels: Fail to load model's material %d, %s: cannot load image from %s, drawn without it\n",
+				i, model_list[m].c_str(), asset.texturePaths[i].c_str());
+	}
+	for (int i = 0; i < data.shapes.size(); i++)
+	{
+		Shape& shape = data.shapes[i];
+		shape.material.softTexture = softTextures[shape.materialIndex];
+		shape.material.diffuseTexture = data.textures[shape.materialIndex].get();
+		if (upload)
+		{
+			UploadShape(shape, m);
+			ReleaseShapeCopies(shape);
+		}
+	}
+	data.loaded = true;
+	data.resident = upload || !gl_enabled;
+	data.firstUpload = !data.resident;
+	data.boundInstanceBuffer = 0;
+	target = std::move(data);
+	if (upload)
+	{
+		BindInstanceBuffer(target, target.instanceVbo.get(), 0);
 	}
-	shapes.clear();
-	materials.clear();
-	models.push_back(tmp_model);
 }
 
 void initParameter()
@@ -1176,7 +2427,6 @@ void setUniformVariables()
 {
 	iLocP = glGetUniformLocation(program, "um4p");
 	iLocV = glGetUniformLocation(program, "um4v");
-	iLocM = glGetUniformLocation(program, "um4m");
 
 	uniform.iLocKa = glGetUniformLocation(program, "Ka");
 	uniform.iLocKd = glGetUniformLocation(program, "Kd");
@@ -1208,6 +2458,9 @@ void setUniformVariables()
 	
 }
 
+void LoadModels();
+void SetupScene();
+
 void setupRC()
 {
 	// setup shaders
@@ -1218,8 +2471,157 @@ void setupRC()
 	// OpenGL States and Values
 	glClearColor(0.2, 0.2, 0.2, 1.0);
 
+	const GLfloat white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	placeholderTexture = gpuResources.createTexture();
+	glBindTexture(GL_TEXTURE_2D, placeholderTexture.get());
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1, 1, 0, GL_RGBA, GL_FLOAT, white);
+	placeholderTexture.setBytes(GpuResources::textureBytes(1, 1, 4 * sizeof(GLfloat), false));
+
+	if (!sceneAssets.manifest.meshes.empty())
+		SetupScene();
+	else
+		LoadModels();
+}
+
+void LoadModels()
+{
 	for (string model_path : model_list){
-		LoadTexturedModels(model_path);
+		AddModelSlot();
+		shared_ptr<model_asset> asset = LoadModelAsset(model_path, vector<pair<string, string> >());
+		if (!asset)
+			exit(1);
+		AdoptModel((int)models.size() - 1, *asset, true);
+	}
+}
+
+// Queue the load of models[m], the mesh of the manifest at m
+void RequestModel(int m)
+{
+	const ManifestMesh& mesh = sceneAssets.manifest.meshes[m];
+	sceneAssets.requestTime[m] = glfwGetTime();
+	sceneAssets.pending[m] = sceneAssets.meshes.request(mesh.name, [mesh] { return LoadModelAsset(mesh.file, mesh.textures); });
+	sceneAssets.waiting++;
+}
+
+// Instances, lights, camera and models of the --scene manifest. The models only get
+// their place, ResolveSceneAssets() loads them once they are shown; with --scene-eager
+// they are all loaded here, for comparison
+void SetupScene()
+{
+	const SceneManifest& manifest = sceneAssets.manifest;
+	for (int i = 0; i < manifest.instances.size(); i++)
+	{
+		const ManifestInstance& instance = manifest.instances[i];
+		int t = transforms.create(instance.parent >= 0 ? scene.getTransform(instance.parent) : -1);
+		transforms.setPosition(t, Vector3(instance.position[0], instance.position[1], instance.position[2]));
+		transforms.setRotation(t, Quaternion(Vector3(instance.axis[0], instance.axis[1], instance.axis[2]), (float)(instance.degrees * PI / 180.0)));
+		transforms.setScale(t, Vector3(instance.scale[0], instance.scale[1], instance.scale[2]));
+		scene.addInstance(instance.mesh, t, instance.visible);
+	}
+
+	Vector3* positions[] = { &lightPos_d, &lightPos_p, &lightPos_s };
+	Vector3* intensities[] = { &I_d, &I_p, &I_s };
+	for (int l = 0; l < 3; l++)
+	{
+		const ManifestLight& light = manifest.lights[l];
+		if (!light.set)
+			continue;
+		*positions[l] = Vector3(light.position[0], light.position[1], light.position[2]);
+		*intensities[l] = Vector3(light.intensity[0], light.intensity[1], light.intensity[2]);
+	}
+	cur_light_id = manifest.lightType >= 0 ? manifest.lightType : cur_light_id;
+	shininess = manifest.shininess >= 0 ? manifest.shininess : shininess;
+	spot_cutoff = manifest.spotCutoff >= 0 ? manifest.spotCutoff : spot_cutoff;
+
+	if (manifest.hasCamera)
+	{
+		main_camera.position = Vector3(manifest.cameraPosition[0], manifest.cameraPosition[1], manifest.cameraPosition[2]);
+		main_camera.center = Vector3(manifest.cameraCenter[0], manifest.cameraCenter[1], manifest.cameraCenter[2]);
+		main_camera.up_vector = Vector3(manifest.cameraUp[0], manifest.cameraUp[1], manifest.cameraUp[2]);
+		setViewingMatrix();
+	}
+	proj.fovy = manifest.fovy > 0 ? manifest.fovy : proj.fovy;
+	if (manifest.projection == Orthogonal)
+		setOrthogonal();
+	else
+		setPerspective();
+
+	for (int m = 0; m < manifest.meshes.size(); m++)
+	{
+		AddModelSlot();
+	}
+	sceneAssets.pending.resize(models.size());
+	sceneAssets.requestTime.assign(models.size(), 0);
+	if (sceneAssets.lazy)
+		return;
+	for (int m = 0; m < models.size(); m++)
+	{
+		RequestModel(m);
+	}
+	for (int m = 0; m < models.size(); m++)
+	{
+		shared_ptr<model_asset> asset = sceneAssets.pending[m].get();
+		if (!asset)
+			exit(1);
+		AdoptModel(m, *asset, true);
+		sceneAssets.pending[m] = AssetLoader<model_asset>::Future();
+	}
+	sceneAssets.waiting = 0;
+}
+
+// true when a model requested by ResolveSceneAssets() can be taken in
+bool SceneAssetReady()
+{
+	for (int m = 0; m < sceneAssets.pending.size(); m++)
+	{
+		if (sceneAssets.pending[m].valid() && sceneAssets.pending[m].wait_for(chrono::seconds(0)) == future_status::ready)
+			return true;
+	}
+	return false;
+}
+
+// On the main thread before CullScene(): request the models of the manifest with an
+// instance shown for the first time, and take in the ones loaded since the last frame
+void ResolveSceneAssets()
+{
+	if (!sceneAssets.lazy)
+		return;
+	for (int m = 0; m < models.size(); m++)
+	{
+		if (models[m].loaded)
+			continue;
+		AssetLoader<model_asset>::Future& pending = sceneAssets.pending[m];
+		if (!pending.valid())
+		{
+			if (!scene.getBatch(m, models.size()).empty())
+				RequestModel(m);
+			continue;
+		}
+		if (pending.wait_for(chrono::seconds(0)) != future_status::ready)
+			continue;
+
+		shared_ptr<model_asset> asset = pending.get();
+		pending = AssetLoader<model_asset>::Future();
+		sceneAssets.waiting--;
+		double ms = (glfwGetTime() - sceneAssets.requestTime[m]) * 1000.0;
+		if (asset)
+		{
+			// the render thread reads the model while it draws
+			lock_guard<mutex> lock(sceneAssets.modelsMutex);
+			AdoptModel(m, *asset, false);
+			printf("Loaded %s on first use, %.2f ms after the request\n", sceneAssets.manifest.meshes[m].name.c_str(), ms);
+		}
+		else
+		{
+			// shown without shapes, not requested again
+			models[m].loaded = true;
+			printf("Cannot load %s\n", model_list[m].c_str());
+		}
+		if (sceneAssets.waiting == 0 && startup.sceneMs < 0)
+		{
+			startup.sceneMs = StartupMs();
+			printf("Startup: the models shown first were taken in %.2f ms after start\n", startup.sceneMs);
+		}
 	}
 }
 
@@ -1242,8 +2644,704 @@ void glPrintContextInfo(bool printExtension)
 }
 
 
+// --soft-render [width height [file.ppm]]: load the models without a GL context,
+// render the start view on the CPU, then time it with 1, 2, 4, ... threads
+int RunSoftRenderer(int argc, char **argv)
+{
+	int width = (argc > 3) ? atoi(argv[2]) : WINDOW_WIDTH;
+	int height = (argc > 3) ? atoi(argv[3]) : WINDOW_HEIGHT;
+	string output = (argc > 4) ? argv[4] : "soft_render.ppm";
+	if (argc == 3 || width < 2 || height < 1)
+	{
+		printf("Usage: --soft-render [width height [file.ppm]]\n");
+		return 1;
+	}
+
+	gl_enabled = false;
+	initParameter();
+	LoadModels();
+	ChangeSize(NULL, width, height);
+	transforms.update();
+	CullScene();
+
+	SoftRasterizer rasterizer;
+	SoftRenderStats stats;
+	SoftRenderScene(rasterizer, width, height, &stats);
+	if (!WritePpm(output, rasterizer.getColor(), width, height))
+	{
+		printf("Cannot write %s\n", output.c_str());
+		return 1;
+	}
+	printf("Soft render: %s, %dx%d, %d triangles, %d pixels shaded, %.2f ms\n", output.c_str(), width, height,
+		(int)stats.triangles, (int)stats.pixels, stats.totalMs);
+
+	unsigned int hardwareThreads = max(1u, thread::hardware_concurrency());
+	vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t < hardwareThreads; t *= 2)
+	{
+		threadCounts.push_back(t);
+	}
+	threadCounts.push_back(hardwareThreads);
+
+	// the start view, then the stress test grid for many small triangles
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			stress.enabled = true;
+			stress.baseTransformCount = transforms.size();
+			stress.baseInstanceCount = scene.size();
+			SelectModel(cur_idx);
+			SetStressInstanceCount(1024);
+			transforms.update();
+			CullScene();
+		}
+		printf("%s, %dx%d, best of 5 frames\n", pass ? "Stress grid of 1024 instances" : "Start view", width, height);
+		printf("  %7s %10s %10s %10s %10s %10s %10s %8s\n", "threads", "frame(ms)", "vertex", "setup", "raster", "Mtri/s", "Mpix/s", "speedup");
+		double singleMs = 0;
+		for (int c = 0; c < threadCounts.size(); c++)
+		{
+			rasterizer.setThreadCount(threadCounts[c]);
+			SoftRenderStats best;
+			best.totalMs = 1e30;
+			for (int r = 0; r < 5; r++)
+			{
+				SoftRenderScene(rasterizer, width, height, &stats);
+				if (stats.totalMs < best.totalMs)
+					best = stats;
+			}
+			if (c == 0)
+				singleMs = best.totalMs;
+			printf("  %7u %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %7.2fx\n", threadCounts[c], best.totalMs, best.vertexMs, best.setupMs,
+				best.rasterMs, best.triangles / (best.totalMs * 1000.0), best.pixels / (best.totalMs * 1000.0), singleMs / best.totalMs);
+		}
+	}
+	return 0;
+}
+
+// --path-trace [width height [samples [seed [name]]]]: load the models without a GL
+// context and path trace one viewport of the start view. name.png and name.exr are
+// rewritten after every pass, each pass doubles the samples. Then the first passes
+// are traced again with 1, 2, 4, ... threads, which have to give the same image.
+int RunPathTracer(int argc, char **argv)
+{
+	int width = (argc > 3) ? atoi(argv[2]) : WINDOW_WIDTH / 2;
+	int height = (argc > 3) ? atoi(argv[3]) : WINDOW_HEIGHT;
+	int samples = (argc > 4) ? atoi(argv[4]) : 64;
+	unsigned long long seed = (argc > 5) ? strtoull(argv[5], NULL, 10) : 1;
+	string name = (argc > 6) ? argv[6] : "path_trace";
+	if (argc == 3 || width < 1 || height < 1 || samples < 1)
+	{
+		printf("Usage: --path-trace [width height [samples [seed [name]]]]\n");
+		return 1;
+	}
+
+	gl_enabled = false;
+	initParameter();
+	LoadModels();
+	// one viewport of the window is width wide
+	ChangeSize(NULL, width * 2, height);
+	transforms.update();
+
+	// every instance, the ones outside the view still shadow and reflect
+	PathTracer tracer;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int m = 0; m < models.size(); m++)
+	{
+		const vector<int>& batch = scene.getBatchTransforms(m, models.size());
+		for (int i = 0; i < models[m].shapes.size(); i++)
+		{
+			int shape = tracer.addShape(models[m].shapes[i].soft, GetSoftMaterial(models[m].shapes[i].material));
+			for (int t = 0; t < batch.size(); t++)
+			{
+				tracer.addInstance(shape, transforms.getWorldMatrix(batch[t]));
+			}
+		}
+	}
+	BvhBuildStats bvhStats;
+	tracer.commit(&bvhStats);
+	float clearColor[3] = { 0.2f, 0.2f, 0.2f };
+	tracer.setCamera(project_matrix * view_matrix, clearColor);
+	tracer.setLighting(GetSoftLighting(0));
+	printf("Path tracer: %dx%d, %d samples per pixel, seed %llu, scene BVH %d nodes in %.2f ms (%.2f ms with the meshes)\n", width, height,
+		samples, seed, (int)bvhStats.nodes, bvhStats.buildMs, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+	// progressive: the files show the image so far after every pass
+	printf("  %7s %10s %10s %12s %10s %8s\n", "samples", "pass(ms)", "total(ms)", "Msamples/s", "Mrays/s", "stolen");
+	tracer.reset(width, height, seed);
+	double totalMs = 0;
+	for (int pass = 1; tracer.getSampleCount() < samples; pass *= 2)
+	{
+		PathTraceStats stats;
+		tracer.render(min(pass, samples - tracer.getSampleCount()), &stats);
+		totalMs += stats.ms;
+		if (!WritePng(name + ".png", tracer.getColor(), width, height) || !WriteExr(name + ".exr", tracer.getRadiance(), width, height))
+		{
+			printf("Cannot write %s.png / %s.exr\n", name.c_str(), name.c_str());
+			return 1;
+		}
+		printf("  %7d %10.2f %10.2f %12.3f %10.3f %8d\n", tracer.getSampleCount(), stats.ms, totalMs, stats.samples / (stats.ms * 1000.0),
+			stats.rays / (stats.ms * 1000.0), stats.stolenTiles);
+	}
+	printf("Wrote %s.png and %s.exr\n", name.c_str(), name.c_str());
+
+	unsigned int hardwareThreads = max(1u, thread::hardware_concurrency());
+	vector<unsigned int> threadCounts;
+	for (unsigned int t = 1; t < hardwareThreads; t *= 2)
+	{
+		threadCounts.push_back(t);
+	}
+	threadCounts.push_back(hardwareThreads);
+
+	int scalingSamples = min(samples, 4);
+	printf("Thread scaling, %d samples per pixel, seed %llu\n", scalingSamples, seed);
+	printf("  %7s %10s %12s %8s %8s  %s\n", "threads", "time(ms)", "Msamples/s", "speedup", "stolen", "image");
+	vector<float> reference;
+	double singleMs = 0;
+	for (int c = 0; c < threadCounts.size(); c++)
+	{
+		PathTraceStats stats;
+		tracer.setThreadCount(threadCounts[c]);
+		tracer.reset(width, height, seed);
+		tracer.render(scalingSamples, &stats);
+		vector<float> radiance = tracer.getRadiance();
+		if (c == 0)
+		{
+			reference = radiance;
+			singleMs = stats.ms;
+		}
+		bool same = radiance == reference;
+		printf("  %7u %10.2f %12.3f %7.2fx %8d  %s\n", threadCounts[c], stats.ms, stats.samples / (stats.ms * 1000.0), singleMs / stats.ms,
+			stats.stolenTiles, same ? "same as 1 thread" : "DIFFERENT from 1 thread");
+	}
+	return 0;
+}
+
+// Golden image regression test:
+//     --golden record|check <dir> [soft|gl [min PSNR]]
+// renders every model of model_list with both projections and all lights, the
+// per-vertex and per-pixel viewports go to separate PNGs in dir. check compares
+// with them and fails below min PSNR (40 dB by default), the image of a failed
+// case is kept next to its golden one. soft uses the CPU rasterizer without a
+// window, gl draws into a framebuffer object of a hidden window, so it runs
+// headless on Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1). Each backend has its own
+// images, as the spot light differs between them.
+// file name of model_list[model] without directory and extension
+string ModelName(int model)
+{
+	string base = model_list[model];
+	size_t slash = base.find_last_of("/\\");
+	if (slash != string::npos)
+		base = base.substr(slash + 1);
+	return base.substr(0, base.find_last_of('.'));
+}
+
+string GoldenName(const string& backend, int model, int mode, int light, int view)
+{
+	string base = ModelName(model);
+	const char* lights[] = { "directional", "point", "spot" };
+	return backend + "_" + base + "_" + (mode == Orthogonal ? "ortho" : "persp") + "_" + lights[light] + "_" + (view == 0 ? "vertex" : "pixel") + ".png";
+}
+
+// RGBA8 of a PNG written by WritePng(), top row first
+bool ReadGoldenImage(const string& path, vector<unsigned char>* rgba, int width, int height)
+{
+	int imageWidth, imageHeight, channels;
+	stbi_set_flip_vertically_on_load(false);
+	stbi_uc* data = stbi_load(path.c_str(), &imageWidth, &imageHeight, &channels, 4);
+	if (!data)
+		return false;
+	bool sameSize = imageWidth == width && imageHeight == height;
+	if (sameSize)
+		rgba->assign(data, data + (size_t)width * height * 4);
+	stbi_image_free(data);
+	return sameSize;
+}
+
+// PSNR of the RGB of two RGBA8 images, offShare: part of the pixels with a channel off by more than 8
+double CompareImages(const vector<unsigned char>& a, const vector<unsigned char>& b, double* offShare)
+{
+	double squared = 0;
+	size_t off = 0, pixels = a.size() / 4;
+	for (size_t i = 0; i < pixels; i++)
+	{
+		int maxDifference = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			int difference = abs((int)a[i * 4 + k] - (int)b[i * 4 + k]);
+			squared += difference * difference;
+			maxDifference = max(maxDifference, difference);
+		}
+		off += (maxDifference > 8) ? 1 : 0;
+	}
+	*offShare = pixels ? (double)off / pixels : 0;
+	double mse = squared / max(pixels * 3, (size_t)1);
+	return (mse > 0) ? 10.0 * log10(255.0 * 255.0 / mse) : 1e9;
+}
+
+// Bind a new framebuffer object of width x height, RGBA8 color with depth and stencil
+bool CreateOffscreenFramebuffer(int width, int height, GLuint* framebuffer, GLuint renderbuffers[2])
+{
+	glGenFramebuffers(1, framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void DeleteOffscreenFramebuffer(GLuint framebuffer, const GLuint renderbuffers[2])
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(2, renderbuffers);
+}
+
+// window is NULL for the soft backend and for arguments which only print the usage
+int RunGoldenImages(int argc, char **argv, GLFWwindow* window)
+{
+	string command = (argc > 2) ? argv[2] : "";
+	string dir = (argc > 3) ? argv[3] : "";
+	string backendArgument = (argc > 4) ? argv[4] : "soft";
+	bool gl = window != NULL;
+	double minPsnr = (argc > 5) ? atof(argv[5]) : 40.0;
+	if ((command != "record" && command != "check") || dir.empty() || (backendArgument != "soft" && backendArgument != "gl") || minPsnr <= 0)
+	{
+		printf("Usage: --golden record|check <dir> [soft|gl [min PSNR]]\n");
+		return 1;
+	}
+	bool record = command == "record";
+	string backend = gl ? "gl" : "soft";
+	int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+
+	GLuint framebuffer = 0, renderbuffers[2] = { 0, 0 };
+	if (gl)
+	{
+		if (!CreateOffscreenFramebuffer(width, height, &framebuffer, renderbuffers))
+		{
+			printf("Cannot create the offscreen framebuffer\n");
+			return 1;
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		// every texture has to be there for the first image
+		textureUploads.finish();
+	}
+	else
+	{
+		gl_enabled = false;
+		initParameter();
+		LoadModels();
+	}
+	screenWidth = width;
+	screenHeight = height;
+	ChangeSize(NULL, width, height);
+
+	printf("Golden images (%s backend), %dx%d per view, %s %s, min PSNR %.1f dB\n", backend.c_str(), width / 2, height,
+		record ? "recording to" : "checking against", dir.c_str(), minPsnr);
+	printf("  %-52s %10s %10s %8s\n", "image", "frame(ms)", "PSNR(dB)", "off(%)");
+	SoftRasterizer rasterizer;
+	int images = 0, failed = 0;
+	double totalMs = 0;
+	int modes[] = { Orthogonal, Perspective };
+	for (int m = 0; m < models.size(); m++)
+	{
+		SelectModel(m);
+		for (int p = 0; p < 2; p++)
+		{
+			if (modes[p] == Orthogonal)
+				setOrthogonal();
+			else
+				setPerspective();
+			for (int light = 0; light < 3; light++)
+			{
+				cur_light_id = light;
+				transforms.update();
+				CullScene();
+
+				// one frame holds both shading modes
+				vector<unsigned char> frame((size_t)width * height * 4);
+				double ms;
+				if (gl)
+				{
+					CaptureFrame(&mainFrame);
+					UploadInstanceBuffers(mainFrame);
+					glFinish();
+					double start = glfwGetTime();
+					DrawFrame(mainFrame);
+					glFinish();
+					ms = (glfwGetTime() - start) * 1000.0;
+					vector<unsigned char> rows(frame.size());
+					glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &rows[0]);
+					for (int y = 0; y < height; y++)
+					{
+						memcpy(&frame[(size_t)y * width * 4], &rows[(size_t)(height - 1 - y) * width * 4], (size_t)width * 4);
+					}
+				}
+				else
+				{
+					SoftRenderStats stats;
+					SoftRenderScene(rasterizer, width, height, &stats);
+					ms = stats.totalMs;
+					frame = rasterizer.getColor();
+				}
+				totalMs += ms;
+
+				for (int view = 0; view < 2; view++)
+				{
+					int viewWidth = width / 2;
+					vector<unsigned char> image((size_t)viewWidth * height * 4);
+					for (int y = 0; y < height; y++)
+					{
+						memcpy(&image[(size_t)y * viewWidth * 4], &frame[((size_t)y * width + view * viewWidth) * 4], (size_t)viewWidth * 4);
+					}
+					string name = GoldenName(backend, m, modes[p], light, view);
+					string path = dir + "/" + name;
+					images++;
+					if (record)
+					{
+						bool written = WritePng(path, image, viewWidth, height);
+						failed += written ? 0 : 1;
+						printf("  %-52s %10.2f %10s %8s  %s\n", name.c_str(), ms, "", "", written ? "recorded" : "CANNOT WRITE");
+						continue;
+					}
+					vector<unsigned char> golden;
+					if (!ReadGoldenImage(path, &golden, viewWidth, height))
+					{
+						failed++;
+						WritePng(path + ".actual.png", image, viewWidth, height);
+						printf("  %-52s %10.2f %10s %8s  MISSING\n", name.c_str(), ms, "", "");
+						continue;
+					}
+					double offShare;
+					double psnr = CompareImages(image, golden, &offShare);
+					bool pass = psnr >= minPsnr;
+					if (pass)
+					{
+						remove((path + ".actual.png").c_str());
+					}
+					else
+					{
+						failed++;
+						WritePng(path + ".actual.png", image, viewWidth, height);
+					}
+					printf("  %-52s %10.2f %10.2f %8.3f  %s\n", name.c_str(), ms, min(psnr, 999.99), offShare * 100.0, pass ? "ok" : "FAILED");
+				}
+			}
+		}
+	}
+
+	if (gl)
+	{
+		DeleteOffscreenFramebuffer(framebuffer, renderbuffers);
+	}
+	printf("%d images, %d %s, %.2f ms per frame, %.2f ms total\n", images, failed, record ? "not written" : "failed",
+		totalMs / max(images / 2, 1), totalMs);
+	return failed ? 1 : 0;
+}
+
+// Turntable renders for asset review:
+//     --turntable <dir> [width height [steps [file.obj ...]]] [--capture-format png|qoi|y4m]
+// orbits the camera around y in steps (36 by default) around every model given,
+// or model_list, with both projections and all lights. Frames hold both
+// viewports at width x height (the window size by default) and are drawn into
+// a framebuffer object of a hidden window, then go through FrameCapture, so
+// they are read back asynchronously and encoded on its workers. Each model
+// gets <dir>/<model>_000000.png ... (or <model>.y4m) in the order projection,
+// light, step: frame (projection * 3 + light) * steps + step.
+const char* ArgumentValue(int argc, char **argv, const char* name, const char* fallback);
+
+vector<string> TurntableFiles(int argc, char **argv)
+{
+	vector<string> files;
+	for (int i = 6; i < argc && string(argv[i]).compare(0, 2, "--") != 0; i++)
+	{
+		files.push_back(argv[i]);
+	}
+	return files;
+}
+
+int RunTurntable(int argc, char **argv)
+{
+	// arguments after --turntable up to the first option: dir, then width and height together
+	int positional = 0;
+	while (2 + positional < argc && string(argv[2 + positional]).compare(0, 2, "--") != 0)
+		positional++;
+	string dir = (positional > 0) ? argv[2] : "";
+	int width = (positional > 2) ? atoi(argv[3]) : WINDOW_WIDTH;
+	int height = (positional > 2) ? atoi(argv[4]) : WINDOW_HEIGHT;
+	int steps = (positional > 3) ? atoi(argv[5]) : 36;
+	CaptureFormat format;
+	if (dir.empty() || positional == 2 || width < 2 || height < 1 || steps < 1 ||
+		!FrameCapture::parseFormat(ArgumentValue(argc, argv, "--capture-format", "png"), &format))
+	{
+		printf("Usage: --turntable <dir> [width height [steps [file.obj ...]]] [--capture-format png|qoi|y4m]\n");
+		return 1;
+	}
+
+	GLuint framebuffer = 0, renderbuffers[2] = { 0, 0 };
+	if (!CreateOffscreenFramebuffer(width, height, &framebuffer, renderbuffers))
+	{
+		printf("Cannot create the offscreen framebuffer\n");
+		return 1;
+	}
+	// every texture has to be there for the first frame
+	textureUploads.finish();
+	screenWidth = width;
+	screenHeight = height;
+	ChangeSize(NULL, width, height);
+
+	camera start = main_camera;
+	Vector3 arm = start.position - start.center;
+	float radius = sqrtf(arm.x * arm.x + arm.z * arm.z);
+	int modes[] = { Orthogonal, Perspective };
+	int framesPerModel = 2 * 3 * steps;
+	printf("Turntable: %d models, %d steps, %d frames of %dx%d each as %s to %s\n", (int)models.size(), steps, framesPerModel,
+		width, height, FrameCapture::formatName(format), dir.c_str());
+	printf("  %-24s %8s %10s %10s %10s %12s %10s\n", "model", "frames", "time(s)", "fps", "MB", "readback(ms)", "encode(ms)");
+
+	chrono::steady_clock::time_point batchStart = chrono::steady_clock::now();
+	unsigned long long frames = 0, written = 0;
+	double bytes = 0, readbackMs = 0, encodeMs = 0;
+	int workers = 0;
+	for (int m = 0; m < models.size(); m++)
+	{
+		SelectModel(m);
+		frameCapture.start(dir + "/" + ModelName(m), format, 30, false);
+		for (int p = 0; p < 2; p++)
+		{
+			for (int light = 0; light < 3; light++)
+			{
+				cur_light_id = light;
+				for (int step = 0; step < steps; step++)
+				{
+					float angle = (float)(2.0 * PI * step / steps);
+					main_camera.position = start.center + Vector3(radius * sinf(angle), arm.y, radius * cosf(angle));
+					setViewingMatrix();
+					if (modes[p] == Orthogonal)
+						setOrthogonal();
+					else
+						setPerspective();
+					transforms.update();
+					CullScene();
+					CaptureFrame(&mainFrame);
+					UploadInstanceBuffers(mainFrame);
+					DrawFrame(mainFrame);
+					frameCapture.capture(framebuffer, width, height);
+				}
+			}
+		}
+		frameCapture.stop();
+
+		FrameCaptureReport r = frameCapture.report();
+		printf("  %-24s %8llu %10.2f %10.1f %10.2f %12.3f %10.2f%s\n", ModelName(m).c_str(), r.frames, r.seconds, r.frames / max(r.seconds, 1e-9),
+			r.bytes / 1048576.0, r.glMs, r.encodeMs, r.written == r.frames ? "" : "  NOT ALL WRITTEN");
+		frames += r.frames;
+		written += r.written;
+		bytes += r.bytes;
+		readbackMs += r.glMs * r.frames;
+		encodeMs += r.encodeMs * (r.written + r.failed);
+		workers = r.workers;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+	main_camera = start;
+	setViewingMatrix();
+
+	DeleteOffscreenFramebuffer(framebuffer, renderbuffers);
+	printf("%llu frames, %llu written, %.2f MB in %.2f s wall time: %.1f frames/s; readback %.3f ms/frame on the GL thread, encoding %.2f ms/frame on %d workers\n",
+		frames, written, bytes / 1048576.0, seconds, frames / max(seconds, 1e-9), readbackMs / max(frames, 1ull),
+		encodeMs / max(frames, 1ull), workers);
+	return written == frames ? 0 : 1;
+}
+
+// Draw every snapshot the main thread publishes, until it stops the thread
+void RenderThreadLoop(GLFWwindow* window)
+{
+	glfwMakeContextCurrent(window);
+	while (true)
+	{
+		double waitStart = glfwGetTime();
+		{
+			unique_lock<mutex> lock(renderThread.wakeMutex);
+			renderThread.wake.wait(lock, [] { return renderThread.frames.hasFresh() || !renderThread.running; });
+		}
+		if (!renderThread.frames.acquire())
+			break;
+		// the main thread may publish the next snapshot now
+		glfwPostEmptyEvent();
+
+		int slot = frameSync.beginFrame();
+		double start = glfwGetTime();
+		renderThread.activity.waited(RENDER_THREAD, start - waitStart);
+		renderThread.activity.begin(RENDER_THREAD, start);
+		const frame_snapshot& frame = renderThread.frames.readSlot();
+		{
+			// the main thread takes models in under the lock
+			lock_guard<mutex> lock(sceneAssets.modelsMutex);
+			UploadFrameInstances(frame, slot);
+			DrawFrame(frame);
+			CaptureDrawnFrame(frame);
+		}
+		double submitEnd = glfwGetTime();
+		frameSync.endSubmit();
+		glfwSwapBuffers(window);
+		frameSync.endFrame();
+		StartupFrameShown();
+		double swapEnd = glfwGetTime();
+		renderThread.activity.end(RENDER_THREAD, swapEnd);
+		renderThread.activity.shown(submitEnd - start, frame.publishTime, frame.changeTime, swapEnd);
+	}
+	glfwMakeContextCurrent(NULL);
+}
+
+// Main loop with --render-thread. Input is taken on every event while the render thread
+// draws; the main thread keeps at most one snapshot ahead, so input arriving while
+// the render thread is behind goes into the next snapshot instead of waiting for a frame.
+int RunRenderThread(GLFWwindow* window)
+{
+	renderThread.enabled = true;
+	renderThread.activity.reset(glfwGetTime());
+	glfwMakeContextCurrent(NULL);
+	thread render(RenderThreadLoop, window);
+
+	while (!glfwWindowShouldClose(window))
+	{
+		ProcessInput(window);
+		if (input.changed || stress.enabled || textureUploads.busy() || frameCapture.isRecording() || SceneAssetReady())
+		{
+			pacer.requestFrame();
+		}
+		bool renderBehind = renderThread.frames.hasFresh();
+		if (!pacer.shouldDraw() || renderBehind)
+		{
+			double waitStart = glfwGetTime();
+			glfwWaitEventsTimeout(FRAME_WAIT_TIMEOUT);
+			double waited = glfwGetTime() - waitStart;
+			if (renderBehind && pacer.shouldDraw())
+				renderThread.activity.waited(MAIN_THREAD, waited);
+			else
+				pacer.waited(waited, input.queue.size() > 0 || pacer.shouldDraw());
+			continue;
+		}
+
+		double updateStart = glfwGetTime();
+		renderThread.activity.begin(MAIN_THREAD, updateStart);
+		if (stress.enabled)
+		{
+			AnimateStressTest();
+		}
+		transforms.update();
+		ResolveSceneAssets();
+		CullScene();
+		frame_snapshot& frame = renderThread.frames.writeSlot();
+		CaptureFrame(&frame);
+		frame.publishTime = glfwGetTime();
+		renderThread.activity.published(!renderThread.frames.publish());
+		{
+			// the render thread checks for a snapshot under the lock, so it cannot miss the notify
+			lock_guard<mutex> lock(renderThread.wakeMutex);
+		}
+		renderThread.wake.notify_one();
+		double updateEnd = glfwGetTime();
+		renderThread.activity.end(MAIN_THREAD, updateEnd);
+
+		// the input latency is taken by the render thread at the swap
+		input.changed = 0;
+		input.changeTime = -1;
+		pacer.frameDrawn();
+		ShowCullingStats(window);
+		glfwPollEvents();
+
+		if (stress.enabled)
+		{
+			StepStressTest(renderThread.activity.getLastSubmit(), updateEnd - updateStart);
+		}
+	}
+
+	{
+		lock_guard<mutex> lock(renderThread.wakeMutex);
+		renderThread.running = false;
+	}
+	renderThread.wake.notify_one();
+	render.join();
+	glfwMakeContextCurrent(window);
+	return 0;
+}
+
+bool HasArgument(int argc, char **argv, const char* argument)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (string(argv[i]) == argument)
+			return true;
+	}
+	return false;
+}
+
+// the argument after name, or fallback
+const char* ArgumentValue(int argc, char **argv, const char* name, const char* fallback)
+{
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (string(argv[i]) == name)
+			return argv[i + 1];
+	}
+	return fallback;
+}
+
 int main(int argc, char **argv)
 {
+	// loader validation and benchmark, runs without a window
+	if (argc > 1 && string(argv[1]) == "--bench-loader")
+		return RunLoaderBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	if (argc > 1 && string(argv[1]) == "--bench-normals")
+		return RunNormalsBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	if (argc > 1 && string(argv[1]) == "--bench-bvh")
+		return RunBvhBenchmark(argc > 2 ? vector<string>(argv + 2, argv + argc) : model_list);
+	if (argc > 1 && string(argv[1]) == "--bench-images")
+		return RunImageBenchmark();
+	// CPU rendering backend, runs without a window
+	if (argc > 1 && string(argv[1]) == "--soft-render")
+		return RunSoftRenderer(argc, argv);
+	// offline path tracer, runs without a window
+	if (argc > 1 && string(argv[1]) == "--path-trace")
+		return RunPathTracer(argc, argv);
+	// golden image regression test, the soft backend runs without a window
+	bool golden = argc > 1 && string(argv[1]) == "--golden";
+	bool goldenGl = golden && argc > 4 && string(argv[4]) == "gl";
+	if (golden && !goldenGl)
+		return RunGoldenImages(argc, argv, NULL);
+	// turntable renders of a model list, in a hidden window
+	bool turntable = argc > 1 && string(argv[1]) == "--turntable";
+	if (turntable && !TurntableFiles(argc, argv).empty())
+		model_list = TurntableFiles(argc, argv);
+	// --scene <manifest.json> replaces model_list, its models are loaded once they are
+	// shown, or all before the first frame with --scene-eager
+	const char* manifestPath = ArgumentValue(argc, argv, "--scene", NULL);
+	if (manifestPath && !golden && !turntable)
+	{
+		string err;
+		if (!LoadSceneManifest(manifestPath, &sceneAssets.manifest, &err))
+		{
+			printf("Cannot read the scene: %s\n", err.c_str());
+			return 1;
+		}
+		model_list.clear();
+		for (int i = 0; i < sceneAssets.manifest.meshes.size(); i++)
+		{
+			model_list.push_back(sceneAssets.manifest.meshes[i].file);
+		}
+		sceneAssets.lazy = !HasArgument(argc, argv, "--scene-eager");
+		// a finished load wakes the main loop up to take the model in
+		sceneAssets.meshes.setListener(glfwPostEmptyEvent);
+		startup.manifestMs = StartupMs();
+		printf("Scene %s: %d meshes, %d instances, parsed in %.2f ms, %.2f ms after start\n", manifestPath,
+			(int)sceneAssets.manifest.meshes.size(), (int)sceneAssets.manifest.instances.size(), sceneAssets.manifest.parseMs, startup.manifestMs);
+	}
+
 
     // initial glfw
     glfwInit();
@@ -1254,6 +3352,10 @@ int main(int argc, char **argv)
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // fix compilation on OS X
 #endif
+	if (goldenGl || turntable)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
 
     
     // create window
@@ -1283,28 +3385,103 @@ int main(int argc, char **argv)
 	glfwSetCursorPosCallback(window, cursor_pos_callback);
 
     glfwSetFramebufferSizeCallback(window, ChangeSize);
+    glfwSetWindowRefreshCallback(window, RefreshWindow);
 	glEnable(GL_DEPTH_TEST);
+	// --vram-budget MB evicts the models drawn least recently above it, set before the
+	// models load as it keeps their CPU copies
+	gpuResources.setBudget((size_t)(atof(ArgumentValue(argc, argv, "--vram-budget", "0")) * 1048576.0));
 	// Setup render context
 	setupRC();
+	if (goldenGl)
+	{
+		return RunGoldenImages(argc, argv, window);
+	}
+	if (turntable)
+	{
+		int result = RunTurntable(argc, argv);
+		ReleaseGpuResources();
+		return result;
+	}
+
+	// --continuous draws every iteration, for benchmarks
+	pacer.setContinuous(HasArgument(argc, argv, "--continuous"));
+	const GLFWvidmode* videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	pacer.setRefreshRate(videoMode ? videoMode->refreshRate : 60);
+	pacer.startPeriod(glfwGetTime());
+	// --frames-in-flight 0 leaves the queue to the driver
+	frameSync.setFramesInFlight(atoi(ArgumentValue(argc, argv, "--frames-in-flight", "2")));
+	// --upload-budget MB of texels are uploaded per frame at most, 0 = no limit
+	textureUploads.setBudget((size_t)(atof(ArgumentValue(argc, argv, "--upload-budget", "8")) * 1048576.0));
+	// --capture <prefix> records from the first frame, as W does
+	if (!FrameCapture::parseFormat(ArgumentValue(argc, argv, "--capture-format", "png"), &capture.format))
+	{
+		printf("Usage: --capture-format png|qoi|y4m\n");
+		return 1;
+	}
+	capture.fps = atoi(ArgumentValue(argc, argv, "--capture-fps", "60"));
+	capture.synchronous = HasArgument(argc, argv, "--capture-sync");
+	capture.prefix = ArgumentValue(argc, argv, "--capture", capture.prefix.c_str());
+	capture.toggle = HasArgument(argc, argv, "--capture");
+	if (HasArgument(argc, argv, "--render-thread"))
+	{
+		int result = RunRenderThread(window);
+		ReleaseGpuResources();
+		return result;
+	}
 
 	// main loop
     while (!glfwWindowShouldClose(window))
     {
+		ProcessInput(window);
+		if (input.changed || stress.enabled || textureUploads.busy() || frameCapture.isRecording() || SceneAssetReady())
+		{
+			pacer.requestFrame();
+		}
+		// sleep until an event changes what is shown, then process it
+		if (!pacer.shouldDraw())
+		{
+			double waitStart = glfwGetTime();
+			glfwWaitEventsTimeout(FRAME_WAIT_TIMEOUT);
+			pacer.waited(glfwGetTime() - waitStart, input.queue.size() > 0 || pacer.shouldDraw());
+			continue;
+		}
+		int slot = frameSync.beginFrame();
+		double updateStart = glfwGetTime();
+		if (stress.enabled)
+		{
+			AnimateStressTest();
+		}
+        // rebuild only the transforms edited since last frame
+		transforms.update();
+		ResolveSceneAssets();
+		CullScene();
+		CaptureFrame(&mainFrame);
+		UploadFrameInstances(mainFrame, slot);
+		double submitStart = glfwGetTime();
+
         // render
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-		// render left view
-		glViewport(0, 0, screenWidth / 2, screenHeight);
-        RenderScene(1);
-		// render right view
-		glViewport(screenWidth / 2, 0, screenWidth / 2, screenHeight);
-		RenderScene(0);
+		DrawFrame(mainFrame);
+		CaptureDrawnFrame(mainFrame);
+		double submitEnd = glfwGetTime();
+		frameSync.endSubmit();
         
         // swap buffer from back to front
         glfwSwapBuffers(window);
+		frameSync.endFrame();
+		FrameShown();
+		StartupFrameShown();
+		pacer.frameDrawn();
+		ShowCullingStats(window);
         
         // Poll input event
         glfwPollEvents();
+
+		if (stress.enabled)
+		{
+			StepStressTest(submitEnd - submitStart, submitStart - updateStart);
+		}
     }
+	ReleaseGpuResources();
 	
 	// just for compatibiliy purposes
 	return 0;
@@ -4,12 +4,12 @@ layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aColor;
 layout (location = 2) in vec3 aNormal;
 layout (location = 3) in vec2 aTexCoord;
+layout (location = 4) in mat4 aModel; // per-instance model matrix
 
 out vec2 texCoord;
 
 uniform mat4 um4p;	
 uniform mat4 um4v;
-uniform mat4 um4m;
 
 uniform vec3 Ka;
 uniform vec3 Kd;
@@ -111,11 +111,11 @@ void main()
 {
 	// [TODO]
 	texCoord = aTexCoord;
-	gl_Position = um4p * um4v * um4m * vec4(aPos, 1.0);
+	gl_Position = um4p * um4v * aModel * vec4(aPos, 1.0);
 
-	vec4 fragPos = um4m * vec4(aPos,1.0);
+	vec4 fragPos = aModel * vec4(aPos,1.0);
 	FragPos = fragPos.xyz;
-	vertex_normal = mat3(transpose(inverse(um4m))) * aNormal;
+	vertex_normal = mat3(transpose(inverse(aModel))) * aNormal;
 	texCoord = aTexCoord;
 	if(per_vertex == 0)
 	{